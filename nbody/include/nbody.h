@@ -51,6 +51,7 @@ typedef struct
     char* matchHistAll;          /* Match this histogram to other histogram, no simulation -- with veta and vel disp, avg beta/vlos/dist */
     char* graphicsBin;
     char* visArgs;
+    char* orbitCacheDir;    /* Keep the reverse orbits in this directory */
 
     const char** forwardedArgs;
     unsigned int numForwardedArgs;
@@ -80,9 +81,13 @@ typedef struct
     int noCleanCheckpoint;
     int disableGPUCheckpointing;
     int verbose;
+    int pinThreads;
+    int hugePages;
+    int printCounters;
+    int printEnergy;
 } NBodyFlags;
 
-#define EMPTY_NBODY_FLAGS { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+#define EMPTY_NBODY_FLAGS { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
 
 NBodyStatus nbStepSystem(const NBodyCtx* ctx, NBodyState* st);
 NBodyStatus nbRunSystem(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf);
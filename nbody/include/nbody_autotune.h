@@ -0,0 +1,37 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _NBODY_AUTOTUNE_H_
+#define _NBODY_AUTOTUNE_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set the criterion, theta and useQuad of ctx to the fastest that keep
+ * the rms relative force error on the bodies of st within
+ * ctx->forceTolerance. They are left alone if none do. */
+void nbAutotune(NBodyCtx* ctx, NBodyState* st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_AUTOTUNE_H_ */
@@ -0,0 +1,101 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _NBODY_COUNTERS_H_
+#define _NBODY_COUNTERS_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Parts of the run the counters keep the wall time of */
+typedef enum
+{
+    NBODY_PHASE_TREE,         /* building or refitting the tree */
+    NBODY_PHASE_FORCE,        /* self gravity, external potential and the kicks done with them */
+    NBODY_PHASE_INTEGRATE,    /* rest of the steps: drifts, kicks and the LMC or dwarf orbit */
+    NBODY_PHASE_LIKELIHOOD,   /* histograms and likelihood in the best likelihood window */
+    NBODY_PHASE_CHECKPOINT,
+    NBODY_PHASE_COUNT
+} NBodyPhase;
+
+/* Walks counted by one thread, padded so threads do not share a line */
+typedef struct MW_ALIGN_TYPE_V(64)
+{
+    uint64_t walks;
+    uint64_t bodies;            /* bodies the walks found forces for */
+    uint64_t cellsOpened;
+    uint64_t cellInteractions;
+    uint64_t bodyInteractions;
+} NBodyThreadCounts;
+
+struct NBodyCounters
+{
+    double time[NBODY_PHASE_COUNT];
+    double forceTime;           /* of all the force calculations, to take out of the steps */
+    double stepStart;
+    double stepForceStart;
+    unsigned int steps;
+    unsigned int forces;
+    unsigned int trees;         /* force calculations that walked a tree */
+    unsigned int treeDepthMax;
+    unsigned int treeCellsMax;
+    double treeDepthSum;
+    double treeCellsSum;
+    int nThread;
+    NBodyThreadCounts* threads;
+};
+
+/* Start counting the work of st, if it is not already */
+void nbStartCounters(NBodyState* st);
+void nbDestroyCounters(NBodyCounters* c);
+
+/* Seconds, on the clock the phases are timed with */
+double nbCounterClock(void);
+
+/* The rest do nothing if st is not being counted */
+
+void nbCountPhase(NBodyState* st, NBodyPhase phase, double seconds);
+
+/* Add walks by the calling thread that found forces for bodies bodies */
+void nbCountWalks(NBodyState* st, unsigned int walks, unsigned int bodies, unsigned int cellsOpened,
+                  uint64_t cellInteractions, uint64_t bodyInteractions);
+
+/* End of a force calculation that took seconds, of which treeSeconds
+ * making the tree if it used one */
+void nbCountForce(NBodyState* st, double seconds, double treeSeconds, mwbool usedTree);
+
+/* Bracket a step. Its time not spent finding forces is integration. */
+void nbCountStepStart(NBodyState* st);
+void nbCountStepEnd(NBodyState* st);
+
+/* Body-cell and body-body interactions counted since the counters were
+ * started or reset */
+uint64_t nbCountedInteractions(const NBodyState* st);
+void nbResetCounters(NBodyState* st);
+
+/* Write the totals to stdout in tags, one per line */
+void nbPrintCounters(const NBodyState* st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_COUNTERS_H_ */
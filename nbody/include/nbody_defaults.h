@@ -44,6 +44,7 @@ extern "C" {
 #define DEFAULT_NGP_DEC ((real) d2r(27.4))
 #define DEFAULT_NGP_RA ((real) d2r(192))
 #define DEFAULT_CRITERION TreeCode
+#define DEFAULT_INTEGRATOR Leapfrog
 #define DEFAULT_TREE_ROOT_SIZE ((real) 4.0)
 
 #define DEFAULT_B_START_COORD ((real) 53.5)
@@ -55,6 +56,22 @@ extern "C" {
 #define DEFAULT_USE_QUADRUPOLE_MOMENTS TRUE
 #define DEFAULT_ALLOW_INCEST FALSE
 #define DEFAULT_QUIET_ERRORS FALSE
+#define DEFAULT_PARALLEL_TREE TRUE
+#define DEFAULT_COST_BALANCE TRUE
+#define DEFAULT_RESTRICTED FALSE
+#define DEFAULT_RESTRICTED_MASS_LOSS FALSE
+#define DEFAULT_WALK_GROUP_SIZE 0
+#define DEFAULT_MULTIPOLE_ORDER 0
+#define DEFAULT_TREE_REFIT_STEPS 0
+#define DEFAULT_MAX_RUNG 0
+#define DEFAULT_RUNG_ETA ((real) 0.025)
+#define DEFAULT_PM_GRID_SIZE 64
+#define DEFAULT_PM_BOX_SIZE ((real) 0.0)
+#define DEFAULT_PM_SPLIT ((real) 1.25)
+#define DEFAULT_FORCE_TOLERANCE ((real) 0.0)
+#define DEFAULT_DETERMINISTIC FALSE
+#define DEFAULT_POTENTIAL_TABLE_TOLERANCE ((real) 0.0)
+#define DEFAULT_DISPERSION_TABLE_TOLERANCE ((real) 0.0)
 
 #define DEFAULT_USE_BEST_LIKELIHOOD FALSE
 #define DEFAULT_USE_VEL_DISP FALSE
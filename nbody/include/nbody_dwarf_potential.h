@@ -34,6 +34,7 @@ extern "C" {
 
 real get_potential(const Dwarf* args, real r);
 real get_density(const Dwarf* args, real r);
+real get_enclosed_mass(const Dwarf* args, real r);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,91 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_ENERGY_H_
+#define _NBODY_ENERGY_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Energy of the bodies at one time, in the frame of their centre of mass
+ * apart from bulk and external */
+typedef struct
+{
+    real kinetic;
+    real potential;         /* of their self gravity */
+    real virial;            /* sum of m r . a, external forces included */
+    real bulk;              /* kinetic energy of the motion of the centre of mass */
+    real external;          /* minus the work of the external forces since the first sample */
+} NBodyEnergySample;
+
+struct NBodyEnergy
+{
+    real* phi;              /* self gravity potential of each body from the last force calculation */
+    int phiCapacity;
+    double* sums;           /* sums over the bodies by each thread in the last force calculation */
+    int sumThreads;
+    double* bodySums;       /* in deterministic mode, the sums for each body instead */
+    int bodySumCapacity;
+    mwbool havePhi;         /* the last force calculation found phi */
+    mwbool potentialKnown;  /* every sample so far had the potential */
+    const char* phiUnknownBy; /* criterion of the first forces which did not find it */
+    unsigned int samples;
+    NBodyEnergySample first;
+    NBodyEnergySample last;
+    real lastTime;          /* of the last sample */
+    real lastPower;         /* of the external forces at the last sample */
+    real work;              /* of the external forces since the first sample */
+    real driftMax;          /* largest |E - E0| / |kinetic0 + potential0| of all the terms */
+    real virialRatioMin;
+    real virialRatioMax;
+};
+
+/* Start keeping the energy of st, if it is not already */
+void nbStartEnergy(NBodyState* st);
+void nbDestroyEnergy(NBodyEnergy* e);
+
+/* The rest do nothing if the energy of st is not being kept */
+
+/* Before a force calculation, with findsPhi if it will fill in e->phi
+ * for the st->nbody bodies. Clears the sums it adds the bodies to. */
+void nbEnergyForces(const NBodyCtx* ctx, NBodyState* st, mwbool findsPhi);
+
+/* Add body i, b, to the sums of the calling thread as the force
+ * calculation finishes it, with its acceleration a, of which ext is
+ * external, after any kick, and the self gravity potential phi if it
+ * was found */
+void nbEnergyAddBody(NBodyEnergy* e, int i, const Body* b, mwvector a, mwvector ext, real phi);
+
+/* Take a sample of the energy at time from the sums of the last force
+ * calculation, which must have left the velocities at the same time,
+ * such as the closing kick of a step. shift is the acceleration of the
+ * frame at that time, felt by every body. */
+void nbSampleEnergy(NBodyState* st, real time, mwvector shift);
+
+/* Write the first and last energies and the largest changes to stdout
+ * in tags, one per line */
+void nbPrintEnergy(const NBodyState* st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_ENERGY_H_ */
+
@@ -6,12 +6,24 @@
 #ifndef _NBODY_FRICTION_H_
 #define _NBODY_FRICTION_H_
 
+#include "nbody_types.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-mwvector dynamicalFriction_LMC(const Potential* pot, mwvector pos, mwvector vel, real mass_LMC, real scaleLength_LMC, mwbool dynaFric, real time, real coulomb_log);
+/* Tabulate the velocity dispersion of pot to the relative tolerance, or
+ * NULL if it depends on time or azimuth */
+NBodyDispersionTable* nbMakeDispersionTable(const Potential* pot, real tolerance);
+void nbDestroyDispersionTable(NBodyDispersionTable* t);
+
+/* t was made for pot with tolerance */
+mwbool nbDispersionTableFor(const NBodyDispersionTable* t, const Potential* pot, real tolerance);
+
+/* Velocity dispersion at pos from the table, or integrated directly if t is NULL */
+real nbVelDispersion(const NBodyDispersionTable* t, const Potential* pot, mwvector pos, real time);
+
+mwvector dynamicalFriction_LMC(const Potential* pot, mwvector pos, mwvector vel, real mass_LMC, real scaleLength_LMC, mwbool dynaFric, real time, real coulomb_log, const NBodyDispersionTable* dispersion);
 
 #ifdef __cplusplus
 }
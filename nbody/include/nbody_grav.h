@@ -30,6 +30,18 @@ extern "C" {
 /* compute force on all the bodies */
 NBodyStatus nbGravMap(const NBodyCtx* ctx, NBodyState* st);
 
+/* compute force on all the bodies and half kick them with it */
+NBodyStatus nbGravMapKick(const NBodyCtx* ctx, NBodyState* st, real dtHalf, mwvector shift);
+
+/* the same with block timesteps, each body kicked by dtHalf / 2^rung */
+NBodyStatus nbGravMapKickRungs(const NBodyCtx* ctx, NBodyState* st, real dtHalf, mwvector shift);
+
+/* self gravity alone on the listed bodies, into acc in the same order */
+NBodyStatus nbGravitySamples(const NBodyCtx* ctx, NBodyState* st, const int* samples, int nSample, mwvector* acc);
+
+/* write the bodies in the order the tree walk meets them, then the test particles */
+int nbTreeBodyOrder(const NBodyState* st, int* order);
+
 #ifdef __cplusplus
 }
 #endif
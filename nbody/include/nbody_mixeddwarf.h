@@ -32,6 +32,7 @@ extern "C" {
 #endif
 
 int nbGenerateMixedDwarf(lua_State* luaSt);
+void nbSetDwarfVars(Dwarf* comp);
 void registerGenerateMixedDwarf(lua_State* luaSt);
 
 #ifdef __cplusplus
@@ -0,0 +1,67 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_MPI_H_
+#define _NBODY_MPI_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int nbMPIInit(void);
+void nbMPIFinalize(void);
+
+/* Rank of this process and count of processes, 0 and 1 before nbMPIInit() */
+int nbMPIRank(void);
+int nbMPISize(void);
+
+/* Keep only a share of the bodies of st on each process, to be moved to
+ * their domains by the first force calculation. Does nothing with one
+ * process. */
+NBodyStatus nbMPIDistribute(const NBodyCtx* ctx, NBodyState* st);
+
+/* Give every process all of the bodies again, in their original order */
+NBodyStatus nbMPICollect(NBodyState* st);
+
+/* Move the bodies to the domains they are now in, build the tree of
+ * this domain, and the tree of the cells and bodies of the others it
+ * needs */
+NBodyStatus nbMPIMakeTree(const NBodyCtx* ctx, NBodyState* st);
+
+/* The cells and bodies of the other domains as bodies in a tree of their
+ * own, with the quad moments of those that are cells in tree.bodyQuads,
+ * or NULL if there are none */
+const NBodyState* nbMPIRemote(const NBodyState* st);
+
+/* Status of all the processes combined */
+NBodyStatus nbMPIReduceStatus(NBodyStatus rc);
+
+/* Copy size bytes at data from the first process to all the others */
+void nbMPIBroadcast(void* data, size_t size);
+
+/* Replace the n values at x on every process by their sums over all of them */
+void nbMPISum(double* x, int n);
+
+void nbDestroyMPI(NBodyMPI* m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_MPI_H_ */
@@ -0,0 +1,49 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _NBODY_NUMA_H_
+#define _NBODY_NUMA_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pin each OpenMP thread to its own processor, spread evenly over the
+ * processors this process may run on. Returns nonzero if not possible. */
+int nbPinThreads(void);
+
+/* Memory for one of the big per body or per cell arrays, aligned as by
+ * mwMallocA() and freed with mwFreeA(). With hugePages it is advised
+ * onto transparent huge pages where supported. */
+void* nbAllocBig(size_t size, mwbool hugePages);
+
+/* Zero n items of size bytes at p, each item by the thread a static
+ * schedule over them gives it, so the pages are first touched there */
+void nbFirstTouch(void* p, int n, size_t size);
+
+/* Move the bodies and their accelerations to memory first touched by
+ * the threads that drift them. Only worth it with pinned threads. */
+void nbPlaceBodies(NBodyState* st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_NUMA_H_ */
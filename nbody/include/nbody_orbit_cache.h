@@ -0,0 +1,54 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_ORBIT_CACHE_H_
+#define _NBODY_ORBIT_CACHE_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Keep the results of the orbit integrations in files in dir, or stop
+ * keeping them if dir is NULL */
+void nbSetOrbitCache(const char* dir);
+
+/* Key of an integration named kind with pot and the nInputs inputs, or
+ * NULL if no cache is set. Free with free(). */
+char* nbOrbitCacheKey(const char* kind, const Potential* pot, const real* inputs, unsigned int nInputs);
+
+/* Path of the file kept for key. Free with free(). */
+char* nbOrbitCacheFile(const char* key);
+
+/* Read the nResults vectors kept for key, and if array is not NULL the
+ * array kept with them into *array, allocated with mwMallocA(). Returns
+ * TRUE if they were found. */
+mwbool nbReadOrbitCache(const char* key, mwvector* results, unsigned int nResults,
+                        mwvector** array, size_t* arraySize);
+
+/* Keep the nResults vectors and the arraySize long array, which may be
+ * NULL, for key. Failing to write them is not an error. */
+void nbWriteOrbitCache(const char* key, const mwvector* results, unsigned int nResults,
+                       const mwvector* array, size_t arraySize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_ORBIT_CACHE_H_ */
+
@@ -48,10 +48,17 @@ void nbReverseOrbit_LMC(mwvector* finalPos,
                     real dt,
                     real LMCmass,
                     real LMCscale,
-                    real coulomb_log);
+                    real coulomb_log,
+                    real dispersionTolerance);
 
+/* The caller owns the shift array it gets, and frees it with mwFreeA() */
 void getLMCArray(mwvector ** shiftArrayPtr, size_t * shiftSizePtr);
 
+/* Velocity dispersion table of pot to tolerance for the friction, taken
+ * from the last reverse orbit if it made one for them. The caller owns it
+ * and frees it with nbDestroyDispersionTable(). */
+NBodyDispersionTable* getLMCDispersionTable(const Potential* pot, real tolerance);
+
 void getLMCPosVel(mwvector * LMCposPtr, mwvector * LMCvelPtr);
 
 void nbPrintReverseOrbit(mwvector* finalPos,
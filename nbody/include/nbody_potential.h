@@ -28,6 +28,11 @@ extern "C" {
 #endif
 
 mwvector nbExtAcceleration(const Potential* pot, mwvector pos, real time);
+
+/* nbExtAcceleration() at each of the n positions x, y, z, written to ax,
+ * ay, az. The positions and accelerations must not overlap. */
+void nbExtAccelerationBlock(const Potential* pot, const real* x, const real* y, const real* z,
+                            real* ax, real* ay, real* az, int n, real time);
 mwvector pointAccel(const mwvector pos, const mwvector pos1, const real mass);
 mwvector plummerAccel(const mwvector pos, const mwvector pos1, const real mass, const real scale);
 
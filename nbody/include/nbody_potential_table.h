@@ -0,0 +1,48 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NBODY_POTENTIAL_TABLE_H_
+#define _NBODY_POTENTIAL_TABLE_H_
+
+#include "nbody_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Tabulate the slow components of ctx->pot, or the Lua closure
+ * potential, into st->potTable to within ctx->potentialTableTolerance.
+ * st->potTable is left NULL if there is nothing worth tabulating or the
+ * tolerance can not be reached. */
+void nbMakePotentialTable(const NBodyCtx* ctx, NBodyState* st);
+
+void nbDestroyPotentialTable(NBodyPotentialTable* t);
+
+/* Same as nbExtAcceleration(pot, pos, time), from the table t of pot
+ * where it covers pos. t may be NULL. */
+mwvector nbTableExtAcceleration(const NBodyPotentialTable* t, const Potential* pot, mwvector pos, real time);
+
+/* Same as nbEvalPotentialClosure(st, pos, aOut), from st->potTable where
+ * it covers pos */
+void nbTableClosureAcceleration(NBodyState* st, mwvector pos, mwvector* aOut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NBODY_POTENTIAL_TABLE_H_ */
+
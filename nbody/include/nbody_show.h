@@ -27,6 +27,7 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 /* Types -> String */
 const char* showBool(mwbool);
 const char* showCriterionT(criterion_t);
+const char* showIntegratorT(integrator_t);
 const char* showSphericalT(spherical_t);
 const char* showDiskT(disk_t);
 const char* showHaloT(halo_t);
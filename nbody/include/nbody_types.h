@@ -25,8 +25,10 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef _NBODY_TYPES_H_
 #define _NBODY_TYPES_H_
 
-/* Body and cell data structures are used to represent the tree.  During
- * tree construction, descendent pointers are stored in the subp arrays:
+/* Body and cell data structures are used to represent the tree.  Cells
+ * are kept together in an arena owned by the tree, and nodes refer to
+ * each other with indices (see nodelink_t) rather than pointers. During
+ * tree construction, descendent links are stored in the subp arrays:
  *
  *          +-------------------------------------------------------------+
  * root --> | CELL: mass, pos, next, rcrit2, more, subp:[/,o,/,/,/,/,o,/] |
@@ -45,9 +47,10 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
  *          +--------------------------------------------|-----|-----|----+
  *                                                      etc   etc   etc
  *
- * After the tree is complete, it is threaded to permit linear force
- * calculation, using the next and more pointers.  The storage used for
- * the subp arrays may be reused to store quadrupole moments.
+ * After the tree is complete, its cells are copied into depth first
+ * order and it is threaded to permit linear force calculation, using
+ * the next and more links.  The storage used for the subp arrays may be
+ * reused to store quadrupole moments.
  *
  *          +-----------------------------------------------+
  * root --> | CELL: mass, pos, next:/, rcrit2, more:o, quad |
@@ -99,17 +102,33 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 
 typedef short body_t;
 
+/* Link between nodes of the tree. A link to a cell is its index in the
+ * tree's cell arena, and a link to body i of the body table is -(i + 1).
+ * The root is the first cell of the arena and is never linked to, so 0
+ * means no link.
+ */
+typedef int nodelink_t;
+
+#define NULL_LINK 0
+#define isBodyLink(x) ((x) < 0)
+#define isCellLink(x) ((x) > 0)
+#define bodyLink(i) (-(i) - 1)
+#define linkBody(x) (-(x) - 1)
+
+/* Node a (non-null) link refers to */
+#define LinkNode(cells, btab, x) (isBodyLink(x) ? (NBodyNode*) &(btab)[linkBody(x)] : (NBodyNode*) &(cells)[x])
+
 /* node: data common to BODY and CELL structures. */
 typedef struct MW_ALIGN_TYPE _NBodyNode
 {
     mwvector pos;             /* position of node */
-    struct _NBodyNode* next;  /* link to next force-calc */
+    nodelink_t next;          /* link to next force-calc */
     real mass;                /* total mass of node */
     body_t type;              /* code for node type */
     unsigned int id;          /* body id */
 } NBodyNode;
 
-#define EMPTY_NODE { ZERO_VECTOR, NULL, 0.0, 0, 0  }
+#define EMPTY_NODE { ZERO_VECTOR, NULL_LINK, 0.0, 0, 0  }
 
 #define Type(x) (((NBodyNode*) (x))->type)
 #define Mass(x) (((NBodyNode*) (x))->mass)
@@ -141,16 +160,26 @@ typedef struct MW_ALIGN_TYPE
     real zz;
 } NBodyQuadMatrix;
 
+/* Octupole moment of a cell, O_ijk = sum m (15 x_i x_j x_k - 3 |x|^2
+ * (delta_ij x_k + delta_ik x_j + delta_jk x_i)) about its center of
+ * mass. It is fully symmetric, so these are the unique components. */
+typedef struct MW_ALIGN_TYPE
+{
+    real xxx, xxy, xxz, xyy, xyz, xzz;
+    real yyy, yyz, yzz;
+    real zzz;
+} NBodyOctMatrix;
 
 
 typedef struct MW_ALIGN_TYPE
 {
     NBodyNode cellnode;         /* data common to all nodes */
     real rcrit2;                /* critical c-of-m radius^2 */
-    NBodyNode* more;            /* link to first descendent */
+    nodelink_t more;            /* link to first descendent */
+    unsigned int nbody;         /* count of bodies below cell */
     union MW_ALIGN_V(16)        /* shared storage for... */
     {
-        NBodyNode* subp[NSUB];  /* descendents of cell */
+        nodelink_t subp[NSUB];  /* descendents of cell */
         NBodyQuadMatrix quad;   /* quad. moment of cell. Unique symmetric matrix components */
     } stuff;
 } NBodyCell;
@@ -162,9 +191,19 @@ typedef enum
     TreeCode, 
     SW93,
     BH86,
-    Exact
+    Exact,
+    FMM,
+    PM
 } criterion_t;
 
+/* time integration scheme of the plain integrator */
+typedef enum
+{
+    InvalidIntegrator = InvalidEnum,
+    Leapfrog,
+    Yoshida4
+} integrator_t;
+
 
 typedef enum
 {
@@ -176,6 +215,7 @@ typedef enum
 
 #define Rcrit2(x) (((NBodyCell*) (x))->rcrit2)
 #define More(x)   (((NBodyCell*) (x))->more)
+#define NBodies(x) (((NBodyCell*) (x))->nbody)
 #define Subp(x)   (((NBodyCell*) (x))->stuff.subp)
 #define Quad(x)   (((NBodyCell*) (x))->stuff.quad)
 
@@ -184,14 +224,34 @@ typedef enum
 typedef struct MW_ALIGN_TYPE
 {
     NBodyCell* root;         /* pointer to root cell */
+    NBodyCell* cells;        /* arena of cells, in tree walk order */
+    NBodyCell* loadCells;    /* arena bodies are loaded into before ordering */
+    NBodyOctMatrix* octs;    /* octupole moments, by cell index, if used */
+    const NBodyQuadMatrix* bodyQuads; /* own quad moment of each body standing for a cell, or NULL */
+    real* cellSize;          /* side length of each cell when built, if refitting */
+    int* bodyBucket;         /* scratch used by the parallel build */
+    int* bucketBodies;
+    int* bucketCounts;
+    struct NBodyTreeBucket* buckets;
     real rsize;              /* side-length of root cell */
+    real bodyExtent;         /* largest coordinate of any body, if extentKnown */
 
+    int bucketThreads;       /* threads bucketCounts has room for */
+    int bucketBodyCapacity;  /* bodies bodyBucket and bucketBodies have room for */
+    unsigned int cellCapacity;  /* cells available in each arena */
+    unsigned int cellReserved;  /* loaded cells handed out to builders */
     unsigned int cellUsed;   /* count of cells in tree */
+    unsigned int cellPeak;   /* largest count of cells in any tree built */
     unsigned int maxDepth;   /* count of levels in tree */
+    unsigned int splitDepth; /* level the last parallel build split the tree at */
+    unsigned int buildCount; /* trees built from scratch */
+    unsigned int refitCount; /* steps which reused the last tree */
+    unsigned int refitSteps; /* refits since the last build */
     int structureError;
+    mwbool extentKnown;      /* bodyExtent was found by the integrator since the bodies last moved */
 } NBodyTree;
 
-#define EMPTY_TREE { NULL, 0.0, 0, 0, FALSE }
+#define EMPTY_TREE { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0.0, 0.0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, FALSE, FALSE }
 
 
 #if NBODY_OPENCL
@@ -356,11 +416,28 @@ typedef struct
     NBodyHistogram* histograms[8]; 
 } MainStruct;
 
+/* Grids and cached Green's function of the particle-mesh solver, private to nbody_pm.c */
+typedef struct NBodyPM NBodyPM;
+
+/* Domain of this process in a run over several processes, private to nbody_mpi.c */
+typedef struct NBodyMPI NBodyMPI;
+
+/* Work and phase time counts of a run, in nbody_counters.h */
+typedef struct NBodyCounters NBodyCounters;
+
+/* Energy and virial through a run, in nbody_energy.h */
+typedef struct NBodyEnergy NBodyEnergy;
+
+/* Interpolation table of the external potential, in nbody_potential_table.h */
+typedef struct NBodyPotentialTable NBodyPotentialTable;
+
+/* Interpolation table of the velocity dispersion for dynamical friction, in nbody_friction.h */
+typedef struct NBodyDispersionTable NBodyDispersionTable;
+
 /* Mutable state used during an evaluation */
 typedef struct MW_ALIGN_TYPE
 {
     NBodyTree tree;
-    NBodyNode* freeCell;      /* list of free cells */
     char* checkpointResolved;
     Body* bodytab;            /* points to array of bodies */
     Body* bestLikelihoodBodyTab;     /* this one used for out file generation */
@@ -414,9 +491,32 @@ typedef struct MW_ALIGN_TYPE
     mwbool usesCL;
     mwbool useCLCheckpointing;
     mwbool reportProgress;
+    mwbool hugePages;          /* big arrays are advised onto huge pages */
+    mwbool placeBodies;        /* threads are pinned, so the bodies are placed on their memory nodes */
 
     
     real previousForwardTime;   //used to calibrate bar time
+
+    int* rungs;                 /* block timestep rung of each body, NULL until first assigned */
+    unsigned int activeRung;    /* bodies on rungs below this are skipped by the force calculation */
+    real substepTime;           /* time of the current block substep past st->step * timestep */
+    unsigned int* bodyCost;     /* nodes each body visited in its last tree walk, with ctx->costBalance */
+    int* costOrder;             /* bodies in tree order for the cost balanced walk */
+    double* costSum;            /* running total of bodyCost over costOrder */
+    int costCapacity;           /* bodies costOrder and costSum have room for */
+    real forceImbalanceSum;     /* sum of slowest / mean thread time over the tree force calculations */
+    real forceImbalanceMax;
+    unsigned int forceImbalanceCount;
+    mwvector dwarfPos;          /* center of the dwarf's potential in the restricted mode */
+    mwvector dwarfVel;
+    mwvector dwarfAcc;          /* acceleration of the center from the last force calculation */
+    real dwarfMassFraction;     /* fraction of the dwarf's mass still bound to it */
+    NBodyPM* pm;                /* particle-mesh solver state with the PM criterion, NULL until first used */
+    NBodyMPI* mpi;              /* while running over several processes; bodytab then only holds this domain */
+    NBodyCounters* counters;    /* work and time of each phase when asked for, else NULL */
+    NBodyEnergy* energy;        /* energy and virial through the run when asked for, else NULL */
+    NBodyPotentialTable* potTable; /* tabulated external potential with ctx->potentialTableTolerance, else NULL */
+    NBodyDispersionTable* dispersion; /* tabulated velocity dispersion for the LMC's dynamical friction, else NULL */
     
   #if NBODY_OPENCL
     CLInfo* ci;
@@ -432,15 +532,21 @@ typedef struct MW_ALIGN_TYPE
 
 #define NBODYSTATE_TYPE "NBodyState"
 
-#define EMPTY_NBODYSTATE { EMPTY_TREE, NULL, NULL, NULL, NULL, NULL, NULL, NULL,            \
+#define EMPTY_NBODYSTATE { EMPTY_TREE, NULL, NULL, NULL, NULL, NULL, NULL,                  \
                            NULL, ZERO_VECTOR, ZERO_VECTOR,                                  \
                            NULL, 0,                                                         \
                            0, 0, 0,                                                         \
                            0, 0, 0, 0, 0, 0,                                                \
                            0, 0,                                                            \
                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, FALSE, FALSE, FALSE, FALSE, FALSE, \
-                           FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, 0,\
-                           NULL, NULL, NULL, NULL}
+                           FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, \
+                           0,                                                               \
+                           NULL, 0, 0.0, NULL, NULL, NULL, 0, 0.0, 0.0, 0,                  \
+                           ZERO_VECTOR, ZERO_VECTOR, ZERO_VECTOR, 0.0, NULL, NULL, NULL, NULL, NULL, \
+                           NULL, NULL, NULL, NULL, NULL}
+
+/* Deepest block timestep rung; bodies on rung r step by timestep / 2^r */
+#define NBODY_MAX_RUNG 16
 
 
 /* The context tracks settings of the simulation.  It should be set
@@ -472,6 +578,7 @@ typedef struct MW_ALIGN_TYPE
 
     criterion_t criterion;
     ExternalPotentialType potentialType;
+    integrator_t integrator;
     
     mwbool Nstep_control;     /* manually control how many timesteps simulation runs */
     mwbool useBestLike;       /* use best likelihood return code */
@@ -488,6 +595,20 @@ typedef struct MW_ALIGN_TYPE
     mwbool useQuad;           /* use quadrupole corrections */
     mwbool allowIncest;
     mwbool quietErrors;
+    mwbool parallelTree;      /* insert bodies into the tree with multiple threads */
+    mwbool costBalance;       /* split the tree walks between threads by each body's cost in the last walk */
+    unsigned int walkGroupSize; /* walk the tree once per group of up to this many bodies; 0 walks per body */
+    unsigned int multipoleOrder; /* highest cell moment: 1 monopole, 2 quadrupole, 3 octupole; 0 follows useQuad */
+    unsigned int treeRefitSteps; /* steps the tree may be refit between rebuilds; 0 rebuilds every step */
+    unsigned int maxRung;     /* deepest block timestep rung, timestep / 2^maxRung; 0 uses the global timestep */
+    real rungEta;             /* accuracy parameter for choosing a body's rung */
+    unsigned int pmGridSize;  /* particle-mesh cells along each side of the mesh, a power of 2 */
+    real pmBoxSize;           /* side of the mesh around the dwarf; 0 fits it to the bodies each step */
+    real pmSplit;             /* scale in mesh cells below which the tree gives the force; 0 uses the mesh alone */
+    real forceTolerance;      /* with > 0, choose criterion, theta and useQuad for this rms relative force error */
+    mwbool deterministic;     /* give bitwise the same results for any number of threads */
+    real potentialTableTolerance; /* with > 0, tabulate the slow external potentials to this relative error */
+    real dispersionTableTolerance; /* with > 0, tabulate the LMC friction's velocity dispersion to this relative error */
     
     real BestLikeStart;       /* after what portion of the sim should the calc start */
     real OutputFreq;          /* frequency of writing outputs */
@@ -509,6 +630,11 @@ typedef struct MW_ALIGN_TYPE
     mwbool LMCDynaFric;        /* LMC Dynamical Friction switch */
     real coulomb_log;          /* Coulomb Logarithm used in dynamical friction */
 
+    mwbool restricted;         /* bodies feel the analytic potential of the dwarf instead of each other */
+    mwbool restrictedMassLoss; /* scale the dwarf's mass by the fraction of the mass still bound to it */
+    Dwarf restrictedLight;     /* components of the dwarf's potential in the restricted mode */
+    Dwarf restrictedDark;
+
     unsigned int calibrationRuns; //for calibrating time-dependent potentials
 
     real Ntsteps;              /* number of time steps to run when manual control is on */
@@ -524,13 +650,15 @@ typedef struct MW_ALIGN_TYPE
 #define EMPTY_NBODYCTX { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,                                                  \
                          0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,                                             \
                          0.0, 0.0, 0.0, 0.0, 0.0,                                                       \
-                         InvalidCriterion, EXTERNAL_POTENTIAL_DEFAULT,                                  \
+                         InvalidCriterion, EXTERNAL_POTENTIAL_DEFAULT, InvalidIntegrator,               \
                          FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE,          \
-                         FALSE, FALSE, FALSE, FALSE,                                                    \
+                         FALSE, FALSE, FALSE, FALSE, FALSE, FALSE,                                      \
+                         0, 0, 0, 0, 0.0, 0, 0.0, 0.0, 0.0, FALSE, 0.0, 0.0,                            \
                          0, 0,                                                                          \
                          0, 0, 0, 0, 0, 0, 0, 0, 0,                                                     \
                          FALSE,                                                                         \
                          0, 0, FALSE, 0,                                                                \
+                         FALSE, FALSE, EMPTY_DWARF, EMPTY_DWARF,                                        \
                          0,                                                                             \
                          0, 0, 0,                                                                       \
                          EMPTY_POTENTIAL}
@@ -616,6 +744,7 @@ NBodyStatus nbInitCL(NBodyState* st, const NBodyCtx* ctx, const CLRequest* clr);
 NBodyStatus nbInitNBodyStateCL(NBodyState* st, const NBodyCtx* ctx);
 
 int destroyNBodyState(NBodyState* st);
+void freeNBodyTree(NBodyTree* t);
 int nbDetachSharedScene(NBodyState* st);
 void setLMCShiftArray(NBodyState* st, mwvector* shiftArray, size_t shiftSize);
 void setLMCPosVel(NBodyState* st, mwvector PosArray, mwvector VelArray);
@@ -631,7 +760,7 @@ int equalSpherical(const Spherical* s1, const Spherical* s2);
 int equalHalo(const Halo* h1, const Halo* h2);
 int equalDisk(const Disk* d1, const Disk* d2);
 
-// int equalDwarf(const Dwarf* h1, const Dwarf* h2);
+int equalDwarf(const Dwarf* d1, const Dwarf* d2);
 
 int equalPotential(const Potential* p1, const Potential* p2);
 
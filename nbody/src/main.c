@@ -33,6 +33,8 @@
 #include "nbody_likelihood.h"
 #include "nbody_defaults.h"
 #include "milkyway_git_version.h"
+#include "nbody_numa.h"
+#include "nbody_orbit_cache.h"
 
 #ifdef _OPENMP
   #include <omp.h>
@@ -42,6 +44,10 @@
   #include <crlibm.h>
 #endif /* NBODY_CRLIBM */
 
+#if NBODY_MPI
+  #include "nbody_mpi.h"
+#endif /* NBODY_MPI */
+
 #define SEED_ARGUMENT (1 << 1)
 
 
@@ -352,6 +358,36 @@ static mwbool nbReadParameters(const int argc, const char* argv[], NBodyFlags* n
             0, "BOINC argument for number of threads. No effect if built without OpenMP", NULL
         },
 
+        {
+            "pin-threads", '\0',
+            POPT_ARG_NONE, &nbf.pinThreads,
+            0, "Pin each thread to its own processor, spread over those available", NULL
+        },
+
+        {
+            "huge-pages", '\0',
+            POPT_ARG_NONE, &nbf.hugePages,
+            0, "Advise the bodies and tree onto transparent huge pages", NULL
+        },
+
+        {
+            "counters", '\0',
+            POPT_ARG_NONE, &nbf.printCounters,
+            0, "Count the tree walk work and time each phase of the steps, printed at the end", NULL
+        },
+
+        {
+            "energy", '\0',
+            POPT_ARG_NONE, &nbf.printEnergy,
+            0, "Follow the energy and virial ratio of the bodies each step, printed at the end", NULL
+        },
+
+        {
+            "orbit-cache", '\0',
+            POPT_ARG_STRING, &nbf.orbitCacheDir,
+            0, "Keep the reverse orbits in this directory and reuse them for the same potential and orbit", NULL
+        },
+
         {
             "p", 'p',
             POPT_ARG_NONE, &params,
@@ -535,6 +571,7 @@ static void freeNBodyFlags(NBodyFlags* nbf)
     free(nbf->forwardedArgs);
     free(nbf->graphicsBin);
     free(nbf->visArgs);
+    free(nbf->orbitCacheDir);
 }
 
 static int nbSetNumThreads(int numThreads)
@@ -592,6 +629,16 @@ int main(int argc, const char* argv[])
     NBodyFlags nbf;
     int rc = 0;
     const char** argvCopy = mwFixArgv(argc, argv);
+
+  #if NBODY_MPI
+    if (nbMPIInit())
+    {
+        mw_printf("Failed to initialize MPI\n");
+        return EXIT_FAILURE;
+    }
+    atexit(nbMPIFinalize);
+  #endif
+
     nbSpecialSetup();
 
     if (nbReadParameters(argc, argvCopy ? argvCopy : argv, &nbf))
@@ -622,6 +669,15 @@ int main(int argc, const char* argv[])
         mw_finish(EXIT_FAILURE);
     }
 
+    nbSetOrbitCache(nbf.orbitCacheDir);
+
+    /* Before anything is allocated, so pages are first touched where
+     * the threads will stay */
+    if (nbf.pinThreads && nbPinThreads())
+    {
+        mw_finish(EXIT_FAILURE);
+    }
+
     if (nbf.verifyOnly)
     {
         rc = nbVerifyFile(&nbf);
@@ -718,6 +774,13 @@ int main(int argc, const char* argv[])
 
         //mw_printf("Before noCleanCheckpoint\n");
 
+      #if NBODY_MPI
+        if (nbMPIRank() != 0)
+        {
+            nbf.noCleanCheckpoint = TRUE;   /* the first process removes it */
+        }
+      #endif
+
         if (!nbf.noCleanCheckpoint)
         {
             //mw_printf("After noCleanCheckpoint\n");
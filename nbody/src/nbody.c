@@ -32,6 +32,17 @@
 #include "nbody_likelihood.h"
 #include "nbody_histogram.h"
 #include "nbody_types.h"
+#include "nbody_numa.h"
+#include "nbody_autotune.h"
+#include "nbody_counters.h"
+#include "nbody_energy.h"
+#include "nbody_potential_table.h"
+#include "nbody_friction.h"
+#include "nbody_orbit_integrator.h"
+
+#if NBODY_MPI
+  #include "nbody_mpi.h"
+#endif
 
 #if NBODY_OPENCL
   #include "nbody_cl.h"
@@ -104,6 +115,18 @@ static void nbSetStateFromFlags(NBodyState* st, const NBodyFlags* nbf)
 {
     st->reportProgress = nbf->reportProgress;
     st->ignoreResponsive = nbf->ignoreResponsive;
+    st->hugePages = nbf->hugePages;
+    st->placeBodies = nbf->pinThreads;
+
+    if (nbf->printCounters)
+    {
+        nbStartCounters(st);
+    }
+
+    if (nbf->printEnergy)
+    {
+        nbStartEnergy(st);
+    }
 }
 
 static void nbSetCLRequestFromFlags(CLRequest* clr, const NBodyFlags* nbf)
@@ -170,7 +193,9 @@ static int nbOutputIsUseful(const NBodyFlags* nbf)
         && !nbf->histoutFileName
         && !nbf->printHistogram
         && !nbf->verifyOnly
-        && !nbf->printTiming)
+        && !nbf->printTiming
+        && !nbf->printCounters
+        && !nbf->printEnergy)
     {
         mw_printf("Don't you want some kind of result?\n");
         return FALSE;
@@ -404,6 +429,11 @@ int nbMain(const NBodyFlags* nbf)
 
     NBodyStatus rc = NBODY_SUCCESS;
     real ts = 0.0, te = 0.0;
+    mwbool reporting = TRUE;   /* only the first of several processes reports */
+
+  #if NBODY_MPI
+    reporting = (nbMPIRank() == 0);
+  #endif
 
     if (!nbOutputIsUseful(nbf))
     {
@@ -431,6 +461,11 @@ int nbMain(const NBodyFlags* nbf)
         return rc;
     }
 
+    if (ctx->forceTolerance > 0.0 && st->step == 0)
+    {
+        nbAutotune(ctx, st);    /* a resumed run keeps what it was tuned to */
+    }
+
     NBodyState initialState = EMPTY_NBODYSTATE;
     //for the first run, just assume the best likelihood timestep will occur in middle of best-likelihood window
     //convert eff_best_like_start to the original best like start
@@ -449,6 +484,16 @@ int nbMain(const NBodyFlags* nbf)
         //these for checkpointing
         nbSetCtxFromFlags(ctx, nbf); /* Do this after setup to avoid the setup clobbering the flags */
         nbSetStateFromFlags(st, nbf); 
+        st->reportProgress = st->reportProgress && reporting;
+        if (st->placeBodies)
+        {
+            nbPlaceBodies(st);    /* they were made, read or reset by one thread */
+        }
+        nbMakePotentialTable(ctx, st);
+        if (ctx->LMC && ctx->LMCDynaFric && ctx->dispersionTableTolerance > 0.0 && !st->dispersion)
+        {
+            st->dispersion = getLMCDispersionTable(&ctx->pot, ctx->dispersionTableTolerance);
+        }
 
         if (NBODY_OPENCL && !nbf->noCL)
         {
@@ -460,7 +505,7 @@ int nbMain(const NBodyFlags* nbf)
             }
         }
 
-        if (nbCreateSharedScene(st, ctx))
+        if (reporting && nbCreateSharedScene(st, ctx))
         {
             mw_printf("Failed to create shared scene\n");
         }
@@ -475,7 +520,7 @@ int nbMain(const NBodyFlags* nbf)
             nbLaunchVisualizer(st, nbf->graphicsBin, nbf->visArgs);
         }
 
-        if (nbf->reportProgress)
+        if (nbf->reportProgress && reporting)
         {
             nbSetupCursesOutput();
         }
@@ -508,9 +553,14 @@ int nbMain(const NBodyFlags* nbf)
         if(i < ctx->calibrationRuns){
             //grab the best likelihood time
             real forwardTime = st->bestLikelihood_time;
+            //the tables only depend on the potential, so the next run keeps them
+            NBodyPotentialTable* potTable = st->potTable;
+            NBodyDispersionTable* dispersion = st->dispersion;
             //reset the state for the next run
             *st = (NBodyState)EMPTY_NBODYSTATE;
             cloneNBodyState(st, &initialState);
+            st->potTable = potTable;
+            st->dispersion = dispersion;
             //set previous forward time for the next run
             st->previousForwardTime = forwardTime;
         }
@@ -520,13 +570,16 @@ int nbMain(const NBodyFlags* nbf)
     te = mwGetTime();
     //mw_printf("After end GetTime\n");
 
-    if (nbf->reportProgress)
+    if (nbf->reportProgress && reporting)
     {
         nbCleanupCursesOutput();
     }
     //mw_printf("After reportProgress\n");
 
-    nbReportSimulationComplete(st);
+    if (reporting)
+    {
+        nbReportSimulationComplete(st);
+    }
     //mw_printf("After nbReportSimulationComplete\n");
 
     if (nbStatusIsFatal(rc))
@@ -542,14 +595,26 @@ int nbMain(const NBodyFlags* nbf)
             mw_printf("System complete with warnings: %s (%d)\n", showNBodyStatus(rc), rc);
         }
 
-        if (nbf->printTiming)
+        if (nbf->printTiming && reporting)
         {
             printf("<run_time> %f </run_time>\n", te - ts);
+            printf("<tree_cells_peak> %u </tree_cells_peak>\n", st->tree.cellPeak);
+            printf("<tree_builds> %u </tree_builds>\n", st->tree.buildCount);
+            printf("<tree_refits> %u </tree_refits>\n", st->tree.refitCount);
+            if (st->forceImbalanceCount > 0)
+            {
+                printf("<force_imbalance_mean> %f </force_imbalance_mean>\n",
+                       st->forceImbalanceSum / st->forceImbalanceCount);
+                printf("<force_imbalance_max> %f </force_imbalance_max>\n", st->forceImbalanceMax);
+            }
         }
     }
     //mw_printf("After Status Check\n");
 
-    rc = nbReportResults(ctx, st, nbf);
+    if (reporting)
+    {
+        rc = nbReportResults(ctx, st, nbf);
+    }
     //mw_printf("After nbReportResults\n");
 
     destroyNBodyState(st);
@@ -0,0 +1,344 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Choose the opening criterion, theta and quadrupole use that find the
+ * forces fastest within ctx->forceTolerance.
+ *
+ * The bodies are evolved a few steps under their own gravity to give a
+ * handful of snapshots, and the exact accelerations of an evenly spaced
+ * sample of them are summed directly in each. For every criterion with
+ * and without quadrupoles, theta is bisected for the largest value whose
+ * rms relative error over the sample stays within the tolerance in all
+ * the snapshots. Each of those is then timed on a full force calculation
+ * of the first snapshot and the fastest is kept. In deterministic mode
+ * the timings would make the choice differ from machine to machine, so
+ * the one with the fewest interactions in the tree walks is kept.
+ *
+ * The external potential adds the same to every candidate, so it is left
+ * out of both the snapshots and the timings.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_autotune.h"
+#include "nbody_counters.h"
+#include "nbody_defaults.h"
+#include "milkyway_util.h"
+
+#if NBODY_MPI
+  #include "nbody_mpi.h"
+#endif
+
+
+#define NBODY_TUNE_SAMPLES 256
+#define NBODY_TUNE_SNAPSHOTS 3
+#define NBODY_TUNE_STEPS 8          /* steps between snapshots */
+#define NBODY_TUNE_BISECTIONS 4
+#define NBODY_TUNE_THETA_MIN ((real) 0.2)
+#define NBODY_TUNE_THETA_MAX ((real) 1.0)
+
+typedef struct
+{
+    criterion_t criterion;
+    mwbool useQuad;
+    real theta;
+    real error;
+    double time;           /* seconds for one force calculation, or interactions if
+                              deterministic; < 0 if none met the tolerance */
+} NBodyTuneChoice;
+
+typedef struct
+{
+    NBodyCtx trial;
+    NBodyState work;
+    Body* snapshots[NBODY_TUNE_SNAPSHOTS];
+    mwvector* exact[NBODY_TUNE_SNAPSHOTS];
+    mwvector* acc;
+    int samples[NBODY_TUNE_SAMPLES];
+    int nSample;
+} NBodyTuner;
+
+
+/* Copy of ctx for the trials, with only the self gravity left */
+static void nbSetTrialCtx(NBodyCtx* trial, const NBodyCtx* ctx)
+{
+    *trial = *ctx;
+    trial->potentialType = EXTERNAL_POTENTIAL_NONE;
+    trial->LMC = FALSE;
+    trial->integrator = Leapfrog;
+    trial->maxRung = 0;
+    trial->treeRefitSteps = 0;
+    trial->allowIncest = TRUE;
+    trial->quietErrors = TRUE;
+}
+
+static void nbLoadSnapshot(NBodyTuner* t, int k)
+{
+    memcpy(t->work.bodytab, t->snapshots[k], t->work.nbody * sizeof(Body));
+    t->work.treeIncest = FALSE;
+    t->work.tree.structureError = FALSE;
+}
+
+/* Evolve a copy of the bodies to take the snapshots, and find the exact
+ * accelerations of the samples in each */
+static void nbInitTuner(NBodyTuner* t, const NBodyCtx* ctx, const NBodyState* st)
+{
+    static const NBodyState emptyState = EMPTY_NBODYSTATE;
+    int i, k;
+    unsigned int step;
+    const int nbody = st->nbody;
+    const mwvector zero = ZERO_VECTOR;
+    int nMassive = 0;
+    Body* bodies = (Body*) mwMallocA(nbody * sizeof(Body));
+
+    nbSetTrialCtx(&t->trial, ctx);
+    t->work = emptyState;
+    memcpy(bodies, st->bodytab, nbody * sizeof(Body));
+    setInitialNBodyState(&t->work, &t->trial, bodies, nbody);
+
+    for (i = 0; i < nbody; ++i)      /* test particles are not in the tree */
+    {
+        nMassive += (Mass(&bodies[i]) > 0.0);
+    }
+
+    t->nSample = 0;
+    for (i = 0, k = 0; i < nbody && t->nSample < NBODY_TUNE_SAMPLES; ++i)
+    {
+        if (!(Mass(&bodies[i]) > 0.0))
+            continue;
+
+        if ((long long) k * NBODY_TUNE_SAMPLES >= (long long) t->nSample * nMassive)
+            t->samples[t->nSample++] = i;
+        ++k;
+    }
+
+    t->acc = (mwvector*) mwMallocA(NBODY_TUNE_SAMPLES * sizeof(mwvector));
+
+    nbGravMap(&t->trial, &t->work);
+    for (k = 0; k < NBODY_TUNE_SNAPSHOTS; ++k)
+    {
+        if (k > 0)
+        {
+            for (step = 0; step < NBODY_TUNE_STEPS; ++step)
+            {
+                nbStepSystemPlain(&t->trial, &t->work, zero, zero);
+            }
+        }
+
+        t->snapshots[k] = (Body*) mwMallocA(nbody * sizeof(Body));
+        memcpy(t->snapshots[k], t->work.bodytab, nbody * sizeof(Body));
+    }
+
+    t->trial.criterion = Exact;
+    for (k = 0; k < NBODY_TUNE_SNAPSHOTS; ++k)
+    {
+        nbLoadSnapshot(t, k);
+        t->exact[k] = (mwvector*) mwMallocA(NBODY_TUNE_SAMPLES * sizeof(mwvector));
+        nbGravitySamples(&t->trial, &t->work, t->samples, t->nSample, t->exact[k]);
+    }
+}
+
+static void nbDestroyTuner(NBodyTuner* t)
+{
+    int k;
+
+    for (k = 0; k < NBODY_TUNE_SNAPSHOTS; ++k)
+    {
+        mwFreeA(t->snapshots[k]);
+        mwFreeA(t->exact[k]);
+    }
+    mwFreeA(t->acc);
+    destroyNBodyState(&t->work);
+}
+
+/* Largest rms relative error of the sampled accelerations over the
+ * snapshots with the trial settings, or infinity if the tree failed */
+static real nbTrialError(NBodyTuner* t)
+{
+    int i, k;
+    real worst = 0.0;
+
+    for (k = 0; k < NBODY_TUNE_SNAPSHOTS; ++k)
+    {
+        real sum = 0.0;
+
+        nbLoadSnapshot(t, k);
+        if (nbGravitySamples(&t->trial, &t->work, t->samples, t->nSample, t->acc) != NBODY_SUCCESS)
+            return INFINITY;
+
+        for (i = 0; i < t->nSample; ++i)
+        {
+            sum += mw_sqrv(mw_subv(t->acc[i], t->exact[k][i])) / mw_sqrv(t->exact[k][i]);
+        }
+
+        worst = mw_fmax(worst, mw_sqrt(sum / t->nSample));
+    }
+
+    return worst;
+}
+
+/* Interactions in a full force calculation on the first snapshot with
+ * the trial settings, or < 0 if it failed */
+static double nbTrialInteractions(NBodyTuner* t)
+{
+    nbLoadSnapshot(t, 0);
+    nbStartCounters(&t->work);
+    nbResetCounters(&t->work);
+    if (nbGravMap(&t->trial, &t->work) != NBODY_SUCCESS)
+        return -1.0;
+
+    return (double) nbCountedInteractions(&t->work);
+}
+
+/* Seconds for the fastest of two full force calculations on the first
+ * snapshot with the trial settings, or < 0 if they failed */
+static double nbTrialTime(NBodyTuner* t)
+{
+    int run;
+    double best = -1.0;
+
+    if (t->trial.deterministic)
+        return nbTrialInteractions(t);
+
+    for (run = 0; run < 2; ++run)
+    {
+        double ts, te;
+
+        nbLoadSnapshot(t, 0);
+        ts = mwGetTime();
+        if (nbGravMap(&t->trial, &t->work) != NBODY_SUCCESS)
+            return -1.0;
+        te = mwGetTime();
+
+        best = (run == 0) ? te - ts : mw_fmin(best, te - ts);
+    }
+
+    return best;
+}
+
+/* Largest theta within the tolerance for the trial criterion and
+ * quadrupole use, to the resolution of the bisection. Returns FALSE if
+ * even the smallest theta tried is not accurate enough. */
+static mwbool nbFindTheta(NBodyTuner* t, real tolerance, real* theta, real* error)
+{
+    int i;
+    real lo = NBODY_TUNE_THETA_MIN;
+    real hi = NBODY_TUNE_THETA_MAX;
+    real err;
+
+    t->trial.theta = hi;
+    err = nbTrialError(t);
+    if (err <= tolerance)
+    {
+        *theta = hi;
+        *error = err;
+        return TRUE;
+    }
+
+    t->trial.theta = lo;
+    *error = nbTrialError(t);
+    if (!(*error <= tolerance))
+        return FALSE;
+
+    for (i = 0; i < NBODY_TUNE_BISECTIONS; ++i)
+    {
+        real mid = 0.5 * (lo + hi);
+
+        t->trial.theta = mid;
+        err = nbTrialError(t);
+        if (err <= tolerance)
+        {
+            lo = mid;
+            *error = err;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    *theta = lo;
+    return TRUE;
+}
+
+static void nbTuneForces(const NBodyCtx* ctx, const NBodyState* st, NBodyTuneChoice* best)
+{
+    static const criterion_t criteria[] = { BH86, SW93, TreeCode };
+    unsigned int i, q;
+    NBodyTuner t;
+
+    best->time = -1.0;
+    nbInitTuner(&t, ctx, st);
+
+    for (i = 0; i < sizeof(criteria) / sizeof(criteria[0]); ++i)
+    {
+        /* An explicit multipole order decides the cell moments itself */
+        for (q = 0; q < (ctx->multipoleOrder != 0 ? 1u : 2u); ++q)
+        {
+            NBodyTuneChoice c;
+
+            c.criterion = criteria[i];
+            c.useQuad = (ctx->multipoleOrder != 0) ? ctx->useQuad : (mwbool) q;
+
+            t.trial.criterion = c.criterion;
+            t.trial.useQuad = c.useQuad;
+            t.work.usesQuad = c.useQuad;
+
+            if (!nbFindTheta(&t, ctx->forceTolerance, &c.theta, &c.error))
+                continue;
+
+            t.trial.theta = c.theta;
+            c.time = nbTrialTime(&t);
+            if (c.time >= 0.0 && (best->time < 0.0 || c.time < best->time))
+                *best = c;
+        }
+    }
+
+    nbDestroyTuner(&t);
+}
+
+void nbAutotune(NBodyCtx* ctx, NBodyState* st)
+{
+    NBodyTuneChoice best;
+
+  #if NBODY_MPI
+    /* Timings differ between processes, so one decides for all */
+    if (nbMPIRank() == 0)
+        nbTuneForces(ctx, st, &best);
+    nbMPIBroadcast(&best, sizeof(best));
+  #else
+    nbTuneForces(ctx, st, &best);
+  #endif
+
+    if (best.time < 0.0)
+    {
+        mw_printf("No tree setting reached force tolerance %g, keeping criterion = %s, theta = %f\n",
+                  ctx->forceTolerance, showCriterionT(ctx->criterion), ctx->theta);
+        return;
+    }
+
+    ctx->criterion = best.criterion;
+    ctx->theta = best.theta;
+    ctx->useQuad = best.useQuad;
+    st->usesQuad = best.useQuad;
+
+    mw_printf("Tuned forces for tolerance %g: criterion = %s, theta = %.3f, useQuad = %s "
+              "(rms force error %.3e, %.4g %s per force calculation)\n",
+              ctx->forceTolerance, showCriterionT(best.criterion), best.theta, showBool(best.useQuad),
+              best.error, best.time, ctx->deterministic ? "interactions" : "s");
+}
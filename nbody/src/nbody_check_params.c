@@ -308,8 +308,189 @@ static int hasAcceptableSteps(const NBodyCtx* ctx)
     return rc;
 }
 
+static int hasAcceptableMultipoleOrder(const NBodyCtx* ctx)
+{
+    if (ctx->multipoleOrder > 3)
+    {
+        mw_printf("Multipole order must be at most 3 (octupole) (multipoleOrder = %u)\n", ctx->multipoleOrder);
+        return TRUE;
+    }
+
+    if (ctx->multipoleOrder >= 3 && (ctx->criterion == FMM || ctx->criterion == PM || ctx->walkGroupSize > 0))
+    {
+        mw_printf("Octupole moments are only used by the per body tree walk\n");
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptableRungs(const NBodyCtx* ctx)
+{
+    if (ctx->maxRung > NBODY_MAX_RUNG)
+    {
+        mw_printf("Block timestep rung must be at most %d (maxRung = %u)\n", NBODY_MAX_RUNG, ctx->maxRung);
+        return TRUE;
+    }
+
+    if (ctx->maxRung > 0 && (!isfinite(ctx->rungEta) || ctx->rungEta <= 0.0))
+    {
+        mw_printf("Rung accuracy parameter must be positive (rungEta = %g)\n", ctx->rungEta);
+        return TRUE;
+    }
+
+    /* These find the force on every body, not only the ones at the end
+     * of their block step */
+    if (ctx->maxRung > 0 && ctx->walkGroupSize > 0)
+    {
+        mw_printf("Block timesteps are not supported by the grouped tree walk (walkGroupSize = %u)\n",
+                  ctx->walkGroupSize);
+        return TRUE;
+    }
+
+    if (ctx->maxRung > 0 && ctx->criterion == FMM)
+    {
+        mw_printf("Block timesteps are not supported by the FMM criterion\n");
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptableIntegrator(const NBodyCtx* ctx)
+{
+    if (ctx->integrator != Leapfrog && ctx->integrator != Yoshida4)
+    {
+        mw_printf("Invalid integrator (integrator = %d)\n", ctx->integrator);
+        return TRUE;
+    }
+
+    if (ctx->integrator != Leapfrog && ctx->maxRung > 0)
+    {
+        mw_printf("Block timesteps are only supported by the Leapfrog integrator\n");
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptableRestrictedDwarf(const Dwarf* comp, const char* name)
+{
+    if (comp->type != Plummer && comp->type != NFW && comp->type != General_Hernquist && comp->type != Cored)
+    {
+        mw_printf("Restricted %s component must be a Plummer, NFW, Hernquist or cored dwarf\n", name);
+        return TRUE;
+    }
+
+    if (!isfinite(comp->mass) || comp->mass <= 0.0 || !isfinite(comp->scaleLength) || comp->scaleLength <= 0.0)
+    {
+        mw_printf("Restricted %s component needs a positive mass and scale radius (mass = %f, scaleLength = %f)\n",
+                  name, comp->mass, comp->scaleLength);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptableRestricted(const NBodyCtx* ctx)
+{
+    if (!ctx->restricted)
+        return FALSE;
+
+    if (ctx->maxRung > 0)
+    {
+        mw_printf("Block timesteps are not supported in restricted mode\n");
+        return TRUE;
+    }
+
+    return hasAcceptableRestrictedDwarf(&ctx->restrictedLight, "light")
+        || hasAcceptableRestrictedDwarf(&ctx->restrictedDark, "dark");
+}
+
+static int hasAcceptablePM(const NBodyCtx* ctx)
+{
+    if (ctx->criterion != PM)
+        return FALSE;
+
+    if (ctx->pmGridSize < 16 || ctx->pmGridSize > 512 || (ctx->pmGridSize & (ctx->pmGridSize - 1)) != 0)
+    {
+        mw_printf("PM grid size must be a power of 2 from 16 to 512 (pmGridSize = %u)\n", ctx->pmGridSize);
+        return TRUE;
+    }
+
+    if (!isfinite(ctx->pmBoxSize) || ctx->pmBoxSize < 0.0)
+    {
+        mw_printf("PM box size must be positive, or 0 to fit the bodies (pmBoxSize = %f)\n", ctx->pmBoxSize);
+        return TRUE;
+    }
+
+    if (!isfinite(ctx->pmSplit) || ctx->pmSplit < 0.0 || ctx->pmSplit > ctx->pmGridSize / 16.0)
+    {
+        mw_printf("PM force split must be from 0 to pmGridSize / 16 cells (pmSplit = %f)\n", ctx->pmSplit);
+        return TRUE;
+    }
+
+    if (ctx->maxRung > 0)
+    {
+        mw_printf("Block timesteps are not supported by the PM criterion\n");
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptableForceTolerance(const NBodyCtx* ctx)
+{
+    if (!isfinite(ctx->forceTolerance) || ctx->forceTolerance < 0.0)
+    {
+        mw_printf("Force tolerance must be positive, or 0 to not tune (forceTolerance = %f)\n",
+                  ctx->forceTolerance);
+        return TRUE;
+    }
+
+    if (!(ctx->forceTolerance > 0.0))
+        return FALSE;
+
+    if (ctx->criterion == Exact || ctx->criterion == FMM || ctx->criterion == PM)
+    {
+        mw_printf("Force tolerance can only be used with the tree criteria (criterion = %s)\n",
+                  showCriterionT(ctx->criterion));
+        return TRUE;
+    }
+
+    if (ctx->restricted)
+    {
+        mw_printf("Force tolerance is not supported in restricted mode\n");
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int hasAcceptablePotentialTable(const NBodyCtx* ctx)
+{
+    if (!isfinite(ctx->potentialTableTolerance) || ctx->potentialTableTolerance < 0.0)
+    {
+        mw_printf("Potential table tolerance must be positive, or 0 to not tabulate (potentialTableTolerance = %f)\n",
+                  ctx->potentialTableTolerance);
+        return TRUE;
+    }
+
+    if (!isfinite(ctx->dispersionTableTolerance) || ctx->dispersionTableTolerance < 0.0)
+    {
+        mw_printf("Dispersion table tolerance must be positive, or 0 to not tabulate (dispersionTableTolerance = %f)\n",
+                  ctx->dispersionTableTolerance);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
 mwbool checkNBodyCtxConstants(const NBodyCtx* ctx)
 {
-    return hasAcceptableTimes(ctx) || hasAcceptableSteps(ctx) || hasAcceptableEps2(ctx) || hasAcceptableTheta(ctx);
+    return hasAcceptableTimes(ctx) || hasAcceptableSteps(ctx) || hasAcceptableEps2(ctx) || hasAcceptableTheta(ctx)
+        || hasAcceptableMultipoleOrder(ctx) || hasAcceptableRungs(ctx) || hasAcceptableIntegrator(ctx)
+        || hasAcceptableRestricted(ctx) || hasAcceptablePM(ctx) || hasAcceptableForceTolerance(ctx)
+        || hasAcceptablePotentialTable(ctx);
 }
 
@@ -77,6 +77,7 @@ typedef struct
    bestLikelihoodBodyTab   Body[]     anything   Array of bodies at best likelihood
    orbitTrace              mwvector[] anything   Array of center of mass history
    shiftByLMC              mwvector[] anything   Array of LMC accelerations on MW
+   rungs                   int[]      anything   Block timestep rung of each body
    ending                  string     "end"      Kind of dumb and pointless
  */
 
@@ -93,6 +94,7 @@ typedef struct
     uint32_t ptrSize;
     uint32_t nOrbitTrace;
     uint32_t nShiftLMC;
+    uint32_t nRungs;                     /* nbody if block timestep rungs follow, otherwise 0 */
     uint32_t treeIncest;
     real rsize;
     NBodyCtx ctx;
@@ -109,6 +111,7 @@ static void nbPrepareWriteCheckpointHeader(NBodyCheckpointHeader* cp, const NBod
     cp->ptrSize = sizeof(void*);
     cp->nOrbitTrace = st->nOrbitTrace;
     cp->nShiftLMC = st->nShiftLMC;
+    cp->nRungs = st->rungs ? st->nbody : 0;
 
     cp->majorVersion = NBODY_VERSION_MAJOR;
     cp->minorVersion= NBODY_VERSION_MINOR;
@@ -209,8 +212,8 @@ static int nbOpenCheckpointHandle(const NBodyState* st,
 
     if (writing)
     {
-                   /*Header Size +     Total Body Size        +         Total Orbit Size           +           Shift Array Size       + LMC Coord Size*/
-        cp->cpFileSize = hdrSize + 2*st->nbody * sizeof(Body) + st->nOrbitTrace * sizeof(mwvector) + st->nShiftLMC * sizeof(mwvector) + 2*sizeof(mwvector) + sizeof(*st) + sizeof(size_t);
+                   /*Header Size +     Total Body Size        +         Total Orbit Size           +           Shift Array Size       + LMC Coord Size + Rung Size*/
+        cp->cpFileSize = hdrSize + 2*st->nbody * sizeof(Body) + st->nOrbitTrace * sizeof(mwvector) + st->nShiftLMC * sizeof(mwvector) + 2*sizeof(mwvector) + (st->rungs ? st->nbody * sizeof(int) : 0) + sizeof(*st) + sizeof(size_t);
         /* Make the file the right size in case it's a new file */
         if (ftruncate(cp->fd, cp->cpFileSize) < 0)
         {
@@ -317,7 +320,7 @@ static int nbOpenCheckpointHandle(const NBodyState* st,
     if (writing)
     {
                             /*Header Size +      Total Body Size       +         Total Orbit Size           +           Shift Array Size       + LMC Coord Size*/
-        cp->cpFileSize = (DWORD) (hdrSize + 2*st->nbody * sizeof(Body) + st->nOrbitTrace * sizeof(mwvector) + st->nShiftLMC * sizeof(mwvector) + 2*sizeof(mwvector) + sizeof(*st) + sizeof(size_t));
+        cp->cpFileSize = (DWORD) (hdrSize + 2*st->nbody * sizeof(Body) + st->nOrbitTrace * sizeof(mwvector) + st->nShiftLMC * sizeof(mwvector) + 2*sizeof(mwvector) + (st->rungs ? st->nbody * sizeof(int) : 0) + sizeof(*st) + sizeof(size_t));
     }
     else
     {
@@ -395,7 +398,7 @@ static int nbCloseCheckpointHandle(CheckpointHandle* cp)
 /* Should be given the same context as the dump. Returns nonzero if the state failed to be thawed */
 static int nbThawState(NBodyCtx* ctx, NBodyState* st, CheckpointHandle* cp)
 {
-    size_t bodySize, traceSize, ShiftLMCSize, LMCPosVelSize, supposedCheckpointSize;
+    size_t bodySize, traceSize, ShiftLMCSize, LMCPosVelSize, rungSize, supposedCheckpointSize;
     NBodyCheckpointHeader cpHdr;
     char* p = cp->mptr;
 
@@ -410,6 +413,13 @@ static int nbThawState(NBodyCtx* ctx, NBodyState* st, CheckpointHandle* cp)
     traceSize = cpHdr.nOrbitTrace * sizeof(mwvector);
     ShiftLMCSize = cpHdr.nShiftLMC * sizeof(mwvector);
     LMCPosVelSize = 2*sizeof(mwvector);
+    rungSize = cpHdr.nRungs * sizeof(int);
+
+    if (cpHdr.nRungs != 0 && cpHdr.nRungs != cpHdr.nbody)
+    {
+        mw_printf("Checkpoint has %u timestep rungs for %u bodies\n", cpHdr.nRungs, cpHdr.nbody);
+        return TRUE;
+    }
     
     size_t* sizeOfData = (size_t*)mwMallocA(sizeof(size_t));
     memcpy(sizeOfData, p, sizeof(size_t));
@@ -455,8 +465,15 @@ static int nbThawState(NBodyCtx* ctx, NBodyState* st, CheckpointHandle* cp)
         p += sizeof(mwvector);
         //mw_printf("Read LMC position: [%.15f,%.15f,%.15f]\n",X(st->LMCpos[0]),Y(st->LMCpos[0]),Z(st->LMCpos[0]));
     }
+
+    if (rungSize != 0)
+    {
+        st->rungs = (int*) mwMalloc(rungSize);
+        memcpy(st->rungs, p, rungSize);
+        p += rungSize;
+    }
     
-    supposedCheckpointSize = hdrSize + 2*bodySize + traceSize + ShiftLMCSize + LMCPosVelSize + *sizeOfData + sizeof(size_t);
+    supposedCheckpointSize = hdrSize + 2*bodySize + traceSize + ShiftLMCSize + LMCPosVelSize + rungSize + *sizeOfData + sizeof(size_t);
 
     if (nbVerifyCheckpointHeader(&cpHdr, cp, st, supposedCheckpointSize))
     {
@@ -478,6 +495,9 @@ static int nbThawState(NBodyCtx* ctx, NBodyState* st, CheckpointHandle* cp)
         mwFreeA(st->shiftByLMC);
         st->shiftByLMC = NULL;
 
+        free(st->rungs);
+        st->rungs = NULL;
+
         mw_printf("Failed to find end marker in checkpoint file.\n");
         return TRUE;
     }
@@ -531,6 +551,12 @@ static void nbFreezeState(const NBodyCtx* ctx, const NBodyState* st, CheckpointH
         p += sizeof(mwvector);
     }
 
+    if (st->rungs)
+    {
+        memcpy(p, st->rungs, st->nbody * sizeof(int));
+        p += st->nbody * sizeof(int);
+    }
+
     strcpy(p, tail);
 }
 
@@ -0,0 +1,230 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Counts of the tree walk work and the wall time of each phase of the
+ * steps, to see where a slow run spends its time.
+ *
+ * The walks are counted per thread and summed at the end. Only whole
+ * phases are timed: the external potential is found in the same pass
+ * over the bodies as their self gravity, and a clock read for each body
+ * would cost more than many of the potentials.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_counters.h"
+#include "nbody_util.h"
+#include "milkyway_util.h"
+
+
+void nbStartCounters(NBodyState* st)
+{
+    NBodyCounters* c;
+
+    if (st->counters)
+    {
+        return;
+    }
+
+    c = (NBodyCounters*) mwCalloc(1, sizeof(NBodyCounters));
+    c->nThread = nbGetMaxThreads();
+    c->threads = (NBodyThreadCounts*) mwCallocA(c->nThread, sizeof(NBodyThreadCounts));
+    st->counters = c;
+}
+
+void nbDestroyCounters(NBodyCounters* c)
+{
+    if (!c)
+    {
+        return;
+    }
+
+    mwFreeA(c->threads);
+    free(c);
+}
+
+double nbCounterClock(void)
+{
+  #ifdef _OPENMP
+    return omp_get_wtime();
+  #else
+    return mwGetTime();
+  #endif
+}
+
+static NBodyThreadCounts* nbThreadCounts(NBodyCounters* c)
+{
+  #ifdef _OPENMP
+    int thread = omp_get_thread_num();
+  #else
+    int thread = 0;
+  #endif
+
+    return &c->threads[thread < c->nThread ? thread : 0];
+}
+
+void nbCountPhase(NBodyState* st, NBodyPhase phase, double seconds)
+{
+    if (st->counters)
+    {
+        st->counters->time[phase] += seconds;
+    }
+}
+
+void nbCountWalks(NBodyState* st, unsigned int walks, unsigned int bodies, unsigned int cellsOpened,
+                  uint64_t cellInteractions, uint64_t bodyInteractions)
+{
+    NBodyThreadCounts* t;
+
+    if (!st->counters)
+    {
+        return;
+    }
+
+    t = nbThreadCounts(st->counters);
+    t->walks += walks;
+    t->bodies += bodies;
+    t->cellsOpened += cellsOpened;
+    t->cellInteractions += cellInteractions;
+    t->bodyInteractions += bodyInteractions;
+}
+
+void nbCountForce(NBodyState* st, double seconds, double treeSeconds, mwbool usedTree)
+{
+    NBodyCounters* c = st->counters;
+
+    if (!c)
+    {
+        return;
+    }
+
+    c->time[NBODY_PHASE_TREE] += treeSeconds;
+    c->time[NBODY_PHASE_FORCE] += seconds - treeSeconds;
+    c->forceTime += seconds;
+    ++c->forces;
+
+    if (usedTree)
+    {
+        ++c->trees;
+        c->treeDepthSum += st->tree.maxDepth;
+        c->treeCellsSum += st->tree.cellUsed;
+        c->treeDepthMax = MAX(c->treeDepthMax, st->tree.maxDepth);
+        c->treeCellsMax = MAX(c->treeCellsMax, st->tree.cellUsed);
+    }
+}
+
+void nbCountStepStart(NBodyState* st)
+{
+    if (st->counters)
+    {
+        st->counters->stepStart = nbCounterClock();
+        st->counters->stepForceStart = st->counters->forceTime;
+    }
+}
+
+void nbCountStepEnd(NBodyState* st)
+{
+    NBodyCounters* c = st->counters;
+
+    if (c)
+    {
+        double step = nbCounterClock() - c->stepStart;
+
+        c->time[NBODY_PHASE_INTEGRATE] += step - (c->forceTime - c->stepForceStart);
+        ++c->steps;
+    }
+}
+
+uint64_t nbCountedInteractions(const NBodyState* st)
+{
+    int i;
+    uint64_t n = 0;
+    const NBodyCounters* c = st->counters;
+
+    for (i = 0; c && i < c->nThread; ++i)
+    {
+        n += c->threads[i].cellInteractions + c->threads[i].bodyInteractions;
+    }
+
+    return n;
+}
+
+void nbResetCounters(NBodyState* st)
+{
+    NBodyCounters* c = st->counters;
+
+    if (c)
+    {
+        NBodyThreadCounts* threads = c->threads;
+        int nThread = c->nThread;
+
+        memset(threads, 0, nThread * sizeof(NBodyThreadCounts));
+        memset(c, 0, sizeof(NBodyCounters));
+        c->threads = threads;
+        c->nThread = nThread;
+    }
+}
+
+static double nbPerCount(uint64_t total, uint64_t n)
+{
+    return n > 0 ? (double) total / (double) n : 0.0;
+}
+
+void nbPrintCounters(const NBodyState* st)
+{
+    static const char* phaseNames[NBODY_PHASE_COUNT] =
+        {
+            "tree", "force", "integrate", "likelihood", "checkpoint"
+        };
+    int i;
+    NBodyThreadCounts sum;
+    const NBodyCounters* c = st->counters;
+
+    if (!c)
+    {
+        return;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    for (i = 0; i < c->nThread; ++i)
+    {
+        sum.walks += c->threads[i].walks;
+        sum.bodies += c->threads[i].bodies;
+        sum.cellsOpened += c->threads[i].cellsOpened;
+        sum.cellInteractions += c->threads[i].cellInteractions;
+        sum.bodyInteractions += c->threads[i].bodyInteractions;
+    }
+
+    printf("<counters>\n");
+    printf("  <steps> %u </steps>\n", c->steps);
+    printf("  <force_calculations> %u </force_calculations>\n", c->forces);
+    printf("  <walks> %llu </walks>\n", (unsigned long long) sum.walks);
+    printf("  <bodies_walked> %llu </bodies_walked>\n", (unsigned long long) sum.bodies);
+    printf("  <cells_opened_per_walk> %f </cells_opened_per_walk>\n", nbPerCount(sum.cellsOpened, sum.walks));
+    printf("  <body_cell_per_body> %f </body_cell_per_body>\n", nbPerCount(sum.cellInteractions, sum.bodies));
+    printf("  <body_body_per_body> %f </body_body_per_body>\n", nbPerCount(sum.bodyInteractions, sum.bodies));
+    printf("  <tree_depth_mean> %f </tree_depth_mean>\n", c->trees > 0 ? c->treeDepthSum / c->trees : 0.0);
+    printf("  <tree_depth_max> %u </tree_depth_max>\n", c->treeDepthMax);
+    printf("  <tree_cells_mean> %f </tree_cells_mean>\n", c->trees > 0 ? c->treeCellsSum / c->trees : 0.0);
+    printf("  <tree_cells_max> %u </tree_cells_max>\n", c->treeCellsMax);
+    for (i = 0; i < NBODY_PHASE_COUNT; ++i)
+    {
+        printf("  <time_%s> %f </time_%s>\n", phaseNames[i], c->time[i], phaseNames[i]);
+    }
+    printf("</counters>\n");
+}
@@ -47,6 +47,7 @@ const NBodyCtx defaultNBodyCtx =
 
     /* .criterion       */  DEFAULT_CRITERION,
     /* .potentialType   */  EXTERNAL_POTENTIAL_DEFAULT,
+    /* .integrator      */  DEFAULT_INTEGRATOR,
 
     /* .Nstep_control   */  FALSE,
     /* .useBestLike     */  DEFAULT_USE_BEST_LIKELIHOOD,
@@ -63,6 +64,20 @@ const NBodyCtx defaultNBodyCtx =
     /* .useQuad         */  DEFAULT_USE_QUADRUPOLE_MOMENTS,
     /* .allowIncest     */  DEFAULT_ALLOW_INCEST,
     /* .quietErrors     */  DEFAULT_QUIET_ERRORS,
+    /* .parallelTree    */  DEFAULT_PARALLEL_TREE,
+    /* .costBalance     */  DEFAULT_COST_BALANCE,
+    /* .walkGroupSize   */  DEFAULT_WALK_GROUP_SIZE,
+    /* .multipoleOrder  */  DEFAULT_MULTIPOLE_ORDER,
+    /* .treeRefitSteps  */  DEFAULT_TREE_REFIT_STEPS,
+    /* .maxRung         */  DEFAULT_MAX_RUNG,
+    /* .rungEta         */  DEFAULT_RUNG_ETA,
+    /* .pmGridSize      */  DEFAULT_PM_GRID_SIZE,
+    /* .pmBoxSize       */  DEFAULT_PM_BOX_SIZE,
+    /* .pmSplit         */  DEFAULT_PM_SPLIT,
+    /* .forceTolerance  */  DEFAULT_FORCE_TOLERANCE,
+    /* .deterministic   */  DEFAULT_DETERMINISTIC,
+    /* .potentialTableTolerance */ DEFAULT_POTENTIAL_TABLE_TOLERANCE,
+    /* .dispersionTableTolerance */ DEFAULT_DISPERSION_TABLE_TOLERANCE,
 
     /* .BestLikeStart   */  DEFAULT_BEST_LIKELIHOOD_START,
     /* .OutputFreq      */  DEFAULT_OUTPUT_FREQUENCY,
@@ -83,6 +98,11 @@ const NBodyCtx defaultNBodyCtx =
     /* .LMCDynaFric     */  FALSE,
     /* .coulomb_log     */  0.0,
 
+    /* .restricted         */  DEFAULT_RESTRICTED,
+    /* .restrictedMassLoss */  DEFAULT_RESTRICTED_MASS_LOSS,
+    /* .restrictedLight    */  EMPTY_DWARF,
+    /* .restrictedDark     */  EMPTY_DWARF,
+
     /* .Ntsteps         */  0,
     /* .checkpointT     */  NOBOINC_DEFAULT_CHECKPOINT_PERIOD,
     /* .nStep           */  0,
@@ -234,3 +234,44 @@ real get_density(const Dwarf* model, real r)
     return den_temp;
 }
 
+
+/* Mass within radius r, so the acceleration towards the center is
+ * get_enclosed_mass(r) / r^2. These follow from the potentials above. */
+real get_enclosed_mass(const Dwarf* model, real r)
+{
+    const real mass = model->mass;
+    const real rscale = model->scaleLength;
+    real R, m;
+
+    switch(model->type)
+    {
+        case Plummer:
+            m = mass * cube(r) * minusthreehalves(sqr(r) + sqr(rscale));
+            break;
+        case NFW:
+            R = r / rscale;
+            m = 4.0 * M_PI * model->p0 * cube(rscale) * (mw_log(1.0 + R) - R / (1.0 + R));
+            break;
+        case General_Hernquist:
+            m = mass * sqr(r / (r + rscale));
+            break;
+        case Cored:
+            if (r <= model->r1)
+            {
+                m = 4.0 * M_PI * model->p0 * sqr(model->rc) * (r - model->rc * mw_atan(r / model->rc));
+            }
+            else
+            {
+                const real r1 = model->r1;
+                const real C3 = 4.0 * M_PI * (model->ps * cube(rscale) * (mw_log(1.0 + r1 / rscale) - r1 / (rscale + r1))
+                                              - model->p0 * sqr(model->rc) * (r1 - model->rc * mw_atan(r1 / model->rc)));
+                m = 4.0 * M_PI * model->ps * cube(rscale) * (mw_log(1.0 + r / rscale) - r / (rscale + r)) - C3;
+            }
+            break;
+        case InvalidDwarf:
+        default:
+            mw_fail("Invalid dwarf type\n");
+    }
+
+    return m;
+}
@@ -0,0 +1,317 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Energy and virial of the bodies through a run, to check how well it
+ * is conserved without another walk of the tree.
+ *
+ * The self gravity potential of each body is summed alongside its
+ * acceleration by the tree walk or direct summation, and each thread
+ * adds the bodies it finishes to its own sums as it kicks them, so a
+ * sample needs no pass over the bodies of its own. The order the bodies
+ * are added in follows the threads and the schedule, so the sums can
+ * differ in the last bits between runs with different thread counts.
+ * In deterministic mode each body has sums of its own instead, which a
+ * sample adds up in the order of the bodies.
+ *
+ * Kinetic and potential energy are in the frame of the centre of mass
+ * of the bodies, which the external potential moves. The external
+ * potential is only known by its acceleration, so its part is the work
+ * its forces do on the bodies, integrated from their power at each
+ * sample with the trapezoid rule, together with the kinetic energy of
+ * the centre of mass. The forces of the restricted, particle mesh, FMM
+ * and grouped walks leave the self gravity potential unknown, and a run
+ * that used any of them reports which instead of the drift.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_energy.h"
+#include "nbody_util.h"
+#include "milkyway_util.h"
+
+#if NBODY_MPI
+  #include "nbody_mpi.h"
+#endif
+
+
+/* Sums over the bodies a sample is found from */
+enum
+{
+    NBODY_SUM_MASS,
+    NBODY_SUM_MR,           /* 3 components of m r */
+    NBODY_SUM_MV = NBODY_SUM_MR + 3,
+    NBODY_SUM_MA = NBODY_SUM_MV + 3,
+    NBODY_SUM_MV2 = NBODY_SUM_MA + 3,
+    NBODY_SUM_MRA,
+    NBODY_SUM_MPHI,
+    NBODY_SUM_MEXTV,        /* m ext . v, the power of the external forces */
+    NBODY_SUM_COUNT
+};
+
+/* Doubles between the sums of each thread, a couple of cache lines
+ * apart so the threads do not share one */
+#define NBODY_SUM_STRIDE 32
+
+
+void nbStartEnergy(NBodyState* st)
+{
+    if (!st->energy)
+    {
+        st->energy = (NBodyEnergy*) mwCalloc(1, sizeof(NBodyEnergy));
+        st->energy->potentialKnown = TRUE;
+    }
+}
+
+void nbDestroyEnergy(NBodyEnergy* e)
+{
+    if (!e)
+    {
+        return;
+    }
+
+    mwFreeA(e->phi);
+    mwFreeA(e->sums);
+    mwFreeA(e->bodySums);
+    free(e);
+}
+
+/* Name of the forces ctx finds without the self gravity potential */
+static const char* nbPhiUnknownBy(const NBodyCtx* ctx)
+{
+    if (ctx->restricted)
+    {
+        return "restricted";
+    }
+    else if (ctx->criterion == PM || ctx->criterion == FMM)
+    {
+        return showCriterionT(ctx->criterion);
+    }
+    else
+    {
+        return "grouped walk";
+    }
+}
+
+void nbEnergyForces(const NBodyCtx* ctx, NBodyState* st, mwbool findsPhi)
+{
+    NBodyEnergy* e = st->energy;
+
+    if (!e)
+    {
+        return;
+    }
+
+    if (findsPhi && e->phiCapacity < st->nbody)
+    {
+        mwFreeA(e->phi);
+        e->phi = (real*) mwCallocA(st->nbody, sizeof(real));
+        e->phiCapacity = st->nbody;
+    }
+
+    if (!e->sums)
+    {
+        e->sumThreads = nbGetMaxThreads();
+        e->sums = (double*) mwMallocA(e->sumThreads * NBODY_SUM_STRIDE * sizeof(double));
+    }
+
+    memset(e->sums, 0, e->sumThreads * NBODY_SUM_STRIDE * sizeof(double));
+
+    if (ctx->deterministic)
+    {
+        if (e->bodySumCapacity < st->nbody)
+        {
+            mwFreeA(e->bodySums);
+            e->bodySums = (double*) mwMallocA(st->nbody * NBODY_SUM_COUNT * sizeof(double));
+            e->bodySumCapacity = st->nbody;
+        }
+
+        memset(e->bodySums, 0, st->nbody * NBODY_SUM_COUNT * sizeof(double));
+    }
+
+    e->havePhi = findsPhi;
+    if (!findsPhi && !e->phiUnknownBy)
+    {
+        e->phiUnknownBy = nbPhiUnknownBy(ctx);
+    }
+}
+
+void nbEnergyAddBody(NBodyEnergy* e, int i, const Body* b, mwvector a, mwvector ext, real phi)
+{
+  #ifdef _OPENMP
+    int thread = omp_get_thread_num();
+  #else
+    int thread = 0;
+  #endif
+    double* sums = e->bodySums ? &e->bodySums[i * NBODY_SUM_COUNT]
+                               : &e->sums[(thread < e->sumThreads ? thread : 0) * NBODY_SUM_STRIDE];
+    const real m = Mass(b);
+
+    sums[NBODY_SUM_MASS] += m;
+    sums[NBODY_SUM_MR + 0] += m * X(Pos(b));
+    sums[NBODY_SUM_MR + 1] += m * Y(Pos(b));
+    sums[NBODY_SUM_MR + 2] += m * Z(Pos(b));
+    sums[NBODY_SUM_MV + 0] += m * X(Vel(b));
+    sums[NBODY_SUM_MV + 1] += m * Y(Vel(b));
+    sums[NBODY_SUM_MV + 2] += m * Z(Vel(b));
+    sums[NBODY_SUM_MA + 0] += m * X(a);
+    sums[NBODY_SUM_MA + 1] += m * Y(a);
+    sums[NBODY_SUM_MA + 2] += m * Z(a);
+    sums[NBODY_SUM_MV2] += m * mw_sqrv(Vel(b));
+    sums[NBODY_SUM_MRA] += m * mw_dotv(Pos(b), a);
+    sums[NBODY_SUM_MPHI] += m * phi;
+    sums[NBODY_SUM_MEXTV] += m * mw_dotv(ext, Vel(b));
+}
+
+void nbSampleEnergy(NBodyState* st, real time, mwvector shift)
+{
+    int i, k, thread;
+    double sums[NBODY_SUM_COUNT];
+    double mrma = 0.0, mv2 = 0.0, power;
+    NBodyEnergySample s;
+    NBodyEnergy* e = st->energy;
+
+    if (!e || !e->sums)
+    {
+        return;
+    }
+
+    memset(sums, 0, sizeof(sums));
+    if (e->bodySums)
+    {
+        for (i = 0; i < st->nbody; ++i)
+        {
+            for (k = 0; k < NBODY_SUM_COUNT; ++k)
+            {
+                sums[k] += e->bodySums[i * NBODY_SUM_COUNT + k];
+            }
+        }
+    }
+    else
+    {
+        for (thread = 0; thread < e->sumThreads; ++thread)
+        {
+            for (k = 0; k < NBODY_SUM_COUNT; ++k)
+            {
+                sums[k] += e->sums[thread * NBODY_SUM_STRIDE + k];
+            }
+        }
+    }
+
+  #if NBODY_MPI
+    if (st->mpi)
+    {
+        nbMPISum(sums, NBODY_SUM_COUNT);
+    }
+  #endif
+
+    if (!(sums[NBODY_SUM_MASS] > 0.0))
+    {
+        return;
+    }
+
+    /* Take out the motion of the centre of mass */
+    for (k = 0; k < 3; ++k)
+    {
+        mrma += sums[NBODY_SUM_MR + k] * sums[NBODY_SUM_MA + k];
+        mv2 += sqr(sums[NBODY_SUM_MV + k]);
+    }
+
+    s.kinetic = 0.5 * (sums[NBODY_SUM_MV2] - mv2 / sums[NBODY_SUM_MASS]);
+    s.potential = 0.5 * sums[NBODY_SUM_MPHI];
+    s.virial = sums[NBODY_SUM_MRA] - mrma / sums[NBODY_SUM_MASS];
+    s.bulk = 0.5 * mv2 / sums[NBODY_SUM_MASS];
+
+    /* The frame shift is felt by every body, so its power is on the
+     * momentum of them all */
+    power = sums[NBODY_SUM_MEXTV] + X(shift) * sums[NBODY_SUM_MV + 0]
+                                  + Y(shift) * sums[NBODY_SUM_MV + 1]
+                                  + Z(shift) * sums[NBODY_SUM_MV + 2];
+    if (e->samples > 0)
+    {
+        e->work += 0.5 * (e->lastPower + power) * (time - e->lastTime);
+    }
+    s.external = -e->work;
+
+    e->lastPower = power;
+    e->lastTime = time;
+    e->potentialKnown = e->potentialKnown && e->havePhi;
+
+    if (e->samples == 0)
+    {
+        e->first = s;
+    }
+    else if (e->potentialKnown)
+    {
+        real e0 = e->first.kinetic + e->first.potential + e->first.bulk;
+        real e1 = s.kinetic + s.potential + s.bulk + s.external;
+        real scale = mw_fabs(e->first.kinetic + e->first.potential);
+
+        e->driftMax = mw_fmax(e->driftMax, mw_fabs(e1 - e0) / scale);
+    }
+
+    if (s.virial < 0.0)
+    {
+        real ratio = -2.0 * s.kinetic / s.virial;
+
+        e->virialRatioMin = (e->samples == 0) ? ratio : mw_fmin(e->virialRatioMin, ratio);
+        e->virialRatioMax = (e->samples == 0) ? ratio : mw_fmax(e->virialRatioMax, ratio);
+    }
+
+    e->last = s;
+    ++e->samples;
+}
+
+static real nbVirialRatio(const NBodyEnergySample* s)
+{
+    return (s->virial < 0.0) ? -2.0 * s->kinetic / s->virial : 0.0;
+}
+
+void nbPrintEnergy(const NBodyState* st)
+{
+    const NBodyEnergy* e = st->energy;
+
+    if (!e || e->samples == 0)
+    {
+        return;
+    }
+
+    printf("<energy>\n");
+    printf("  <samples> %u </samples>\n", e->samples);
+    printf("  <kinetic_initial> %.15e </kinetic_initial>\n", e->first.kinetic);
+    printf("  <kinetic_final> %.15e </kinetic_final>\n", e->last.kinetic);
+    if (e->potentialKnown)
+    {
+        printf("  <potential_initial> %.15e </potential_initial>\n", e->first.potential);
+        printf("  <potential_final> %.15e </potential_final>\n", e->last.potential);
+        printf("  <bulk_kinetic_initial> %.15e </bulk_kinetic_initial>\n", e->first.bulk);
+        printf("  <bulk_kinetic_final> %.15e </bulk_kinetic_final>\n", e->last.bulk);
+        printf("  <external_final> %.15e </external_final>\n", e->last.external);
+        printf("  <energy_drift_max> %.6e </energy_drift_max>\n", e->driftMax);
+    }
+    else
+    {
+        mw_printf("Energy drift not reported: potential unavailable for criterion %s\n", e->phiUnknownBy);
+        printf("  <potential_unavailable> %s </potential_unavailable>\n", e->phiUnknownBy);
+    }
+    printf("  <virial_ratio_initial> %f </virial_ratio_initial>\n", nbVirialRatio(&e->first));
+    printf("  <virial_ratio_final> %f </virial_ratio_final>\n", nbVirialRatio(&e->last));
+    printf("  <virial_ratio_min> %f </virial_ratio_min>\n", e->virialRatioMin);
+    printf("  <virial_ratio_max> %f </virial_ratio_max>\n", e->virialRatioMax);
+    printf("</energy>\n");
+}
+
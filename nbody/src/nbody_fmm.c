@@ -0,0 +1,470 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fast multipole method on the force tree.
+ *
+ * The tree is walked against itself: pairs of nodes which are well
+ * separated, i.e. theta * |z_A - z_B| > r_A + r_B with z the center of
+ * mass and r the radius of the ball around it containing the node,
+ * interact through a Taylor expansion of the field of A around z_B.
+ * Pairs which are too close are split, larger node first, and summed
+ * directly once they are small. The expansions are then passed down
+ * the tree and evaluated at the bodies.
+ *
+ * Sources contribute their monopole and, with useQuad, quadrupole
+ * moments. The local expansions hold the acceleration and its first
+ * and second derivatives, using the same Plummer softening as the tree
+ * walk.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_fmm.h"
+#include "milkyway_util.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif /* _OPENMP */
+
+
+/* Pairs of nodes too close for an expansion are summed directly once
+ * there are no more than this many body pairs between them. */
+#define NBODY_FMM_DIRECT_PAIRS 64
+
+/* Each thread handles a subtree of sinks holding at most about this
+ * fraction of the bodies at a time. */
+#define NBODY_FMM_SINK_SHARE 512
+
+/* Field of the far sources of a cell, expanded around its center of
+ * mass: the acceleration a_i, T_ij = da_i / dx_j and
+ * U_ijk = d^2 a_i / dx_j dx_k. Both are symmetric in all indices. */
+typedef struct
+{
+    real ax, ay, az;
+    real txx, txy, txz, tyy, tyz, tzz;
+    real uxxx, uxxy, uxxz, uxyy, uxyz, uxzz, uyyy, uyyz, uyzz, uzzz;
+} NBodyLocalExpansion;
+
+typedef struct
+{
+    const NBodyCell* cells;
+    const Body* btab;
+    real* radius;                  /* radius of each cell around its center of mass */
+    NBodyLocalExpansion* locals;   /* local expansion of each cell */
+    mwvector* acc;
+    real theta2;
+    real eps2;
+    mwbool useQuad;
+} NBodyFMM;
+
+
+static inline const NBodyNode* nbFMMNode(const NBodyFMM* f, nodelink_t l)
+{
+    return LinkNode(f->cells, f->btab, l);
+}
+
+static inline real nbFMMRadius(const NBodyFMM* f, nodelink_t l)
+{
+    return isBodyLink(l) ? 0.0 : f->radius[l];
+}
+
+static inline unsigned int nbFMMCount(const NBodyFMM* f, nodelink_t l)
+{
+    return isBodyLink(l) ? 1 : NBodies(&f->cells[l]);
+}
+
+/* Find the radius of each cell, working up from the leaves. Cells are
+ * stored in depth first order, so each comes after its parent. */
+static void nbFMMCellRadii(NBodyFMM* f, unsigned int nCell)
+{
+    int c;
+
+    for (c = (int) nCell - 1; c >= 0; --c)
+    {
+        const NBodyCell* p = &f->cells[c];
+        nodelink_t l = More(p);
+        real r = 0.0;
+
+        while (l != Next(p))                /* loop over children */
+        {
+            const NBodyNode* q = nbFMMNode(f, l);
+            r = mw_fmax(r, mw_distv(Pos(q), Pos(p)) + nbFMMRadius(f, l));
+            l = Next(q);
+        }
+
+        f->radius[c] = r;
+    }
+}
+
+/* Write the indices of the bodies below node x to ids, returning the count */
+static unsigned int nbFMMCollectBodies(const NBodyFMM* f, nodelink_t x, int* ids)
+{
+    unsigned int n = 0;
+    const NBodyNode* p;
+    nodelink_t l;
+
+    if (isBodyLink(x))
+    {
+        ids[0] = linkBody(x);
+        return 1;
+    }
+
+    p = nbFMMNode(f, x);
+    l = More(p);
+    while (l != Next(p))
+    {
+        const NBodyNode* q = nbFMMNode(f, l);
+        if (isBody(q))
+        {
+            ids[n++] = linkBody(l);
+            l = Next(q);
+        }
+        else
+        {
+            l = More(q);
+        }
+    }
+
+    return n;
+}
+
+/* Sum the forces of the bodies below a on the bodies below b directly */
+static void nbFMMDirect(const NBodyFMM* f, nodelink_t b, nodelink_t a)
+{
+    int sinks[NBODY_FMM_DIRECT_PAIRS];
+    int sources[NBODY_FMM_DIRECT_PAIRS];
+    unsigned int i, j, nSink, nSource;
+
+    nSink = nbFMMCollectBodies(f, b, sinks);
+    nSource = nbFMMCollectBodies(f, a, sources);
+
+    for (i = 0; i < nSink; ++i)
+    {
+        const mwvector pos0 = Pos(&f->btab[sinks[i]]);
+        mwvector acc0 = f->acc[sinks[i]];
+
+        for (j = 0; j < nSource; ++j)
+        {
+            const Body* q = &f->btab[sources[j]];
+            mwvector dr;
+            real drSq, drab, phii, mor3;
+
+            if (sources[j] == sinks[i])    /* self-interaction */
+                continue;
+
+            dr = mw_subv(Pos(q), pos0);
+            drSq = mw_sqrv(dr) + f->eps2;
+            drab = mw_sqrt(drSq);
+            phii = Mass(q) / drab;
+            mor3 = phii / drSq;
+
+            acc0.x += mor3 * dr.x;
+            acc0.y += mor3 * dr.y;
+            acc0.z += mor3 * dr.z;
+        }
+
+        f->acc[sinks[i]] = acc0;
+    }
+}
+
+/* Acceleration at offset dr from node q due to its multipole moments */
+static inline mwvector nbFMMMultipoleAccel(const NBodyFMM* f, const NBodyNode* q, mwvector dr)
+{
+    mwvector acc = ZERO_VECTOR;
+    real drSq = mw_sqrv(dr) + f->eps2;
+    real drab = mw_sqrt(drSq);
+    real phii = Mass(q) / drab;
+    real mor3 = phii / drSq;
+
+    acc.x = mor3 * dr.x;
+    acc.y = mor3 * dr.y;
+    acc.z = mor3 * dr.z;
+
+    if (f->useQuad && isCell(q))
+    {
+        real dr5inv, drQdr, phiQ;
+        mwvector Qdr;
+
+        Qdr.x = Quad(q).xx * dr.x + Quad(q).xy * dr.y + Quad(q).xz * dr.z;
+        Qdr.y = Quad(q).xy * dr.x + Quad(q).yy * dr.y + Quad(q).yz * dr.z;
+        Qdr.z = Quad(q).xz * dr.x + Quad(q).yz * dr.y + Quad(q).zz * dr.z;
+
+        drQdr = Qdr.x * dr.x + Qdr.y * dr.y + Qdr.z * dr.z;
+        dr5inv = 1.0 / (sqr(drSq) * drab);
+        phiQ = 2.5 * (dr5inv * drQdr) / drSq;
+
+        acc.x += phiQ * dr.x - dr5inv * Qdr.x;
+        acc.y += phiQ * dr.y - dr5inv * Qdr.y;
+        acc.z += phiQ * dr.z - dr5inv * Qdr.z;
+    }
+
+    return acc;
+}
+
+/* Add the field of source node q to the local expansion L around z */
+static void nbFMMAddToLocal(const NBodyFMM* f, const NBodyNode* q, NBodyLocalExpansion* L, mwvector z)
+{
+    mwvector dr = mw_subv(Pos(q), z);
+    mwvector acc = nbFMMMultipoleAccel(f, q, dr);
+
+    real dx = X(dr), dy = Y(dr), dz = Z(dr);
+    real drSq = mw_sqrv(dr) + f->eps2;
+    real drab = mw_sqrt(drSq);
+    real mor3 = (Mass(q) / drab) / drSq;     /* M / r^3 */
+    real mor5 = 3.0 * mor3 / drSq;           /* 3 M / r^5 */
+    real mor7 = 5.0 * mor5 / drSq;           /* 15 M / r^7 */
+
+    L->ax += X(acc);
+    L->ay += Y(acc);
+    L->az += Z(acc);
+
+    /* T_ij = 3 M dr_i dr_j / r^5 - M delta_ij / r^3 */
+    L->txx += mor5 * dx * dx - mor3;
+    L->txy += mor5 * dx * dy;
+    L->txz += mor5 * dx * dz;
+    L->tyy += mor5 * dy * dy - mor3;
+    L->tyz += mor5 * dy * dz;
+    L->tzz += mor5 * dz * dz - mor3;
+
+    /* U_ijk = 15 M dr_i dr_j dr_k / r^7
+     *         - 3 M (delta_ij dr_k + delta_ik dr_j + delta_jk dr_i) / r^5 */
+    L->uxxx += mor7 * dx * dx * dx - 3.0 * mor5 * dx;
+    L->uxxy += mor7 * dx * dx * dy - mor5 * dy;
+    L->uxxz += mor7 * dx * dx * dz - mor5 * dz;
+    L->uxyy += mor7 * dx * dy * dy - mor5 * dx;
+    L->uxyz += mor7 * dx * dy * dz;
+    L->uxzz += mor7 * dx * dz * dz - mor5 * dx;
+    L->uyyy += mor7 * dy * dy * dy - 3.0 * mor5 * dy;
+    L->uyyz += mor7 * dy * dy * dz - mor5 * dz;
+    L->uyzz += mor7 * dy * dz * dz - mor5 * dy;
+    L->uzzz += mor7 * dz * dz * dz - 3.0 * mor5 * dz;
+}
+
+/* Evaluate the acceleration of local expansion L at offset d */
+static inline mwvector nbFMMEvalLocal(const NBodyLocalExpansion* L, mwvector d)
+{
+    mwvector a = ZERO_VECTOR;
+    real dx = X(d), dy = Y(d), dz = Z(d);
+
+    /* U_ijk d_j d_k */
+    real ux = L->uxxx * dx * dx + L->uxyy * dy * dy + L->uxzz * dz * dz
+            + 2.0 * (L->uxxy * dx * dy + L->uxxz * dx * dz + L->uxyz * dy * dz);
+    real uy = L->uxxy * dx * dx + L->uyyy * dy * dy + L->uyzz * dz * dz
+            + 2.0 * (L->uxyy * dx * dy + L->uxyz * dx * dz + L->uyyz * dy * dz);
+    real uz = L->uxxz * dx * dx + L->uyyz * dy * dy + L->uzzz * dz * dz
+            + 2.0 * (L->uxyz * dx * dy + L->uxzz * dx * dz + L->uyzz * dy * dz);
+
+    X(a) = L->ax + L->txx * dx + L->txy * dy + L->txz * dz + 0.5 * ux;
+    Y(a) = L->ay + L->txy * dx + L->tyy * dy + L->tyz * dz + 0.5 * uy;
+    Z(a) = L->az + L->txz * dx + L->tyz * dy + L->tzz * dz + 0.5 * uz;
+
+    return a;
+}
+
+/* Add local expansion L, moved by offset d, to the expansion C */
+static inline void nbFMMShiftLocal(const NBodyLocalExpansion* L, NBodyLocalExpansion* C, mwvector d)
+{
+    real dx = X(d), dy = Y(d), dz = Z(d);
+    mwvector a = nbFMMEvalLocal(L, d);
+
+    C->ax += X(a);
+    C->ay += Y(a);
+    C->az += Z(a);
+
+    C->txx += L->txx + L->uxxx * dx + L->uxxy * dy + L->uxxz * dz;
+    C->txy += L->txy + L->uxxy * dx + L->uxyy * dy + L->uxyz * dz;
+    C->txz += L->txz + L->uxxz * dx + L->uxyz * dy + L->uxzz * dz;
+    C->tyy += L->tyy + L->uxyy * dx + L->uyyy * dy + L->uyyz * dz;
+    C->tyz += L->tyz + L->uxyz * dx + L->uyyz * dy + L->uyzz * dz;
+    C->tzz += L->tzz + L->uxzz * dx + L->uyzz * dy + L->uzzz * dz;
+
+    C->uxxx += L->uxxx;
+    C->uxxy += L->uxxy;
+    C->uxxz += L->uxxz;
+    C->uxyy += L->uxyy;
+    C->uxyz += L->uxyz;
+    C->uxzz += L->uxzz;
+    C->uyyy += L->uyyy;
+    C->uyyz += L->uyyz;
+    C->uyzz += L->uyzz;
+    C->uzzz += L->uzzz;
+}
+
+/* Add the forces of the bodies below source node a to the sink node b.
+ * Only b and the nodes below it are written.
+ */
+static void nbFMMInteract(const NBodyFMM* f, nodelink_t b, nodelink_t a)
+{
+    const NBodyNode* nb = nbFMMNode(f, b);
+    const NBodyNode* na = nbFMMNode(f, a);
+    real ra, rb;
+    nodelink_t l;
+
+    if (a == b)                                 /* within one node */
+    {
+        if (isBody(nb))
+            return;
+
+        if (sqr(NBodies(nb)) <= NBODY_FMM_DIRECT_PAIRS)
+        {
+            nbFMMDirect(f, b, b);
+            return;
+        }
+
+        for (l = More(nb); l != Next(nb); l = Next(nbFMMNode(f, l)))
+        {
+            nbFMMInteract(f, l, b);
+        }
+        return;
+    }
+
+    ra = nbFMMRadius(f, a);
+    rb = nbFMMRadius(f, b);
+
+    if (f->theta2 * mw_sqrv(mw_subv(Pos(na), Pos(nb))) > sqr(ra + rb))   /* well separated */
+    {
+        if (isBody(nb))
+        {
+            mwvector* acc = &f->acc[linkBody(b)];
+            mwvector aM = nbFMMMultipoleAccel(f, na, mw_subv(Pos(na), Pos(nb)));
+            mw_incaddv(*acc, aM);
+        }
+        else
+        {
+            nbFMMAddToLocal(f, na, &f->locals[b], Pos(nb));
+        }
+        return;
+    }
+
+    if (nbFMMCount(f, a) * nbFMMCount(f, b) <= NBODY_FMM_DIRECT_PAIRS)
+    {
+        nbFMMDirect(f, b, a);
+        return;
+    }
+
+    if (isCell(nb) && (isBody(na) || rb >= ra))  /* split the larger node */
+    {
+        for (l = More(nb); l != Next(nb); l = Next(nbFMMNode(f, l)))
+        {
+            nbFMMInteract(f, l, a);
+        }
+    }
+    else
+    {
+        for (l = More(na); l != Next(na); l = Next(nbFMMNode(f, l)))
+        {
+            nbFMMInteract(f, b, l);
+        }
+    }
+}
+
+/* Pass the local expansion of cell c down to the nodes below it */
+static void nbFMMEvaluate(const NBodyFMM* f, nodelink_t c)
+{
+    const NBodyCell* p = &f->cells[c];
+    const NBodyLocalExpansion* L = &f->locals[c];
+    nodelink_t l = More(p);
+
+    while (l != Next(p))
+    {
+        const NBodyNode* q = nbFMMNode(f, l);
+        mwvector d = mw_subv(Pos(q), Pos(p));
+
+        if (isBody(q))
+        {
+            mwvector aL = nbFMMEvalLocal(L, d);
+            mw_incaddv(f->acc[linkBody(l)], aL);
+        }
+        else
+        {
+            nbFMMShiftLocal(L, &f->locals[l], d);
+            nbFMMEvaluate(f, l);
+        }
+
+        l = Next(q);
+    }
+}
+
+/* Split the tree into disjoint subtrees of at most sinkSize bodies to
+ * be handled independently. Returns the number written to sinks. */
+static int nbFMMFindSinks(const NBodyFMM* f, const NBodyCell* root, unsigned int sinkSize, nodelink_t* sinks)
+{
+    int n = 0;
+    nodelink_t l;
+    const NBodyNode* q = (const NBodyNode*) root;
+
+    while (q != NULL)
+    {
+        if (isCell(q) && NBodies(q) > sinkSize)
+        {
+            l = More(q);
+        }
+        else
+        {
+            if (isBody(q))
+                sinks[n++] = bodyLink((nodelink_t) ((const Body*) q - f->btab));
+            else
+                sinks[n++] = (nodelink_t) ((const NBodyCell*) q - f->cells);
+            l = Next(q);
+        }
+
+        q = (l == NULL_LINK) ? NULL : nbFMMNode(f, l);
+    }
+
+    return n;
+}
+
+void nbFMMGravity(const NBodyCtx* ctx, NBodyState* st)
+{
+    int i, nSinks;
+    NBodyFMM f;
+    nodelink_t* sinks;
+    const NBodyTree* t = &st->tree;
+    unsigned int sinkSize = MAX(NBODY_FMM_DIRECT_PAIRS, (unsigned int) st->nbody / NBODY_FMM_SINK_SHARE);
+
+    f.cells = t->cells;
+    f.btab = st->bodytab;
+    f.radius = (real*) mwMallocA(t->cellUsed * sizeof(real));
+    f.locals = (NBodyLocalExpansion*) mwCallocA(t->cellUsed, sizeof(NBodyLocalExpansion));
+    f.acc = st->acctab;
+    f.theta2 = sqr(ctx->theta);
+    f.eps2 = ctx->eps2;
+    f.useQuad = ctx->useQuad;
+
+    memset(st->acctab, 0, st->nbody * sizeof(mwvector));
+    nbFMMCellRadii(&f, t->cellUsed);
+
+    sinks = (nodelink_t*) mwMalloc(st->nbody * sizeof(nodelink_t));
+    nSinks = nbFMMFindSinks(&f, t->root, sinkSize, sinks);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(sinks) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nSinks; ++i)
+    {
+        nbFMMInteract(&f, sinks[i], 0);          /* against the whole tree */
+        if (!isBodyLink(sinks[i]))
+        {
+            nbFMMEvaluate(&f, sinks[i]);
+        }
+    }
+
+    free(sinks);
+    mwFreeA(f.locals);
+    mwFreeA(f.radius);
+}
+
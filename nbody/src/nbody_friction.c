@@ -17,10 +17,11 @@
 /** Isotropic Velocity Dispersion Formulas **/
 static const real pi = 3.1415926535;
 
-static inline real dispIntegrand(const Potential* pot, const mwvector pos, real time){
-    //mw_printf("Getting External Acceleration\n");
-    mwvector acc = nbExtAcceleration(pot, pos, time);
+/* Number of intervals and quadrature points in each for the dispersion integral */
+#define DISP_DIVS 10
+#define DISP_POINTS 5
 
+static inline real dispIntegrand(const Potential* pot, const mwvector pos, const mwvector acc, real time){
     real mag = mw_pow(mw_dotv(pos,pos), 0.5);
     mwvector unit_v = mw_mulvs(pos, 1.0/mag);
 
@@ -31,7 +32,7 @@ static inline real dispIntegrand(const Potential* pot, const mwvector pos, real
     return rho*a_r;
 }
 
-static inline real velDispersion(const Potential* pot, const mwvector pos, real upperlimit, real time){
+static real velDispersion(const Potential* pot, const mwvector pos, real upperlimit, real time){
     /** Use 5-point Gaussian Quadrature to calculate the RADIAL (1-dimensional) velocity dispersion integral **/
     int i,j;
     real a,b,integral,r;
@@ -50,22 +51,38 @@ static inline real velDispersion(const Potential* pot, const mwvector pos, real
     points[3] = 0.5384693101056831;
     points[4] = 0.9061798459386640;
 
+    /** All the quadrature points lie on one ray, so their accelerations are found together **/
+    real x[DISP_DIVS*DISP_POINTS], y[DISP_DIVS*DISP_POINTS], z[DISP_DIVS*DISP_POINTS];
+    real ax[DISP_DIVS*DISP_POINTS], ay[DISP_DIVS*DISP_POINTS], az[DISP_DIVS*DISP_POINTS];
+    mwvector acc;
+
     real dist = mw_pow(mw_dotv(pos,pos), 0.5);
-    int nDivs = 10;
+    int nDivs = DISP_DIVS;
     real width = (upperlimit - dist)/(nDivs*1.0);
     real rho0 = nbExtDensity(pot,pos, time);
     if ((width <= 0)||(rho0 == 0.0)) /** To avoid divide by zero later **/
     {
         return -1;       /** Want to ignore any contribution more than 50 scale radii from galactic center. Chose this value because dispersion is never negative. **/
     }
-    integral = 0.0;
     for (i = 0; i < nDivs; i++) {
         a = dist + i*width;
         b = dist + (i+1)*width;
-        for (j = 0; j < 5; j++) {
+        for (j = 0; j < DISP_POINTS; j++) {
             r = width*points[j]/2.0 + (a+b)/2.0;
             input_vec = mw_mulvs(pos,r/dist);
-            integral += weights[j]*dispIntegrand(pot,input_vec, time)*width/2.0;
+            x[i*DISP_POINTS + j] = X(input_vec);
+            y[i*DISP_POINTS + j] = Y(input_vec);
+            z[i*DISP_POINTS + j] = Z(input_vec);
+        }
+    }
+    nbExtAccelerationBlock(pot, x, y, z, ax, ay, az, DISP_DIVS*DISP_POINTS, time);
+
+    integral = 0.0;
+    for (i = 0; i < nDivs; i++) {
+        for (j = 0; j < DISP_POINTS; j++) {
+            SET_VECTOR(input_vec, x[i*DISP_POINTS + j], y[i*DISP_POINTS + j], z[i*DISP_POINTS + j]);
+            SET_VECTOR(acc, ax[i*DISP_POINTS + j], ay[i*DISP_POINTS + j], az[i*DISP_POINTS + j]);
+            integral += weights[j]*dispIntegrand(pot,input_vec,acc, time)*width/2.0;
         }
     }
 
@@ -81,14 +98,349 @@ static inline real getHaloScaleLength(const Halo* halo){
     return scale;
 }
 
+/** Upper limit of the dispersion integral, beyond which there is no dispersion **/
+static inline real dispUpperLimit(const Potential* pot){
+    return 50.0*getHaloScaleLength(&(pot->halo));
+}
+
+/*
+ * Interpolation table of the velocity dispersion.
+ *
+ * The dispersion integral takes 50 accelerations and 51 densities, twice
+ * on every step of the LMC's orbit. When the potential does not depend on
+ * time and is axisymmetric, the dispersion depends only on R and |z|, so
+ * it is found once on a grid out to the upper limit of the integral and
+ * interpolated from it. The grid is uniform in asinh(R / scaleR) and
+ * asinh(|z| / scaleZ) with the nodes in the middle of the cells, folded
+ * evenly across the axis and the plane, as in the external potential table,
+ * and is interpolated with a cubic through 4 x 4 nodes.
+ *
+ * The relative error is checked in the middle of every cell, and the cells
+ * outside the tolerance, or crossing the upper limit where the dispersion
+ * stops, are integrated directly. The table is halved until few enough
+ * cells are left direct. It is only made with ctx->dispersionTableTolerance,
+ * since it moves the LMC's orbit by the tolerance.
+ */
+
+#define DISP_TABLE_START_CELLS 16
+#define DISP_TABLE_MAX_CELLS 64          /* along each side */
+#define DISP_TABLE_DIRECT_FRACTION 64    /* refine until at most 1 / this of the cells are direct */
+
+struct NBodyDispersionTable
+{
+    Potential pot;             /* potential it was made for */
+    real tolerance;
+    real upper;                /* upper limit of the integral */
+    int nCells;                /* cells along R and z; there are 2 more nodes than cells along each */
+    real scaleR, scaleZ;
+    real invDu, invDv;         /* cells per unit of asinh(R / scaleR) and asinh(|z| / scaleZ) */
+    real* sigma2;              /* dispersion at each node, by R then z */
+    unsigned char* direct;     /* cells to integrate directly, by R then z */
+    int nDirect;
+    real error;                /* largest relative error of the other cells */
+};
+
+/* The dispersion only depends on R and |z| if the potential is static,
+ * axisymmetric and symmetric about the plane */
+static mwbool dispTabulable(const Potential* pot)
+{
+    return pot->disk.type != OrbitingBar
+        && pot->disk2.type != OrbitingBar
+        && pot->halo.type != TriaxialHalo;
+}
+
+/* Smallest scale length and height of the disks, else the halo scale */
+static void dispTableScales(NBodyDispersionTable* t, const Potential* pot)
+{
+    const Disk* disks[2] = { &pot->disk, &pot->disk2 };
+    int k;
+
+    t->scaleR = 0.0;
+    t->scaleZ = 0.0;
+
+    for (k = 0; k < 2; ++k)
+    {
+        if (disks[k]->type == NoDisk)
+            continue;
+
+        if (disks[k]->scaleLength > 0.0)
+            t->scaleR = (t->scaleR > 0.0) ? mw_fmin(t->scaleR, disks[k]->scaleLength) : disks[k]->scaleLength;
+        if (disks[k]->scaleHeight > 0.0)
+            t->scaleZ = (t->scaleZ > 0.0) ? mw_fmin(t->scaleZ, disks[k]->scaleHeight) : disks[k]->scaleHeight;
+    }
+
+    if (!(t->scaleR > 0.0))
+        t->scaleR = getHaloScaleLength(&pot->halo);
+    if (!(t->scaleZ > 0.0))
+        t->scaleZ = t->scaleR;
+}
+
+static inline real dispDirect(const Potential* pot, real R, real z, real upper)
+{
+    mwvector pos;
+
+    SET_VECTOR(pos, R, 0.0, z);
+    return velDispersion(pot, pos, upper, 0.0);
+}
+
+static void dispFillTable(NBodyDispersionTable* t, const Potential* pot, int nCells)
+{
+    int i, j;
+    const int nNode = nCells + 2;
+    const real du = mw_asinh(t->upper / t->scaleR) / nCells;
+    const real dv = mw_asinh(t->upper / t->scaleZ) / nCells;
+
+    t->nCells = nCells;
+    t->invDu = 1.0 / du;
+    t->invDv = 1.0 / dv;
+    t->sigma2 = (real*) mwMallocA(nNode * nNode * sizeof(real));
+    t->direct = (unsigned char*) mwCalloc(nCells * nCells, sizeof(unsigned char));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i, j) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nNode; ++i)
+    {
+        const real R = t->scaleR * mw_sinh((i + 0.5) * du);
+
+        for (j = 0; j < nNode; ++j)
+        {
+            const real z = t->scaleZ * mw_sinh((j + 0.5) * dv);
+
+            /* None beyond the upper limit */
+            t->sigma2[i * nNode + j] = mw_fmax(dispDirect(pot, R, z, t->upper), 0.0);
+        }
+    }
+}
+
+/* Weights of the cubic through the nodes at -1, 0, 1, 2 at x in [0, 1] */
+static inline void dispCubicWeights(real x, real w[4])
+{
+    w[0] = -x * (x - 1.0) * (x - 2.0) / 6.0;
+    w[1] = (x + 1.0) * (x - 1.0) * (x - 2.0) / 2.0;
+    w[2] = -(x + 1.0) * x * (x - 2.0) / 2.0;
+    w[3] = (x + 1.0) * x * (x - 1.0) / 6.0;
+}
+
+/* Weights of the stencil for node position p >= -0.5 between nodes
+ * first and first + 1, and its node indices folded back across 0 */
+static inline void dispStencil(real p, int first, real w[4], int node[4])
+{
+    int k;
+
+    dispCubicWeights(p - first, w);
+
+    for (k = 0; k < 4; ++k)
+    {
+        const int n = first - 1 + k;
+        node[k] = (n < 0) ? -1 - n : n;
+    }
+}
+
+/* Interpolate at R and |z| inside the table. Returns FALSE without
+ * interpolating in a cell to be integrated directly. */
+static inline mwbool dispInterpolate(const NBodyDispersionTable* t, real R, real absZ, real* sigma2)
+{
+    int a, b;
+    real wu[4], wv[4];
+    int iu[4], iv[4];
+    real sum = 0.0;
+    const int nNode = t->nCells + 2;
+    const real pu = mw_asinh(R / t->scaleR) * t->invDu - 0.5;
+    const real pv = mw_asinh(absZ / t->scaleZ) * t->invDv - 0.5;
+    const int ku = (int) mw_floor(pu);
+    const int kv = (int) mw_floor(pv);
+
+    /* Within half a node of the axis or plane counts as the first cell */
+    if (t->direct[(ku < 0 ? 0 : ku) * t->nCells + (kv < 0 ? 0 : kv)])
+        return FALSE;
+
+    dispStencil(pu, ku, wu, iu);
+    dispStencil(pv, kv, wv, iv);
+
+    for (a = 0; a < 4; ++a)
+    {
+        const real* row = &t->sigma2[iu[a] * nNode];
+        real col = 0.0;
+
+        for (b = 0; b < 4; ++b)
+        {
+            col += wv[b] * row[iv[b]];
+        }
+
+        sum += wu[a] * col;
+    }
+
+    *sigma2 = sum;
+    return TRUE;
+}
+
+/* Relative error of the table at R, z, inside a cell not yet direct */
+static real dispCheckPoint(const NBodyDispersionTable* t, const Potential* pot, real R, real z)
+{
+    real tabled = 0.0;
+    const real direct = dispDirect(pot, R, z, t->upper);
+
+    dispInterpolate(t, R, z, &tabled);
+    return mw_fabs(tabled - direct) / direct;
+}
+
+/* Check the middle of each cell, marking those outside the tolerance or
+ * reaching past the upper limit to be integrated directly */
+static void dispCheckTable(NBodyDispersionTable* t, const Potential* pot)
+{
+    int i, j;
+    int nDirect = 0;
+    real worst = 0.0;
+    const int nCells = t->nCells;
+    const real du = 1.0 / t->invDu;
+    const real dv = 1.0 / t->invDv;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i, j) schedule(dynamic, 1) reduction(max: worst) reduction(+: nDirect)
+  #endif
+    for (i = 0; i < nCells; ++i)
+    {
+        const real R = t->scaleR * mw_sinh((i + 1) * du);
+        const real outerR = t->scaleR * mw_sinh((i + 2) * du);
+
+        for (j = 0; j < nCells; ++j)
+        {
+            const real z = t->scaleZ * mw_sinh((j + 1) * dv);
+            const real outerZ = t->scaleZ * mw_sinh((j + 2) * dv);
+            real err;
+
+            if (mw_sqrt(sqr(outerR) + sqr(outerZ)) < t->upper)
+            {
+                err = dispCheckPoint(t, pot, R, z);
+
+                /* The dispersion changes fastest across the plane and axis,
+                 * so the cells on them are also checked there */
+                if (j == 0)
+                    err = mw_fmax(err, dispCheckPoint(t, pot, R, 0.0));
+                if (i == 0)
+                    err = mw_fmax(err, dispCheckPoint(t, pot, 0.0, z));
+            }
+            else
+            {
+                err = REAL_MAX;
+            }
+
+            if (err <= t->tolerance)
+            {
+                worst = mw_fmax(worst, err);
+            }
+            else
+            {
+                t->direct[i * nCells + j] = TRUE;
+                ++nDirect;
+            }
+        }
+    }
+
+    t->error = worst;
+    t->nDirect = nDirect;
+}
+
+static void dispFreeTableArrays(NBodyDispersionTable* t)
+{
+    mwFreeA(t->sigma2);
+    free(t->direct);
+    t->sigma2 = NULL;
+    t->direct = NULL;
+}
+
+void nbDestroyDispersionTable(NBodyDispersionTable* t)
+{
+    if (!t)
+    {
+        return;
+    }
+
+    dispFreeTableArrays(t);
+    free(t);
+}
+
+NBodyDispersionTable* nbMakeDispersionTable(const Potential* pot, real tolerance)
+{
+    int nCells;
+    NBodyDispersionTable* t;
+    double ts;
+
+    if (!dispTabulable(pot))
+    {
+        mw_printf("Velocity dispersion depends on time or azimuth, integrating it directly\n");
+        return NULL;
+    }
+
+    t = (NBodyDispersionTable*) mwCalloc(1, sizeof(NBodyDispersionTable));
+    t->pot = *pot;
+    t->tolerance = tolerance;
+    t->upper = dispUpperLimit(pot);
+    dispTableScales(t, pot);
+
+    ts = mwGetTime();
+    for (nCells = DISP_TABLE_START_CELLS; nCells <= DISP_TABLE_MAX_CELLS; nCells *= 2)
+    {
+        dispFreeTableArrays(t);
+        dispFillTable(t, pot, nCells);
+        dispCheckTable(t, pot);
+
+        if (t->nDirect * DISP_TABLE_DIRECT_FRACTION <= nCells * nCells)
+            break;
+    }
+
+    if (t->nDirect == t->nCells * t->nCells)
+    {
+        mw_printf("Velocity dispersion table did not reach tolerance %g in any cell, integrating it directly\n",
+                  tolerance);
+        nbDestroyDispersionTable(t);
+        return NULL;
+    }
+
+    mw_printf("Tabulated velocity dispersion on %d x %d cells to R, |z| = %g in %.2fs "
+              "(relative error %.3e, %d cells integrated directly)\n",
+              t->nCells, t->nCells, t->upper, mwGetTime() - ts, t->error, t->nDirect);
+
+    return t;
+}
+
+mwbool nbDispersionTableFor(const NBodyDispersionTable* t, const Potential* pot, real tolerance)
+{
+    return t && equalPotential(&t->pot, pot) && t->tolerance <= tolerance && t->tolerance >= tolerance;
+}
+
+real nbVelDispersion(const NBodyDispersionTable* t, const Potential* pot, mwvector pos, real time)
+{
+    real R, absZ, sigma2;
+
+    if (!t)
+    {
+        return velDispersion(pot, pos, dispUpperLimit(pot), time);
+    }
+
+    if (mw_absv(pos) >= t->upper)
+    {
+        return -1;    /** As velDispersion() does **/
+    }
+
+    R = mw_sqrt(sqr(X(pos)) + sqr(Y(pos)));
+    absZ = mw_fabs(Z(pos));
+    if (!dispInterpolate(t, R, absZ, &sigma2))
+    {
+        return velDispersion(pot, pos, t->upper, time);
+    }
+
+    return sigma2;
+}
+
 /** Formula for Dynamical Friction using Chandrasekhar's formula and assuming an isotropic Maxwellian velocity distribution **/
-mwvector dynamicalFriction_LMC(const Potential* pot, mwvector pos, mwvector vel, real mass_LMC, real scaleLength_LMC, mwbool dynaFric, real time, real coulomb_log){
+mwvector dynamicalFriction_LMC(const Potential* pot, mwvector pos, mwvector vel, real mass_LMC, real scaleLength_LMC, mwbool dynaFric, real time, real coulomb_log, const NBodyDispersionTable* dispersion){
     mwvector result = mw_vec(0.0,0.0,0.0);        //Vector with acceleration due to DF
     if (!dynaFric) {
         return result;
     }
     real X;
-    Halo *mw_halo;
 
     const real G_CONST = 1; //(Time: Gyrs, Distance: kpc, Mass: SMU = 222288.47 solar masses)
     const real thresh = mw_pow(2,-8);
@@ -98,9 +450,6 @@ mwvector dynamicalFriction_LMC(const Potential* pot, mwvector pos, mwvector vel,
     objectVel = (objectVel >= thresh)*objectVel + (objectVel < thresh)*thresh; // To avoid divide-by-zero error.
 
     //Coloumb Logarithm
-    mw_halo = &(pot->halo);
-    real scaleLength_halo = getHaloScaleLength(mw_halo);
-    //mw_printf("a = %.15f\n", scaleLength_halo);
     real ln_lambda = coulomb_log;
     //mw_printf("ln(L) = %.15f\n", ln_lambda);
 
@@ -109,7 +458,7 @@ mwvector dynamicalFriction_LMC(const Potential* pot, mwvector pos, mwvector vel,
     //mw_printf("rho = %.15f\n", density);
 
     //Get velocity dispersion of MW galaxy assuming isotropy
-    real sigma2 = velDispersion(pot, pos, 50.0*scaleLength_halo, time);
+    real sigma2 = nbVelDispersion(dispersion, pot, pos, time);
     //mw_printf("sig2 = %.15f\n", sigma2);
  
     //ratio of the velocity of the object to the modal velocity
@@ -22,13 +22,150 @@
 #include "nbody_priv.h"
 #include "nbody_util.h"
 #include "nbody_grav.h"
+#include "nbody_fmm.h"
+#include "nbody_pm.h"
+#include "nbody_counters.h"
+#include "nbody_energy.h"
+#include "nbody_potential_table.h"
+#include "nbody_dwarf_potential.h"
 #include "milkyway_util.h"
 
+#if NBODY_MPI
+  #include "nbody_mpi.h"
+#endif
+
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+#endif
+
 #ifdef _OPENMP
   #include <omp.h>
 #endif /* _OPENMP */
 
 
+/* Add the quadrupole term of the acceleration and potential at offset
+ * -dr from a cell with moment Q, with drSq the softened distance squared
+ * and drab its square root */
+static inline void nbQuadTerm(const NBodyQuadMatrix* Q, mwvector dr, real drSq, real drab, mwvector* acc, real* phi)
+{
+    real dr5inv, drQdr, phiQ;
+    mwvector Qdr;
+
+    /* form Q * dr */
+    Qdr.x = Q->xx * dr.x + Q->xy * dr.y + Q->xz * dr.z;
+    Qdr.y = Q->xy * dr.x + Q->yy * dr.y + Q->yz * dr.z;
+    Qdr.z = Q->xz * dr.x + Q->yz * dr.y + Q->zz * dr.z;
+
+
+    /* form dr * Q * dr */
+    drQdr = Qdr.x * dr.x + Qdr.y * dr.y + Qdr.z * dr.z;
+
+    dr5inv = 1.0 / (sqr(drSq) * drab);  /* form dr^-5 */
+
+    /* get quad. part of phi */
+    *phi -= 0.5 * dr5inv * drQdr;
+    phiQ = 2.5 * (dr5inv * drQdr) / drSq;
+
+    acc->x += phiQ * dr.x;
+    acc->y += phiQ * dr.y;
+    acc->z += phiQ * dr.z;
+
+    /* acceleration */
+    acc->x -= dr5inv * Qdr.x;
+    acc->y -= dr5inv * Qdr.y;
+    acc->z -= dr5inv * Qdr.z;
+}
+
+#if NBODY_MPI
+
+/* Add the gravity at pos0 of the other domains, from the tree of the
+ * cells and bodies they sent. Those that were cells carry their quad
+ * moment along as bodies. Returns the count of nodes visited. */
+static NEVER_INLINE unsigned int nbRemoteGravity(const NBodyCtx* ctx, const NBodyState* st, mwvector pos0, mwvector* acc, real* phi)
+{
+    unsigned int nVisited = 0;
+    const NBodyState* remote = nbMPIRemote(st);
+    const NBodyTree* t;
+    const NBodyNode* q;
+    nodelink_t l;
+
+    if (!remote)
+    {
+        return 0;
+    }
+
+    t = &remote->tree;
+    q = (const NBodyNode*) t->root;
+    while (q != NULL)
+    {
+        mwvector dr = mw_subv(Pos(q), pos0);
+        real drSq = mw_sqrv(dr);
+
+        ++nVisited;
+        if (isBody(q) || (drSq >= Rcrit2(q)))
+        {
+            real drab, phii, mor3;
+
+            drSq += ctx->eps2;
+            drab = mw_sqrt(drSq);
+            phii = Mass(q) / drab;
+            mor3 = phii / drSq;
+            *phi -= phii;
+            mw_incaddv(*acc, mw_mulvs(dr, mor3));
+
+            if (ctx->useQuad)
+            {
+                const NBodyQuadMatrix* Q = isCell(q) ? &Quad(q) : &t->bodyQuads[(const Body*) q - remote->bodytab];
+                nbQuadTerm(Q, dr, drSq, drab, acc, phi);
+            }
+
+            l = Next(q);
+        }
+        else
+        {
+            l = More(q);
+        }
+
+        q = (l == NULL_LINK) ? NULL : LinkNode(t->cells, remote->bodytab, l);
+    }
+
+    return nVisited;
+}
+
+#endif /* NBODY_MPI */
+
+/* Octupole term of the acceleration at offset -dr from a cell, with
+ * drSq the softened distance squared and drab its square root. Kept
+ * out of line so nbGravity() still fits the inlining limits. */
+static NEVER_INLINE mwvector nbOctupoleAccel(const NBodyOctMatrix* o, mwvector dr, real drSq, real drab)
+{
+    mwvector a;
+    real dx = dr.x, dy = dr.y, dz = dr.z;
+    real dr7inv = 1.0 / (sqr(drSq) * drSq * drab);   /* form dr^-7 */
+    real Oddx, Oddy, Oddz, Oddd, phiO;
+
+    /* form O : dr dr */
+    Oddx = o->xxx * dx * dx + o->xyy * dy * dy + o->xzz * dz * dz
+         + 2.0 * (o->xxy * dx * dy + o->xxz * dx * dz + o->xyz * dy * dz);
+    Oddy = o->xxy * dx * dx + o->yyy * dy * dy + o->yzz * dz * dz
+         + 2.0 * (o->xyy * dx * dy + o->xyz * dx * dz + o->yyz * dy * dz);
+    Oddz = o->xxz * dx * dx + o->yyz * dy * dy + o->zzz * dz * dz
+         + 2.0 * (o->xyz * dx * dy + o->xzz * dx * dz + o->yzz * dy * dz);
+
+    /* and O : dr dr dr */
+    Oddd = Oddx * dx + Oddy * dy + Oddz * dz;
+
+    /* get oct. part of phi */
+    phiO = (7.0 / 6.0) * (dr7inv * Oddd) / drSq;
+
+    a.x = 0.5 * dr7inv * Oddx - phiO * dx;
+    a.y = 0.5 * dr7inv * Oddy - phiO * dy;
+    a.z = 0.5 * dr7inv * Oddz - phiO * dz;
+    a.w = 0.0;
+
+    return a;
+}
+
 /*
  * nbodyGravity: Walk the tree starting at the root to do force
  * calculations.
@@ -39,32 +176,44 @@
  *     mapForceBody(). Measurably better with the inline, but only
  *     slightly.
  */
-static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body* p)
+static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body* p, real* phi)
 {
     mwbool skipSelf = FALSE;
+    unsigned int nVisited = 0;
+    unsigned int nOpened = 0;
+    unsigned int nBody = 0;
 
     mwvector pos0 = Pos(p);
     mwvector acc0 = ZERO_VECTOR;
+    real phi0 = 0.0;
 
+    const NBodyCell* cells = st->tree.cells;
+    const Body* btab = st->bodytab;
     const NBodyNode* q = (const NBodyNode*) st->tree.root; /* Start at the root */
+    const NBodyOctMatrix* octs = (ctx->multipoleOrder >= 3) ? st->tree.octs : NULL;
+    nodelink_t l;
 
     while (q != NULL)               /* while not at end of scan */
     {
         mwvector dr = mw_subv(Pos(q), pos0);   /* Then compute distance */
         real drSq = mw_sqrv(dr);               /* and distance squared */
 
+        ++nVisited;
         if (isBody(q) || (drSq >= Rcrit2(q)))      /* If is a body or far enough away to approximate */
         {
             if (mw_likely((const Body*) q != p))   /* self-interaction? */
             {
                 real drab, phii, mor3;
 
+                nBody += isBody(q);
+
                 /* Compute gravity */
 
                 drSq += ctx->eps2;   /* use standard softening */
                 drab = mw_sqrt(drSq);
                 phii = Mass(q) / drab;
                 mor3 = phii / drSq;
+                phi0 -= phii;
 
                 acc0.x += mor3 * dr.x;
                 acc0.y += mor3 * dr.y;
@@ -72,31 +221,14 @@ static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body
 
                 if (ctx->useQuad && isCell(q))          /* if cell, add quad term */
                 {
-                    real dr5inv, drQdr, phiQ;
-                    mwvector Qdr;
-
-                    /* form Q * dr */
-                    Qdr.x = Quad(q).xx * dr.x + Quad(q).xy * dr.y + Quad(q).xz * dr.z;
-                    Qdr.y = Quad(q).xy * dr.x + Quad(q).yy * dr.y + Quad(q).yz * dr.z;
-                    Qdr.z = Quad(q).xz * dr.x + Quad(q).yz * dr.y + Quad(q).zz * dr.z;
-
-
-                    /* form dr * Q * dr */
-                    drQdr = Qdr.x * dr.x + Qdr.y * dr.y + Qdr.z * dr.z;
-
-                    dr5inv = 1.0 / (sqr(drSq) * drab);  /* form dr^-5 */
-
-                    /* get quad. part of phi */
-                    phiQ = 2.5 * (dr5inv * drQdr) / drSq;
-
-                    acc0.x += phiQ * dr.x;
-                    acc0.y += phiQ * dr.y;
-                    acc0.z += phiQ * dr.z;
+                    nbQuadTerm(&Quad(q), dr, drSq, drab, &acc0, &phi0);
+                }
 
-                    /* acceleration */
-                    acc0.x -= dr5inv * Qdr.x;
-                    acc0.y -= dr5inv * Qdr.y;
-                    acc0.z -= dr5inv * Qdr.z;
+                if (octs && isCell(q))                  /* and the octupole term */
+                {
+                    const NBodyOctMatrix* o = &octs[(const NBodyCell*) q - cells];
+                    mwvector octAcc = nbOctupoleAccel(o, dr, drSq, drab);
+                    mw_incaddv(acc0, octAcc);
                 }
             }
             else
@@ -104,12 +236,15 @@ static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body
                 skipSelf = TRUE;   /* Encountered self */
             }
 
-            q = Next(q);  /* Follow next link */
+            l = Next(q);  /* Follow next link */
         }
         else
         {
-             q = More(q); /* Follow to the next level if need to go deeper */
+             ++nOpened;
+             l = More(q); /* Follow to the next level if need to go deeper */
         }
+
+        q = (l == NULL_LINK) ? NULL : LinkNode(cells, btab, l);
     }
 
     if (!skipSelf)
@@ -120,210 +255,1615 @@ static inline mwvector nbGravity(const NBodyCtx* ctx, NBodyState* st, const Body
         nbReportTreeIncest(ctx, st);
     }
 
+    if (st->bodyCost)
+    {
+        st->bodyCost[p - btab] = nVisited;
+    }
+
+  #if NBODY_MPI
+    if (st->mpi)
+    {
+        unsigned int nRemote = nbRemoteGravity(ctx, st, pos0, &acc0, &phi0);
+
+        if (st->bodyCost)
+        {
+            st->bodyCost[p - btab] += nRemote;
+        }
+    }
+  #endif
+
+    if (mw_unlikely(st->counters != NULL))
+    {
+        nbCountWalks(st, 1, 1, nOpened, nVisited - nOpened - nBody - (skipSelf ? 1 : 0), nBody);
+    }
+
+    if (phi)
+    {
+        *phi = phi0;
+    }
+
     return acc0;
 }
 
-static inline void nbMapForceBody(const NBodyCtx* ctx, NBodyState* st)
+/* Half kick applied to each body as soon as its acceleration is found,
+ * so the integrator does not need another pass over the bodies */
+typedef struct
 {
-    int i;
-    const int nbody = st->nbody;  /* Prevent reload on each loop */
-    mwvector LMCx;
-    mwvector a, externAcc;
-    const Body* b;
-    real lmcmass, lmcscale;
+    real dtHalf;
+    mwvector shift;     /* acceleration of the frame added to each body's */
+    const int* rungs;   /* if set, body i is kicked by dtHalf / 2^rungs[i] */
+} NBodyKick;
 
-    const Body* bodies = mw_assume_aligned(st->bodytab, 16);
-    mwvector* accels = mw_assume_aligned(st->acctab, 16);
-    real curTime = st->step * ctx->timestep;
-    real timeFromStart = (-1)*ctx->Ntsteps*ctx->timestep + curTime;
+/* Kick body i with its acceleration a, of which ext is external, and add
+ * it to the energy sums while it is still in cache */
+static inline void nbKickBody(NBodyState* st, int i, const mwvector a, const mwvector ext, const NBodyKick* kick)
+{
+    Body* b = &st->bodytab[i];
+
+    if (kick)
+    {
+        real dtHalf = kick->rungs ? mw_ldexp(kick->dtHalf, -kick->rungs[i]) : kick->dtHalf;
+        mw_incaddv(Vel(b), mw_mulvs(mw_addv(a, kick->shift), dtHalf));
+    }
+
+    if (mw_unlikely(st->energy != NULL))
+    {
+        nbEnergyAddBody(st->energy, i, b, a, ext, st->energy->havePhi ? st->energy->phi[i] : 0.0);
+    }
+}
+
+/* The time dependent parts of the external potential for one force
+ * calculation */
+typedef struct
+{
+    real barTime;       /* shifted by the previous calibration run */
+    mwvector LMCx;      /* a massless LMC at the origin without one */
+    real lmcmass;
+    real lmcscale;
+} NBodyExternal;
+
+static inline NBodyExternal nbExternalNow(const NBodyCtx* ctx, const NBodyState* st)
+{
+    NBodyExternal now;
 
     //use previous calibration run to shift time and calibrate the bar
-    real barTime = st->step * ctx->timestep - st->previousForwardTime;
+    now.barTime = st->step * ctx->timestep + st->substepTime - st->previousForwardTime;
 
     if (ctx->LMC) {
-        LMCx = st->LMCpos;
-        lmcmass = ctx->LMCmass;
-        lmcscale = ctx->LMCscale;
+        now.LMCx = st->LMCpos;
+        now.lmcmass = ctx->LMCmass;
+        now.lmcscale = ctx->LMCscale;
     }
     else {
-        SET_VECTOR(LMCx,0.0,0.0,0.0);
-        lmcmass = 0.0;
-        lmcscale = 1.0;
+        SET_VECTOR(now.LMCx,0.0,0.0,0.0);
+        now.lmcmass = 0.0;
+        now.lmcscale = 1.0;
     }
 
-  #ifdef _OPENMP
-    #pragma omp parallel for private(i, b, a, externAcc) shared(bodies, accels) schedule(dynamic, 4096 / sizeof(accels[0]))
-  #endif
-    for (i = 0; i < nbody; ++i)      /* get force on each body */
-    {
-        /* Repeat the base hackGrav part in each case or else GCC's
-         * -funswitch-loops doesn't happen. Without that this constant
-         * gets checked on every body on every step which is dumb.  */
-        switch (ctx->potentialType)
-        {
-            case EXTERNAL_POTENTIAL_DEFAULT:
-                //mw_printf("DEFAULT POTENTIAL - TREE\n");
-                b = &bodies[i];
-                a = nbGravity(ctx, st, b);
-                externAcc = mw_addv(nbExtAcceleration(&ctx->pot, Pos(b), barTime), plummerAccel(Pos(b), LMCx, lmcmass, lmcscale));
-                /** WARNING!: Adding any code to this section may cause the checkpointing to randomly bug out. I'm not
-                    sure what causes this, but if you ever plan to add another gravity calculation outside of a new potential,
-                    take the time to manually test the checkpointing. It drove me nuts when I was trying to add the LMC as a
-                    moving potential. **/
-                mw_incaddv(a, externAcc);
-                //real test = X(plummerAccel(Pos(b), LMCx, lmcmass, lmcscale));
-    	        //if(test > 400) {
-      		//   mw_printf("Plummer Additive Acceleration (X): %f\n", test);
-      		//   printf("Plummer Additive Acceleration (X): %f\n", test);
-    		//}
-    
-
-                accels[i] = a;
-                break;
-
-            case EXTERNAL_POTENTIAL_NONE:
-                //mw_printf("NULL POTENTIAL - TREE\n");
-                accels[i] = nbGravity(ctx, st, &bodies[i]);
-                break;
-
-            case EXTERNAL_POTENTIAL_CUSTOM_LUA:
-                //mw_printf("CUSTOM POTENTIAL - TREE\n");
-                a = nbGravity(ctx, st, &bodies[i]);
-                nbEvalPotentialClosure(st, Pos(&bodies[i]), &externAcc);
-                mw_incaddv(externAcc, plummerAccel(Pos(&bodies[i]), LMCx, lmcmass, lmcscale));
-                mw_incaddv(a, externAcc);
+    return now;
+}
 
-                accels[i] = a;
-                break;
+static inline mwvector nbExternalAccel(const NBodyCtx* ctx,
+                                       NBodyState* st,
+                                       mwvector pos,
+                                       const NBodyExternal* now)
+{
+    mwvector externAcc = ZERO_VECTOR;
 
-            default:
-                mw_fail("Bad external potential type: %d\n", ctx->potentialType);
-        }
+    switch (ctx->potentialType)
+    {
+        case EXTERNAL_POTENTIAL_DEFAULT:
+            externAcc = mw_addv(nbTableExtAcceleration(st->potTable, &ctx->pot, pos, now->barTime), plummerAccel(pos, now->LMCx, now->lmcmass, now->lmcscale));
+            break;
+
+        case EXTERNAL_POTENTIAL_NONE:
+            break;
+
+        case EXTERNAL_POTENTIAL_CUSTOM_LUA:
+            nbTableClosureAcceleration(st, pos, &externAcc);
+            mw_incaddv(externAcc, plummerAccel(pos, now->LMCx, now->lmcmass, now->lmcscale));
+            break;
+
+        default:
+            mw_fail("Bad external potential type: %d\n", ctx->potentialType);
     }
+
+    return externAcc;
 }
 
-static mwvector nbGravity_Exact(const NBodyCtx* ctx, NBodyState* st, const Body* p)
+/* Bodies per block of the external acceleration */
+#define NBODY_EXT_BLOCK 64
+
+/* External acceleration of the n <= NBODY_EXT_BLOCK bodies id into ext.
+ * The force loops take their bodies a block at a time, so each component
+ * of the default potential is picked once per block rather than once per
+ * body and the common ones vectorize, while the bodies are still in cache
+ * for their self gravity. The Lua potential and the tabulated ones go
+ * body by body. Too big to inline, and only called once per block. */
+static void nbExternalAccelBlock(const NBodyCtx* ctx,
+                                 NBodyState* st,
+                                 const int* id,
+                                 int n,
+                                 mwvector* ext,
+                                 const NBodyExternal* now)
 {
-    int i;
-    const int nbody = st->nbody;
-    mwvector a = ZERO_VECTOR;
-    const real eps2 = ctx->eps2;
+    int j;
+    const Body* bodies = st->bodytab;
 
-    for (i = 0; i < nbody; ++i)
+    n = MIN(n, NBODY_EXT_BLOCK);
+    if (n <= 0)
+    {
+        return;
+    }
+
+    if (ctx->potentialType == EXTERNAL_POTENTIAL_DEFAULT && !st->potTable)
     {
-        const Body* b = &st->bodytab[i];
+        real x[NBODY_EXT_BLOCK], y[NBODY_EXT_BLOCK], z[NBODY_EXT_BLOCK];
+        real ax[NBODY_EXT_BLOCK], ay[NBODY_EXT_BLOCK], az[NBODY_EXT_BLOCK];
+
+        for (j = 0; j < n; ++j)
+        {
+            x[j] = X(Pos(&bodies[id[j]]));
+            y[j] = Y(Pos(&bodies[id[j]]));
+            z[j] = Z(Pos(&bodies[id[j]]));
+        }
+
+        nbExtAccelerationBlock(&ctx->pot, x, y, z, ax, ay, az, n, now->barTime);
+        for (j = 0; j < n; ++j)
+        {
+            mwvector a;
 
-        mwvector dr = mw_subv(Pos(b), Pos(p));
-        real drSq = mw_sqrv(dr) + eps2;
+            SET_VECTOR(a, ax[j], ay[j], az[j]);
+            ext[j] = mw_addv(a, plummerAccel(Pos(&bodies[id[j]]), now->LMCx, now->lmcmass, now->lmcscale));
+        }
+    }
+    else
+    {
+        for (j = 0; j < n; ++j)
+        {
+            ext[j] = nbExternalAccel(ctx, st, Pos(&bodies[id[j]]), now);
+        }
+    }
+}
 
-        real drab = mw_sqrt(drSq);
-        real phii = Mass(b) / drab;
-        real mor3 = phii / drSq;
+/* Indices of the bodies of block k which are at the end of their block
+ * step, into id. Returns how many there are. */
+static inline int nbBlockBodies(const NBodyState* st, int k, int* id)
+{
+    int i, n = 0;
+    const int* rungs = st->rungs;
+    const int activeRung = (int) st->activeRung;
+    const int first = k * NBODY_EXT_BLOCK;
+    const int last = MIN(first + NBODY_EXT_BLOCK, st->nbody);
 
-        mw_incaddv(a, mw_mulvs(dr, mor3));
+    for (i = first; i < last; ++i)
+    {
+        if (!rungs || rungs[i] >= activeRung)
+            id[n++] = i;
     }
 
-    return a;
+    return n;
 }
 
-static inline void nbMapForceBody_Exact(const NBodyCtx* ctx, NBodyState* st)
+/* Find the acceleration of body i from the tree and add the external
+ * acceleration externAcc already found for it */
+static inline void nbForceOnBody(const NBodyCtx* ctx, NBodyState* st, int i, mwvector externAcc, const NBodyKick* kick)
 {
-    int i;
-    const int nbody = st->nbody;  /* Prevent reload on each loop */
-    mwvector LMCx;
-    mwvector a, externAcc;
+    mwvector a;
     const Body* b;
-    real lmcmass, lmcscale;
-
-    Body* bodies = mw_assume_aligned(st->bodytab, 16);
+    const Body* bodies = mw_assume_aligned(st->bodytab, 16);
     mwvector* accels = mw_assume_aligned(st->acctab, 16);
-    real curTime = st->step * ctx->timestep;
-    real timeFromStart = -ctx->Ntsteps*ctx->timestep + curTime;
-    real barTime = st->step * ctx->timestep - st->previousForwardTime;
+    real* phi = (st->energy && st->energy->havePhi) ? &st->energy->phi[i] : NULL;
 
-    if (ctx->LMC) {
-        LMCx = st->LMCpos;
-        lmcmass = ctx->LMCmass;
-        lmcscale = ctx->LMCscale;
+    /* Repeat the base hackGrav part in each case or else GCC's
+     * -funswitch-loops doesn't happen. Without that this constant
+     * gets checked on every body on every step which is dumb.  */
+    switch (ctx->potentialType)
+    {
+        case EXTERNAL_POTENTIAL_DEFAULT:
+            //mw_printf("DEFAULT POTENTIAL - TREE\n");
+            b = &bodies[i];
+            a = nbGravity(ctx, st, b, phi);
+            /** WARNING!: Adding any code to this section may cause the checkpointing to randomly bug out. I'm not
+                sure what causes this, but if you ever plan to add another gravity calculation outside of a new potential,
+                take the time to manually test the checkpointing. It drove me nuts when I was trying to add the LMC as a
+                moving potential. **/
+            mw_incaddv(a, externAcc);
+            //real test = X(plummerAccel(Pos(b), LMCx, lmcmass, lmcscale));
+            //if(test > 400) {
+            //   mw_printf("Plummer Additive Acceleration (X): %f\n", test);
+            //   printf("Plummer Additive Acceleration (X): %f\n", test);
+            //}
+
+            accels[i] = a;
+            break;
+
+        case EXTERNAL_POTENTIAL_NONE:
+            //mw_printf("NULL POTENTIAL - TREE\n");
+            accels[i] = nbGravity(ctx, st, &bodies[i], phi);
+            break;
+
+        case EXTERNAL_POTENTIAL_CUSTOM_LUA:
+            //mw_printf("CUSTOM POTENTIAL - TREE\n");
+            a = nbGravity(ctx, st, &bodies[i], phi);
+            mw_incaddv(a, externAcc);
+
+            accels[i] = a;
+            break;
+
+        default:
+            mw_fail("Bad external potential type: %d\n", ctx->potentialType);
     }
-    else {
-        SET_VECTOR(LMCx,0.0,0.0,0.0);
-        lmcmass = 0.0;
-        lmcscale = 1.0;
+
+    nbKickBody(st, i, accels[i], externAcc, kick);
+}
+
+/* Find the accelerations of the n <= NBODY_EXT_BLOCK bodies id */
+static inline void nbForceOnBlock(const NBodyCtx* ctx,
+                                  NBodyState* st,
+                                  const int* id,
+                                  int n,
+                                  const NBodyKick* kick,
+                                  const NBodyExternal* now)
+{
+    int j;
+    mwvector ext[NBODY_EXT_BLOCK];
+
+    nbExternalAccelBlock(ctx, st, id, n, ext, now);
+    for (j = 0; j < n; ++j)
+    {
+        nbForceOnBody(ctx, st, id[j], ext[j], kick);
     }
+}
 
-  #ifdef _OPENMP
-    #pragma omp parallel for private(i, b, a, externAcc) shared(bodies, accels) schedule(dynamic, 4096 / sizeof(accels[0]))
-  #endif
+/* Write the bodies in the order the tree walk meets them, which keeps
+ * neighbours together, followed by the test particles which are not in
+ * the tree. Bodies of other processes' domains loaded into the tree
+ * past st->nbody are left out. Returns the number of bodies written to
+ * order.
+ */
+int nbTreeBodyOrder(const NBodyState* st, int* order)
+{
+    int i, n = 0;
+    nodelink_t l;
+    const NBodyCell* cells = st->tree.cells;
+    const Body* btab = st->bodytab;
+    const NBodyNode* q = (const NBodyNode*) st->tree.root;
 
-    for (i = 0; i < nbody; ++i)      /* get force on each body */
+    while (q != NULL)
     {
-        switch (ctx->potentialType)
+        if (isBody(q))
         {
-            case EXTERNAL_POTENTIAL_DEFAULT:
-                //mw_printf("DEFAULT POTENTIAL - EXACT\n");
-                b = &bodies[i];
-                a = nbGravity_Exact(ctx, st, b);
-                //mw_incaddv(a, nbExtAcceleration(&ctx->pot, Pos(b), curTime - ctx->timeBack));
-                externAcc = mw_addv(nbExtAcceleration(&ctx->pot, Pos(b), barTime), plummerAccel(Pos(b), LMCx, lmcmass, lmcscale));
-                mw_incaddv(a, externAcc);
-                
-                accels[i] = a;
-                break;
-
-            case EXTERNAL_POTENTIAL_NONE:
-                //mw_printf("NULL POTENTIAL - EXACT\n");
-                accels[i] = nbGravity_Exact(ctx, st, &bodies[i]);
-                break;
-
-            case EXTERNAL_POTENTIAL_CUSTOM_LUA:
-                //mw_printf("CUSTOM POTENTIAL - EXACT\n");
-                a = nbGravity_Exact(ctx, st, &bodies[i]);
-                nbEvalPotentialClosure(st, Pos(&bodies[i]), &externAcc);
-                mw_incaddv(externAcc, plummerAccel(Pos(&bodies[i]), LMCx, lmcmass, lmcscale));
-                mw_incaddv(a, externAcc);
+            int b = (int) ((const Body*) q - btab);
+
+            if (b < st->nbody)
+                order[n++] = b;
+            l = Next(q);
+        }
+        else
+        {
+            l = More(q);
+        }
 
-                accels[i] = a;
-                break;
+        q = (l == NULL_LINK) ? NULL : LinkNode(cells, btab, l);
+    }
 
-            default:
-                mw_fail("Bad external potential type: %d\n", ctx->potentialType);
+    for (i = 0; i < st->nbody; ++i)
+    {
+        if (Mass(&btab[i]) == 0.0)
+        {
+            order[n++] = i;
         }
     }
+
+    return n;
 }
 
-static inline NBodyStatus nbIncestStatusCheck(const NBodyCtx* ctx, const NBodyState* st)
+/* Running total of the cost of the bodies in order, so sum[k] is the
+ * cost of the first k. Bodies not stepped in this substep cost nothing,
+ * and the rest at least 1 so bodies never walked before still count. */
+static void nbCostSums(const NBodyState* st, const int* order, int n, double* sum)
 {
-    if (st->treeIncest)
+    int k;
+    const unsigned int* cost = st->bodyCost;
+    const int* rungs = st->rungs;
+    const int activeRung = (int) st->activeRung;
+
+    sum[0] = 0.0;
+    for (k = 0; k < n; ++k)
     {
-        return ctx->allowIncest ? NBODY_TREE_INCEST_NONFATAL : NBODY_TREE_INCEST_FATAL;
+        int i = order[k];
+        double c = (rungs && rungs[i] < activeRung) ? 0.0 : 1.0 + (double) cost[i];
+
+        sum[k + 1] = sum[k] + c;
     }
+}
 
-    return NBODY_SUCCESS;
+/* First k with sum[k] >= target */
+static int nbCostSplit(const double* sum, int n, double target)
+{
+    int lo = 0, hi = n;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (sum[mid] < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
 }
 
-NBodyStatus nbGravMap(const NBodyCtx* ctx, NBodyState* st)
+/* Walk the tree for each body. With ctx->costBalance each thread takes
+ * a contiguous run of the bodies in tree order with an equal share of
+ * the nodes they visited in their last walk, rather than dynamically
+ * scheduled chunks in body order. The time of the slowest thread over
+ * the mean is kept in st either way.
+ */
+static inline void nbMapForceBody(const NBodyCtx* ctx, NBodyState* st, const NBodyKick* kick)
 {
-    NBodyStatus rc;
+    int i;
+    const int nbody = st->nbody;  /* Prevent reload on each loop */
+    const NBodyExternal now = nbExternalNow(ctx, st);
+    const int* rungs = st->rungs;
+    const int activeRung = (int) st->activeRung;
+    const int* order = NULL;
+    double* costSum = NULL;
+    int nThreads = 1;
+    double tMax = 0.0, tSum = 0.0;
 
-    if (mw_likely(ctx->criterion != Exact))
+    if (ctx->costBalance && st->tree.root)
     {
-        rc = nbMakeTree(ctx, st);
-        if (nbStatusIsFatal(rc))
-            return rc;
+        if (!st->bodyCost)
+        {
+            st->bodyCost = (unsigned int*) mwCalloc(nbody, sizeof(unsigned int));
+        }
+
+        /* Kept between steps, only growing when the bodies outgrow them */
+        if (nbody > st->costCapacity)
+        {
+            st->costOrder = (int*) mwRealloc(st->costOrder, nbody * sizeof(int));
+            st->costSum = (double*) mwRealloc(st->costSum, (nbody + 1) * sizeof(double));
+            st->costCapacity = nbody;
+        }
 
-        nbMapForceBody(ctx, st);
+        if (nbTreeBodyOrder(st, st->costOrder) == nbody)
+        {
+            order = st->costOrder;
+            costSum = st->costSum;
+            nbCostSums(st, order, nbody, costSum);
+        }
     }
-    else
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(i) shared(order, costSum) reduction(max: tMax) reduction(+: tSum)
+  #endif
+    {
+        int id[NBODY_EXT_BLOCK];
+
+      #ifdef _OPENMP
+        const int thread = omp_get_thread_num();
+        const int nTeam = omp_get_num_threads();
+        const double t0 = omp_get_wtime();
+
+        #pragma omp master
+        nThreads = nTeam;
+      #else
+        const int thread = 0;
+        const int nTeam = 1;
+      #endif
+
+        if (costSum)
+        {
+            int k, n = 0;
+            double total = costSum[nbody];
+            int first = nbCostSplit(costSum, nbody, total * thread / nTeam);
+            int last = (thread == nTeam - 1) ? nbody : nbCostSplit(costSum, nbody, total * (thread + 1) / nTeam);
+
+            for (k = first; k < last; ++k)
+            {
+                i = order[k];
+                if (rungs && rungs[i] < activeRung)  /* not at the end of its block step */
+                    continue;
+
+                id[n++] = i;
+                if (n == NBODY_EXT_BLOCK)
+                {
+                    nbForceOnBlock(ctx, st, id, n, kick, &now);
+                    n = 0;
+                }
+            }
+
+            if (n > 0)
+            {
+                nbForceOnBlock(ctx, st, id, n, kick, &now);
+            }
+        }
+        else
+        {
+            const int nBlock = (nbody + NBODY_EXT_BLOCK - 1) / NBODY_EXT_BLOCK;
+
+          #ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 1) nowait
+          #endif
+            for (i = 0; i < nBlock; ++i)      /* get force on each body */
+            {
+                int n = nbBlockBodies(st, i, id);
+                nbForceOnBlock(ctx, st, id, n, kick, &now);
+            }
+        }
+
+      #ifdef _OPENMP
+        tMax = tSum = omp_get_wtime() - t0;
+      #endif
+    }
+
+    if (nThreads > 1 && tSum > 0.0)
     {
-        nbMapForceBody_Exact(ctx, st);
+        real imbalance = (real) (tMax * nThreads / tSum);
+
+        st->forceImbalanceSum += imbalance;
+        st->forceImbalanceMax = mw_fmax(st->forceImbalanceMax, imbalance);
+        ++st->forceImbalanceCount;
     }
+}
 
-    if (st->potentialEvalError)
+/* Interaction list shared by a group of bodies. Each component is
+ * kept in a separate array so the force kernels vectorize over the
+ * bodies of the group. Quadrupole moments are only kept for cells, and
+ * body indices only for bodies.
+ */
+typedef struct
+{
+    real* x;
+    real* y;
+    real* z;
+    real* m;
+    real* qxx;
+    real* qxy;
+    real* qxz;
+    real* qyy;
+    real* qyz;
+    real* qzz;
+    int* id;
+    unsigned int n;
+    unsigned int capacity;
+} NBodyInteractionList;
+
+/* Per thread space for walking the tree for a group of bodies */
+typedef struct
+{
+    NBodyInteractionList cells;
+    NBodyInteractionList bodies;
+
+    unsigned int opened;    /* cells the last walk opened */
+    int* members;           /* bodytab index of each body in the group */
+    int* found;             /* if the body was met in the interaction list */
+    real* x;
+    real* y;
+    real* z;
+    real* ax;
+    real* ay;
+    real* az;
+} NBodyWalkGroup;
+
+static void nbGrowInteractionList(NBodyInteractionList* list, mwbool isCellList)
+{
+    size_t size;
+
+    list->capacity = list->capacity ? 2 * list->capacity : 256;
+    size = list->capacity * sizeof(real);
+
+    list->x = (real*) mwRealloc(list->x, size);
+    list->y = (real*) mwRealloc(list->y, size);
+    list->z = (real*) mwRealloc(list->z, size);
+    list->m = (real*) mwRealloc(list->m, size);
+
+    if (isCellList)
     {
-        return NBODY_LUA_POTENTIAL_ERROR;
+        list->qxx = (real*) mwRealloc(list->qxx, size);
+        list->qxy = (real*) mwRealloc(list->qxy, size);
+        list->qxz = (real*) mwRealloc(list->qxz, size);
+        list->qyy = (real*) mwRealloc(list->qyy, size);
+        list->qyz = (real*) mwRealloc(list->qyz, size);
+        list->qzz = (real*) mwRealloc(list->qzz, size);
     }
+    else
+    {
+        list->id = (int*) mwRealloc(list->id, list->capacity * sizeof(int));
+    }
+}
+
+static void nbFreeInteractionList(NBodyInteractionList* list)
+{
+    free(list->x);
+    free(list->y);
+    free(list->z);
+    free(list->m);
+    free(list->qxx);
+    free(list->qxy);
+    free(list->qxz);
+    free(list->qyy);
+    free(list->qyz);
+    free(list->qzz);
+    free(list->id);
+}
+
+static void nbInitWalkGroup(NBodyWalkGroup* g, unsigned int groupSize)
+{
+    memset(g, 0, sizeof(*g));
+
+    nbGrowInteractionList(&g->cells, TRUE);
+    nbGrowInteractionList(&g->bodies, FALSE);
+
+    g->members = (int*) mwMalloc(groupSize * sizeof(int));
+    g->found = (int*) mwMalloc(groupSize * sizeof(int));
+    g->x = (real*) mwMalloc(groupSize * sizeof(real));
+    g->y = (real*) mwMalloc(groupSize * sizeof(real));
+    g->z = (real*) mwMalloc(groupSize * sizeof(real));
+    g->ax = (real*) mwMalloc(groupSize * sizeof(real));
+    g->ay = (real*) mwMalloc(groupSize * sizeof(real));
+    g->az = (real*) mwMalloc(groupSize * sizeof(real));
+}
 
-    return nbIncestStatusCheck(ctx, st); /* Check if incest occured during step */
+static void nbFreeWalkGroup(NBodyWalkGroup* g)
+{
+    nbFreeInteractionList(&g->cells);
+    nbFreeInteractionList(&g->bodies);
+
+    free(g->members);
+    free(g->found);
+    free(g->x);
+    free(g->y);
+    free(g->z);
+    free(g->ax);
+    free(g->ay);
+    free(g->az);
+}
+
+static inline nodelink_t nbNodeLink(const NBodyState* st, const NBodyNode* q)
+{
+    if (isBody(q))
+        return bodyLink((nodelink_t) ((const Body*) q - st->bodytab));
+    else
+        return (nodelink_t) ((const NBodyCell*) q - st->tree.cells);
 }
 
+/* Split the tree into groups to walk it for: the largest cells with no
+ * more than groupSize bodies, and bodies on their own in larger cells.
+ * Returns the number of groups written to groups.
+ */
+static int nbFindWalkGroups(const NBodyState* st, unsigned int groupSize, nodelink_t* groups)
+{
+    int n = 0;
+    nodelink_t l;
+    const NBodyNode* q = (const NBodyNode*) st->tree.root;
+
+    while (q != NULL)
+    {
+        if (isCell(q) && NBodies(q) > groupSize)   /* too big, split it */
+        {
+            l = More(q);
+        }
+        else
+        {
+            groups[n++] = nbNodeLink(st, q);
+            l = Next(q);
+        }
+
+        q = (l == NULL_LINK) ? NULL : LinkNode(st->tree.cells, st->bodytab, l);
+    }
+
+    return n;
+}
+
+/* Collect the bodies of group into g and build the interaction list
+ * they share. A cell is only accepted if every point of the bounding
+ * box of the group passes the opening test, so each body sees at least
+ * the detail its own walk would. Returns the number of bodies in the
+ * group.
+ */
+static unsigned int nbWalkGroup(const NBodyState* st, NBodyWalkGroup* g, nodelink_t group)
+{
+    unsigned int i, n = 0;
+    nodelink_t l;
+    const NBodyCell* cells = st->tree.cells;
+    const Body* btab = st->bodytab;
+    const NBodyNode* gn = LinkNode(cells, btab, group);
+    const NBodyNode* q;
+    NBodyInteractionList* cl = &g->cells;
+    NBodyInteractionList* bl = &g->bodies;
+    mwvector lo, hi;
+
+    if (isBody(gn))
+    {
+        g->members[n++] = linkBody(group);
+    }
+    else
+    {
+        l = More(gn);
+        while (l != Next(gn))      /* scan the subtree of the group */
+        {
+            q = LinkNode(cells, btab, l);
+            if (isBody(q))
+            {
+                g->members[n++] = linkBody(l);
+                l = Next(q);
+            }
+            else
+            {
+                l = More(q);
+            }
+        }
+    }
+
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    lo = hi = Pos(&btab[g->members[0]]);
+    for (i = 0; i < n; ++i)
+    {
+        const Body* b = &btab[g->members[i]];
+
+        g->x[i] = X(Pos(b));
+        g->y[i] = Y(Pos(b));
+        g->z[i] = Z(Pos(b));
+
+        X(lo) = mw_fmin(X(lo), X(Pos(b)));
+        Y(lo) = mw_fmin(Y(lo), Y(Pos(b)));
+        Z(lo) = mw_fmin(Z(lo), Z(Pos(b)));
+        X(hi) = mw_fmax(X(hi), X(Pos(b)));
+        Y(hi) = mw_fmax(Y(hi), Y(Pos(b)));
+        Z(hi) = mw_fmax(Z(hi), Z(Pos(b)));
+    }
+
+    cl->n = 0;
+    bl->n = 0;
+    g->opened = 0;
+    q = (const NBodyNode*) st->tree.root;
+    while (q != NULL)
+    {
+        if (isBody(q))
+        {
+            if (bl->n == bl->capacity)
+                nbGrowInteractionList(bl, FALSE);
+
+            bl->x[bl->n] = X(Pos(q));
+            bl->y[bl->n] = Y(Pos(q));
+            bl->z[bl->n] = Z(Pos(q));
+            bl->m[bl->n] = Mass(q);
+            bl->id[bl->n] = (int) ((const Body*) q - btab);
+            ++bl->n;
+
+            l = Next(q);
+        }
+        else
+        {
+            /* Distance from the cell's center of mass to the group box */
+            real dx = mw_fmax(mw_fmax(X(lo) - X(Pos(q)), X(Pos(q)) - X(hi)), 0.0);
+            real dy = mw_fmax(mw_fmax(Y(lo) - Y(Pos(q)), Y(Pos(q)) - Y(hi)), 0.0);
+            real dz = mw_fmax(mw_fmax(Z(lo) - Z(Pos(q)), Z(Pos(q)) - Z(hi)), 0.0);
+
+            if (dx * dx + dy * dy + dz * dz >= Rcrit2(q))   /* far enough for all */
+            {
+                if (cl->n == cl->capacity)
+                    nbGrowInteractionList(cl, TRUE);
+
+                cl->x[cl->n] = X(Pos(q));
+                cl->y[cl->n] = Y(Pos(q));
+                cl->z[cl->n] = Z(Pos(q));
+                cl->m[cl->n] = Mass(q);
+                cl->qxx[cl->n] = Quad(q).xx;
+                cl->qxy[cl->n] = Quad(q).xy;
+                cl->qxz[cl->n] = Quad(q).xz;
+                cl->qyy[cl->n] = Quad(q).yy;
+                cl->qyz[cl->n] = Quad(q).yz;
+                cl->qzz[cl->n] = Quad(q).zz;
+                ++cl->n;
+
+                l = Next(q);
+            }
+            else
+            {
+                ++g->opened;
+                l = More(q);
+            }
+        }
+
+        q = (l == NULL_LINK) ? NULL : LinkNode(cells, btab, l);
+    }
+
+    return n;
+}
+
+/* Add the forces from the accepted cells of the interaction list to
+ * the n bodies of the group. The inner loops run over the bodies of
+ * the group, so they vectorize without reordering any sum.
+ */
+static void nbGroupCellForces(NBodyWalkGroup* g, unsigned int n, real eps2, mwbool useQuad)
+{
+    unsigned int i, j;
+    const NBodyInteractionList* cl = &g->cells;
+    const real* RESTRICT x = g->x;
+    const real* RESTRICT y = g->y;
+    const real* RESTRICT z = g->z;
+    real* RESTRICT ax = g->ax;
+    real* RESTRICT ay = g->ay;
+    real* RESTRICT az = g->az;
+
+    for (j = 0; j < cl->n; ++j)
+    {
+        const real xj = cl->x[j];
+        const real yj = cl->y[j];
+        const real zj = cl->z[j];
+        const real mj = cl->m[j];
+
+        if (useQuad)
+        {
+            const real qxx = cl->qxx[j];
+            const real qxy = cl->qxy[j];
+            const real qxz = cl->qxz[j];
+            const real qyy = cl->qyy[j];
+            const real qyz = cl->qyz[j];
+            const real qzz = cl->qzz[j];
+
+            for (i = 0; i < n; ++i)
+            {
+                real dx = xj - x[i];
+                real dy = yj - y[i];
+                real dz = zj - z[i];
+                real drSq = (dx * dx + dy * dy + dz * dz) + eps2;
+                real drab = mw_sqrt(drSq);
+                real phii = mj / drab;
+                real mor3 = phii / drSq;
+
+                /* form Q * dr, dr * Q * dr and dr^-5 */
+                real Qdrx = qxx * dx + qxy * dy + qxz * dz;
+                real Qdry = qxy * dx + qyy * dy + qyz * dz;
+                real Qdrz = qxz * dx + qyz * dy + qzz * dz;
+                real drQdr = Qdrx * dx + Qdry * dy + Qdrz * dz;
+                real dr5inv = 1.0 / (sqr(drSq) * drab);
+                real phiQ = 2.5 * (dr5inv * drQdr) / drSq;
+
+                ax[i] += mor3 * dx;
+                ay[i] += mor3 * dy;
+                az[i] += mor3 * dz;
+
+                ax[i] += phiQ * dx;
+                ay[i] += phiQ * dy;
+                az[i] += phiQ * dz;
+
+                ax[i] -= dr5inv * Qdrx;
+                ay[i] -= dr5inv * Qdry;
+                az[i] -= dr5inv * Qdrz;
+            }
+        }
+        else
+        {
+            for (i = 0; i < n; ++i)
+            {
+                real dx = xj - x[i];
+                real dy = yj - y[i];
+                real dz = zj - z[i];
+                real drSq = (dx * dx + dy * dy + dz * dz) + eps2;
+                real drab = mw_sqrt(drSq);
+                real phii = mj / drab;
+                real mor3 = phii / drSq;
+
+                ax[i] += mor3 * dx;
+                ay[i] += mor3 * dy;
+                az[i] += mor3 * dz;
+            }
+        }
+    }
+}
+
+/* Add the forces from the bodies of the interaction list to the n
+ * bodies of the group, skipping each body's interaction with itself.
+ */
+static void nbGroupBodyForces(NBodyWalkGroup* g, unsigned int n, real eps2)
+{
+    unsigned int i, j;
+    const NBodyInteractionList* bl = &g->bodies;
+    const int* RESTRICT members = g->members;
+    int* RESTRICT found = g->found;
+    const real* RESTRICT x = g->x;
+    const real* RESTRICT y = g->y;
+    const real* RESTRICT z = g->z;
+    real* RESTRICT ax = g->ax;
+    real* RESTRICT ay = g->ay;
+    real* RESTRICT az = g->az;
+
+    for (j = 0; j < bl->n; ++j)
+    {
+        const real xj = bl->x[j];
+        const real yj = bl->y[j];
+        const real zj = bl->z[j];
+        const real mj = bl->m[j];
+        const int idj = bl->id[j];
+
+        for (i = 0; i < n; ++i)
+        {
+            int self = (members[i] == idj);
+            real dx = xj - x[i];
+            real dy = yj - y[i];
+            real dz = zj - z[i];
+            real drSq = (dx * dx + dy * dy + dz * dz) + eps2;
+            real m = self ? 0.0 : mj;   /* select, so the loop stays branch free */
+            real drab, phii, mor3;
+
+            drSq = self ? 1.0 : drSq;
+            drab = mw_sqrt(drSq);
+            phii = m / drab;
+            mor3 = phii / drSq;
+
+            ax[i] += mor3 * dx;
+            ay[i] += mor3 * dy;
+            az[i] += mor3 * dz;
+
+            found[i] |= self;
+        }
+    }
+}
+
+/* Like nbMapForceBody(), but walk the tree once for each group of up
+ * to ctx->walkGroupSize nearby bodies and evaluate the shared
+ * interaction list for all of them together. Test particles are not in
+ * the tree, so they still get a walk of their own.
+ */
+static inline void nbMapForceBodyGrouped(const NBodyCtx* ctx, NBodyState* st, const NBodyKick* kick)
+{
+    int i, nGroups;
+    const int nbody = st->nbody;
+    const real eps2 = ctx->eps2;
+    const NBodyExternal now = nbExternalNow(ctx, st);
+    nodelink_t* groups;
+
+    const Body* bodies = mw_assume_aligned(st->bodytab, 16);
+    mwvector* accels = mw_assume_aligned(st->acctab, 16);
+
+    groups = (nodelink_t*) mwMalloc(nbody * sizeof(nodelink_t));
+    nGroups = nbFindWalkGroups(st, ctx->walkGroupSize, groups);
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(i) shared(bodies, accels, groups)
+  #endif
+    {
+        NBodyWalkGroup g;
+        int id[NBODY_EXT_BLOCK];
+        mwvector ext[NBODY_EXT_BLOCK];
+        const int nBlock = (nbody + NBODY_EXT_BLOCK - 1) / NBODY_EXT_BLOCK;
+
+        nbInitWalkGroup(&g, ctx->walkGroupSize);
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+      #endif
+        for (i = 0; i < nGroups; ++i)
+        {
+            unsigned int j, n;
+
+            n = nbWalkGroup(st, &g, groups[i]);
+
+            memset(g.ax, 0, n * sizeof(real));
+            memset(g.ay, 0, n * sizeof(real));
+            memset(g.az, 0, n * sizeof(real));
+            memset(g.found, 0, n * sizeof(int));
+
+            nbGroupCellForces(&g, n, eps2, ctx->useQuad);
+            nbGroupBodyForces(&g, n, eps2);
+
+            if (mw_unlikely(st->counters != NULL))
+            {
+                /* The body list has the group's own bodies in it */
+                nbCountWalks(st, 1, n, g.opened, (uint64_t) n * g.cells.n, (uint64_t) n * g.bodies.n - n);
+            }
+
+            for (j = 0; j < n; ++j)
+            {
+                mwvector a = ZERO_VECTOR;
+                mwvector externAcc;
+
+                if (!g.found[j])
+                {
+                    /* If a body does not encounter itself in its
+                     * traversal of the tree, it is "tree incest" */
+                    nbReportTreeIncest(ctx, st);
+                }
+
+                if (j % NBODY_EXT_BLOCK == 0)
+                {
+                    nbExternalAccelBlock(ctx, st, &g.members[j], (int) MIN(n - j, (unsigned int) NBODY_EXT_BLOCK), ext, &now);
+                }
+
+                externAcc = ext[j % NBODY_EXT_BLOCK];
+                SET_VECTOR(a, g.ax[j], g.ay[j], g.az[j]);
+                mw_incaddv(a, externAcc);
+                accels[g.members[j]] = a;
+                nbKickBody(st, g.members[j], a, externAcc, kick);
+            }
+        }
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+      #endif
+        for (i = 0; i < nBlock; ++i)      /* test particles */
+        {
+            int j, k, n = 0;
+            int last = MIN((i + 1) * NBODY_EXT_BLOCK, nbody);
+
+            for (k = i * NBODY_EXT_BLOCK; k < last; ++k)
+            {
+                if (Mass(&bodies[k]) == 0.0)
+                    id[n++] = k;
+            }
+
+            nbExternalAccelBlock(ctx, st, id, n, ext, &now);
+            for (j = 0; j < n; ++j)
+            {
+                mwvector a = nbGravity(ctx, st, &bodies[id[j]], NULL);
+                mw_incaddv(a, ext[j]);
+                accels[id[j]] = a;
+                nbKickBody(st, id[j], a, ext[j], kick);
+            }
+        }
+
+        nbFreeWalkGroup(&g);
+    }
+
+    free(groups);
+}
+
+/* Self gravity of the tree bodies by the fast multipole method. Test
+ * particles are not in the tree, so they walk it as usual.
+ */
+static inline void nbMapForceBodyFMM(const NBodyCtx* ctx, NBodyState* st, const NBodyKick* kick)
+{
+    int i;
+    const int nbody = st->nbody;
+    const NBodyExternal now = nbExternalNow(ctx, st);
+    const int nBlock = (nbody + NBODY_EXT_BLOCK - 1) / NBODY_EXT_BLOCK;
+
+    const Body* bodies = mw_assume_aligned(st->bodytab, 16);
+    mwvector* accels = mw_assume_aligned(st->acctab, 16);
+
+    nbFMMGravity(ctx, st);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(bodies, accels) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nBlock; ++i)
+    {
+        int j;
+        int id[NBODY_EXT_BLOCK];
+        mwvector ext[NBODY_EXT_BLOCK];
+        int n = nbBlockBodies(st, i, id);
+
+        nbExternalAccelBlock(ctx, st, id, n, ext, &now);
+        for (j = 0; j < n; ++j)
+        {
+            const int k = id[j];
+
+            if (Mass(&bodies[k]) == 0.0)      /* test particle */
+            {
+                accels[k] = nbGravity(ctx, st, &bodies[k], NULL);
+            }
+
+            mw_incaddv(accels[k], ext[j]);
+            nbKickBody(st, k, accels[k], ext[j], kick);
+        }
+    }
+}
+
+/* Self gravity of all the bodies by the particle-mesh method, with the
+ * short range part from the tree if it has been built for the split.
+ */
+static inline void nbMapForceBodyPM(const NBodyCtx* ctx, NBodyState* st, const NBodyKick* kick)
+{
+    int i;
+    const int nbody = st->nbody;
+    const NBodyExternal now = nbExternalNow(ctx, st);
+    const int nBlock = (nbody + NBODY_EXT_BLOCK - 1) / NBODY_EXT_BLOCK;
+
+    mwvector* accels = mw_assume_aligned(st->acctab, 16);
+
+    nbPMGravity(ctx, st);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(accels) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nBlock; ++i)
+    {
+        int j;
+        int id[NBODY_EXT_BLOCK];
+        mwvector ext[NBODY_EXT_BLOCK];
+        int n = nbBlockBodies(st, i, id);
+
+        nbExternalAccelBlock(ctx, st, id, n, ext, &now);
+        for (j = 0; j < n; ++j)
+        {
+            mw_incaddv(accels[id[j]], ext[j]);
+            nbKickBody(st, id[j], accels[id[j]], ext[j], kick);
+        }
+    }
+}
+
+/* Bodies per tile of the direct summation. Two tiles of positions and
+ * masses plus their accelerations stay in L1 */
+#define NBODY_EXACT_TILE 256
+#define NBODY_EXACT_MIN_TILE 32
+
+/* Tiles the bodies are split into at least, down to the smallest tile,
+ * so small runs still give the threads work to share */
+#define NBODY_EXACT_MIN_TILES 64
+
+/* Structure of arrays copy of the bodies for direct summation */
+typedef struct
+{
+    real* x;
+    real* y;
+    real* z;
+    real* m;
+    real* ax;
+    real* ay;
+    real* az;
+    real* phi;      /* potential of each body if the energy is kept, else NULL */
+} NBodyExactArrays;
+
+static void nbAllocExactArrays(NBodyExactArrays* e, const NBodyState* st, mwbool withPhi)
+{
+    int i;
+    const int nbody = st->nbody;
+    const Body* bodies = st->bodytab;
+    real* block = (real*) mwMallocA((withPhi ? 8 : 7) * nbody * sizeof(real));
+
+    e->x = block;
+    e->y = block + nbody;
+    e->z = block + 2 * nbody;
+    e->m = block + 3 * nbody;
+    e->ax = block + 4 * nbody;
+    e->ay = block + 5 * nbody;
+    e->az = block + 6 * nbody;
+    e->phi = withPhi ? block + 7 * nbody : NULL;
+
+    if (withPhi)
+    {
+        memset(e->phi, 0, nbody * sizeof(real));
+    }
+
+    for (i = 0; i < nbody; ++i)
+    {
+        e->x[i] = X(Pos(&bodies[i]));
+        e->y[i] = Y(Pos(&bodies[i]));
+        e->z[i] = Z(Pos(&bodies[i]));
+        e->m[i] = Mass(&bodies[i]);
+        e->ax[i] = 0.0;
+        e->ay[i] = 0.0;
+        e->az[i] = 0.0;
+    }
+}
+
+/* Add the forces between the bodies [i0, i1) and [j0, j1) to both,
+ * using each pair once. With i0 == j0 the tile interacts with itself.
+ * The inner loop reduces into the i body and scatters into contiguous
+ * j bodies, so it vectorizes. */
+static void nbExactTilePair(NBodyExactArrays* e, int i0, int i1, int j0, int j1, real eps2)
+{
+    int i, j;
+    const real* RESTRICT x = e->x;
+    const real* RESTRICT y = e->y;
+    const real* RESTRICT z = e->z;
+    const real* RESTRICT m = e->m;
+    real* RESTRICT ax = e->ax;
+    real* RESTRICT ay = e->ay;
+    real* RESTRICT az = e->az;
+    real* RESTRICT phi = e->phi;
+    const mwbool diagonal = (i0 == j0);
+
+    for (i = i0; i < i1; ++i)
+    {
+        const real xi = x[i];
+        const real yi = y[i];
+        const real zi = z[i];
+        const real mi = m[i];
+        real axi = 0.0, ayi = 0.0, azi = 0.0, phii = 0.0;
+
+      #ifdef _OPENMP
+        #pragma omp simd reduction(+:axi, ayi, azi, phii)
+      #endif
+        for (j = diagonal ? i + 1 : j0; j < j1; ++j)
+        {
+            real dx = x[j] - xi;
+            real dy = y[j] - yi;
+            real dz = z[j] - zi;
+            real drSq = (dx * dx + dy * dy + dz * dz) + eps2;
+            real drab = mw_sqrt(drSq);
+            real r3inv = 1.0 / (drSq * drab);
+            real mjr3 = m[j] * r3inv;
+            real mir3 = mi * r3inv;
+
+            axi += mjr3 * dx;
+            ayi += mjr3 * dy;
+            azi += mjr3 * dz;
+
+            ax[j] -= mir3 * dx;
+            ay[j] -= mir3 * dy;
+            az[j] -= mir3 * dz;
+
+            if (phi)
+            {
+                phii -= mjr3 * drSq;
+                phi[j] -= mir3 * drSq;
+            }
+        }
+
+        ax[i] += axi;
+        ay[i] += ayi;
+        az[i] += azi;
+        if (phi)
+        {
+            phi[i] += phii;
+        }
+    }
+}
+
+static inline int nbExactTileEnd(int k, int tile, int nbody)
+{
+    return ((k + 1) * tile < nbody) ? (k + 1) * tile : nbody;
+}
+
+/* Direct summation over all pairs once. The tiles are paired off with
+ * a round robin schedule, so every round touches each tile at most
+ * once and the threads never write the same body. The tiles are sized
+ * from the number of bodies alone, so the order of the sums and the
+ * forces do not depend on the number of threads, and Exact stays a
+ * reference reproducible anywhere. */
+static void nbExactPairForces(NBodyExactArrays* e, int nbody, real eps2)
+{
+    int tile = NBODY_EXACT_TILE;
+    int nTile, nTeam, round, k;
+
+    while (tile > NBODY_EXACT_MIN_TILE && (nbody + tile - 1) / tile < NBODY_EXACT_MIN_TILES)
+        tile /= 2;
+
+    nTile = (nbody + tile - 1) / tile;
+    nTeam = nTile + (nTile & 1);    /* a dummy tile sits out each round when odd */
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(round, k)
+  #endif
+    {
+      #ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+      #endif
+        for (k = 0; k < nTile; ++k)
+        {
+            int i1 = nbExactTileEnd(k, tile, nbody);
+            nbExactTilePair(e, k * tile, i1, k * tile, i1, eps2);
+        }
+
+        for (round = 0; round < nTeam - 1; ++round)
+        {
+          #ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 1)
+          #endif
+            for (k = 0; k < nTeam / 2; ++k)
+            {
+                int a = (k == 0) ? nTeam - 1 : (round + k) % (nTeam - 1);
+                int b = (k == 0) ? round : (round - k + nTeam - 1) % (nTeam - 1);
+
+                if (a < nTile && b < nTile)
+                {
+                    nbExactTilePair(e,
+                                    a * tile, nbExactTileEnd(a, tile, nbody),
+                                    b * tile, nbExactTileEnd(b, tile, nbody),
+                                    eps2);
+                }
+            }
+        }
+    }
+}
+
+/* Direct summation onto only the listed sinks, used when the block
+ * timesteps leave most bodies inactive and pair symmetry would mostly
+ * find forces nobody needs. */
+static void nbExactSinkForces(NBodyExactArrays* e, int nbody, const int* sinks, int nSink, real eps2)
+{
+    int s, j;
+    const real* RESTRICT x = e->x;
+    const real* RESTRICT y = e->y;
+    const real* RESTRICT z = e->z;
+    const real* RESTRICT m = e->m;
+    real* RESTRICT phi = e->phi;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(s, j) schedule(dynamic, 16)
+  #endif
+    for (s = 0; s < nSink; ++s)
+    {
+        const int i = sinks[s];
+        const real xi = x[i];
+        const real yi = y[i];
+        const real zi = z[i];
+        real axi = 0.0, ayi = 0.0, azi = 0.0, phii = 0.0;
+
+      #ifdef _OPENMP
+        #pragma omp simd reduction(+:axi, ayi, azi, phii)
+      #endif
+        for (j = 0; j < nbody; ++j)
+        {
+            real dx = x[j] - xi;
+            real dy = y[j] - yi;
+            real dz = z[j] - zi;
+            real drSq = (dx * dx + dy * dy + dz * dz) + eps2;
+            real drab = mw_sqrt(drSq);
+            real mjr3 = m[j] / (drSq * drab);
+
+            axi += mjr3 * dx;
+            ayi += mjr3 * dy;
+            azi += mjr3 * dz;
+            phii -= mjr3 * drSq;
+        }
+
+        e->ax[i] = axi;
+        e->ay[i] = ayi;
+        e->az[i] = azi;
+        if (phi)
+        {
+            /* less the softened self term */
+            phi[i] = phii + m[i] / mw_sqrt(eps2);
+        }
+    }
+}
+
+static void nbMapForceBody_Exact(const NBodyCtx* ctx, NBodyState* st, const NBodyKick* kick)
+{
+    int i, nSink = 0;
+    const int nbody = st->nbody;  /* Prevent reload on each loop */
+    const NBodyExternal now = nbExternalNow(ctx, st);
+    const int nBlock = (nbody + NBODY_EXT_BLOCK - 1) / NBODY_EXT_BLOCK;
+    const int* rungs = st->rungs;
+    const int activeRung = (int) st->activeRung;
+    int* sinks = NULL;
+    NBodyExactArrays e;
+
+    mwvector* accels = mw_assume_aligned(st->acctab, 16);
+
+    nbAllocExactArrays(&e, st, st->energy != NULL);
+
+    if (rungs && activeRung > 0)
+    {
+        sinks = (int*) mwMalloc(nbody * sizeof(int));
+        for (i = 0; i < nbody; ++i)
+        {
+            if (rungs[i] >= activeRung)
+                sinks[nSink++] = i;
+        }
+    }
+
+    /* Pair symmetry halves the work only when most bodies need a force */
+    if (sinks && 2 * nSink < nbody)
+        nbExactSinkForces(&e, nbody, sinks, nSink, ctx->eps2);
+    else
+        nbExactPairForces(&e, nbody, ctx->eps2);
+
+    if (st->counters)
+    {
+        unsigned int found = sinks ? (unsigned int) nSink : (unsigned int) nbody;
+        nbCountWalks(st, 0, found, 0, 0, (uint64_t) found * (nbody - 1));
+    }
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(accels) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nBlock; ++i)
+    {
+        int j;
+        int id[NBODY_EXT_BLOCK];
+        mwvector ext[NBODY_EXT_BLOCK];
+        int n = nbBlockBodies(st, i, id);   /* those at the end of their block step */
+
+        nbExternalAccelBlock(ctx, st, id, n, ext, &now);
+        for (j = 0; j < n; ++j)
+        {
+            mwvector a;
+            const int k = id[j];
+
+            SET_VECTOR(a, e.ax[k], e.ay[k], e.az[k]);
+            mw_incaddv(a, ext[j]);
+            accels[k] = a;
+
+            if (e.phi)
+            {
+                st->energy->phi[k] = e.phi[k];
+            }
+
+            nbKickBody(st, k, a, ext[j], kick);
+        }
+    }
+
+    free(sinks);
+    mwFreeA(e.x);
+}
+
+/* Acceleration towards the centre of the restricted dwarf of a body at
+ * offset dr from it, from the mass of both components inside its radius */
+static inline mwvector nbRestrictedDwarfAccel(const NBodyCtx* ctx, mwvector dr, real massFraction)
+{
+    real r = mw_absv(dr);
+    real mEnc;
+
+    if (r <= 0.0)
+    {
+        mwvector zero = ZERO_VECTOR;
+        return zero;
+    }
+
+    mEnc = get_enclosed_mass(&ctx->restrictedLight, r) + get_enclosed_mass(&ctx->restrictedDark, r);
+    return mw_mulvs(dr, -massFraction * mEnc / cube(r));
+}
+
+/* Restricted mode: each body moves in the external potential and the
+ * fixed analytic potential of the dwarf around st->dwarfPos, and bodies
+ * do not attract each other, so there is no tree to build. With
+ * restrictedMassLoss the dwarf's potential is scaled by the fraction of
+ * the mass still bound to it, which never grows back. The acceleration
+ * of the dwarf's centre is left in st->dwarfAcc for the integrator.
+ */
+static void nbMapForceBodyRestricted(const NBodyCtx* ctx, NBodyState* st, const NBodyKick* kick)
+{
+    int i;
+    const int nbody = st->nbody;
+    const mwvector dwarfPos = st->dwarfPos;
+    const mwvector dwarfVel = st->dwarfVel;
+    const real massFraction = st->dwarfMassFraction;
+    const mwbool massLoss = ctx->restrictedMassLoss;
+    const NBodyExternal now = nbExternalNow(ctx, st);
+    const int nBlock = (nbody + NBODY_EXT_BLOCK - 1) / NBODY_EXT_BLOCK;
+    real boundMass = 0.0, totalMass = 0.0;
+    real* bound = NULL;     /* mass of each body bound to the dwarf, to sum in order */
+
+    Body* bodies = mw_assume_aligned(st->bodytab, 16);
+    mwvector* accels = mw_assume_aligned(st->acctab, 16);
+
+    if (massLoss && ctx->deterministic)
+    {
+        bound = (real*) mwMalloc(nbody * sizeof(real));
+    }
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(bodies, accels) schedule(dynamic, 1) reduction(+: boundMass, totalMass)
+  #endif
+    for (i = 0; i < nBlock; ++i)
+    {
+        int j;
+        int id[NBODY_EXT_BLOCK];
+        mwvector ext[NBODY_EXT_BLOCK];
+        int n = nbBlockBodies(st, i, id);
+
+        nbExternalAccelBlock(ctx, st, id, n, ext, &now);
+        for (j = 0; j < n; ++j)
+        {
+            mwvector a;
+            const int k = id[j];
+            mwvector dr = mw_subv(Pos(&bodies[k]), dwarfPos);
+
+            if (massLoss)
+            {
+                real r = mw_fmax(mw_absv(dr), REAL_EPSILON);
+                real psi = massFraction * (get_potential(&ctx->restrictedLight, r) + get_potential(&ctx->restrictedDark, r));
+                real m = (0.5 * mw_sqrv(mw_subv(Vel(&bodies[k]), dwarfVel)) < psi) ? Mass(&bodies[k]) : 0.0;
+
+                if (bound)
+                {
+                    bound[k] = m;
+                }
+                else
+                {
+                    totalMass += Mass(&bodies[k]);
+                    boundMass += m;
+                }
+            }
+
+            a = nbRestrictedDwarfAccel(ctx, dr, massFraction);
+            mw_incaddv(a, ext[j]);
+            accels[k] = a;
+            nbKickBody(st, k, a, ext[j], kick);
+        }
+    }
+
+    if (bound)
+    {
+        for (i = 0; i < nbody; ++i)
+        {
+            totalMass += Mass(&bodies[i]);
+            boundMass += bound[i];
+        }
+        free(bound);
+    }
+
+    if (massLoss && totalMass > 0.0)
+    {
+        st->dwarfMassFraction = mw_fmin(massFraction, boundMass / totalMass);
+    }
+
+    st->dwarfAcc = nbExternalAccel(ctx, st, dwarfPos, &now);
+}
+
+static inline NBodyStatus nbIncestStatusCheck(const NBodyCtx* ctx, const NBodyState* st)
+{
+    if (st->treeIncest)
+    {
+        return ctx->allowIncest ? NBODY_TREE_INCEST_NONFATAL : NBODY_TREE_INCEST_FATAL;
+    }
+
+    return NBODY_SUCCESS;
+}
+
+/* Build the tree, with the cells and bodies other processes' domains
+ * contribute to this one when running over several */
+static inline NBodyStatus nbBuildTree(const NBodyCtx* ctx, NBodyState* st)
+{
+  #if NBODY_MPI
+    if (st->mpi)
+    {
+        return nbMPIMakeTree(ctx, st);
+    }
+  #endif
+
+    return nbMakeTree(ctx, st);
+}
+
+static NBodyStatus nbGravMapAndKick(const NBodyCtx* ctx, NBodyState* st, const NBodyKick* kick)
+{
+    NBodyStatus rc;
+    mwbool usedTree = FALSE;
+    double treeTime = 0.0;
+    const double startTime = st->counters ? nbCounterClock() : 0.0;
+
+    if (ctx->restricted)
+    {
+        nbEnergyForces(ctx, st, FALSE);
+        nbMapForceBodyRestricted(ctx, st, kick);
+    }
+    else if (ctx->criterion == PM)
+    {
+        nbEnergyForces(ctx, st, FALSE);
+
+        if (ctx->pmSplit > 0.0)      /* the tree is only walked for the short range force */
+        {
+            rc = nbMakeTree(ctx, st);
+            if (nbStatusIsFatal(rc))
+                return rc;
+
+            usedTree = TRUE;
+            treeTime = st->counters ? nbCounterClock() - startTime : 0.0;
+        }
+
+        nbMapForceBodyPM(ctx, st, kick);
+    }
+    else if (mw_likely(ctx->criterion != Exact))
+    {
+        rc = nbBuildTree(ctx, st);
+        if (nbStatusIsFatal(rc))
+            return rc;
+
+        usedTree = TRUE;
+        treeTime = st->counters ? nbCounterClock() - startTime : 0.0;
+
+        /* Only the walk of each body on its own finds its potential */
+        nbEnergyForces(ctx, st, ctx->criterion != FMM && ctx->walkGroupSize == 0);
+
+        if (ctx->criterion == FMM)
+            nbMapForceBodyFMM(ctx, st, kick);
+        else if (ctx->walkGroupSize > 0)
+            nbMapForceBodyGrouped(ctx, st, kick);
+        else
+            nbMapForceBody(ctx, st, kick);
+    }
+    else
+    {
+        nbEnergyForces(ctx, st, TRUE);
+        nbMapForceBody_Exact(ctx, st, kick);
+    }
+
+    if (st->potentialEvalError)
+    {
+        rc = NBODY_LUA_POTENTIAL_ERROR;
+    }
+    else
+    {
+        rc = nbIncestStatusCheck(ctx, st); /* Check if incest occured during step */
+    }
+
+    if (st->counters)
+    {
+        nbCountForce(st, nbCounterClock() - startTime, treeTime, usedTree);
+    }
+
+  #if NBODY_MPI
+    if (st->mpi)
+    {
+        rc = nbMPIReduceStatus(rc);     /* so every process stops together */
+    }
+  #endif
+
+    return rc;
+}
+
+NBodyStatus nbGravMap(const NBodyCtx* ctx, NBodyState* st)
+{
+    return nbGravMapAndKick(ctx, st, NULL);
+}
+
+/* Find the forces like nbGravMap(), and advance the velocity of each
+ * body found by dtHalf with its new acceleration plus shift while it
+ * is still in cache. Bodies skipped for their block timestep are not
+ * kicked. */
+NBodyStatus nbGravMapKick(const NBodyCtx* ctx, NBodyState* st, real dtHalf, mwvector shift)
+{
+    NBodyKick kick;
+
+    kick.dtHalf = dtHalf;
+    kick.shift = shift;
+    kick.rungs = NULL;
+
+    return nbGravMapAndKick(ctx, st, &kick);
+}
+
+/* nbGravMapKick() for block timesteps, kicking each body found by
+ * dtHalf / 2^rung, half its own timestep */
+NBodyStatus nbGravMapKickRungs(const NBodyCtx* ctx, NBodyState* st, real dtHalf, mwvector shift)
+{
+    NBodyKick kick;
+
+    kick.dtHalf = dtHalf;
+    kick.shift = shift;
+    kick.rungs = st->rungs;
+
+    return nbGravMapAndKick(ctx, st, &kick);
+}
+
+/* Self gravity alone on the bodies listed in samples, into acc. Tree
+ * criteria build the tree and walk it once for each sample, which is
+ * never more accurate than a grouped walk; Exact sums over all the
+ * bodies. */
+NBodyStatus nbGravitySamples(const NBodyCtx* ctx, NBodyState* st, const int* samples, int nSample, mwvector* acc)
+{
+    int s;
+    NBodyStatus rc;
+
+    if (ctx->criterion == Exact)
+    {
+        NBodyExactArrays e;
+
+        nbAllocExactArrays(&e, st, FALSE);
+        nbExactSinkForces(&e, st->nbody, samples, nSample, ctx->eps2);
+        for (s = 0; s < nSample; ++s)
+        {
+            SET_VECTOR(acc[s], e.ax[samples[s]], e.ay[samples[s]], e.az[samples[s]]);
+        }
+        mwFreeA(e.x);
+
+        return NBODY_SUCCESS;
+    }
+
+    rc = nbMakeTree(ctx, st);
+    if (nbStatusIsFatal(rc))
+        return rc;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(s) schedule(dynamic, 8)
+  #endif
+    for (s = 0; s < nSample; ++s)
+    {
+        acc[s] = nbGravity(ctx, st, &st->bodytab[samples[s]], NULL);
+    }
+
+    return nbIncestStatusCheck(ctx, st);
+}
@@ -280,6 +280,7 @@ static int luaReverseOrbit_LMC(lua_State* luaSt)
     static real LMCmass = 0.0;
     static real LMCscale = 0.0;
     static real coulomb_log = 0.0;
+    static real dispersionTableTolerance = 0.0;
     static mwbool LMCDynaFric = FALSE;
     static Potential* pot = NULL;
     static const mwvector* pos = NULL;
@@ -301,9 +302,12 @@ static int luaReverseOrbit_LMC(lua_State* luaSt)
             { "tstop",       LUA_TNUMBER,   NULL,           TRUE, &tstop       },
             { "ftime",       LUA_TNUMBER,   NULL,           TRUE, &ftime       },
             { "dt",          LUA_TNUMBER,   NULL,           TRUE, &dt          },
+            { "dispersionTableTolerance", LUA_TNUMBER, NULL, FALSE, &dispersionTableTolerance },
             END_MW_NAMED_ARG
         };
 
+    dispersionTableTolerance = 0.0;
+
     switch (lua_gettop(luaSt))
     {
         case 1:
@@ -333,7 +337,7 @@ static int luaReverseOrbit_LMC(lua_State* luaSt)
     if (checkPotentialConstants(pot))
         luaL_error(luaSt, "Error with potential");
 
-    nbReverseOrbit_LMC(&finalPos, &finalVel, &LMCfinalPos, &LMCfinalVel, pot, *pos, *vel, *LMCpos, *LMCvel, LMCDynaFric, ftime, tstop, dt, LMCmass, LMCscale, coulomb_log);
+    nbReverseOrbit_LMC(&finalPos, &finalVel, &LMCfinalPos, &LMCfinalVel, pot, *pos, *vel, *LMCpos, *LMCvel, LMCDynaFric, ftime, tstop, dt, LMCmass, LMCscale, coulomb_log, dispersionTableTolerance);
     pushVector(luaSt, finalPos);
     pushVector(luaSt, finalVel);
     pushVector(luaSt, LMCfinalPos);
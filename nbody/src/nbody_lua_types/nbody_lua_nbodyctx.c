@@ -33,6 +33,7 @@
 #include "nbody_lua_util.h"
 #include "nbody_potential.h"
 #include "nbody_density.h"
+#include "nbody_mixeddwarf.h"
 
 static const real pi = 3.1415926535;
 
@@ -42,6 +43,15 @@ static const MWEnumAssociation criterionOptions[] =
     { "Exact",        Exact        },
     { "BH86",         BH86         },
     { "SW93",         SW93         },
+    { "FMM",          FMM          },
+    { "PM",           PM           },
+    END_MW_ENUM_ASSOCIATION
+};
+
+static const MWEnumAssociation integratorOptions[] =
+{
+    { "Leapfrog",     Leapfrog     },
+    { "Yoshida4",     Yoshida4     },
     END_MW_ENUM_ASSOCIATION
 };
 
@@ -56,6 +66,17 @@ static int setCriterionT(lua_State* luaSt, void* v)
     return 0;
 }
 
+static int getIntegratorT(lua_State* luaSt, void* v)
+{
+    return pushEnum(luaSt, integratorOptions, *(integrator_t*) v);
+}
+
+static int setIntegratorT(lua_State* luaSt, void* v)
+{
+    *(integrator_t*) v = checkEnum(luaSt, integratorOptions, 3);
+    return 0;
+}
+
 NBodyCtx* checkNBodyCtx(lua_State* luaSt, int idx)
 {
     return (NBodyCtx*) mw_checknamedudata(luaSt, idx, NBODYCTX_TYPE);
@@ -85,6 +106,9 @@ static int createNBodyCtx(lua_State* luaSt)
 {
     static NBodyCtx ctx;
     static const char* criterionName = NULL;
+    static const char* integratorName = NULL;
+    static const Dwarf* restrictedLight = NULL;
+    static const Dwarf* restrictedDark = NULL;
     real nStepf = 0.0;
 
     static const MWNamedArg argTable[] =
@@ -107,10 +131,25 @@ static int createNBodyCtx(lua_State* luaSt)
             { "vz",            LUA_TNUMBER,  NULL, FALSE,  &ctx.vz  },
             
             { "criterion",     LUA_TSTRING,  NULL, FALSE, &criterionName             },
+            { "integrator",    LUA_TSTRING,  NULL, FALSE, &integratorName            },
             { "SimpleOutput",  LUA_TBOOLEAN, NULL, FALSE, &ctx.SimpleOutput          },
             { "useQuad",       LUA_TBOOLEAN, NULL, FALSE, &ctx.useQuad               },
             { "allowIncest",   LUA_TBOOLEAN, NULL, FALSE, &ctx.allowIncest           },
             { "quietErrors",   LUA_TBOOLEAN, NULL, FALSE, &ctx.quietErrors           },
+            { "parallelTree",  LUA_TBOOLEAN, NULL, FALSE, &ctx.parallelTree          },
+            { "costBalance",   LUA_TBOOLEAN, NULL, FALSE, &ctx.costBalance           },
+            { "walkGroupSize", LUA_TNUMBER,  "UINT", FALSE, &ctx.walkGroupSize       },
+            { "multipoleOrder", LUA_TNUMBER, "UINT", FALSE, &ctx.multipoleOrder      },
+            { "treeRefitSteps", LUA_TNUMBER, "UINT", FALSE, &ctx.treeRefitSteps      },
+            { "maxRung",       LUA_TNUMBER,  "UINT", FALSE, &ctx.maxRung             },
+            { "rungEta",       LUA_TNUMBER,  NULL, FALSE, &ctx.rungEta               },
+            { "pmGridSize",    LUA_TNUMBER,  "UINT", FALSE, &ctx.pmGridSize          },
+            { "pmBoxSize",     LUA_TNUMBER,  NULL, FALSE, &ctx.pmBoxSize             },
+            { "pmSplit",       LUA_TNUMBER,  NULL, FALSE, &ctx.pmSplit               },
+            { "forceTolerance", LUA_TNUMBER, NULL, FALSE, &ctx.forceTolerance        },
+            { "deterministic", LUA_TBOOLEAN, NULL, FALSE, &ctx.deterministic         },
+            { "potentialTableTolerance", LUA_TNUMBER, NULL, FALSE, &ctx.potentialTableTolerance },
+            { "dispersionTableTolerance", LUA_TNUMBER, NULL, FALSE, &ctx.dispersionTableTolerance },
             { "useBestLike",   LUA_TBOOLEAN, NULL, FALSE, &ctx.useBestLike           },
             { "BestLikeStart", LUA_TNUMBER,  NULL, FALSE, &ctx.BestLikeStart         },
             { "useVelDisp",    LUA_TBOOLEAN, NULL, FALSE, &ctx.useVelDisp            },
@@ -138,11 +177,18 @@ static int createNBodyCtx(lua_State* luaSt)
             { "LMCscale",      LUA_TNUMBER,  NULL, FALSE, &ctx.LMCscale              },
             { "LMCDynaFric",   LUA_TBOOLEAN, NULL, FALSE, &ctx.LMCDynaFric           },
             { "coulomb_log",   LUA_TNUMBER,  NULL, FALSE, &ctx.coulomb_log           },
+            { "restricted",    LUA_TBOOLEAN, NULL, FALSE, &ctx.restricted            },
+            { "restrictedMassLoss", LUA_TBOOLEAN, NULL, FALSE, &ctx.restrictedMassLoss },
+            { "restrictedLight", LUA_TUSERDATA, DWARF_TYPE, FALSE, &restrictedLight  },
+            { "restrictedDark",  LUA_TUSERDATA, DWARF_TYPE, FALSE, &restrictedDark   },
             { "calibrationRuns", LUA_TNUMBER, "UINT", FALSE, &ctx.calibrationRuns    },
             END_MW_NAMED_ARG
         };
 
     criterionName = NULL;
+    integratorName = NULL;
+    restrictedLight = NULL;
+    restrictedDark = NULL;
     ctx = defaultNBodyCtx;
 
     if (lua_gettop(luaSt) != 1)
@@ -157,6 +203,24 @@ static int createNBodyCtx(lua_State* luaSt)
         ctx.criterion = readCriterion(luaSt, criterionName);
     }
 
+    if (integratorName)
+    {
+        ctx.integrator = (integrator_t) readEnum(luaSt, integratorOptions, integratorName);
+    }
+
+    /* Derived parameters are filled in the same way as for generating the dwarf */
+    if (restrictedLight)
+    {
+        ctx.restrictedLight = *restrictedLight;
+        nbSetDwarfVars(&ctx.restrictedLight);
+    }
+
+    if (restrictedDark)
+    {
+        ctx.restrictedDark = *restrictedDark;
+        nbSetDwarfVars(&ctx.restrictedDark);
+    }
+
     if ((ctx.criterion != Exact) && (ctx.theta < 0.0))
     {
         return luaL_argerror(luaSt, 1, "Theta argument required for criterion != 'Exact'");
@@ -166,6 +230,12 @@ static int createNBodyCtx(lua_State* luaSt)
         /* These don't mean anything here */
         ctx.theta = 0.0;
         ctx.useQuad = FALSE;
+        ctx.multipoleOrder = 0;
+    }
+    else if (ctx.multipoleOrder != 0)
+    {
+        /* Every order above the monopole includes the quadrupole */
+        ctx.useQuad = (ctx.multipoleOrder >= 2);
     }
 
     nStepf = mw_ceil(ctx.timeEvolve / ctx.timestep);
@@ -271,10 +341,25 @@ static const Xet_reg_pre gettersNBodyCtx[] =
     { "sunVely",       getNumber,     offsetof(NBodyCtx, sunVely)     },
     { "sunVelz",       getNumber,     offsetof(NBodyCtx, sunVelz)     },
     { "criterion",       getCriterionT, offsetof(NBodyCtx, criterion)     },
+    { "integrator",      getIntegratorT, offsetof(NBodyCtx, integrator)   },
     { "SimpleOutput",    getBool,       offsetof(NBodyCtx, SimpleOutput)  },
     { "useQuad",         getBool,       offsetof(NBodyCtx, useQuad)       },
     { "allowIncest",     getBool,       offsetof(NBodyCtx, allowIncest)   },
     { "quietErrors",     getBool,       offsetof(NBodyCtx, quietErrors)   },
+    { "parallelTree",    getBool,       offsetof(NBodyCtx, parallelTree)  },
+    { "costBalance",     getBool,       offsetof(NBodyCtx, costBalance)   },
+    { "walkGroupSize",   getUInt,       offsetof(NBodyCtx, walkGroupSize) },
+    { "multipoleOrder",  getUInt,       offsetof(NBodyCtx, multipoleOrder) },
+    { "treeRefitSteps",  getUInt,       offsetof(NBodyCtx, treeRefitSteps) },
+    { "maxRung",         getUInt,       offsetof(NBodyCtx, maxRung)       },
+    { "rungEta",         getNumber,     offsetof(NBodyCtx, rungEta)       },
+    { "pmGridSize",      getUInt,       offsetof(NBodyCtx, pmGridSize)    },
+    { "pmBoxSize",       getNumber,     offsetof(NBodyCtx, pmBoxSize)     },
+    { "pmSplit",         getNumber,     offsetof(NBodyCtx, pmSplit)       },
+    { "forceTolerance",  getNumber,     offsetof(NBodyCtx, forceTolerance) },
+    { "deterministic",   getBool,       offsetof(NBodyCtx, deterministic) },
+    { "potentialTableTolerance", getNumber, offsetof(NBodyCtx, potentialTableTolerance) },
+    { "dispersionTableTolerance", getNumber, offsetof(NBodyCtx, dispersionTableTolerance) },
     { "useBestLike",     getBool,       offsetof(NBodyCtx, useBestLike)   },
     { "useVelDisp",      getBool,       offsetof(NBodyCtx, useVelDisp)    },
     { "useBetaDisp",     getBool,       offsetof(NBodyCtx, useBetaDisp)   },
@@ -302,6 +387,8 @@ static const Xet_reg_pre gettersNBodyCtx[] =
     { "LMCscale",        getNumber,     offsetof(NBodyCtx, LMCscale)      },
     { "LMCDynaFric",     getBool,       offsetof(NBodyCtx, LMCDynaFric)   },
     { "coulomb_log",     getNumber,     offsetof(NBodyCtx, coulomb_log)   },
+    { "restricted",      getBool,       offsetof(NBodyCtx, restricted)    },
+    { "restrictedMassLoss", getBool,    offsetof(NBodyCtx, restrictedMassLoss) },
     { "calibrationRuns", getNumber,     offsetof(NBodyCtx, calibrationRuns)},
     { NULL, NULL, 0 }
 };
@@ -319,10 +406,25 @@ static const Xet_reg_pre settersNBodyCtx[] =
     { "sunVely",       setNumber,     offsetof(NBodyCtx, sunVely)     },
     { "sunVelz",       setNumber,     offsetof(NBodyCtx, sunVelz)     },
     { "criterion",       setCriterionT, offsetof(NBodyCtx, criterion)     },
+    { "integrator",      setIntegratorT, offsetof(NBodyCtx, integrator)   },
     { "SimpleOutput",    setBool,       offsetof(NBodyCtx, SimpleOutput)  },
     { "useQuad",         setBool,       offsetof(NBodyCtx, useQuad)       },
     { "allowIncest",     setBool,       offsetof(NBodyCtx, allowIncest)   },
     { "quietErrors",     setBool,       offsetof(NBodyCtx, quietErrors)   },
+    { "parallelTree",    setBool,       offsetof(NBodyCtx, parallelTree)  },
+    { "costBalance",     setBool,       offsetof(NBodyCtx, costBalance)   },
+    { "walkGroupSize",   setUInt,       offsetof(NBodyCtx, walkGroupSize) },
+    { "multipoleOrder",  setUInt,       offsetof(NBodyCtx, multipoleOrder) },
+    { "treeRefitSteps",  setUInt,       offsetof(NBodyCtx, treeRefitSteps) },
+    { "maxRung",         setUInt,       offsetof(NBodyCtx, maxRung)       },
+    { "rungEta",         setNumber,     offsetof(NBodyCtx, rungEta)       },
+    { "pmGridSize",      setUInt,       offsetof(NBodyCtx, pmGridSize)    },
+    { "pmBoxSize",       setNumber,     offsetof(NBodyCtx, pmBoxSize)     },
+    { "pmSplit",         setNumber,     offsetof(NBodyCtx, pmSplit)       },
+    { "forceTolerance",  setNumber,     offsetof(NBodyCtx, forceTolerance) },
+    { "deterministic",   setBool,       offsetof(NBodyCtx, deterministic) },
+    { "potentialTableTolerance", setNumber, offsetof(NBodyCtx, potentialTableTolerance) },
+    { "dispersionTableTolerance", setNumber, offsetof(NBodyCtx, dispersionTableTolerance) },
     { "useBestLike",     setBool,       offsetof(NBodyCtx, useBestLike)   },
     { "useVelDisp",      setBool,       offsetof(NBodyCtx, useVelDisp)    },
     { "useBetaDisp",     setBool,       offsetof(NBodyCtx, useBetaDisp)   },
@@ -350,6 +452,8 @@ static const Xet_reg_pre settersNBodyCtx[] =
     { "LMCscale",        setNumber,     offsetof(NBodyCtx, LMCscale)      },
     { "LMCDynaFric",     setBool,       offsetof(NBodyCtx, LMCDynaFric)   },
     { "coulomb_log",     setNumber,     offsetof(NBodyCtx, coulomb_log)   },
+    { "restricted",      setBool,       offsetof(NBodyCtx, restricted)    },
+    { "restrictedMassLoss", setBool,    offsetof(NBodyCtx, restrictedMassLoss) },
     { "calibrationRuns", setNumber,     offsetof(NBodyCtx, calibrationRuns)},
     { NULL, NULL, 0 }
 };
@@ -193,6 +193,24 @@ static int sortBodiesNBodyState(lua_State* luaSt)
     return 0;
 }
 
+/* Whether every body has a finite position and velocity */
+static int isFiniteNBodyState(lua_State* luaSt)
+{
+    const NBodyState* st;
+    const Body* b;
+    int finite = TRUE;
+
+    st = checkNBodyState(luaSt, 1);
+    for (b = st->bodytab; b < st->bodytab + st->nbody && finite; ++b)
+    {
+        finite = isfinite(X(Pos(b))) && isfinite(Y(Pos(b))) && isfinite(Z(Pos(b)))
+              && isfinite(X(Vel(b))) && isfinite(Y(Vel(b))) && isfinite(Z(Vel(b)));
+    }
+
+    lua_pushboolean(luaSt, finite);
+    return 1;
+}
+
 static int luaWriteCheckpoint(lua_State* luaSt)
 {
     NBodyState* st;
@@ -359,6 +377,7 @@ static const luaL_reg methodsNBodyState[] =
     { "step",            stepNBodyState            },
     { "runSystem",       luaRunSystem              },
     { "sortBodies",      sortBodiesNBodyState      },
+    { "isFinite",        isFiniteNBodyState        },
     { "clone",           luaCloneNBodyState        },
     { "writeCheckpoint", luaWriteCheckpoint        },
     { "readCheckpoint",  luaReadCheckpoint         },
@@ -693,7 +693,9 @@ static int cm_correction_by_comp(real * x, real * y, real * z, real * vx, real *
     return 1;
 }
 
-static inline void set_vars(Dwarf* comp)
+/* Fill in r200, p0 and for cored profiles ps from the mass and scale
+ * radius of comp */
+void nbSetDwarfVars(Dwarf* comp)
 {
     /*this is only used for the nfw and sidm but it is technically valid for all the profiles. easier to have it here*/
     /* this is the pcrit * delta_crit from the nfw 1997 paper or just p0 from binney */
@@ -788,8 +790,8 @@ int nbGenerateMixedDwarfCore(lua_State* luaSt, dsfmt_t* prng, unsigned int nbody
         mwvector vec;
         real rscale_l = comp1->scaleLength; //comp1[1]; /*scale radius of the light component*/
         real rscale_d = comp2->scaleLength; //comp2[1]; /*scale radius of the dark component*/
-        set_vars(comp1);
-        set_vars(comp2);
+        nbSetDwarfVars(comp1);
+        nbSetDwarfVars(comp2);
         real bound1 ;
         real bound2 ;
         
@@ -0,0 +1,781 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Running one simulation over several processes with MPI.
+ *
+ * Each process owns the bodies in one domain of space. Before every
+ * force calculation the bodies are sorted along a Morton curve through
+ * the box around all of them, and the curve is cut into one run per
+ * process with equal shares of the nodes the bodies visited in their
+ * last tree walk. Bodies that have moved into another run are sent to
+ * its process.
+ *
+ * Each process then builds the tree of its own bodies, and sends every
+ * other process its locally essential part: the cells that pass the
+ * opening test for every point of the other domain's bounding box, as
+ * a single body with their mass at their centre of mass and their quad
+ * moment, and the bodies of the cells that do not. What is received is
+ * loaded into a small tree of its own, whose cells add the moments of
+ * the bodies that stand for cells to their own, and the force on each
+ * body of the domain is the walk of the local tree plus the walk of
+ * that one. Octupole moments are not sent.
+ *
+ * Everything outside the force calculation works on the bodies of the
+ * domain alone, which is all the integrator needs. Every process sets
+ * up the whole model to begin with, and all the bodies are gathered
+ * back to every process at the end of the run for the output.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_mpi.h"
+#include "nbody_tree.h"
+#include "nbody_numa.h"
+#include "milkyway_util.h"
+
+#include <mpi.h>
+#include <stdint.h>
+
+
+/* Samples of the Morton keys taken from each process to cut the curve */
+#define NBODY_MPI_SAMPLES 256
+
+/* Bits of each coordinate in a Morton key */
+#define NBODY_MPI_KEY_BITS 21
+
+/* A body being moved between processes */
+typedef struct
+{
+    Body b;
+    mwvector acc;
+    int index;              /* position in the original body table */
+    unsigned int cost;      /* nodes visited in its last walk */
+} NBodyMPIBody;
+
+/* Morton key of a body, or a sample of them standing for weight bodies */
+typedef struct
+{
+    uint64_t key;
+    double weight;
+    int body;
+} NBodyMPIKey;
+
+/* Cell or body of another domain's tree sent to this one */
+typedef struct
+{
+    mwvector pos;
+    real mass;
+    NBodyQuadMatrix quad;   /* zero for a body */
+} NBodyMPIEssential;
+
+struct NBodyMPI
+{
+    int rank;
+    int size;
+    int nbodyTotal;          /* bodies over all the processes */
+    int capacity;            /* bodies bodytab, acctab, index and bodyCost have room for */
+    int* index;              /* position of each body in the original body table */
+    double* boxes;           /* lower and upper corners of each domain */
+
+    int* sendCounts;
+    int* sendDispls;
+    int* recvCounts;
+    int* recvDispls;
+
+    NBodyMPIBody* sendBodies;
+    NBodyMPIBody* recvBodies;
+    size_t sendBodiesCapacity;
+    size_t recvBodiesCapacity;
+
+    NBodyMPIEssential* sendEssential;
+    NBodyMPIEssential* recvEssential;
+    size_t sendEssentialCapacity;
+    size_t recvEssentialCapacity;
+
+    NBodyState remote;          /* what the other domains sent, as bodies in a tree of their own */
+    NBodyQuadMatrix* remoteQuads;
+    int remoteCapacity;         /* bodies remote.bodytab and remoteQuads have room for */
+
+    MPI_Datatype bodyType;
+    MPI_Datatype keyType;
+    MPI_Datatype essentialType;
+};
+
+
+int nbMPIInit(void)
+{
+    return MPI_Init(NULL, NULL) != MPI_SUCCESS;
+}
+
+void nbMPIFinalize(void)
+{
+    int initialized, finalized;
+
+    MPI_Initialized(&initialized);
+    MPI_Finalized(&finalized);
+    if (initialized && !finalized)
+    {
+        MPI_Finalize();
+    }
+}
+
+static mwbool nbMPIRunning(void)
+{
+    int initialized, finalized;
+
+    MPI_Initialized(&initialized);
+    MPI_Finalized(&finalized);
+
+    return initialized && !finalized;
+}
+
+int nbMPIRank(void)
+{
+    int rank = 0;
+
+    if (nbMPIRunning())
+    {
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    }
+
+    return rank;
+}
+
+int nbMPISize(void)
+{
+    int size = 1;
+
+    if (nbMPIRunning())
+    {
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+    }
+
+    return size;
+}
+
+NBodyStatus nbMPIReduceStatus(NBodyStatus rc)
+{
+    int in = (int) rc;
+    int out;
+
+    MPI_Allreduce(&in, &out, 1, MPI_INT, MPI_BOR, MPI_COMM_WORLD);
+
+    return (NBodyStatus) out;
+}
+
+void nbMPIBroadcast(void* data, size_t size)
+{
+    if (nbMPIRunning())
+    {
+        MPI_Bcast(data, (int) size, MPI_BYTE, 0, MPI_COMM_WORLD);
+    }
+}
+
+void nbMPISum(double* x, int n)
+{
+    if (nbMPIRunning())
+    {
+        MPI_Allreduce(MPI_IN_PLACE, x, n, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    }
+}
+
+void nbDestroyMPI(NBodyMPI* m)
+{
+    if (!m)
+    {
+        return;
+    }
+
+    if (nbMPIRunning())
+    {
+        MPI_Type_free(&m->bodyType);
+        MPI_Type_free(&m->keyType);
+        MPI_Type_free(&m->essentialType);
+    }
+
+    free(m->index);
+    free(m->boxes);
+    free(m->sendCounts);
+    free(m->sendDispls);
+    free(m->recvCounts);
+    free(m->recvDispls);
+    free(m->sendBodies);
+    free(m->recvBodies);
+    free(m->sendEssential);
+    free(m->recvEssential);
+    freeNBodyTree(&m->remote.tree);
+    mwFreeA(m->remote.bodytab);
+    mwFreeA(m->remoteQuads);
+    free(m);
+}
+
+/* Make sure buf has room for n items of size bytes, keeping what it holds */
+static void* nbMPIReserve(void* buf, size_t* capacity, size_t n, size_t size)
+{
+    if (n > *capacity)
+    {
+        *capacity = n + n / 4 + 64;
+        buf = mwRealloc(buf, *capacity * size);
+    }
+
+    return buf;
+}
+
+/* Make sure the body table and everything kept for each body has room
+ * for n bodies, keeping the first st->nbody of them */
+static void nbMPIReserveBodies(NBodyState* st, int n)
+{
+    NBodyMPI* m = st->mpi;
+    Body* bodies;
+    mwvector* accs;
+
+    if (n <= m->capacity)
+    {
+        return;
+    }
+
+    m->capacity = n + n / 4 + 64;
+
+    bodies = (Body*) nbAllocBig(m->capacity * sizeof(Body), st->hugePages);
+    nbFirstTouch(bodies, m->capacity, sizeof(Body));
+    memcpy(bodies, st->bodytab, st->nbody * sizeof(Body));
+    mwFreeA(st->bodytab);
+    st->bodytab = bodies;
+
+    accs = (mwvector*) nbAllocBig(m->capacity * sizeof(mwvector), st->hugePages);
+    nbFirstTouch(accs, m->capacity, sizeof(mwvector));
+    memcpy(accs, st->acctab, st->nbody * sizeof(mwvector));
+    mwFreeA(st->acctab);
+    st->acctab = accs;
+
+    m->index = (int*) mwRealloc(m->index, m->capacity * sizeof(int));
+    if (st->bodyCost)
+    {
+        st->bodyCost = (unsigned int*) mwRealloc(st->bodyCost, m->capacity * sizeof(unsigned int));
+    }
+}
+
+static NBodyStatus nbMPICheckCtx(const NBodyCtx* ctx, const NBodyState* st)
+{
+    const char* problem = NULL;
+
+    if (st->usesCL)
+        problem = "OpenCL";
+    else if (ctx->criterion == Exact || ctx->criterion == FMM || ctx->criterion == PM)
+        problem = "the Exact, FMM or PM criterion";
+    else if (ctx->restricted)
+        problem = "the restricted mode";
+    else if (ctx->maxRung > 0)
+        problem = "block timesteps";
+    else if (ctx->walkGroupSize > 0)
+        problem = "grouped tree walks";
+    else if (ctx->multipoleOrder >= 3)
+        problem = "octupole moments";
+    else if (ctx->treeRefitSteps > 0)
+        problem = "refitting the tree";
+    else if (ctx->useBestLike)
+        problem = "the best likelihood";
+
+    if (problem)
+    {
+        if (nbMPIRank() == 0)
+        {
+            mw_printf("Running over several processes is not supported with %s\n", problem);
+        }
+
+        return NBODY_UNSUPPORTED;
+    }
+
+    return NBODY_SUCCESS;
+}
+
+NBodyStatus nbMPIDistribute(const NBodyCtx* ctx, NBodyState* st)
+{
+    static const NBodyState emptyState = EMPTY_NBODYSTATE;
+    int i, first, last;
+    NBodyMPI* m;
+    NBodyStatus rc;
+
+    if (nbMPISize() == 1)
+    {
+        return NBODY_SUCCESS;
+    }
+
+    rc = nbMPICheckCtx(ctx, st);
+    if (nbStatusIsFatal(rc))
+    {
+        return rc;
+    }
+
+    m = (NBodyMPI*) mwCalloc(1, sizeof(NBodyMPI));
+    m->remote = emptyState;
+    m->remote.tree.rsize = ctx->treeRSize;
+    m->remote.hugePages = st->hugePages;
+    m->rank = nbMPIRank();
+    m->size = nbMPISize();
+    m->nbodyTotal = st->nbody;
+    m->capacity = st->nbody;
+    m->index = (int*) mwMalloc(m->capacity * sizeof(int));
+    m->boxes = (double*) mwMalloc(6 * m->size * sizeof(double));
+    m->sendCounts = (int*) mwMalloc(m->size * sizeof(int));
+    m->sendDispls = (int*) mwMalloc(m->size * sizeof(int));
+    m->recvCounts = (int*) mwMalloc(m->size * sizeof(int));
+    m->recvDispls = (int*) mwMalloc(m->size * sizeof(int));
+
+    MPI_Type_contiguous((int) sizeof(NBodyMPIBody), MPI_BYTE, &m->bodyType);
+    MPI_Type_commit(&m->bodyType);
+    MPI_Type_contiguous((int) sizeof(NBodyMPIKey), MPI_BYTE, &m->keyType);
+    MPI_Type_commit(&m->keyType);
+    MPI_Type_contiguous((int) sizeof(NBodyMPIEssential), MPI_BYTE, &m->essentialType);
+    MPI_Type_commit(&m->essentialType);
+
+    if (ctx->costBalance && !st->bodyCost)
+    {
+        st->bodyCost = (unsigned int*) mwCalloc(m->capacity, sizeof(unsigned int));
+    }
+
+    /* Start from an even share; the first force calculation moves the
+     * bodies to their domains */
+    first = (int) (((long long) st->nbody * m->rank) / m->size);
+    last = (int) (((long long) st->nbody * (m->rank + 1)) / m->size);
+
+    memmove(st->bodytab, &st->bodytab[first], (last - first) * sizeof(Body));
+    memmove(st->acctab, &st->acctab[first], (last - first) * sizeof(mwvector));
+    if (st->bodyCost)
+    {
+        memmove(st->bodyCost, &st->bodyCost[first], (last - first) * sizeof(unsigned int));
+    }
+
+    for (i = first; i < last; ++i)
+    {
+        m->index[i - first] = i;
+    }
+
+    st->nbody = last - first;
+    st->tree.extentKnown = FALSE;
+    st->mpi = m;
+
+    return NBODY_SUCCESS;
+}
+
+NBodyStatus nbMPICollect(NBodyState* st)
+{
+    int i, r, n, total = 0;
+    NBodyMPI* m = st->mpi;
+
+    if (!m)
+    {
+        return NBODY_SUCCESS;
+    }
+
+    n = st->nbody;
+    m->sendBodies = (NBodyMPIBody*) nbMPIReserve(m->sendBodies, &m->sendBodiesCapacity, n, sizeof(NBodyMPIBody));
+    for (i = 0; i < n; ++i)
+    {
+        m->sendBodies[i].b = st->bodytab[i];
+        m->sendBodies[i].acc = st->acctab[i];
+        m->sendBodies[i].index = m->index[i];
+        m->sendBodies[i].cost = st->bodyCost ? st->bodyCost[i] : 0;
+    }
+
+    MPI_Allgather(&n, 1, MPI_INT, m->recvCounts, 1, MPI_INT, MPI_COMM_WORLD);
+    for (r = 0; r < m->size; ++r)
+    {
+        m->recvDispls[r] = total;
+        total += m->recvCounts[r];
+    }
+
+    if (total != m->nbodyTotal)
+    {
+        mw_printf("Collected %d bodies from the processes, expected %d\n", total, m->nbodyTotal);
+        return NBODY_CONSISTENCY_ERROR;
+    }
+
+    m->recvBodies = (NBodyMPIBody*) nbMPIReserve(m->recvBodies, &m->recvBodiesCapacity, total, sizeof(NBodyMPIBody));
+    MPI_Allgatherv(m->sendBodies, n, m->bodyType,
+                   m->recvBodies, m->recvCounts, m->recvDispls, m->bodyType, MPI_COMM_WORLD);
+
+    nbMPIReserveBodies(st, total);
+    for (i = 0; i < total; ++i)
+    {
+        const NBodyMPIBody* p = &m->recvBodies[i];
+
+        st->bodytab[p->index] = p->b;
+        st->acctab[p->index] = p->acc;
+        if (st->bodyCost)
+        {
+            st->bodyCost[p->index] = p->cost;
+        }
+    }
+
+    st->nbody = total;
+    st->tree.extentKnown = FALSE;
+    st->mpi = NULL;
+    nbDestroyMPI(m);
+
+    return NBODY_SUCCESS;
+}
+
+/* Spread the lowest NBODY_MPI_KEY_BITS bits of x out to every third bit */
+static inline uint64_t nbMPISpreadBits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x1f00000000ffffULL;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+    x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+    x = (x | (x << 2)) & 0x1249249249249249ULL;
+
+    return x;
+}
+
+static inline uint64_t nbMPIKeyCoord(real x, real lo, real scale)
+{
+    real k = (x - lo) * scale;
+    real kMax = (real) ((1 << NBODY_MPI_KEY_BITS) - 1);
+
+    return (uint64_t) mw_fmin(mw_fmax(k, 0.0), kMax);
+}
+
+/* Morton key of pos in the cube of side 1 / scale keys from lo */
+static inline uint64_t nbMPIKey(mwvector pos, const double* lo, real scale)
+{
+    return (nbMPISpreadBits(nbMPIKeyCoord(X(pos), lo[0], scale)) << 2)
+         | (nbMPISpreadBits(nbMPIKeyCoord(Y(pos), lo[1], scale)) << 1)
+         | nbMPISpreadBits(nbMPIKeyCoord(Z(pos), lo[2], scale));
+}
+
+static int nbMPICompareKeys(const void* a, const void* b)
+{
+    uint64_t ka = ((const NBodyMPIKey*) a)->key;
+    uint64_t kb = ((const NBodyMPIKey*) b)->key;
+
+    return (ka > kb) - (ka < kb);
+}
+
+/* Lower and upper corners of the box around the bodies of this domain.
+ * An empty domain has the lower corner above the upper. */
+static void nbMPILocalBox(const NBodyState* st, double* lo, double* hi)
+{
+    int i;
+
+    lo[0] = lo[1] = lo[2] = HUGE_VAL;
+    hi[0] = hi[1] = hi[2] = -HUGE_VAL;
+
+    for (i = 0; i < st->nbody; ++i)
+    {
+        const mwvector r = Pos(&st->bodytab[i]);
+
+        lo[0] = mw_fmin(lo[0], X(r));
+        lo[1] = mw_fmin(lo[1], Y(r));
+        lo[2] = mw_fmin(lo[2], Z(r));
+        hi[0] = mw_fmax(hi[0], X(r));
+        hi[1] = mw_fmax(hi[1], Y(r));
+        hi[2] = mw_fmax(hi[2], Z(r));
+    }
+}
+
+/* Cut the Morton curve through all the bodies into one run per process
+ * with equal weight, from samples of the sorted keys of each. Run r
+ * takes the keys from splitters[r - 1] up to splitters[r]. */
+static void nbMPIFindSplitters(NBodyMPI* m, const NBodyMPIKey* keys, int n, double weight, uint64_t* splitters)
+{
+    int s, r, k = 0;
+    const int nSample = NBODY_MPI_SAMPLES * m->size;
+    NBodyMPIKey local[NBODY_MPI_SAMPLES];
+    NBodyMPIKey* all = (NBodyMPIKey*) mwMalloc(nSample * sizeof(NBodyMPIKey));
+    double below = 0.0, total = 0.0;
+
+    /* Each sample stands for an equal share of this domain's weight */
+    for (s = 0; s < NBODY_MPI_SAMPLES; ++s)
+    {
+        double target = (s + 0.5) * weight / NBODY_MPI_SAMPLES;
+
+        while (k < n - 1 && below + keys[k].weight <= target)
+        {
+            below += keys[k].weight;
+            ++k;
+        }
+
+        local[s].key = (n > 0) ? keys[k].key : 0;
+        local[s].weight = weight / NBODY_MPI_SAMPLES;
+        local[s].body = 0;
+    }
+
+    MPI_Allgather(local, NBODY_MPI_SAMPLES, m->keyType, all, NBODY_MPI_SAMPLES, m->keyType, MPI_COMM_WORLD);
+    qsort(all, nSample, sizeof(NBodyMPIKey), nbMPICompareKeys);
+
+    for (s = 0; s < nSample; ++s)
+    {
+        total += all[s].weight;
+    }
+
+    below = 0.0;
+    s = 0;
+    for (r = 1; r < m->size; ++r)
+    {
+        double target = total * r / m->size;
+
+        while (s < nSample && below + 0.5 * all[s].weight < target)
+        {
+            below += all[s].weight;
+            ++s;
+        }
+
+        splitters[r - 1] = (s < nSample) ? all[s].key : UINT64_MAX;
+    }
+    splitters[m->size - 1] = UINT64_MAX;
+
+    free(all);
+}
+
+/* Send each body to the process whose run of the Morton curve it is now in */
+static void nbMPIExchangeBodies(NBodyState* st)
+{
+    int i, r, nRecv;
+    NBodyMPI* m = st->mpi;
+    const int n = st->nbody;
+    double lo[3], hi[3], side;
+    double weight = 0.0;
+    real scale;
+    NBodyMPIKey* keys = (NBodyMPIKey*) mwMalloc((n + 1) * sizeof(NBodyMPIKey));
+    uint64_t* splitters = (uint64_t*) mwMalloc(m->size * sizeof(uint64_t));
+
+    nbMPILocalBox(st, lo, hi);
+    MPI_Allreduce(MPI_IN_PLACE, lo, 3, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, hi, 3, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+    side = mw_fmax(hi[0] - lo[0], mw_fmax(hi[1] - lo[1], hi[2] - lo[2]));
+    scale = (side > 0.0) ? (real) ((1 << NBODY_MPI_KEY_BITS) / side) : 0.0;
+
+    for (i = 0; i < n; ++i)
+    {
+        keys[i].key = nbMPIKey(Pos(&st->bodytab[i]), lo, scale);
+        keys[i].weight = 1.0 + (st->bodyCost ? (double) st->bodyCost[i] : 0.0);
+        keys[i].body = i;
+        weight += keys[i].weight;
+    }
+    qsort(keys, n, sizeof(NBodyMPIKey), nbMPICompareKeys);
+
+    nbMPIFindSplitters(m, keys, n, weight, splitters);
+
+    /* The keys are sorted, so the bodies for each process are a run of them */
+    m->sendBodies = (NBodyMPIBody*) nbMPIReserve(m->sendBodies, &m->sendBodiesCapacity, n, sizeof(NBodyMPIBody));
+    memset(m->sendCounts, 0, m->size * sizeof(int));
+    for (i = 0, r = 0; i < n; ++i)
+    {
+        const int b = keys[i].body;
+        NBodyMPIBody* p = &m->sendBodies[i];
+
+        while (keys[i].key >= splitters[r] && r < m->size - 1)
+            ++r;
+
+        p->b = st->bodytab[b];
+        p->acc = st->acctab[b];
+        p->index = m->index[b];
+        p->cost = st->bodyCost ? st->bodyCost[b] : 0;
+        ++m->sendCounts[r];
+    }
+
+    MPI_Alltoall(m->sendCounts, 1, MPI_INT, m->recvCounts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    nRecv = 0;
+    for (r = 0; r < m->size; ++r)
+    {
+        m->sendDispls[r] = (r == 0) ? 0 : m->sendDispls[r - 1] + m->sendCounts[r - 1];
+        m->recvDispls[r] = nRecv;
+        nRecv += m->recvCounts[r];
+    }
+
+    m->recvBodies = (NBodyMPIBody*) nbMPIReserve(m->recvBodies, &m->recvBodiesCapacity, nRecv, sizeof(NBodyMPIBody));
+    MPI_Alltoallv(m->sendBodies, m->sendCounts, m->sendDispls, m->bodyType,
+                  m->recvBodies, m->recvCounts, m->recvDispls, m->bodyType, MPI_COMM_WORLD);
+
+    st->nbody = 0;
+    nbMPIReserveBodies(st, nRecv);
+    for (i = 0; i < nRecv; ++i)
+    {
+        const NBodyMPIBody* p = &m->recvBodies[i];
+
+        st->bodytab[i] = p->b;
+        st->acctab[i] = p->acc;
+        m->index[i] = p->index;
+        if (st->bodyCost)
+        {
+            st->bodyCost[i] = p->cost;
+        }
+    }
+    st->nbody = nRecv;
+
+    free(keys);
+    free(splitters);
+}
+
+/* Squared distance from pos to the nearest point of the box from lo to hi */
+static inline real nbMPIBoxDistance2(mwvector pos, const double* lo, const double* hi)
+{
+    real dx = mw_fmax(mw_fmax(lo[0] - X(pos), X(pos) - hi[0]), 0.0);
+    real dy = mw_fmax(mw_fmax(lo[1] - Y(pos), Y(pos) - hi[1]), 0.0);
+    real dz = mw_fmax(mw_fmax(lo[2] - Z(pos), Z(pos) - hi[2]), 0.0);
+
+    return dx * dx + dy * dy + dz * dz;
+}
+
+/* Add q to the essential part being sent, with its quad moment if the
+ * tree has them */
+static inline void nbMPIAddEssential(NBodyMPI* m, size_t* n, const NBodyNode* q, mwbool useQuad)
+{
+    m->sendEssential = (NBodyMPIEssential*) nbMPIReserve(m->sendEssential, &m->sendEssentialCapacity,
+                                                         *n + 1, sizeof(NBodyMPIEssential));
+    m->sendEssential[*n].pos = Pos(q);
+    m->sendEssential[*n].mass = Mass(q);
+    if (useQuad && isCell(q))
+    {
+        m->sendEssential[*n].quad = Quad(q);
+    }
+    else
+    {
+        memset(&m->sendEssential[*n].quad, 0, sizeof(NBodyQuadMatrix));
+    }
+    ++*n;
+}
+
+/* Walk the tree of this domain for the box of domain r, the same way
+ * the grouped walk does for a group of bodies */
+static void nbMPIFindEssential(const NBodyCtx* ctx, const NBodyState* st, size_t* n, const double* lo, const double* hi)
+{
+    nodelink_t l;
+    NBodyMPI* m = st->mpi;
+    const NBodyCell* cells = st->tree.cells;
+    const Body* btab = st->bodytab;
+    const NBodyNode* q = (const NBodyNode*) st->tree.root;
+
+    while (q != NULL)
+    {
+        if (isBody(q) || nbMPIBoxDistance2(Pos(q), lo, hi) >= Rcrit2(q))
+        {
+            nbMPIAddEssential(m, n, q, ctx->useQuad);
+            l = Next(q);
+        }
+        else
+        {
+            l = More(q);
+        }
+
+        q = (l == NULL_LINK) ? NULL : LinkNode(cells, btab, l);
+    }
+}
+
+/* Send each other domain the essential part of this domain's tree, and
+ * keep what they send as the bodies of m->remote. Returns their count. */
+static int nbMPIExchangeEssential(const NBodyCtx* ctx, NBodyState* st)
+{
+    int i, r, nRecv = 0;
+    size_t n = 0;
+    NBodyMPI* m = st->mpi;
+    double* box = &m->boxes[6 * m->rank];
+
+    nbMPILocalBox(st, box, box + 3);
+    MPI_Allgather(MPI_IN_PLACE, 6, MPI_DOUBLE, m->boxes, 6, MPI_DOUBLE, MPI_COMM_WORLD);
+
+    for (r = 0; r < m->size; ++r)
+    {
+        const double* lo = &m->boxes[6 * r];
+        const double* hi = lo + 3;
+        size_t start = n;
+
+        if (r != m->rank && lo[0] <= hi[0] && st->tree.root)
+        {
+            nbMPIFindEssential(ctx, st, &n, lo, hi);
+        }
+
+        m->sendDispls[r] = (int) start;
+        m->sendCounts[r] = (int) (n - start);
+    }
+
+    MPI_Alltoall(m->sendCounts, 1, MPI_INT, m->recvCounts, 1, MPI_INT, MPI_COMM_WORLD);
+    for (r = 0; r < m->size; ++r)
+    {
+        m->recvDispls[r] = nRecv;
+        nRecv += m->recvCounts[r];
+    }
+
+    m->recvEssential = (NBodyMPIEssential*) nbMPIReserve(m->recvEssential, &m->recvEssentialCapacity,
+                                                         nRecv, sizeof(NBodyMPIEssential));
+    MPI_Alltoallv(m->sendEssential, m->sendCounts, m->sendDispls, m->essentialType,
+                  m->recvEssential, m->recvCounts, m->recvDispls, m->essentialType, MPI_COMM_WORLD);
+
+    if (nRecv > m->remoteCapacity)
+    {
+        mwFreeA(m->remote.bodytab);
+        mwFreeA(m->remoteQuads);
+        m->remoteCapacity = nRecv + nRecv / 4 + 64;
+        m->remote.bodytab = (Body*) mwMallocA(m->remoteCapacity * sizeof(Body));
+        m->remoteQuads = (NBodyQuadMatrix*) mwMallocA(m->remoteCapacity * sizeof(NBodyQuadMatrix));
+    }
+
+    for (i = 0; i < nRecv; ++i)
+    {
+        Body* b = &m->remote.bodytab[i];
+        const Body empty = EMPTY_BODY;
+
+        *b = empty;
+        Pos(b) = m->recvEssential[i].pos;
+        Mass(b) = m->recvEssential[i].mass;
+        Type(b) = BODY(FALSE);
+        m->remoteQuads[i] = m->recvEssential[i].quad;
+    }
+
+    return nRecv;
+}
+
+NBodyStatus nbMPIMakeTree(const NBodyCtx* ctx, NBodyState* st)
+{
+    NBodyMPI* m = st->mpi;
+    NBodyStatus rc;
+
+    nbMPIExchangeBodies(st);
+
+    st->tree.extentKnown = FALSE;
+    rc = nbMPIReduceStatus(nbMakeTree(ctx, st));
+    if (nbStatusIsFatal(rc))
+    {
+        return rc;
+    }
+
+    /* The local tree is kept as it is, and what the other domains send
+     * goes in a tree of its own, which is much smaller */
+    m->remote.nbody = nbMPIExchangeEssential(ctx, st);
+    m->remote.tree.root = NULL;
+    m->remote.tree.bodyQuads = m->remoteQuads;
+    rc = NBODY_SUCCESS;
+    if (m->remote.nbody > 0)
+    {
+        m->remote.tree.extentKnown = FALSE;
+        rc = nbMakeTree(ctx, &m->remote);
+    }
+
+    return nbMPIReduceStatus(rc);
+}
+
+const NBodyState* nbMPIRemote(const NBodyState* st)
+{
+    const NBodyMPI* m = st->mpi;
+
+    return (m && m->remote.tree.root) ? &m->remote : NULL;
+}
@@ -0,0 +1,181 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Placement of the big arrays and the threads on machines with several
+ * memory nodes.
+ *
+ * An operating system puts a page on the node of the thread that first
+ * writes it. The bodies are made and the arrays zeroed by one thread,
+ * so all of them would otherwise end up on that thread's node, and the
+ * threads on the other nodes would read them remotely every step. With
+ * --pin-threads the bodies and accelerations are copied once before the
+ * run, each by the thread the static schedule of the drift gives it, and
+ * the cell arenas are zeroed by all the threads, which spreads the tree
+ * over the nodes as evenly as its shared use allows.
+ *
+ * The tree walks do not follow that schedule: they split the bodies in
+ * tree order by cost, or hand them out dynamically, and the order changes
+ * as the bodies move. So only the drift finds its bodies local; the
+ * walks, and the kicks done in them, use local and remote bodies alike,
+ * as they use the shared tree.
+ *
+ * This only helps if threads stay where they first touched their pages,
+ * which the scheduler does not promise. The OpenMP runtimes keep their
+ * threads between parallel regions, so pinning each to a processor once
+ * at the start is enough to hold them there, and the bodies are only
+ * placed when the threads are pinned.
+ */
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE 1           /* for the CPU_* macros of sched.h */
+#endif
+
+#include "nbody_priv.h"
+#include "nbody_numa.h"
+#include "nbody_util.h"
+#include "milkyway_util.h"
+
+#if HAVE_SCHED_SETAFFINITY
+  #include <sched.h>
+#endif
+
+#if HAVE_MADVISE
+  #include <sys/mman.h>
+#endif
+
+
+/* Size of a transparent huge page on x86-64 and most others */
+#define NBODY_HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+
+
+int nbPinThreads(void)
+{
+  #if HAVE_SCHED_SETAFFINITY
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int i, nCpu = 0, failed = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+    {
+        mwPerror("Getting processors to pin threads to");
+        return 1;
+    }
+
+    for (i = 0; i < CPU_SETSIZE; ++i)
+    {
+        if (CPU_ISSET(i, &allowed))
+        {
+            cpus[nCpu++] = i;
+        }
+    }
+
+  #ifdef _OPENMP
+    #pragma omp parallel reduction(|: failed)
+  #endif
+    {
+        cpu_set_t one;
+      #ifdef _OPENMP
+        const int thread = omp_get_thread_num();
+        const int nTeam = omp_get_num_threads();
+      #else
+        const int thread = 0;
+        const int nTeam = 1;
+      #endif
+
+        /* Spread out over the allowed processors, so with fewer threads
+         * than processors each memory node still gets its share */
+        CPU_ZERO(&one);
+        CPU_SET(cpus[(int) (((long long) thread * nCpu) / nTeam)], &one);
+        failed = (sched_setaffinity(0, sizeof(one), &one) != 0);
+    }
+
+    if (failed)
+    {
+        mw_printf("Failed to pin threads to processors\n");
+    }
+
+    return failed;
+  #else
+    mw_printf("Pinning threads is not supported on this system\n");
+    return 1;
+  #endif /* HAVE_SCHED_SETAFFINITY */
+}
+
+void* nbAllocBig(size_t size, mwbool hugePages)
+{
+  #if HAVE_MADVISE && HAVE_POSIX_MEMALIGN && defined(MADV_HUGEPAGE)
+    if (hugePages)
+    {
+        void* p;
+        size_t rounded = (size + NBODY_HUGE_PAGE_SIZE - 1) & ~(NBODY_HUGE_PAGE_SIZE - 1);
+
+        if (posix_memalign(&p, NBODY_HUGE_PAGE_SIZE, rounded))
+        {
+            mw_fail("Failed to allocate block of size "ZU" aligned to huge pages\n", rounded);
+        }
+
+        /* Only advice; the kernel may still use small pages */
+        madvise(p, rounded, MADV_HUGEPAGE);
+
+        return p;
+    }
+  #else
+    (void) hugePages;
+  #endif
+
+    return mwMallocA(size);
+}
+
+void nbFirstTouch(void* p, int n, size_t size)
+{
+    int i;
+    char* bytes = (char*) p;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < n; ++i)
+    {
+        memset(&bytes[(size_t) i * size], 0, size);
+    }
+}
+
+void nbPlaceBodies(NBodyState* st)
+{
+    int i;
+    const int nbody = st->nbody;
+    const Body* oldBodies = st->bodytab;
+    const mwvector* oldAccs = st->acctab;
+    Body* bodies = (Body*) nbAllocBig(nbody * sizeof(Body), st->hugePages);
+    mwvector* accs = (mwvector*) nbAllocBig(nbody * sizeof(mwvector), st->hugePages);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        bodies[i] = oldBodies[i];
+        accs[i] = oldAccs[i];
+    }
+
+    mwFreeA(st->bodytab);
+    mwFreeA(st->acctab);
+    st->bodytab = bodies;
+    st->acctab = accs;
+}
@@ -0,0 +1,286 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Files keeping the results of the reverse orbit integrations, so runs
+ * of a parameter sweep that only change the dwarf start from the same
+ * orbit without integrating it again.
+ *
+ * The key of an integration spells out every one of its inputs exactly,
+ * as hexadecimal floating point, along with the version and commit of
+ * the build and the size of its reals, since the results depend on all
+ * of them. The file is named by a hash of the key and starts with the
+ * key itself, so a file is only used if the key matches in full. The
+ * results follow as the build's own vectors, so they come back bit for
+ * bit as they were integrated.
+ *
+ * A file is written to a temporary first and renamed into place, so
+ * runs sharing the directory never read one half written. Nothing
+ * checks whether the integrator changed without a new commit, so clear
+ * the directory when working on it.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_orbit_cache.h"
+#include "milkyway_util.h"
+#include "milkyway_git_version.h"
+
+
+#define NBODY_ORBIT_CACHE_MAGIC "milkyway nbody orbit cache\n"
+#define NBODY_ORBIT_CACHE_KEY_SIZE 4096
+
+static char* orbitCacheDir = NULL;
+
+
+void nbSetOrbitCache(const char* dir)
+{
+    free(orbitCacheDir);
+    orbitCacheDir = dir ? strdup(dir) : NULL;
+}
+
+static int nbAppendKey(char* key, int used, const char* fmt, real x)
+{
+    if (used < 0 || used >= NBODY_ORBIT_CACHE_KEY_SIZE)
+    {
+        return used;
+    }
+
+    return used + snprintf(key + used, NBODY_ORBIT_CACHE_KEY_SIZE - used, fmt, (double) x);
+}
+
+char* nbOrbitCacheKey(const char* kind, const Potential* pot, const real* inputs, unsigned int nInputs)
+{
+    unsigned int i;
+    int used;
+    char* key;
+    const Spherical* s = &pot->sphere[0];
+    const Disk* disks[2] = { &pot->disk, &pot->disk2 };
+    const Halo* h = &pot->halo;
+
+    if (!orbitCacheDir)
+    {
+        return NULL;
+    }
+
+    key = (char*) mwMalloc(NBODY_ORBIT_CACHE_KEY_SIZE);
+    used = snprintf(key, NBODY_ORBIT_CACHE_KEY_SIZE, "%s nbody %s commit %s real %u vector %u\n",
+                    kind, NBODY_VERSION, MILKYWAY_GIT_COMMIT_ID,
+                    (unsigned int) sizeof(real), (unsigned int) sizeof(mwvector));
+
+    used = nbAppendKey(key, used, "sphere %.0f", (real) s->type);
+    used = nbAppendKey(key, used, " %a", s->mass);
+    used = nbAppendKey(key, used, " %a\n", s->scale);
+
+    for (i = 0; i < 2; ++i)
+    {
+        used = nbAppendKey(key, used, "disk %.0f", (real) disks[i]->type);
+        used = nbAppendKey(key, used, " %a", disks[i]->mass);
+        used = nbAppendKey(key, used, " %a", disks[i]->scaleLength);
+        used = nbAppendKey(key, used, " %a", disks[i]->scaleHeight);
+        used = nbAppendKey(key, used, " %a", disks[i]->patternSpeed);
+        used = nbAppendKey(key, used, " %a\n", disks[i]->startAngle);
+    }
+
+    used = nbAppendKey(key, used, "halo %.0f", (real) h->type);
+    used = nbAppendKey(key, used, " %a", h->vhalo);
+    used = nbAppendKey(key, used, " %a", h->scaleLength);
+    used = nbAppendKey(key, used, " %a", h->flattenZ);
+    used = nbAppendKey(key, used, " %a", h->flattenY);
+    used = nbAppendKey(key, used, " %a", h->flattenX);
+    used = nbAppendKey(key, used, " %a", h->triaxAngle);
+    used = nbAppendKey(key, used, " %a", h->c1);
+    used = nbAppendKey(key, used, " %a", h->c2);
+    used = nbAppendKey(key, used, " %a", h->c3);
+    used = nbAppendKey(key, used, " %a", h->mass);
+    used = nbAppendKey(key, used, " %a", h->gamma);
+    used = nbAppendKey(key, used, " %a", h->lambda);
+    used = nbAppendKey(key, used, " %a\n", h->rho0);
+
+    used = nbAppendKey(key, used, "inputs %.0f", (real) nInputs);
+    for (i = 0; i < nInputs; ++i)
+    {
+        used = nbAppendKey(key, used, " %a", inputs[i]);
+    }
+
+    if (used < 0 || used >= NBODY_ORBIT_CACHE_KEY_SIZE - 1)
+    {
+        mw_printf("Orbit cache key for %s is too long\n", kind);
+        free(key);
+        return NULL;
+    }
+
+    key[used] = '\n';
+    key[used + 1] = '\0';
+
+    return key;
+}
+
+/* 64 bit FNV-1a */
+static uint64_t nbHashKey(const char* key)
+{
+    uint64_t h = UINT64_C(14695981039346656037);
+
+    while (*key)
+    {
+        h ^= (unsigned char) *key++;
+        h *= UINT64_C(1099511628211);
+    }
+
+    return h;
+}
+
+char* nbOrbitCacheFile(const char* key)
+{
+    char* path;
+    size_t size;
+
+    if (!orbitCacheDir)
+    {
+        return NULL;
+    }
+
+    size = strlen(orbitCacheDir) + 64;
+    path = (char*) mwMalloc(size);
+    snprintf(path, size, "%s/orbit_%016" PRIx64 ".cache", orbitCacheDir, nbHashKey(key));
+
+    return path;
+}
+
+/* The magic and key the file starts with match */
+static mwbool nbReadCacheKey(FILE* f, const char* key)
+{
+    mwbool match = TRUE;
+    const char* p;
+
+    for (p = NBODY_ORBIT_CACHE_MAGIC; *p && match; ++p)
+    {
+        match = (fgetc(f) == (unsigned char) *p);
+    }
+
+    for (p = key; *p && match; ++p)
+    {
+        match = (fgetc(f) == (unsigned char) *p);
+    }
+
+    return match;
+}
+
+mwbool nbReadOrbitCache(const char* key, mwvector* results, unsigned int nResults,
+                        mwvector** array, size_t* arraySize)
+{
+    FILE* f;
+    char* path;
+    uint32_t counts[2];
+    mwvector* a = NULL;
+    mwbool found;
+
+    if (!key || !(path = nbOrbitCacheFile(key)))
+    {
+        return FALSE;
+    }
+
+    f = mw_fopen(path, "rb");
+    if (!f)
+    {
+        free(path);
+        return FALSE;
+    }
+
+    found = nbReadCacheKey(f, key)
+        && fread(counts, sizeof(counts), 1, f) == 1
+        && counts[0] == nResults
+        && (counts[1] == 0 || array)
+        && fread(results, sizeof(mwvector), nResults, f) == nResults;
+
+    if (found && array)
+    {
+        a = counts[1] ? (mwvector*) mwMallocA(counts[1] * sizeof(mwvector)) : NULL;
+        found = (fread(a, sizeof(mwvector), counts[1], f) == counts[1]);
+    }
+
+    found = found && fgetc(f) == EOF;
+    fclose(f);
+
+    if (!found)
+    {
+        mwFreeA(a);
+        mw_printf("Orbit cache '%s' does not match, integrating again\n", path);
+        free(path);
+        return FALSE;
+    }
+
+    if (array)
+    {
+        *array = a;
+        *arraySize = counts[1];
+    }
+
+    mw_printf("Read orbit from cache '%s'\n", path);
+    free(path);
+
+    return TRUE;
+}
+
+void nbWriteOrbitCache(const char* key, const mwvector* results, unsigned int nResults,
+                       const mwvector* array, size_t arraySize)
+{
+    FILE* f;
+    char* path;
+    char* tmpPath;
+    size_t size;
+    uint32_t counts[2];
+    mwbool failed;
+
+    if (!key || !(path = nbOrbitCacheFile(key)))
+    {
+        return;
+    }
+
+    size = strlen(path) + 32;
+    tmpPath = (char*) mwMalloc(size);
+    snprintf(tmpPath, size, "%s.tmp_%d", path, (int) getpid());
+
+    f = mw_fopen(tmpPath, "wb");
+    if (!f)
+    {
+        mwPerror("Failed to open orbit cache '%s'", tmpPath);
+        free(tmpPath);
+        free(path);
+        return;
+    }
+
+    counts[0] = nResults;
+    counts[1] = (uint32_t) arraySize;
+
+    failed = fputs(NBODY_ORBIT_CACHE_MAGIC, f) == EOF
+        || fputs(key, f) == EOF
+        || fwrite(counts, sizeof(counts), 1, f) != 1
+        || fwrite(results, sizeof(mwvector), nResults, f) != nResults
+        || (arraySize && fwrite(array, sizeof(mwvector), arraySize, f) != arraySize);
+    failed |= (fclose(f) != 0);
+
+    if (failed || mw_rename(tmpPath, path))
+    {
+        mwPerror("Failed to write orbit cache '%s'", path);
+        mw_remove(tmpPath);
+    }
+
+    free(tmpPath);
+    free(path);
+}
+
@@ -29,6 +29,7 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 #include "milkyway_util.h"
 #include "nbody.h"
 #include "nbody_friction.h"
+#include "nbody_orbit_cache.h"
 /* Simple orbit integrator in user-defined potential
     Written for BOINC Nbody
     willeb 10 May 2010 */
@@ -37,17 +38,18 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 
 mwvector* shiftByLMC = NULL; //Ptr to LMC Shift Array (default is NULL)
 size_t nShiftLMC = 0;
+static NBodyDispersionTable* dispersionLMC = NULL; //Kept for the forward run by getLMCDispersionTable()
 
 mwvector LMCpos = ZERO_VECTOR; //Ptr to LMC position (default is NULL)
 mwvector LMCvel = ZERO_VECTOR; //Ptr to LMC velocity (default is NULL)
 
-void nbReverseOrbit(mwvector* finalPos,
-                    mwvector* finalVel,
-                    const Potential* pot,
-                    mwvector pos,
-                    mwvector vel,
-                    real tstop,
-                    real dt)
+static void nbIntegrateReverseOrbit(mwvector* finalPos,
+                                    mwvector* finalVel,
+                                    const Potential* pot,
+                                    mwvector pos,
+                                    mwvector vel,
+                                    real tstop,
+                                    real dt)
 {
     mwvector acc, v, x;
     real t;
@@ -80,28 +82,57 @@ void nbReverseOrbit(mwvector* finalPos,
     
     *finalPos = x;
     *finalVel = v;
-
-    mw_printf("Dwarf Initial Position: [%.15f,%.15f,%.15f]\n", X(x), Y(x), Z(x));
-    mw_printf("Dwarf Initial Velocity: [%.15f,%.15f,%.15f]\n", X(v), Y(v), Z(v));
 }
 
-void nbReverseOrbit_LMC(mwvector* finalPos,
+void nbReverseOrbit(mwvector* finalPos,
                     mwvector* finalVel,
-                    mwvector* LMCfinalPos,
-                    mwvector* LMCfinalVel,
                     const Potential* pot,
                     mwvector pos,
                     mwvector vel,
-                    mwvector LMCposition,
-                    mwvector LMCvelocity,
-                    mwbool LMCDynaFric,
-                    real ftime,
                     real tstop,
-                    real dt,
-                    real LMCmass,
-                    real LMCscale,
-                    real coulomb_log
-                    )
+                    real dt)
+{
+    mwvector results[2];
+    const real inputs[] = { X(pos), Y(pos), Z(pos), X(vel), Y(vel), Z(vel), tstop, dt };
+    char* key = nbOrbitCacheKey("reverse orbit", pot, inputs, sizeof(inputs) / sizeof(inputs[0]));
+
+    if (nbReadOrbitCache(key, results, 2, NULL, NULL))
+    {
+        *finalPos = results[0];
+        *finalVel = results[1];
+    }
+    else
+    {
+        nbIntegrateReverseOrbit(finalPos, finalVel, pot, pos, vel, tstop, dt);
+        results[0] = *finalPos;
+        results[1] = *finalVel;
+        nbWriteOrbitCache(key, results, 2, NULL, 0);
+    }
+    free(key);
+
+    mw_printf("Dwarf Initial Position: [%.15f,%.15f,%.15f]\n", X(*finalPos), Y(*finalPos), Z(*finalPos));
+    mw_printf("Dwarf Initial Velocity: [%.15f,%.15f,%.15f]\n", X(*finalVel), Y(*finalVel), Z(*finalVel));
+}
+
+/* Fills in shiftByLMC and nShiftLMC too */
+static void nbIntegrateReverseOrbit_LMC(mwvector* finalPos,
+                                        mwvector* finalVel,
+                                        mwvector* LMCfinalPos,
+                                        mwvector* LMCfinalVel,
+                                        const Potential* pot,
+                                        mwvector pos,
+                                        mwvector vel,
+                                        mwvector LMCposition,
+                                        mwvector LMCvelocity,
+                                        mwbool LMCDynaFric,
+                                        real ftime,
+                                        real tstop,
+                                        real dt,
+                                        real LMCmass,
+                                        real LMCscale,
+                                        real coulomb_log,
+                                        real dispersionTolerance
+                                        )
 {	
     unsigned int steps = mw_ceil((tstop)/(dt)) + 1;
     unsigned int exSteps = mw_abs(mw_ceil((ftime-tstop)/(dt)) + 1);
@@ -110,6 +141,16 @@ void nbReverseOrbit_LMC(mwvector* finalPos,
     mwvector mw_x = mw_vec(0, 0, 0);
     mwvector* bacArray = NULL;
     mwvector* forArray = NULL;
+    const NBodyDispersionTable* dispersion = NULL;
+
+    //The friction's velocity dispersion is found on every step, so tabulate it if asked to
+    if (LMCDynaFric && dispersionTolerance > 0.0) {
+        if (!nbDispersionTableFor(dispersionLMC, pot, dispersionTolerance)) {
+            nbDestroyDispersionTable(dispersionLMC);
+            dispersionLMC = nbMakeDispersionTable(pot, dispersionTolerance);
+        }
+        dispersion = dispersionLMC;
+    }
 
     //Placeholder arrays for LMC acceleration corrections
     bacArray = (mwvector*)mwCallocA(steps + 1, sizeof(mwvector));
@@ -129,7 +170,7 @@ void nbReverseOrbit_LMC(mwvector* finalPos,
 
         // Get the initial acceleration
         mw_acc = plummerAccel(mw_x, LMCx, LMCmass, LMCscale);
-        LMC_acc = mw_addv(nbExtAcceleration(pot, LMCx, 0), dynamicalFriction_LMC(pot, LMCx, LMCv, LMCmass, LMCscale, LMCDynaFric, 0, coulomb_log));
+        LMC_acc = mw_addv(nbExtAcceleration(pot, LMCx, 0), dynamicalFriction_LMC(pot, LMCx, LMCv, LMCmass, LMCscale, LMCDynaFric, 0, coulomb_log, dispersion));
         acc = nbExtAcceleration(pot, x, 0);
         tmp = plummerAccel(x, LMCx, LMCmass, LMCscale);
         mw_incaddv(acc, tmp);
@@ -155,7 +196,7 @@ void nbReverseOrbit_LMC(mwvector* finalPos,
         
             // Compute the new acceleration
             mw_acc = plummerAccel(mw_x, LMCx, LMCmass, LMCscale);
-            LMC_acc = mw_addv(nbExtAcceleration(pot, LMCx, t), dynamicalFriction_LMC(pot, LMCx, LMCv, LMCmass, LMCscale, LMCDynaFric, t, coulomb_log));
+            LMC_acc = mw_addv(nbExtAcceleration(pot, LMCx, t), dynamicalFriction_LMC(pot, LMCx, LMCv, LMCmass, LMCscale, LMCDynaFric, t, coulomb_log, dispersion));
             acc = nbExtAcceleration(pot, x, t);
             tmp = plummerAccel(x, LMCx, LMCmass, LMCscale);
     	    mw_incaddv(acc, tmp);
@@ -185,7 +226,7 @@ void nbReverseOrbit_LMC(mwvector* finalPos,
     mw_acc = plummerAccel(mw_x, LMCx, LMCmass, LMCscale);
     LMC_acc = nbExtAcceleration(pot, LMCx, 0);
     if (LMCDynaFric) {
-        DF_acc = dynamicalFriction_LMC(pot, LMCx, LMCv, LMCmass, LMCscale, TRUE, 0, coulomb_log);
+        DF_acc = dynamicalFriction_LMC(pot, LMCx, LMCv, LMCmass, LMCscale, TRUE, 0, coulomb_log, dispersion);
         mw_incnegv(DF_acc); /* Inverting drag force for reverse orbit */
         mw_incaddv(LMC_acc, DF_acc)
      }
@@ -219,7 +260,7 @@ void nbReverseOrbit_LMC(mwvector* finalPos,
         mw_acc = plummerAccel(mw_x, LMCx, LMCmass, LMCscale);
         LMC_acc = nbExtAcceleration(pot, LMCx, negT);
         if (LMCDynaFric) {
-            DF_acc = dynamicalFriction_LMC(pot, LMCx, LMCv, LMCmass, LMCscale, TRUE, negT, coulomb_log);
+            DF_acc = dynamicalFriction_LMC(pot, LMCx, LMCv, LMCmass, LMCscale, TRUE, negT, coulomb_log, dispersion);
             //mw_printf("DF: [%.15f,%.15f,%.15f]\n",X(DF_acc),Y(DF_acc),Z(DF_acc));
             mw_incnegv(DF_acc); /* Inverting drag force for reverse orbit */
             mw_incaddv(LMC_acc, DF_acc)
@@ -273,21 +314,88 @@ void nbReverseOrbit_LMC(mwvector* finalPos,
     *finalVel = v;
     *LMCfinalPos = LMCx;
     *LMCfinalVel = LMCv;
+}
+
+void nbReverseOrbit_LMC(mwvector* finalPos,
+                    mwvector* finalVel,
+                    mwvector* LMCfinalPos,
+                    mwvector* LMCfinalVel,
+                    const Potential* pot,
+                    mwvector pos,
+                    mwvector vel,
+                    mwvector LMCposition,
+                    mwvector LMCvelocity,
+                    mwbool LMCDynaFric,
+                    real ftime,
+                    real tstop,
+                    real dt,
+                    real LMCmass,
+                    real LMCscale,
+                    real coulomb_log,
+                    real dispersionTolerance
+                    )
+{
+    mwvector results[4];
+    const real inputs[] = { X(pos), Y(pos), Z(pos), X(vel), Y(vel), Z(vel),
+                            X(LMCposition), Y(LMCposition), Z(LMCposition),
+                            X(LMCvelocity), Y(LMCvelocity), Z(LMCvelocity),
+                            (real) LMCDynaFric, ftime, tstop, dt, LMCmass, LMCscale, coulomb_log, dispersionTolerance };
+    char* key = nbOrbitCacheKey("LMC reverse orbit", pot, inputs, sizeof(inputs) / sizeof(inputs[0]));
+
+    /* Drop a shift array from an earlier orbit nothing took with getLMCArray() */
+    mwFreeA(shiftByLMC);
+    shiftByLMC = NULL;
+    nShiftLMC = 0;
+
+    if (nbReadOrbitCache(key, results, 4, &shiftByLMC, &nShiftLMC))
+    {
+        *finalPos = results[0];
+        *finalVel = results[1];
+        *LMCfinalPos = results[2];
+        *LMCfinalVel = results[3];
+    }
+    else
+    {
+        nbIntegrateReverseOrbit_LMC(finalPos, finalVel, LMCfinalPos, LMCfinalVel, pot, pos, vel,
+                                    LMCposition, LMCvelocity, LMCDynaFric, ftime, tstop, dt,
+                                    LMCmass, LMCscale, coulomb_log, dispersionTolerance);
+        results[0] = *finalPos;
+        results[1] = *finalVel;
+        results[2] = *LMCfinalPos;
+        results[3] = *LMCfinalVel;
+        nbWriteOrbitCache(key, results, 4, shiftByLMC, nShiftLMC);
+    }
+    free(key);
 
-    mw_printf("Dwarf Initial Position: [%.15f,%.15f,%.15f]\n", X(x), Y(x), Z(x));
-    mw_printf("Dwarf Initial Velocity: [%.15f,%.15f,%.15f]\n", X(v), Y(v), Z(v));
-    mw_printf("Initial LMC position: [%.15f,%.15f,%.15f]\n",X(LMCx),Y(LMCx),Z(LMCx));
-    mw_printf("Initial LMC velocity: [%.15f,%.15f,%.15f]\n",X(LMCv),Y(LMCv),Z(LMCv));
+    mw_printf("Dwarf Initial Position: [%.15f,%.15f,%.15f]\n", X(*finalPos), Y(*finalPos), Z(*finalPos));
+    mw_printf("Dwarf Initial Velocity: [%.15f,%.15f,%.15f]\n", X(*finalVel), Y(*finalVel), Z(*finalVel));
+    mw_printf("Initial LMC position: [%.15f,%.15f,%.15f]\n",X(*LMCfinalPos),Y(*LMCfinalPos),Z(*LMCfinalPos));
+    mw_printf("Initial LMC velocity: [%.15f,%.15f,%.15f]\n",X(*LMCfinalVel),Y(*LMCfinalVel),Z(*LMCfinalVel));
 
     //Store LMC position and velocity
-    LMCpos = LMCx;
-    LMCvel = LMCv;
+    LMCpos = *LMCfinalPos;
+    LMCvel = *LMCfinalVel;
 }
 
 void getLMCArray(mwvector ** shiftArrayPtr, size_t * shiftSizePtr) {
-    //Allows access to shift array
+    //Hands over the shift array, which the caller frees from now on
     *shiftArrayPtr = shiftByLMC;
     *shiftSizePtr = nShiftLMC;
+    shiftByLMC = NULL;
+    nShiftLMC = 0;
+}
+
+NBodyDispersionTable* getLMCDispersionTable(const Potential* pot, real tolerance) {
+    //Hands over the table of the reverse orbit if it fits, else makes one
+    NBodyDispersionTable* t = dispersionLMC;
+    dispersionLMC = NULL;
+
+    if (!nbDispersionTableFor(t, pot, tolerance)) {
+        nbDestroyDispersionTable(t);
+        t = nbMakeDispersionTable(pot, tolerance);
+    }
+
+    return t;
 }
 
 void getLMCPosVel(mwvector * LMCposPtr, mwvector * LMCvelPtr) {
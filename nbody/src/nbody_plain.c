@@ -33,6 +33,12 @@
 #include "nbody_orbit_integrator.h"
 #include "nbody_potential.h"
 #include "nbody_friction.h"
+#include "nbody_counters.h"
+#include "nbody_energy.h"
+
+#if NBODY_MPI
+  #include "nbody_mpi.h"
+#endif
 
 #ifdef NBODY_BLENDER_OUTPUT
   #include "blender_visualizer.h"
@@ -59,6 +65,15 @@ static void nbReportProgress(const NBodyCtx* ctx, NBodyState* st)
 
 static NBodyStatus nbCheckpoint(const NBodyCtx* ctx, NBodyState* st)
 {
+#if NBODY_MPI
+    /* The processes would not agree on when it is time, and each only
+     * has its own bodies. Only the final checkpoint is written. */
+    if (st->mpi)
+    {
+        return NBODY_SUCCESS;
+    }
+#endif
+
     if (nbTimeToCheckpoint(ctx, st))
     {
         if (nbWriteCheckpoint(ctx, st))
@@ -265,22 +280,41 @@ static inline void bodyAdvancePos(Body* p, const real dt)
     mw_incaddv(Pos(p), dr);     /* advance r by 1 step */
 }
 
+/* Largest coordinate of r from the origin, where the tree's root is
+ * centred. Found while drifting the bodies so building the tree does
+ * not need its own pass over them to size the root. */
+static inline real nbCoordMax(const mwvector r)
+{
+    return mw_fmax(mw_abs(X(r)), mw_fmax(mw_abs(Y(r)), mw_abs(Z(r))));
+}
+
+static inline void nbSetBodyExtent(NBodyState* st, real xyzmax)
+{
+    st->tree.bodyExtent = xyzmax;
+    st->tree.extentKnown = TRUE;
+}
+
 static inline void advancePosVel(NBodyState* st, const int nbody, const real dt, const mwvector acc_i)
 {
     int i;
     real dtHalf = 0.5 * dt;
     Body* bodies = mw_assume_aligned(st->bodytab, 16);
     const mwvector* accs = mw_assume_aligned(st->acctab, 16);
+    real xyzmax = 0.0;
 
+    /* Statically scheduled, so with pinned threads each steps the bodies
+     * whose pages it first touched in nbPlaceBodies() */
   #ifdef _OPENMP
-    #pragma omp parallel for private(i) shared(bodies, accs) schedule(dynamic, 4096 / sizeof(accs[0]))
+    #pragma omp parallel for private(i) shared(bodies, accs) schedule(static) reduction(max: xyzmax)
   #endif
     for (i = 0; i < nbody; ++i)
     {
         bodyAdvanceVel(&bodies[i], mw_addv(accs[i], acc_i), dtHalf);
         bodyAdvancePos(&bodies[i], dt);
+        xyzmax = mw_fmax(xyzmax, nbCoordMax(Pos(&bodies[i])));
     }
 
+    nbSetBodyExtent(st, xyzmax);
 }
 
 static inline void advancePosVel_LMC(NBodyState* st, const real dt, const mwvector acc, const mwvector acc_i)
@@ -298,32 +332,287 @@ static inline void advancePosVel_LMC(NBodyState* st, const real dt, const mwvect
     
 }
 
-static inline void advanceVelocities(NBodyState* st, const int nbody, const real dt, const mwvector acc_i1)
+static inline void advanceVelocities_LMC(NBodyState* st, const real dt, const mwvector acc, const mwvector acc_i)
 {
-    int i;
     real dtHalf = 0.5 * dt;
+    mwvector dv;
+
+    mwvector acc_total = mw_addv(acc, acc_i);
+    dv = mw_mulvs(acc_total, dtHalf);
+    mw_incaddv(st->LMCvel,dv);
+}
+
+/* Kick and drift the centre of the restricted dwarf with the
+ * acceleration found for it in the last force calculation */
+static inline void advancePosVel_Dwarf(NBodyState* st, const real dt, const mwvector acc_i)
+{
+    mw_incaddv(st->dwarfVel, mw_mulvs(mw_addv(st->dwarfAcc, acc_i), 0.5 * dt));
+    mw_incaddv(st->dwarfPos, mw_mulvs(st->dwarfVel, dt));
+}
+
+static inline void advanceVelocities_Dwarf(NBodyState* st, const real dt, const mwvector acc_i1)
+{
+    mw_incaddv(st->dwarfVel, mw_mulvs(mw_addv(st->dwarfAcc, acc_i1), 0.5 * dt));
+}
+
+/* Find the forces and close a kick-drift-kick step with a half kick of
+ * dt / 2. The kick is done in the force calculation as each body's
+ * acceleration is found. */
+static inline NBodyStatus nbGravMapCloseKick(const NBodyCtx* ctx, NBodyState* st, const real dt, const mwvector acc_i1)
+{
+    return nbGravMapKick(ctx, st, 0.5 * dt, acc_i1);
+}
+
+/* Deepest rung whose timestep timestep / 2^r keeps a body's step under
+ * sqrt(2 eta eps / |a|), so fast bodies take proportionally finer steps */
+static inline int nbRungForAccel(const NBodyCtx* ctx, const mwvector a)
+{
+    int rung = 0;
+    real aMag = mw_absv(a);
+    real dt = ctx->timestep;
+    real dtWant;
+
+    if (!(aMag > 0.0))
+        return 0;
+
+    dtWant = mw_sqrt(2.0 * ctx->rungEta * mw_sqrt(ctx->eps2) / aMag);
+    while (dt > dtWant && rung < (int) ctx->maxRung)
+    {
+        dt *= 0.5;
+        ++rung;
+    }
+
+    return rung;
+}
+
+/* Lowest rung synchronized at substep k of a block step 2^deepest substeps long */
+static inline int nbLowestActiveRung(int deepest, unsigned int k)
+{
+    int r = deepest;
+
+    while (r > 0 && !(k & (1u << (deepest - r))))
+        --r;
+
+    return r;
+}
+
+/* Shift of the Milky Way linearly interpolated to a fraction of the step */
+static inline mwvector nbShiftAt(const mwvector acc_i, const mwvector acc_i1, real frac)
+{
+    return mw_addv(acc_i, mw_mulvs(mw_subv(acc_i1, acc_i), frac));
+}
+
+/* Shift of the Milky Way interpolated to substep k of nSub */
+static inline mwvector nbSubstepShift(const mwvector acc_i, const mwvector acc_i1, unsigned int k, unsigned int nSub)
+{
+    if (k == 0)
+        return acc_i;
+    if (k == nSub)
+        return acc_i1;
+
+    return nbShiftAt(acc_i, acc_i1, (real) k / (real) nSub);
+}
+
+/* Shift of the Milky Way at the start of the current step, felt by every body */
+static inline mwvector nbFrameShift(const NBodyCtx* ctx, const NBodyState* st)
+{
+    mwvector zero = ZERO_VECTOR;
+
+    return ctx->LMC ? st->shiftByLMC[st->step] : zero;
+}
+
+/* Half kick the bodies on rungs at least minRung, each by half its own timestep */
+static inline void advanceVelocitiesRungs(NBodyState* st, const real dt, const int minRung, const mwvector shift)
+{
+    int i;
+    const int nbody = st->nbody;
+    const int* rungs = st->rungs;
     Body* bodies = mw_assume_aligned(st->bodytab, 16);
     const mwvector* accs = mw_assume_aligned(st->acctab, 16);
 
   #ifdef _OPENMP
     #pragma omp parallel for private(i) schedule(dynamic, 4096 / sizeof(accs[0]))
   #endif
-    for (i = 0; i < nbody; ++i)      /* loop over all bodies */
+    for (i = 0; i < nbody; ++i)
     {
-        bodyAdvanceVel(&bodies[i], mw_addv(accs[i], acc_i1), dtHalf);
+        if (rungs[i] >= minRung)
+        {
+            bodyAdvanceVel(&bodies[i], mw_addv(accs[i], shift), 0.5 * mw_ldexp(dt, -rungs[i]));
+        }
     }
 }
 
-static inline void advanceVelocities_LMC(NBodyState* st, const real dt, const mwvector acc, const mwvector acc_i)
+static inline void advancePositions(NBodyState* st, const real dt)
 {
-    real dtHalf = 0.5 * dt;
-    mwvector dv;
+    int i;
+    const int nbody = st->nbody;
+    Body* bodies = mw_assume_aligned(st->bodytab, 16);
+    real xyzmax = 0.0;
 
-    mwvector acc_total = mw_addv(acc, acc_i);
-    dv = mw_mulvs(acc_total, dtHalf);
-    mw_incaddv(st->LMCvel,dv);
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static) reduction(max: xyzmax)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        bodyAdvancePos(&bodies[i], dt);
+        xyzmax = mw_fmax(xyzmax, nbCoordMax(Pos(&bodies[i])));
+    }
+
+    nbSetBodyExtent(st, xyzmax);
+}
+
+/* Move the bodies just synchronized at a rung boundary to the rung their
+ * new acceleration asks for. A body may only move to a coarser rung that
+ * is also synchronized here, and stays within deepest during a step. */
+static inline void nbReassignRungs(const NBodyCtx* ctx, NBodyState* st, int minRung, int deepest)
+{
+    int i;
+    const int nbody = st->nbody;
+    int* rungs = st->rungs;
+    const mwvector* accs = st->acctab;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static)
+  #endif
+    for (i = 0; i < nbody; ++i)
+    {
+        if (rungs[i] >= minRung)
+        {
+            int r = nbRungForAccel(ctx, accs[i]);
+            r = (r > deepest) ? deepest : r;
+            rungs[i] = (r < minRung) ? minRung : r;
+        }
+    }
 }
 
+/* Advance the system one timestep with block timesteps: a body on rung r
+ * is kicked every timestep / 2^r, and the force is only found for bodies
+ * at the end of their own step. All bodies drift every substep so the
+ * tree always sees current positions. */
+static NBodyStatus nbStepSystemBlock(const NBodyCtx* ctx, NBodyState* st, const mwvector acc_i, const mwvector acc_i1)
+{
+    NBodyStatus rc = NBODY_SUCCESS;
+    mwvector acc_LMC;
+    unsigned int s, nSub;
+    int i, deepest = 0;
+    real dtMin, barTime;
+
+    if (!st->rungs)
+    {
+        st->rungs = (int*) mwMalloc(st->nbody * sizeof(int));
+        st->activeRung = 0;
+        for (i = 0; i < st->nbody; ++i)
+        {
+            st->rungs[i] = nbRungForAccel(ctx, st->acctab[i]);
+        }
+    }
+
+    for (i = 0; i < st->nbody; ++i)
+    {
+        if (st->rungs[i] > deepest)
+            deepest = st->rungs[i];
+    }
+
+    nSub = 1u << deepest;
+    dtMin = mw_ldexp(ctx->timestep, -deepest);
+
+    for (s = 0; s < nSub; ++s)
+    {
+        int closing = nbLowestActiveRung(deepest, s + 1);
+
+        st->substepTime = s * dtMin;
+        barTime = st->step * ctx->timestep + st->substepTime - st->previousForwardTime;
+
+        advanceVelocitiesRungs(st, ctx->timestep, nbLowestActiveRung(deepest, s), nbSubstepShift(acc_i, acc_i1, s, nSub));
+        advancePositions(st, dtMin);
+        if (ctx->LMC)
+        {
+            acc_LMC = mw_addv(nbExtAcceleration(&ctx->pot, st->LMCpos, barTime), dynamicalFriction_LMC(&ctx->pot, st->LMCpos, st->LMCvel, ctx->LMCmass, ctx->LMCscale, ctx->LMCDynaFric, barTime, ctx->coulomb_log, st->dispersion));
+            advancePosVel_LMC(st, dtMin, acc_LMC, nbSubstepShift(acc_i, acc_i1, s, nSub));
+        }
+
+        st->activeRung = (unsigned int) closing;
+        rc |= nbGravMapKickRungs(ctx, st, 0.5 * ctx->timestep, nbSubstepShift(acc_i, acc_i1, s + 1, nSub));
+        if (nbStatusIsFatal(rc))
+            break;
+        if (ctx->LMC)
+        {
+            acc_LMC = mw_addv(nbExtAcceleration(&ctx->pot, st->LMCpos, barTime), dynamicalFriction_LMC(&ctx->pot, st->LMCpos, st->LMCvel, ctx->LMCmass, ctx->LMCscale, ctx->LMCDynaFric, barTime, ctx->coulomb_log, st->dispersion));
+            advanceVelocities_LMC(st, dtMin, acc_LMC, nbSubstepShift(acc_i, acc_i1, s + 1, nSub));
+        }
+
+        nbReassignRungs(ctx, st, closing, (s + 1 == nSub) ? (int) ctx->maxRung : deepest);
+    }
+
+    st->activeRung = 0;
+    st->substepTime = 0.0;
+    st->step++;
+
+    return rc;
+}
+
+/* Yoshida (1990) weights composing three leapfrog steps into a fourth
+ * order step: w1 = 1 / (2 - 2^(1/3)), w0 = 1 - 2 w1 */
+#define YOSHIDA_W1 ((real) 1.3512071919596576340476878089715)
+#define YOSHIDA_W0 ((real) -1.7024143839193152680953756179429)
+
+/* Advance the system one timestep as three kick-drift-kick substeps of
+ * w1, w0 and w1 times the timestep. The middle substep runs backwards.
+ * Costs three force calculations per step instead of one, but the
+ * error falls as timestep^4 so far fewer steps are needed. */
+static NBodyStatus nbStepSystemYoshida(const NBodyCtx* ctx, NBodyState* st, const mwvector acc_i, const mwvector acc_i1)
+{
+    static const real weights[3] = { YOSHIDA_W1, YOSHIDA_W0, YOSHIDA_W1 };
+    NBodyStatus rc = NBODY_SUCCESS;
+    mwvector acc_LMC, shift;
+    real start = 0.0;   /* fraction of the step done before this substep */
+    real end, dt, barTime;
+    int k;
+
+    for (k = 0; k < 3; ++k)
+    {
+        dt = weights[k] * ctx->timestep;
+        end = (k == 2) ? 1.0 : start + weights[k];
+
+        st->substepTime = start * ctx->timestep;
+        barTime = st->step * ctx->timestep + st->substepTime - st->previousForwardTime;
+
+        shift = (k == 0) ? acc_i : nbShiftAt(acc_i, acc_i1, start);
+        advancePosVel(st, st->nbody, dt, shift);
+        if (ctx->LMC)
+        {
+            acc_LMC = mw_addv(nbExtAcceleration(&ctx->pot, st->LMCpos, barTime), dynamicalFriction_LMC(&ctx->pot, st->LMCpos, st->LMCvel, ctx->LMCmass, ctx->LMCscale, ctx->LMCDynaFric, barTime, ctx->coulomb_log, st->dispersion));
+            advancePosVel_LMC(st, dt, acc_LMC, shift);
+        }
+        if (ctx->restricted)
+        {
+            advancePosVel_Dwarf(st, dt, shift);
+        }
+
+        shift = (k == 2) ? acc_i1 : nbShiftAt(acc_i, acc_i1, end);
+        rc |= nbGravMapCloseKick(ctx, st, dt, shift);
+        if (nbStatusIsFatal(rc))
+            break;
+
+        if (ctx->restricted)
+        {
+            advanceVelocities_Dwarf(st, dt, shift);
+        }
+
+        if (ctx->LMC)
+        {
+            acc_LMC = mw_addv(nbExtAcceleration(&ctx->pot, st->LMCpos, barTime), dynamicalFriction_LMC(&ctx->pot, st->LMCpos, st->LMCvel, ctx->LMCmass, ctx->LMCscale, ctx->LMCDynaFric, barTime, ctx->coulomb_log, st->dispersion));
+            advanceVelocities_LMC(st, dt, acc_LMC, shift);
+        }
+
+        start = end;
+    }
+
+    st->substepTime = 0.0;
+    st->step++;
+
+    return rc;
+}
 
 /* stepSystem: advance N-body system one time-step. */
 NBodyStatus nbStepSystemPlain(const NBodyCtx* ctx, NBodyState* st, const mwvector acc_i, const mwvector acc_i1)
@@ -332,24 +621,41 @@ NBodyStatus nbStepSystemPlain(const NBodyCtx* ctx, NBodyState* st, const mwvecto
     mwvector acc_LMC;
     
     const real dt = ctx->timestep;
+
+    if (ctx->maxRung > 0)
+    {
+        return nbStepSystemBlock(ctx, st, acc_i, acc_i1);
+    }
+
+    if (ctx->integrator == Yoshida4)
+    {
+        return nbStepSystemYoshida(ctx, st, acc_i, acc_i1);
+    }
     
     real barTime = st->step * dt - st->previousForwardTime;
 
     advancePosVel(st, st->nbody, dt, acc_i);   /* acc_i and acc_i1 are accelerations due to the shifting Milky Way */
     if(ctx->LMC){
-	acc_LMC = mw_addv(nbExtAcceleration(&ctx->pot, st->LMCpos, barTime), dynamicalFriction_LMC(&ctx->pot, st->LMCpos, st->LMCvel, ctx->LMCmass, ctx->LMCscale, ctx->LMCDynaFric, barTime, ctx->coulomb_log));
+	acc_LMC = mw_addv(nbExtAcceleration(&ctx->pot, st->LMCpos, barTime), dynamicalFriction_LMC(&ctx->pot, st->LMCpos, st->LMCvel, ctx->LMCmass, ctx->LMCscale, ctx->LMCDynaFric, barTime, ctx->coulomb_log, st->dispersion));
         advancePosVel_LMC(st, dt, acc_LMC, acc_i);
     }
+    if (ctx->restricted)
+    {
+        advancePosVel_Dwarf(st, dt, acc_i);
+    }
     //printf("LMC position: %f %f %f, LMC mass: %f, LMC scale: %f \n", X(st->LMCpos), Y(st->LMCpos), 
     //       Z(st->LMCpos), ctx->LMCmass, ctx->LMCscale);
     //mw_printf("LMC position: %f %f %f, LMC mass: %f, LMC scale: %f \n", X(st->LMCpos), Y(st->LMCpos), 
     //       Z(st->LMCpos), ctx->LMCmass, ctx->LMCscale);
-    rc = nbGravMap(ctx, st);
-    advanceVelocities(st, st->nbody, dt, acc_i1);
+    rc = nbGravMapCloseKick(ctx, st, dt, acc_i1);
     if(ctx->LMC){
-	acc_LMC = mw_addv(nbExtAcceleration(&ctx->pot, st->LMCpos, barTime), dynamicalFriction_LMC(&ctx->pot, st->LMCpos, st->LMCvel, ctx->LMCmass, ctx->LMCscale, ctx->LMCDynaFric, barTime, ctx->coulomb_log));
+	acc_LMC = mw_addv(nbExtAcceleration(&ctx->pot, st->LMCpos, barTime), dynamicalFriction_LMC(&ctx->pot, st->LMCpos, st->LMCvel, ctx->LMCmass, ctx->LMCscale, ctx->LMCDynaFric, barTime, ctx->coulomb_log, st->dispersion));
         advanceVelocities_LMC(st, dt, acc_LMC, acc_i1);
     }
+    if (ctx->restricted)
+    {
+        advanceVelocities_Dwarf(st, dt, acc_i1);
+    }
 
 //    mw_printf("(%.15f) LMC position: [%.15f,%.15f,%.15f] | ",(int)(st->step)*(ctx->timestep),X(st->LMCpos[0]),Y(st->LMCpos[0]),Z(st->LMCpos[0]));
 //    mw_printf("LMC velocity: [%.15f,%.15f,%.15f]\n",X(st->LMCvel[0]),Y(st->LMCvel[0]),Z(st->LMCvel[0]));
@@ -363,7 +669,7 @@ NBodyStatus nbStepSystemPlain(const NBodyCtx* ctx, NBodyState* st, const mwvecto
     return rc;
 }
 
-NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf)
+static NBodyStatus nbRunStepsPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf)
 {
     NBodyLikelihoodMethod method;
     HistogramParams hp;
@@ -388,6 +694,7 @@ NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFla
     rc |= nbGravMap(ctx, st); /* Calculate accelerations for 1st step this episode */
     if (nbStatusIsFatal(rc))
         return rc;
+    nbSampleEnergy(st, st->step * ctx->timestep, nbFrameShift(ctx, st));
 
     #ifdef NBODY_BLENDER_OUTPUT
         if(mkdir("./frames", S_IRWXU | S_IRWXG) < 0)
@@ -425,6 +732,7 @@ NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFla
             }
                 
         #endif
+        nbCountStepStart(st);
         if(!ctx->LMC) {
             mwvector zero;
             SET_VECTOR(zero,0,0,0);
@@ -432,18 +740,26 @@ NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFla
         } else {
             rc |= nbStepSystemPlain(ctx, st, st->shiftByLMC[st->step], st->shiftByLMC[st->step+1]);
         }
+        nbCountStepEnd(st);
+        nbSampleEnergy(st, st->step * ctx->timestep, nbFrameShift(ctx, st));
 
         curStep = st->step;
         
         if(curStep / Nstep >= ctx->BestLikeStart && ctx->useBestLike)
         {
+            double t0 = nbCounterClock();
             get_likelihood(ctx, st, nbf);
+            nbCountPhase(st, NBODY_PHASE_LIKELIHOOD, nbCounterClock() - t0);
         }
     
         if (nbStatusIsFatal(rc))   /* advance N-body system */
             return rc;
 
-        rc |= nbCheckpoint(ctx, st);
+        {
+            double t0 = nbCounterClock();
+            rc |= nbCheckpoint(ctx, st);
+            nbCountPhase(st, NBODY_PHASE_CHECKPOINT, nbCounterClock() - t0);
+        }
         if (nbStatusIsFatal(rc))
             return rc;
         /* We report the progress at step + 1. 0 is the original
@@ -456,7 +772,44 @@ NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFla
         blenderPrintMisc(st, ctx, startCmPos, perpendicularCmPos);
     #endif
 
+    return rc;
+}
+
+NBodyStatus nbRunSystemPlain(const NBodyCtx* ctx, NBodyState* st, const NBodyFlags* nbf)
+{
+    NBodyStatus rc;
+    double t0;
+
+#if NBODY_MPI
+    rc = nbMPIDistribute(ctx, st);
+    if (nbStatusIsFatal(rc))
+        return rc;
+#endif
+
+    rc = nbRunStepsPlain(ctx, st, nbf);
 
-    return nbWriteFinalCheckpoint(ctx, st);
+#if NBODY_MPI
+    if (st->mpi)
+    {
+        rc = nbMPIReduceStatus(rc);
+        rc |= nbMPICollect(st);
+    }
+
+    /* Every process has all the bodies again, so one writes them */
+    if (!nbStatusIsFatal(rc) && nbMPIRank() != 0)
+        return NBODY_SUCCESS;
+#endif
+
+    if (nbStatusIsFatal(rc))
+        return rc;
+
+    t0 = nbCounterClock();
+    rc = nbWriteFinalCheckpoint(ctx, st);
+    nbCountPhase(st, NBODY_PHASE_CHECKPOINT, nbCounterClock() - t0);
+
+    nbPrintCounters(st);
+    nbPrintEnergy(st);
+
+    return rc;
 }
 
@@ -0,0 +1,778 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Particle-mesh self gravity.
+ *
+ * The masses of the bodies are assigned to a cubic mesh of n^3 cells
+ * around the dwarf with cloud in cell weights, and convolved with the
+ * Green's function of an isolated system by FFT on a mesh of (2n)^3
+ * cells, zero padded so that the periodic images do not interact. The
+ * acceleration is found from the potential by four point differences
+ * and interpolated back to the bodies with the same weights, so a body
+ * does not accelerate itself.
+ *
+ * With pmSplit > 0 the force is split at rs = pmSplit cells. The mesh
+ * gives the long range part, with the Green's function -erf(r / 2rs) / r,
+ * and a walk of the tree gives the rest, each interaction weighted by
+ *
+ *   g(r) = erfc(r / 2rs) + r / (rs sqrt(pi)) exp(-r^2 / 4rs^2)
+ *
+ * and cut off beyond NBODY_PM_CUTOFF rs, so only the neighbourhood of
+ * each body is walked. Without the split the mesh gives the whole force
+ * with a Plummer softened Green's function, softened to at least half
+ * a cell.
+ *
+ * The mesh is centred on the centre of mass of the bodies. A box of
+ * fixed size may leave some of them outside; they add no mass to the
+ * mesh and feel only the monopole of the mass on it.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_pm.h"
+#include "nbody_grav.h"
+#include "milkyway_util.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif /* _OPENMP */
+
+
+/* Short range interactions are cut off beyond this many split scales,
+ * where g(r) is below 5e-4. g(r) is interpolated from a table. */
+#define NBODY_PM_CUTOFF 6
+
+/* A box fitted to the bodies changes size in steps of 2^(1/8), so the
+ * Green's function only needs to be found again when it does */
+#define NBODY_PM_BOX_STEPS 8.0
+
+/* Lines of the mesh transformed together along y and z */
+#define NBODY_PM_LINES 8
+
+/* Samples of the short range weight g(r) per split scale */
+#define NBODY_PM_TABLE_STEPS 256
+
+/* Cells left empty at each edge of the mesh, so the assignment and the
+ * differences of the potential stay on it */
+#define NBODY_PM_MARGIN 3
+
+struct NBodyPM
+{
+    int n;                  /* cells along a side of the mesh */
+    int m;                  /* cells along a side of the padded mesh, 2n */
+    real hGreen;            /* cell size and split scale the Green's function was found for */
+    real rsGreen;
+    real* green;            /* transform of the Green's function, real as it is even, m^3 */
+    real* grid;             /* padded mesh of complex values, interleaved, m^3 */
+    real* phi;              /* potential on the mesh, n^3 */
+    real* ax;               /* acceleration on the mesh, n^3 each */
+    real* ay;
+    real* az;
+    real* twiddle;          /* exp(-2 pi i k / m) for k < m / 2, interleaved */
+    real* shortWeight;      /* g(r) at steps of rs / NBODY_PM_TABLE_STEPS out to the cutoff */
+
+    mwvector origin;        /* corner of the mesh in this force calculation */
+    real h;                 /* cell size in this force calculation */
+};
+
+
+static NBodyPM* nbCreatePM(int n)
+{
+    int k;
+    const int m = 2 * n;
+    const size_t nCell = (size_t) n * n * n;
+    const size_t mCell = (size_t) m * m * m;
+    NBodyPM* pm = (NBodyPM*) mwCalloc(1, sizeof(NBodyPM));
+
+    pm->n = n;
+    pm->m = m;
+    pm->green = (real*) mwMallocA(mCell * sizeof(real));
+    pm->grid = (real*) mwMallocA(2 * mCell * sizeof(real));
+    pm->phi = (real*) mwMallocA(nCell * sizeof(real));
+    pm->ax = (real*) mwCallocA(3 * nCell, sizeof(real));
+    pm->ay = pm->ax + nCell;
+    pm->az = pm->ax + 2 * nCell;
+    pm->twiddle = (real*) mwMallocA(m * sizeof(real));
+    pm->shortWeight = (real*) mwMallocA((NBODY_PM_CUTOFF * NBODY_PM_TABLE_STEPS + 2) * sizeof(real));
+
+    for (k = 0; k < m / 2; ++k)
+    {
+        pm->twiddle[2 * k] = mw_cos(2.0 * M_PI * k / m);
+        pm->twiddle[2 * k + 1] = -mw_sin(2.0 * M_PI * k / m);
+    }
+
+    for (k = 0; k < NBODY_PM_CUTOFF * NBODY_PM_TABLE_STEPS + 2; ++k)
+    {
+        real x = (real) k / NBODY_PM_TABLE_STEPS;    /* r / rs */
+        pm->shortWeight[k] = mw_erfc(0.5 * x) + x / mw_sqrt(M_PI) * mw_exp(-0.25 * sqr(x));
+    }
+
+    return pm;
+}
+
+void nbDestroyPM(NBodyPM* pm)
+{
+    if (!pm)
+        return;
+
+    mwFreeA(pm->green);
+    mwFreeA(pm->grid);
+    mwFreeA(pm->phi);
+    mwFreeA(pm->ax);
+    mwFreeA(pm->twiddle);
+    mwFreeA(pm->shortWeight);
+    free(pm);
+}
+
+static inline size_t nbPMPaddedIndex(const NBodyPM* pm, int i, int j, int k)
+{
+    return ((size_t) k * pm->m + j) * pm->m + i;
+}
+
+static inline size_t nbPMIndex(const NBodyPM* pm, int i, int j, int k)
+{
+    return ((size_t) k * pm->n + j) * pm->n + i;
+}
+
+/* In place radix 2 transform of the m interleaved complex values in d.
+ * The inverse is not scaled. */
+static void nbPMFFT(const NBodyPM* pm, real* d, mwbool inverse)
+{
+    int i, j, k, len;
+    const int m = pm->m;
+    const real sign = inverse ? -1.0 : 1.0;
+
+    for (i = 1, j = 0; i < m; ++i)        /* bit reversed order */
+    {
+        int bit = m >> 1;
+
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+
+        if (i < j)
+        {
+            real tr = d[2 * i];
+            real ti = d[2 * i + 1];
+
+            d[2 * i] = d[2 * j];
+            d[2 * i + 1] = d[2 * j + 1];
+            d[2 * j] = tr;
+            d[2 * j + 1] = ti;
+        }
+    }
+
+    for (len = 2; len <= m; len <<= 1)
+    {
+        const int half = len >> 1;
+        const int step = m / len;
+
+        for (i = 0; i < m; i += len)
+        {
+            for (k = 0; k < half; ++k)
+            {
+                const real wr = pm->twiddle[2 * k * step];
+                const real wi = sign * pm->twiddle[2 * k * step + 1];
+                real* a = &d[2 * (i + k)];
+                real* b = &d[2 * (i + k + half)];
+                real tr = wr * b[0] - wi * b[1];
+                real ti = wr * b[1] + wi * b[0];
+
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+/* Transform the lines of the padded mesh along axis which start at the
+ * first na cells of the next axis and the first nb of the one after.
+ * Lines known to be empty, or not needed, are left out this way. Lines
+ * along y and z are copied out NBODY_PM_LINES at a time, so each read
+ * of the mesh uses whole cache lines. */
+static void nbPMTransformAxis(NBodyPM* pm, int axis, int na, int nb, mwbool inverse)
+{
+    int group;
+    const size_t m = (size_t) pm->m;
+    const size_t width = (axis == 0) ? 1 : NBODY_PM_LINES;   /* lines next to each other in memory */
+    const int nGroup = (int) (na / width) * nb;
+    const size_t stride = (axis == 0) ? 1 : ((axis == 1) ? m : m * m);
+    const size_t strideA = (axis == 0) ? m : 1;
+    const size_t strideB = (axis == 2) ? m : m * m;
+    real* grid = pm->grid;
+
+  #ifdef _OPENMP
+    #pragma omp parallel private(group)
+  #endif
+    {
+        real* buf = (real*) mwMallocA(2 * m * width * sizeof(real));
+
+      #ifdef _OPENMP
+        #pragma omp for schedule(static)
+      #endif
+        for (group = 0; group < nGroup; ++group)
+        {
+            size_t k, w;
+            const size_t base = (group % (na / width)) * width * strideA + (group / (na / width)) * strideB;
+
+            for (k = 0; k < m; ++k)
+            {
+                const real* src = &grid[2 * (base + k * stride)];
+                for (w = 0; w < width; ++w)
+                {
+                    buf[2 * (w * m + k)] = src[2 * w];
+                    buf[2 * (w * m + k) + 1] = src[2 * w + 1];
+                }
+            }
+
+            for (w = 0; w < width; ++w)
+            {
+                nbPMFFT(pm, &buf[2 * w * m], inverse);
+            }
+
+            for (k = 0; k < m; ++k)
+            {
+                real* dst = &grid[2 * (base + k * stride)];
+                for (w = 0; w < width; ++w)
+                {
+                    dst[2 * w] = buf[2 * (w * m + k)];
+                    dst[2 * w + 1] = buf[2 * (w * m + k) + 1];
+                }
+            }
+        }
+
+        mwFreeA(buf);
+    }
+}
+
+/* Find the transform of the Green's function for cells of size h */
+static void nbPMGreen(NBodyPM* pm, real h, real rs, real eps2)
+{
+    int k;
+    const int m = pm->m;
+    const size_t mCell = (size_t) m * m * m;
+    const real soft2 = mw_fmax(eps2, sqr(0.5 * h));
+    size_t idx;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(static)
+  #endif
+    for (k = 0; k < m; ++k)
+    {
+        int i, j;
+        const int dk = (k <= m / 2) ? k : k - m;
+
+        for (j = 0; j < m; ++j)
+        {
+            const int dj = (j <= m / 2) ? j : j - m;
+
+            for (i = 0; i < m; ++i)
+            {
+                const int di = (i <= m / 2) ? i : i - m;
+                const real r = h * mw_sqrt((real) (di * di + dj * dj + dk * dk));
+                const size_t c = nbPMPaddedIndex(pm, i, j, k);
+                real g;
+
+                if (rs > 0.0)
+                    g = (di == 0 && dj == 0 && dk == 0) ? -1.0 / (rs * mw_sqrt(M_PI)) : -mw_erf(0.5 * r / rs) / r;
+                else
+                    g = -1.0 / mw_sqrt(sqr(r) + soft2);
+
+                pm->grid[2 * c] = g;
+                pm->grid[2 * c + 1] = 0.0;
+            }
+        }
+    }
+
+    nbPMTransformAxis(pm, 0, m, m, FALSE);
+    nbPMTransformAxis(pm, 1, m, m, FALSE);
+    nbPMTransformAxis(pm, 2, m, m, FALSE);
+
+    for (idx = 0; idx < mCell; ++idx)
+    {
+        pm->green[idx] = pm->grid[2 * idx];
+    }
+
+    /* The long range part is smooth enough to undo the smoothing of the
+     * assignment and the interpolation, sinc^2 along each axis each */
+    if (rs > 0.0)
+    {
+        real* window = (real*) mwMallocA(m * sizeof(real));
+
+        for (k = 0; k < m; ++k)
+        {
+            real x = M_PI * ((k <= m / 2) ? k : k - m) / m;
+            window[k] = (k == 0) ? 1.0 : sqr(sqr(mw_sin(x) / x));
+        }
+
+      #ifdef _OPENMP
+        #pragma omp parallel for private(k) schedule(static)
+      #endif
+        for (k = 0; k < m; ++k)
+        {
+            int i, j;
+            for (j = 0; j < m; ++j)
+            {
+                for (i = 0; i < m; ++i)
+                {
+                    pm->green[nbPMPaddedIndex(pm, i, j, k)] /= window[i] * window[j] * window[k];
+                }
+            }
+        }
+
+        mwFreeA(window);
+    }
+
+    pm->hGreen = h;
+    pm->rsGreen = rs;
+}
+
+/* Centre of mass of the bodies with mass within halfSide of c along each
+ * axis, or of all of them with halfSide 0. Returns their mass. The sums
+ * are split between the threads unless deterministic. */
+static real nbPMCentreOfMass(const NBodyState* st, mwvector c, real halfSide, mwbool deterministic, mwvector* cm)
+{
+    int i;
+    const Body* bodies = st->bodytab;
+    real mass = 0.0, mx = 0.0, my = 0.0, mz = 0.0;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static) reduction(+: mass, mx, my, mz) if (!deterministic)
+  #endif
+    for (i = 0; i < st->nbody; ++i)
+    {
+        const Body* b = &bodies[i];
+
+        if (   halfSide > 0.0
+            && (   mw_fabs(X(Pos(b)) - X(c)) >= halfSide
+                || mw_fabs(Y(Pos(b)) - Y(c)) >= halfSide
+                || mw_fabs(Z(Pos(b)) - Z(c)) >= halfSide))
+        {
+            continue;
+        }
+
+        mass += Mass(b);
+        mx += Mass(b) * X(Pos(b));
+        my += Mass(b) * Y(Pos(b));
+        mz += Mass(b) * Z(Pos(b));
+    }
+
+    if (mass > 0.0)
+    {
+        SET_VECTOR(*cm, mx / mass, my / mass, mz / mass);
+    }
+
+    return mass;
+}
+
+/* Largest distance along an axis of a body with mass from c */
+static real nbPMExtent(const NBodyState* st, mwvector c)
+{
+    int i;
+    const Body* bodies = st->bodytab;
+    real ext = 0.0;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static) reduction(max: ext)
+  #endif
+    for (i = 0; i < st->nbody; ++i)
+    {
+        const Body* b = &bodies[i];
+
+        if (Mass(b) > 0.0)
+        {
+            ext = mw_fmax(ext, mw_fabs(X(Pos(b)) - X(c)));
+            ext = mw_fmax(ext, mw_fabs(Y(Pos(b)) - Y(c)));
+            ext = mw_fmax(ext, mw_fabs(Z(Pos(b)) - Z(c)));
+        }
+    }
+
+    return ext;
+}
+
+/* Place the mesh around the dwarf for this force calculation */
+static void nbPMPlaceMesh(const NBodyCtx* ctx, const NBodyState* st, NBodyPM* pm)
+{
+    const real inner = 0.5 * pm->n - NBODY_PM_MARGIN;   /* cells from the centre bodies may be */
+    mwvector c = ZERO_VECTOR;
+    real side;
+
+    nbPMCentreOfMass(st, c, 0.0, ctx->deterministic, &c);
+
+    if (ctx->pmBoxSize > 0.0)
+    {
+        side = ctx->pmBoxSize;
+        nbPMCentreOfMass(st, c, inner * side / pm->n, ctx->deterministic, &c);   /* of the mass on the mesh */
+    }
+    else
+    {
+        real ext = mw_fmax(nbPMExtent(st, c), mw_sqrt(ctx->eps2));
+        side = pm->n * ext / inner * (1.0 + 1.0e-6);
+        side = mw_pow(2.0, mw_ceil(NBODY_PM_BOX_STEPS * mw_log2(side)) / NBODY_PM_BOX_STEPS);
+    }
+
+    pm->h = side / pm->n;
+    SET_VECTOR(pm->origin, X(c) - 0.5 * side, Y(c) - 0.5 * side, Z(c) - 0.5 * side);
+}
+
+/* Find the cell a body's cloud starts in and its weights in the next
+ * cell along each axis. Returns FALSE for a body off the mesh. */
+static inline mwbool nbPMCloud(const NBodyPM* pm, mwvector pos, int* c, real* f)
+{
+    int d;
+    const real lo = NBODY_PM_MARGIN - 1;
+    const real hi = pm->n - NBODY_PM_MARGIN;
+    real u[3];
+
+    u[0] = (X(pos) - X(pm->origin)) / pm->h - 0.5;
+    u[1] = (Y(pos) - Y(pm->origin)) / pm->h - 0.5;
+    u[2] = (Z(pos) - Z(pm->origin)) / pm->h - 0.5;
+
+    for (d = 0; d < 3; ++d)
+    {
+        if (!(u[d] >= lo && u[d] < hi))
+            return FALSE;
+
+        c[d] = (int) mw_floor(u[d]);
+        f[d] = u[d] - c[d];
+    }
+
+    return TRUE;
+}
+
+/* Assign the masses of the bodies on the mesh to the padded mesh, and
+ * find the mass and centre of mass of them. Unless deterministic, the
+ * threads add into the mesh in whatever order they reach the bodies. */
+static real nbPMAssign(const NBodyState* st, NBodyPM* pm, mwbool deterministic, mwvector* cm)
+{
+    int i;
+    const Body* bodies = st->bodytab;
+    real* grid = pm->grid;
+    real mass = 0.0, mx = 0.0, my = 0.0, mz = 0.0;
+
+    memset(grid, 0, 2 * (size_t) pm->m * pm->m * pm->m * sizeof(real));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) schedule(static) reduction(+: mass, mx, my, mz) if (!deterministic)
+  #endif
+    for (i = 0; i < st->nbody; ++i)
+    {
+        int c[3], a, b, k;
+        real f[3];
+        const Body* p = &bodies[i];
+
+        if (Mass(p) <= 0.0 || !nbPMCloud(pm, Pos(p), c, f))
+            continue;
+
+        for (k = 0; k < 2; ++k)
+        {
+            for (b = 0; b < 2; ++b)
+            {
+                for (a = 0; a < 2; ++a)
+                {
+                    real w = Mass(p) * (a ? f[0] : 1.0 - f[0]) * (b ? f[1] : 1.0 - f[1]) * (k ? f[2] : 1.0 - f[2]);
+                    size_t idx = nbPMPaddedIndex(pm, c[0] + a, c[1] + b, c[2] + k);
+
+                  #ifdef _OPENMP
+                    #pragma omp atomic
+                  #endif
+                    grid[2 * idx] += w;
+                }
+            }
+        }
+
+        mass += Mass(p);
+        mx += Mass(p) * X(Pos(p));
+        my += Mass(p) * Y(Pos(p));
+        mz += Mass(p) * Z(Pos(p));
+    }
+
+    if (mass > 0.0)
+    {
+        SET_VECTOR(*cm, mx / mass, my / mass, mz / mass);
+    }
+
+    return mass;
+}
+
+/* Convolve the masses on the padded mesh with the Green's function, and
+ * difference the potential into the acceleration on the mesh */
+static void nbPMSolve(NBodyPM* pm)
+{
+    int k;
+    const int n = pm->n;
+    const int m = pm->m;
+    const size_t mCell = (size_t) m * m * m;
+    const real scale = 1.0 / (real) mCell;
+    const real inv12h = 1.0 / (12.0 * pm->h);
+    const real* phi = pm->phi;
+    size_t idx;
+
+    /* The masses only fill the first n cells along each axis */
+    nbPMTransformAxis(pm, 0, n, n, FALSE);
+    nbPMTransformAxis(pm, 1, m, n, FALSE);
+    nbPMTransformAxis(pm, 2, m, m, FALSE);
+
+    for (idx = 0; idx < mCell; ++idx)
+    {
+        pm->grid[2 * idx] *= pm->green[idx];
+        pm->grid[2 * idx + 1] *= pm->green[idx];
+    }
+
+    /* and only the potential on those cells is needed */
+    nbPMTransformAxis(pm, 2, m, m, TRUE);
+    nbPMTransformAxis(pm, 1, m, n, TRUE);
+    nbPMTransformAxis(pm, 0, n, n, TRUE);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(static)
+  #endif
+    for (k = 0; k < n; ++k)
+    {
+        int i, j;
+        for (j = 0; j < n; ++j)
+        {
+            for (i = 0; i < n; ++i)
+            {
+                pm->phi[nbPMIndex(pm, i, j, k)] = scale * pm->grid[2 * nbPMPaddedIndex(pm, i, j, k)];
+            }
+        }
+    }
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(static)
+  #endif
+    for (k = 2; k < n - 2; ++k)
+    {
+        int i, j;
+        for (j = 2; j < n - 2; ++j)
+        {
+            for (i = 2; i < n - 2; ++i)
+            {
+                const size_t c = nbPMIndex(pm, i, j, k);
+                const size_t sj = (size_t) n;
+                const size_t sk = (size_t) n * n;
+
+                pm->ax[c] = -(8.0 * (phi[c + 1] - phi[c - 1]) - (phi[c + 2] - phi[c - 2])) * inv12h;
+                pm->ay[c] = -(8.0 * (phi[c + sj] - phi[c - sj]) - (phi[c + 2 * sj] - phi[c - 2 * sj])) * inv12h;
+                pm->az[c] = -(8.0 * (phi[c + sk] - phi[c - sk]) - (phi[c + 2 * sk] - phi[c - 2 * sk])) * inv12h;
+            }
+        }
+    }
+}
+
+/* Interpolate the acceleration on the mesh to a body's cloud */
+static inline mwvector nbPMInterpolate(const NBodyPM* pm, const int* c, const real* f)
+{
+    int a, b, k;
+    mwvector acc = ZERO_VECTOR;
+
+    for (k = 0; k < 2; ++k)
+    {
+        for (b = 0; b < 2; ++b)
+        {
+            for (a = 0; a < 2; ++a)
+            {
+                real w = (a ? f[0] : 1.0 - f[0]) * (b ? f[1] : 1.0 - f[1]) * (k ? f[2] : 1.0 - f[2]);
+                size_t idx = nbPMIndex(pm, c[0] + a, c[1] + b, c[2] + k);
+
+                acc.x += w * pm->ax[idx];
+                acc.y += w * pm->ay[idx];
+                acc.z += w * pm->az[idx];
+            }
+        }
+    }
+
+    return acc;
+}
+
+/* Find the radius of each tree cell around its center of mass, working
+ * up from the leaves. Cells are stored in depth first order, so each
+ * comes after its parent. */
+static void nbPMCellRadii(const NBodyState* st, real* radius)
+{
+    int c;
+    const NBodyCell* cells = st->tree.cells;
+    const Body* btab = st->bodytab;
+
+    for (c = (int) st->tree.cellUsed - 1; c >= 0; --c)
+    {
+        const NBodyCell* p = &cells[c];
+        nodelink_t l = More(p);
+        real r = 0.0;
+
+        while (l != Next(p))                /* loop over children */
+        {
+            const NBodyNode* q = LinkNode(cells, btab, l);
+            r = mw_fmax(r, mw_distv(Pos(q), Pos(p)) + (isBodyLink(l) ? 0.0 : radius[l]));
+            l = Next(q);
+        }
+
+        radius[c] = r;
+    }
+}
+
+/* Short range part of the force on body p from the tree, skipping any
+ * cell with none of its bodies within the cutoff */
+static mwvector nbPMShortRange(const NBodyCtx* ctx, const NBodyState* st, const NBodyPM* pm,
+                               const real* radius, const Body* p, real rs)
+{
+    const real rcut = NBODY_PM_CUTOFF * rs;
+    const real rcut2 = sqr(rcut);
+    const real toTable = NBODY_PM_TABLE_STEPS / rs;
+    const NBodyCell* cells = st->tree.cells;
+    const Body* btab = st->bodytab;
+    const NBodyNode* q = (const NBodyNode*) st->tree.root;
+    const mwvector pos0 = Pos(p);
+    mwvector acc0 = ZERO_VECTOR;
+    nodelink_t l;
+
+    while (q != NULL)
+    {
+        mwvector dr = mw_subv(Pos(q), pos0);
+        real drSq = mw_sqrv(dr);
+        mwbool accept;
+
+        if (isBody(q))
+        {
+            accept = ((const Body*) q != p);
+            l = Next(q);
+        }
+        else if (drSq > sqr(rcut + radius[(const NBodyCell*) q - cells]))
+        {
+            accept = FALSE;
+            l = Next(q);
+        }
+        else if (drSq >= Rcrit2(q))
+        {
+            accept = TRUE;
+            l = Next(q);
+        }
+        else
+        {
+            accept = FALSE;
+            l = More(q);
+        }
+
+        if (accept && drSq < rcut2)
+        {
+            real x = mw_sqrt(drSq) * toTable;
+            int k = (int) x;
+            real g = pm->shortWeight[k] + (x - k) * (pm->shortWeight[k + 1] - pm->shortWeight[k]);
+            real soft = drSq + ctx->eps2;
+            real mor3 = g * Mass(q) / (soft * mw_sqrt(soft));
+
+            acc0.x += mor3 * dr.x;
+            acc0.y += mor3 * dr.y;
+            acc0.z += mor3 * dr.z;
+        }
+
+        q = (l == NULL_LINK) ? NULL : LinkNode(cells, btab, l);
+    }
+
+    return acc0;
+}
+
+void nbPMGravity(const NBodyCtx* ctx, NBodyState* st)
+{
+    int k;
+    int* order = NULL;
+    const int nbody = st->nbody;
+    const Body* bodies = st->bodytab;
+    mwvector* accels = st->acctab;
+    mwvector meshCentre = ZERO_VECTOR;
+    real meshMass, rs;
+    real* radius = NULL;
+    NBodyPM* pm;
+
+    if (!st->pm || st->pm->n != (int) ctx->pmGridSize)
+    {
+        nbDestroyPM(st->pm);
+        st->pm = nbCreatePM((int) ctx->pmGridSize);
+    }
+    pm = st->pm;
+
+    nbPMPlaceMesh(ctx, st, pm);
+    rs = ctx->pmSplit * pm->h;
+
+    if (mw_fabs(pm->hGreen - pm->h) > 1.0e-9 * pm->h || mw_fabs(pm->rsGreen - rs) > 1.0e-9 * pm->h)
+    {
+        nbPMGreen(pm, pm->h, rs, ctx->eps2);
+    }
+
+    meshMass = nbPMAssign(st, pm, ctx->deterministic, &meshCentre);
+    if (meshMass > 0.0)
+    {
+        nbPMSolve(pm);
+    }
+
+    /* Walk the tree for the bodies in the order it holds them, so the
+     * neighbourhoods walked one after another overlap */
+    if (rs > 0.0 && st->tree.root)
+    {
+        radius = (real*) mwMallocA(st->tree.cellUsed * sizeof(real));
+        nbPMCellRadii(st, radius);
+
+        order = (int*) mwMalloc(nbody * sizeof(int));
+        if (nbTreeBodyOrder(st, order) != nbody)
+        {
+            free(order);
+            order = NULL;
+        }
+    }
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(k) schedule(dynamic, 4096 / sizeof(accels[0]))
+  #endif
+    for (k = 0; k < nbody; ++k)
+    {
+        int c[3];
+        real f[3];
+        const int i = order ? order[k] : k;
+        const Body* b = &bodies[i];
+
+        if (meshMass <= 0.0)
+        {
+            SET_VECTOR(accels[i], 0.0, 0.0, 0.0);
+        }
+        else if (nbPMCloud(pm, Pos(b), c, f))
+        {
+            mwvector a = nbPMInterpolate(pm, c, f);
+
+            if (radius)
+            {
+                mwvector aShort = nbPMShortRange(ctx, st, pm, radius, b, rs);
+                mw_incaddv(a, aShort);
+            }
+
+            accels[i] = a;
+        }
+        else    /* off the mesh */
+        {
+            mwvector dr = mw_subv(meshCentre, Pos(b));
+            real soft = mw_sqrv(dr) + ctx->eps2;
+
+            accels[i] = mw_mulvs(dr, meshMass / (soft * mw_sqrt(soft)));
+        }
+    }
+
+    free(order);
+    mwFreeA(radius);
+}
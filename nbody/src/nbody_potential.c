@@ -624,13 +624,20 @@ static inline mwvector ninkovicHaloAccel(const Halo* h, mwvector pos, real r)
     return acc;
 }
 
+/* Distance from the centre, kept from getting too small */
+static inline real nbExtRadius(mwvector pos)
+{
+    const real limit = 0.00390625;  /* 2^-8 */
+    const real r = mw_absv(pos);
+
+    /* Change r if less than limit. A select, so it vectorizes */
+    return (r <= limit) ? limit : r;
+}
+
 mwvector nbExtAcceleration(const Potential* pot, mwvector pos, real time)
 {
     mwvector acc, acctmp;
-    real limit = mw_pow(2.0,-8.0);
-
-    /* Change r if less than limit. Done this way to pipeline this step*/
-    real r = (mw_absv(pos) <= limit)*limit + (mw_absv(pos) > limit)*mw_absv(pos);
+    real r = nbExtRadius(pos);
 
     /*Calculate the Disk Accelerations*/
     switch (pot->disk.type)
@@ -761,9 +768,216 @@ mwvector nbExtAcceleration(const Potential* pot, mwvector pos, real time)
     return acc;
 }
 
+/* The components of a potential in the order nbExtAcceleration() adds
+ * them */
+typedef enum
+{
+    EXT_DISK,
+    EXT_DISK2,
+    EXT_HALO,
+    EXT_BULGE
+} NBodyExtComponent;
+
+/* Add one component of pot at each position of the block to ax, ay, az,
+ * found by nbExtAcceleration() on a copy of pot without the others. For
+ * the components with no loop of their own below. */
+static void nbComponentBlock(const Potential* pot, NBodyExtComponent component,
+                             const real* x, const real* y, const real* z,
+                             real* ax, real* ay, real* az, int n, real time)
+{
+    int i;
+    Potential only = *pot;
+
+    if (component != EXT_DISK)
+        only.disk.type = NoDisk;
+    if (component != EXT_DISK2)
+        only.disk2.type = NoDisk;
+    if (component != EXT_HALO)
+        only.halo.type = NoHalo;
+    if (component != EXT_BULGE)
+        only.sphere[0].type = NoSpherical;
+
+    for (i = 0; i < n; ++i)
+    {
+        mwvector pos = mw_vec(x[i], y[i], z[i]);
+        mwvector a = nbExtAcceleration(&only, pos, time);
+
+        ax[i] += X(a);
+        ay[i] += Y(a);
+        az[i] += Z(a);
+    }
+}
+
+static void nbDiskBlock(const Potential* pot, NBodyExtComponent component,
+                        const real* RESTRICT x, const real* RESTRICT y, const real* RESTRICT z,
+                        real* RESTRICT ax, real* RESTRICT ay, real* RESTRICT az, int n, real time)
+{
+    int i;
+    const Disk* disk = (component == EXT_DISK) ? &pot->disk : &pot->disk2;
+
+    switch (disk->type)
+    {
+        case NoDisk:
+            break;
+
+        case MiyamotoNagaiDisk:
+          #ifdef _OPENMP
+            #pragma omp simd
+          #endif
+            for (i = 0; i < n; ++i)
+            {
+                mwvector pos = mw_vec(x[i], y[i], z[i]);
+                mwvector a = miyamotoNagaiDiskAccel(disk, pos, nbExtRadius(pos));
+
+                ax[i] += X(a);
+                ay[i] += Y(a);
+                az[i] += Z(a);
+            }
+            break;
 
+        case FreemanDisk:
+        case DoubleExponentialDisk:
+        case Sech2ExponentialDisk:
+        case OrbitingBar:
+        case InvalidDisk:
+        default:
+            nbComponentBlock(pot, component, x, y, z, ax, ay, az, n, time);
+    }
+}
 
+static void nbHaloBlock(const Potential* pot,
+                        const real* RESTRICT x, const real* RESTRICT y, const real* RESTRICT z,
+                        real* RESTRICT ax, real* RESTRICT ay, real* RESTRICT az, int n, real time)
+{
+    int i;
+    const Halo* halo = &pot->halo;
 
+    switch (halo->type)
+    {
+        case NoHalo:
+            break;
 
+        case LogarithmicHalo:
+          #ifdef _OPENMP
+            #pragma omp simd
+          #endif
+            for (i = 0; i < n; ++i)
+            {
+                mwvector pos = mw_vec(x[i], y[i], z[i]);
+                mwvector a = logHaloAccel(halo, pos);
+
+                ax[i] += X(a);
+                ay[i] += Y(a);
+                az[i] += Z(a);
+            }
+            break;
 
+        case NFWHalo:
+          #ifdef _OPENMP
+            #pragma omp simd
+          #endif
+            for (i = 0; i < n; ++i)
+            {
+                mwvector pos = mw_vec(x[i], y[i], z[i]);
+                mwvector a = nfwHaloAccel(halo, pos, nbExtRadius(pos));
+
+                ax[i] += X(a);
+                ay[i] += Y(a);
+                az[i] += Z(a);
+            }
+            break;
+
+        case TriaxialHalo:
+          #ifdef _OPENMP
+            #pragma omp simd
+          #endif
+            for (i = 0; i < n; ++i)
+            {
+                mwvector pos = mw_vec(x[i], y[i], z[i]);
+                mwvector a = triaxialHaloAccel(halo, pos, nbExtRadius(pos));
+
+                ax[i] += X(a);
+                ay[i] += Y(a);
+                az[i] += Z(a);
+            }
+            break;
+
+        case HernquistHalo:
+          #ifdef _OPENMP
+            #pragma omp simd
+          #endif
+            for (i = 0; i < n; ++i)
+            {
+                mwvector pos = mw_vec(x[i], y[i], z[i]);
+                mwvector a = hernquistHaloAccel(halo, pos, nbExtRadius(pos));
+
+                ax[i] += X(a);
+                ay[i] += Y(a);
+                az[i] += Z(a);
+            }
+            break;
+
+        case CausticHalo:
+        case AllenSantillanHalo:
+        case WilkinsonEvansHalo:
+        case NFWMassHalo:
+        case PlummerHalo:
+        case NinkovicHalo:
+        case InvalidHalo:
+        default:
+            nbComponentBlock(pot, EXT_HALO, x, y, z, ax, ay, az, n, time);
+    }
+}
+
+static void nbBulgeBlock(const Potential* pot,
+                         const real* RESTRICT x, const real* RESTRICT y, const real* RESTRICT z,
+                         real* RESTRICT ax, real* RESTRICT ay, real* RESTRICT az, int n, real time)
+{
+    int i;
+    const Spherical* sph = &pot->sphere[0];
+
+    switch (sph->type)
+    {
+        case NoSpherical:
+            break;
+
+        case HernquistSpherical:
+          #ifdef _OPENMP
+            #pragma omp simd
+          #endif
+            for (i = 0; i < n; ++i)
+            {
+                mwvector pos = mw_vec(x[i], y[i], z[i]);
+                mwvector a = hernquistSphericalAccel(sph, pos, nbExtRadius(pos));
+
+                ax[i] += X(a);
+                ay[i] += Y(a);
+                az[i] += Z(a);
+            }
+            break;
+
+        case PlummerSpherical:
+        case InvalidSpherical:
+        default:
+            nbComponentBlock(pot, EXT_BULGE, x, y, z, ax, ay, az, n, time);
+    }
+}
+
+/* The type of each component is looked up once for the whole block
+ * rather than once for each position. The common components run through
+ * the same inline functions as nbExtAcceleration() in loops that
+ * vectorize, and are added in the same order, so each position gets
+ * exactly the same acceleration either way. */
+void nbExtAccelerationBlock(const Potential* pot, const real* x, const real* y, const real* z,
+                            real* ax, real* ay, real* az, int n, real time)
+{
+    memset(ax, 0, n * sizeof(real));
+    memset(ay, 0, n * sizeof(real));
+    memset(az, 0, n * sizeof(real));
+
+    nbDiskBlock(pot, EXT_DISK, x, y, z, ax, ay, az, n, time);
+    nbDiskBlock(pot, EXT_DISK2, x, y, z, ax, ay, az, n, time);
+    nbHaloBlock(pot, x, y, z, ax, ay, az, n, time);
+    nbBulgeBlock(pot, x, y, z, ax, ay, az, n, time);
+}
 
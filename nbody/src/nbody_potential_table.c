@@ -0,0 +1,762 @@
+/*
+ *  This file is part of Milkway@Home.
+ *
+ *  Milkway@Home is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Interpolation table of the slow parts of the external potential.
+ *
+ * The exponential disks sum long Bessel function quadratures and the
+ * caustic halo sums over its rings for every body on every step. All
+ * three are static, axisymmetric and symmetric about the disk plane, so
+ * their acceleration is tabulated once on a grid in R and |z| and
+ * interpolated from it. The other components are cheaper to evaluate
+ * than to interpolate, or depend on time or azimuth, and are still found
+ * directly.
+ *
+ * The grid is uniform in asinh(R / scaleR) and asinh(|z| / scaleZ), so
+ * it is fine within a scale length and height of the centre and plane
+ * and spreads out logarithmically beyond them. The nodes sit in the
+ * middle of the cells, off the axis and the plane where the disks divide
+ * by R and |z|, and the nodes across them are found from the symmetry:
+ * the acceleration along R is odd in R and even in z, and the one along z
+ * the other way around. Each component is interpolated with a cubic
+ * through 4 x 4 nodes.
+ *
+ * The relative error of the acceleration is checked in the middle of
+ * every cell, where cubic interpolation is worst, and the cells outside
+ * the tolerance are evaluated directly. The table starts coarse and is
+ * halved until few enough cells are left to evaluate directly, which
+ * also keeps the table clear of where the direct evaluation itself goes
+ * wrong, such as the disks' quadratures very close to the axis. Since
+ * those cells stay wrong however fine the table gets, refining also stops
+ * once it no longer halves the share of the cells left direct.
+ *
+ * A Lua closure potential costs a call into the interpreter for every
+ * body on every step. It takes no time, so it is static too, but may have
+ * no symmetry, so it is tabulated on a Cartesian grid instead, uniform in
+ * asinh(x / 1 kpc) along each axis, interpolated with a cubic through
+ * 4 x 4 x 4 nodes and checked the same way. A closure found to be
+ * axisymmetric and symmetric about the plane at a spread of points goes
+ * in the R and z table instead, whose lookup costs a quarter of the
+ * nodes of the Cartesian one.
+ */
+
+#include "nbody_priv.h"
+#include "nbody_potential_table.h"
+#include "nbody_potential.h"
+#include "nbody_lua.h"
+#include "milkyway_util.h"
+
+
+#define NBODY_TABLE_RADIUS ((real) 100.0)  /* R and |z| covered, in kpc */
+#define NBODY_TABLE_START_CELLS 16
+#define NBODY_TABLE_MAX_CELLS 512          /* along each side */
+#define NBODY_TABLE_DIRECT_FRACTION 64     /* refine until at most 1 / this of the cells are direct */
+                                           /* or halving the cells no longer halves their share */
+#define NBODY_CLOSURE_SCALE ((real) 1.0)  /* kpc beyond which the closure's grid spreads out */
+#define NBODY_CLOSURE_MAX_CELLS 64         /* along each axis */
+#define NBODY_CLOSURE_SYMMETRY ((real) 0.01) /* of the tolerance, largest asymmetry of an axisymmetric closure */
+
+struct NBodyPotentialTable
+{
+    Potential tabled;          /* the components in the table */
+    Potential rest;            /* the others, evaluated as usual */
+    mwbool haveRest;
+    mwbool closure;            /* the R and z table holds an axisymmetric Lua closure instead */
+    int nR, nZ;                /* cells in R and z; there are 2 more nodes than cells along each */
+    real radiusR;              /* R covered, out to the corners of the Cartesian table for a closure */
+    real scaleR, scaleZ;
+    real invDu, invDv;         /* cells per unit of asinh(R / scaleR) and asinh(|z| / scaleZ) */
+    real* aR;                  /* acceleration along R and z at each node, by R then z */
+    real* aZ;
+    unsigned char* direct;     /* cells outside the tolerance, by R then z, or by x, y then z */
+    int nDirect;
+    real error;                /* largest relative error of the other cells */
+
+    int nC;                    /* cells along each axis of a closure's table, else 0; there are 4 more nodes */
+    real invDw;                /* cells per unit of asinh(x / NBODY_CLOSURE_SCALE) */
+    real* aC;                  /* acceleration x, y and z at each node, by x, y then z */
+};
+
+
+static mwbool nbSlowDisk(const Disk* d)
+{
+    return d->type == DoubleExponentialDisk || d->type == Sech2ExponentialDisk;
+}
+
+/* Split pot into the components to tabulate and the rest. Returns FALSE
+ * if there is nothing to tabulate. */
+static mwbool nbSplitPotential(NBodyPotentialTable* t, const Potential* pot)
+{
+    mwbool any = FALSE;
+
+    t->tabled = *pot;
+    t->rest = *pot;
+
+    if (nbSlowDisk(&pot->disk))
+    {
+        t->rest.disk.type = NoDisk;
+        any = TRUE;
+    }
+    else
+    {
+        t->tabled.disk.type = NoDisk;
+    }
+
+    if (nbSlowDisk(&pot->disk2))
+    {
+        t->rest.disk2.type = NoDisk;
+        any = TRUE;
+    }
+    else
+    {
+        t->tabled.disk2.type = NoDisk;
+    }
+
+    if (pot->halo.type == CausticHalo)
+    {
+        t->rest.halo.type = NoHalo;
+        any = TRUE;
+    }
+    else
+    {
+        t->tabled.halo.type = NoHalo;
+    }
+
+    t->tabled.sphere[0].type = NoSpherical;
+
+    t->haveRest = t->rest.disk.type != NoDisk
+              || t->rest.disk2.type != NoDisk
+              || t->rest.halo.type != NoHalo
+              || t->rest.sphere[0].type != NoSpherical;
+
+    return any;
+}
+
+/* Smallest scale length and height of the tabulated disks, or 1 kpc
+ * for the caustic halo alone */
+static void nbTableScales(NBodyPotentialTable* t)
+{
+    const Disk* disks[2] = { &t->tabled.disk, &t->tabled.disk2 };
+    int k;
+
+    t->scaleR = 0.0;
+    t->scaleZ = 0.0;
+
+    for (k = 0; k < 2; ++k)
+    {
+        if (disks[k]->type == NoDisk)
+            continue;
+
+        if (disks[k]->scaleLength > 0.0)
+            t->scaleR = (t->scaleR > 0.0) ? mw_fmin(t->scaleR, disks[k]->scaleLength) : disks[k]->scaleLength;
+        if (disks[k]->scaleHeight > 0.0)
+            t->scaleZ = (t->scaleZ > 0.0) ? mw_fmin(t->scaleZ, disks[k]->scaleHeight) : disks[k]->scaleHeight;
+    }
+
+    if (!(t->scaleR > 0.0))
+        t->scaleR = 1.0;
+    if (!(t->scaleZ > 0.0))
+        t->scaleZ = t->scaleR;
+}
+
+/* Acceleration along R and z of the tabulated components or closure at R, z > 0 */
+static void nbTabledAccel(const NBodyPotentialTable* t, NBodyState* st, real R, real z, real* aR, real* aZ)
+{
+    mwvector pos, acc;
+
+    SET_VECTOR(pos, R, 0.0, z);
+    if (t->closure)
+    {
+        nbEvalPotentialClosure(st, pos, &acc);
+    }
+    else
+    {
+        acc = nbExtAcceleration(&t->tabled, pos, 0.0);
+    }
+
+    *aR = X(acc);
+    *aZ = Z(acc);
+}
+
+static void nbFillTable(NBodyPotentialTable* t, NBodyState* st, int nCells)
+{
+    int i, j;
+    const int nNodeZ = nCells + 2;
+    const real du = mw_asinh(t->radiusR / t->scaleR) / nCells;
+    const real dv = mw_asinh(NBODY_TABLE_RADIUS / t->scaleZ) / nCells;
+
+    t->nR = nCells;
+    t->nZ = nCells;
+    t->invDu = 1.0 / du;
+    t->invDv = 1.0 / dv;
+    t->aR = (real*) mwMallocA((nCells + 2) * nNodeZ * sizeof(real));
+    t->aZ = (real*) mwMallocA((nCells + 2) * nNodeZ * sizeof(real));
+    t->direct = (unsigned char*) mwCalloc(nCells * nCells, sizeof(unsigned char));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i, j) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nCells + 2; ++i)
+    {
+        const real R = t->scaleR * mw_sinh((i + 0.5) * du);
+
+        for (j = 0; j < nNodeZ; ++j)
+        {
+            const real z = t->scaleZ * mw_sinh((j + 0.5) * dv);
+            nbTabledAccel(t, st, R, z, &t->aR[i * nNodeZ + j], &t->aZ[i * nNodeZ + j]);
+        }
+    }
+}
+
+/* Weights of the cubic through the nodes at -1, 0, 1, 2 at x in [0, 1] */
+static inline void nbCubicWeights(real x, real w[4])
+{
+    w[0] = -x * (x - 1.0) * (x - 2.0) / 6.0;
+    w[1] = (x + 1.0) * (x - 1.0) * (x - 2.0) / 2.0;
+    w[2] = -(x + 1.0) * x * (x - 2.0) / 2.0;
+    w[3] = (x + 1.0) * x * (x - 1.0) / 6.0;
+}
+
+/* Weights of the stencil for node position p >= -0.5 between nodes
+ * first and first + 1, and its node indices folded back across 0 with
+ * the sign an odd component takes there */
+static inline void nbStencil(real p, int first, real w[4], int node[4], real odd[4])
+{
+    int k;
+
+    nbCubicWeights(p - first, w);
+
+    for (k = 0; k < 4; ++k)
+    {
+        const int n = first - 1 + k;
+
+        node[k] = (n < 0) ? -1 - n : n;
+        odd[k] = (n < 0) ? -1.0 : 1.0;
+    }
+}
+
+/* Interpolate at R and |z| inside the table. Returns FALSE without
+ * interpolating in a cell to be evaluated directly. */
+static inline mwbool nbInterpolate(const NBodyPotentialTable* t, real R, real absZ, real* aR, real* aZ)
+{
+    int a, b;
+    real wu[4], wv[4], oddU[4], oddV[4];
+    int iu[4], iv[4];
+    real sumR = 0.0, sumZ = 0.0;
+    const int nNodeZ = t->nZ + 2;
+    const real pu = mw_asinh(R / t->scaleR) * t->invDu - 0.5;
+    const real pv = mw_asinh(absZ / t->scaleZ) * t->invDv - 0.5;
+    const int ku = (int) mw_floor(pu);
+    const int kv = (int) mw_floor(pv);
+
+    /* Within half a node of the axis or plane counts as the first cell */
+    if (t->direct[(ku < 0 ? 0 : ku) * t->nZ + (kv < 0 ? 0 : kv)])
+        return FALSE;
+
+    nbStencil(pu, ku, wu, iu, oddU);
+    nbStencil(pv, kv, wv, iv, oddV);
+
+    for (a = 0; a < 4; ++a)
+    {
+        const real* rowR = &t->aR[iu[a] * nNodeZ];
+        const real* rowZ = &t->aZ[iu[a] * nNodeZ];
+        real colR = 0.0, colZ = 0.0;
+
+        for (b = 0; b < 4; ++b)
+        {
+            colR += wv[b] * rowR[iv[b]];
+            colZ += wv[b] * oddV[b] * rowZ[iv[b]];
+        }
+
+        sumR += wu[a] * oddU[a] * colR;
+        sumZ += wu[a] * colZ;
+    }
+
+    *aR = sumR;
+    *aZ = sumZ;
+    return TRUE;
+}
+
+/* Check the middle of each cell, marking those outside the tolerance to
+ * be evaluated directly */
+static void nbCheckTable(NBodyPotentialTable* t, NBodyState* st, real tolerance)
+{
+    int i, j;
+    int nDirect = 0;
+    real worst = 0.0;
+    const real du = 1.0 / t->invDu;
+    const real dv = 1.0 / t->invDv;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i, j) schedule(dynamic, 1) reduction(max: worst) reduction(+: nDirect)
+  #endif
+    for (i = 0; i < t->nR; ++i)
+    {
+        const real R = t->scaleR * mw_sinh((i + 1) * du);
+
+        for (j = 0; j < t->nZ; ++j)
+        {
+            const real z = t->scaleZ * mw_sinh((j + 1) * dv);
+            real aR, aZ, err;
+            real tR = 0.0, tZ = 0.0;   /* no cell is direct yet */
+
+            nbTabledAccel(t, st, R, z, &aR, &aZ);
+            nbInterpolate(t, R, z, &tR, &tZ);
+            err = mw_sqrt(sqr(tR - aR) + sqr(tZ - aZ)) / mw_sqrt(sqr(aR) + sqr(aZ));
+
+            if (err <= tolerance)
+            {
+                worst = mw_fmax(worst, err);
+            }
+            else
+            {
+                t->direct[i * t->nZ + j] = TRUE;
+                ++nDirect;
+            }
+        }
+    }
+
+    t->error = worst;
+    t->nDirect = nDirect;
+}
+
+static void nbFreeTableArrays(NBodyPotentialTable* t)
+{
+    mwFreeA(t->aR);
+    mwFreeA(t->aZ);
+    mwFreeA(t->aC);
+    free(t->direct);
+    t->aR = NULL;
+    t->aZ = NULL;
+    t->aC = NULL;
+    t->direct = NULL;
+}
+
+/* Coordinate of node or node position p of a closure's table with
+ * nCells cells, nodes sitting 1.5 nodes outside the table on either
+ * side so a cubic reaches its edges */
+static inline real nbClosureCoord(real p, int nCells, real dw)
+{
+    const real w = (p - 1.5) * dw - 0.5 * nCells * dw;
+    return NBODY_CLOSURE_SCALE * mw_sinh(w);
+}
+
+static void nbFillClosureTable(NBodyPotentialTable* t, NBodyState* st, int nCells)
+{
+    int i, j, k;
+    const int nNode = nCells + 4;
+    const real dw = 2.0 * mw_asinh(NBODY_TABLE_RADIUS / NBODY_CLOSURE_SCALE) / nCells;
+
+    t->nC = nCells;
+    t->invDw = 1.0 / dw;
+    t->aC = (real*) mwMallocA(3 * nNode * nNode * nNode * sizeof(real));
+    t->direct = (unsigned char*) mwCalloc((nCells + 1) * (nCells + 1) * (nCells + 1), sizeof(unsigned char));
+
+    /* Each thread calls its own Lua state */
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i, j, k) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nNode; ++i)
+    {
+        const real x = nbClosureCoord(i, nCells, dw);
+
+        for (j = 0; j < nNode; ++j)
+        {
+            const real y = nbClosureCoord(j, nCells, dw);
+
+            for (k = 0; k < nNode; ++k)
+            {
+                mwvector pos, a;
+                real* node = &t->aC[3 * ((i * nNode + j) * nNode + k)];
+
+                SET_VECTOR(pos, x, y, nbClosureCoord(k, nCells, dw));
+                nbEvalPotentialClosure(st, pos, &a);
+                node[0] = X(a);
+                node[1] = Y(a);
+                node[2] = Z(a);
+            }
+        }
+    }
+}
+
+/* Interpolate the closure at pos inside the table. Returns FALSE
+ * without interpolating in a cell to be evaluated directly. */
+static inline mwbool nbInterpolateClosure(const NBodyPotentialTable* t, mwvector pos, mwvector* acc)
+{
+    int a, b, c, d;
+    real w[3][4];
+    int first[3];
+    real sum[3] = { 0.0, 0.0, 0.0 };
+    const int nCells = t->nC;
+    const int nNode = nCells + 4;
+    const real coord[3] = { X(pos), Y(pos), Z(pos) };
+
+    for (d = 0; d < 3; ++d)
+    {
+        const real p = mw_asinh(coord[d] / NBODY_CLOSURE_SCALE) * t->invDw + 0.5 * nCells + 1.5;
+        int k = (int) mw_floor(p);
+
+        k = (k > nCells + 1) ? nCells + 1 : k;   /* on the far edge */
+        nbCubicWeights(p - k, w[d]);
+        first[d] = k;
+    }
+
+    if (t->direct[((first[0] - 1) * (nCells + 1) + (first[1] - 1)) * (nCells + 1) + (first[2] - 1)])
+        return FALSE;
+
+    for (a = 0; a < 4; ++a)
+    {
+        for (b = 0; b < 4; ++b)
+        {
+            const real wab = w[0][a] * w[1][b];
+            const real* row = &t->aC[3 * (((first[0] - 1 + a) * nNode + (first[1] - 1 + b)) * nNode + first[2] - 1)];
+
+            for (c = 0; c < 4; ++c)
+            {
+                const real wabc = wab * w[2][c];
+
+                sum[0] += wabc * row[3 * c];
+                sum[1] += wabc * row[3 * c + 1];
+                sum[2] += wabc * row[3 * c + 2];
+            }
+        }
+    }
+
+    SET_VECTOR(*acc, sum[0], sum[1], sum[2]);
+    return TRUE;
+}
+
+static inline mwbool nbInsideClosureTable(mwvector pos)
+{
+    return mw_fabs(X(pos)) <= NBODY_TABLE_RADIUS
+        && mw_fabs(Y(pos)) <= NBODY_TABLE_RADIUS
+        && mw_fabs(Z(pos)) <= NBODY_TABLE_RADIUS;
+}
+
+/* Check the middle of each cell of a closure's table, marking those
+ * outside the tolerance to be evaluated directly */
+static void nbCheckClosureTable(NBodyPotentialTable* t, NBodyState* st, real tolerance)
+{
+    int i, j, k;
+    int nDirect = 0;
+    real worst = 0.0;
+    const int nCells = t->nC;
+    const real dw = 1.0 / t->invDw;
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i, j, k) schedule(dynamic, 1) reduction(max: worst) reduction(+: nDirect)
+  #endif
+    for (i = 1; i <= nCells + 1; ++i)
+    {
+        const real x = nbClosureCoord(i + 0.5, nCells, dw);
+
+        for (j = 1; j <= nCells + 1; ++j)
+        {
+            const real y = nbClosureCoord(j + 0.5, nCells, dw);
+
+            for (k = 1; k <= nCells + 1; ++k)
+            {
+                mwvector pos, a;
+                mwvector tabled = ZERO_VECTOR;   /* no cell is direct yet */
+                real err;
+
+                SET_VECTOR(pos, x, y, nbClosureCoord(k + 0.5, nCells, dw));
+                nbEvalPotentialClosure(st, pos, &a);
+                nbInterpolateClosure(t, pos, &tabled);
+                err = mw_absv(mw_subv(tabled, a)) / mw_absv(a);
+
+                if (err <= tolerance)
+                {
+                    worst = mw_fmax(worst, err);
+                }
+                else
+                {
+                    t->direct[((i - 1) * (nCells + 1) + (j - 1)) * (nCells + 1) + (k - 1)] = TRUE;
+                    ++nDirect;
+                }
+            }
+        }
+    }
+
+    t->error = worst;
+    t->nDirect = nDirect;
+}
+
+/* Whether the closure is axisymmetric and symmetric about the plane to
+ * within a small fraction of the tolerance, judged by turning and
+ * mirroring points spread from the centre to the edge of the table */
+static mwbool nbClosureIsAxisymmetric(NBodyState* st, real tolerance)
+{
+    static const real radii[] = { 0.3, 3.0, 30.0 };
+    static const real angles[] = { 0.7, 2.0, 3.9, 5.5 };
+    const real allowed = NBODY_CLOSURE_SYMMETRY * tolerance;
+    unsigned int i, j, k;
+
+    for (i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+    {
+        for (j = 0; j < sizeof(radii) / sizeof(radii[0]); ++j)
+        {
+            const real R = radii[i];
+            const real z = radii[j];
+            mwvector pos, ref, a;
+            real scale;
+
+            SET_VECTOR(pos, R, 0.0, z);
+            nbEvalPotentialClosure(st, pos, &ref);
+            scale = allowed * mw_absv(ref);
+
+            SET_VECTOR(pos, R, 0.0, -z);
+            nbEvalPotentialClosure(st, pos, &a);
+            if (mw_fabs(Y(ref)) > scale || mw_fabs(X(a) - X(ref)) > scale
+                || mw_fabs(Y(a)) > scale || mw_fabs(Z(a) + Z(ref)) > scale)
+            {
+                return FALSE;
+            }
+
+            for (k = 0; k < sizeof(angles) / sizeof(angles[0]); ++k)
+            {
+                const real c = mw_cos(angles[k]);
+                const real s = mw_sin(angles[k]);
+
+                SET_VECTOR(pos, R * c, R * s, z);
+                nbEvalPotentialClosure(st, pos, &a);
+                if (   mw_fabs(X(a) * c + Y(a) * s - X(ref)) > scale
+                    || mw_fabs(Y(a) * c - X(a) * s) > scale
+                    || mw_fabs(Z(a) - Z(ref)) > scale)
+                {
+                    return FALSE;
+                }
+            }
+        }
+    }
+
+    return !st->potentialEvalError;
+}
+
+/* Refine the R and z table from its coarsest until few enough cells are
+ * left direct, or refining stops helping */
+static void nbRefineTable(NBodyPotentialTable* t, NBodyState* st, real tolerance)
+{
+    int nCells;
+    int lastDirect = -1;
+
+    for (nCells = NBODY_TABLE_START_CELLS; nCells <= NBODY_TABLE_MAX_CELLS; nCells *= 2)
+    {
+        nbFreeTableArrays(t);
+        nbFillTable(t, st, nCells);
+        nbCheckTable(t, st, tolerance);
+
+        if (st->potentialEvalError)
+            break;
+
+        if (t->nDirect * NBODY_TABLE_DIRECT_FRACTION <= nCells * nCells)
+            break;
+
+        /* Twice the cells on each side and the same share direct is 4 times as many */
+        if (lastDirect >= 0 && t->nDirect > 2 * lastDirect)
+            break;
+        lastDirect = t->nDirect;
+    }
+}
+
+static void nbMakeClosureTable(const NBodyCtx* ctx, NBodyState* st)
+{
+    int nCells, nCellsTotal;
+    int lastDirect = -1;
+    NBodyPotentialTable* t;
+    double ts;
+
+    t = (NBodyPotentialTable*) mwCalloc(1, sizeof(NBodyPotentialTable));
+
+    ts = mwGetTime();
+    if (nbClosureIsAxisymmetric(st, ctx->potentialTableTolerance))
+    {
+        t->closure = TRUE;
+        t->radiusR = M_SQRT2 * NBODY_TABLE_RADIUS;
+        t->scaleR = NBODY_CLOSURE_SCALE;
+        t->scaleZ = NBODY_CLOSURE_SCALE;
+        nbRefineTable(t, st, ctx->potentialTableTolerance);
+
+        if (st->potentialEvalError || t->nDirect == t->nR * t->nZ)
+        {
+            mw_printf("Lua potential table did not reach tolerance %g in any cell, evaluating it directly\n",
+                      ctx->potentialTableTolerance);
+            nbDestroyPotentialTable(t);
+            return;
+        }
+
+        mw_printf("Tabulated axisymmetric Lua potential on %d x %d cells to R = %g, |z| = %g in %.2fs "
+                  "(relative error %.3e, %d cells evaluated directly)\n",
+                  t->nR, t->nZ, t->radiusR, NBODY_TABLE_RADIUS, mwGetTime() - ts, t->error, t->nDirect);
+
+        st->potTable = t;
+        return;
+    }
+
+    for (nCells = NBODY_TABLE_START_CELLS; nCells <= NBODY_CLOSURE_MAX_CELLS; nCells *= 2)
+    {
+        nbFreeTableArrays(t);
+        nbFillClosureTable(t, st, nCells);
+        nbCheckClosureTable(t, st, ctx->potentialTableTolerance);
+
+        if (st->potentialEvalError)
+            break;
+
+        nCellsTotal = (nCells + 1) * (nCells + 1) * (nCells + 1);
+        if (t->nDirect * NBODY_TABLE_DIRECT_FRACTION <= nCellsTotal)
+            break;
+
+        /* Twice the cells on each side is 8 times as many, so refining
+         * only helps while the share of them direct falls */
+        if (lastDirect >= 0 && t->nDirect >= 8 * lastDirect)
+            break;
+        lastDirect = t->nDirect;
+    }
+
+    nCellsTotal = (t->nC + 1) * (t->nC + 1) * (t->nC + 1);
+    if (st->potentialEvalError || t->nDirect == nCellsTotal)
+    {
+        mw_printf("Lua potential table did not reach tolerance %g in any cell, evaluating it directly\n",
+                  ctx->potentialTableTolerance);
+        nbDestroyPotentialTable(t);
+        return;
+    }
+
+    mw_printf("Tabulated Lua potential on %d x %d x %d cells to |x|, |y|, |z| = %g in %.2fs "
+              "(relative error %.3e, %d cells evaluated directly)\n",
+              t->nC, t->nC, t->nC, NBODY_TABLE_RADIUS, mwGetTime() - ts, t->error, t->nDirect);
+
+    st->potTable = t;
+}
+
+void nbDestroyPotentialTable(NBodyPotentialTable* t)
+{
+    if (!t)
+    {
+        return;
+    }
+
+    nbFreeTableArrays(t);
+    free(t);
+}
+
+void nbMakePotentialTable(const NBodyCtx* ctx, NBodyState* st)
+{
+    NBodyPotentialTable* t;
+    double ts;
+
+    if (st->potTable || !(ctx->potentialTableTolerance > 0.0))
+    {
+        return;
+    }
+
+    if (ctx->potentialType == EXTERNAL_POTENTIAL_CUSTOM_LUA)
+    {
+        nbMakeClosureTable(ctx, st);
+        return;
+    }
+
+    t = (NBodyPotentialTable*) mwCalloc(1, sizeof(NBodyPotentialTable));
+    if (ctx->potentialType != EXTERNAL_POTENTIAL_DEFAULT || !nbSplitPotential(t, &ctx->pot))
+    {
+        mw_printf("No slow external potential components to tabulate\n");
+        free(t);
+        return;
+    }
+
+    nbTableScales(t);
+    t->radiusR = NBODY_TABLE_RADIUS;
+
+    ts = mwGetTime();
+    nbRefineTable(t, st, ctx->potentialTableTolerance);
+
+    if (t->nDirect == t->nR * t->nZ)
+    {
+        mw_printf("External potential table did not reach tolerance %g in any cell, evaluating it directly\n",
+                  ctx->potentialTableTolerance);
+        nbDestroyPotentialTable(t);
+        return;
+    }
+
+    mw_printf("Tabulated external potential on %d x %d cells to R, |z| = %g in %.2fs "
+              "(relative error %.3e, %d cells evaluated directly)\n",
+              t->nR, t->nZ, NBODY_TABLE_RADIUS, mwGetTime() - ts, t->error, t->nDirect);
+
+    st->potTable = t;
+}
+
+/* Acceleration at pos from the R and z table. Returns FALSE outside it
+ * or in a cell to be evaluated directly. */
+static inline mwbool nbTableAcceleration(const NBodyPotentialTable* t, mwvector pos, mwvector* acc)
+{
+    real aR, aZ;
+    const real R = mw_sqrt(sqr(X(pos)) + sqr(Y(pos)));
+    const real absZ = mw_fabs(Z(pos));
+
+    if (R > t->radiusR || absZ > NBODY_TABLE_RADIUS || !nbInterpolate(t, R, absZ, &aR, &aZ))
+    {
+        return FALSE;
+    }
+
+    if (R > 0.0)
+    {
+        SET_VECTOR(*acc, aR * X(pos) / R, aR * Y(pos) / R, Z(pos) < 0.0 ? -aZ : aZ);
+    }
+    else
+    {
+        SET_VECTOR(*acc, 0.0, 0.0, Z(pos) < 0.0 ? -aZ : aZ);
+    }
+
+    return TRUE;
+}
+
+mwvector nbTableExtAcceleration(const NBodyPotentialTable* t, const Potential* pot, mwvector pos, real time)
+{
+    mwvector acc;
+
+    if (!t || !nbTableAcceleration(t, pos, &acc))
+    {
+        return nbExtAcceleration(pot, pos, time);
+    }
+
+    if (t->haveRest)
+    {
+        mw_incaddv(acc, nbExtAcceleration(&t->rest, pos, time));
+    }
+
+    return acc;
+}
+
+void nbTableClosureAcceleration(NBodyState* st, mwvector pos, mwvector* aOut)
+{
+    const NBodyPotentialTable* t = st->potTable;
+
+    if (!t)
+    {
+        nbEvalPotentialClosure(st, pos, aOut);
+    }
+    else if (t->closure)
+    {
+        if (!nbTableAcceleration(t, pos, aOut))
+            nbEvalPotentialClosure(st, pos, aOut);
+    }
+    else if (!nbInsideClosureTable(pos) || !nbInterpolateClosure(t, pos, aOut))
+    {
+        nbEvalPotentialClosure(st, pos, aOut);
+    }
+}
@@ -50,6 +50,10 @@ const char* showCriterionT(criterion_t x)
             return "BH86";
         case SW93:
             return "SW93";
+        case FMM:
+            return "FMM";
+        case PM:
+            return "PM";
         case InvalidCriterion:
             return "InvalidCriterion";
         default:
@@ -57,6 +61,21 @@ const char* showCriterionT(criterion_t x)
     }
 }
 
+const char* showIntegratorT(integrator_t x)
+{
+    switch (x)
+    {
+        case Leapfrog:
+            return "Leapfrog";
+        case Yoshida4:
+            return "Yoshida4";
+        case InvalidIntegrator:
+            return "InvalidIntegrator";
+        default:
+            return "Bad integrator_t";
+    }
+}
+
 const char* showSphericalT(spherical_t x)
 {
     switch (x)
@@ -385,12 +404,13 @@ char* showCell(const NBodyCell* c)
                      "NBodyCell = {\n"
                      "  cellnode = {\n"
                      "    pos  = %s\n"
-                     "    next = %p\n"
+                     "    next = %d\n"
                      "    mass = %f\n"
                      "    type = %d\n"
                      "  }\n"
                      "  rcrit2   = %f\n"
-                     "  more     = %p\n"
+                     "  more     = %d\n"
+                     "  nbody    = %u\n"
                      "  stuff    = {\n"
                      "    .quad = {\n"
                      "      .xx = %f, .xy = %f, .xz = %f,\n"
@@ -399,25 +419,26 @@ char* showCell(const NBodyCell* c)
                      "    },\n"
                      "\n"
                      "    .subp = {\n"
-                     "      %p, %p, %p, %p,\n"
-                     "      %p, %p, %p, %p\n"
+                     "      %d, %d, %d, %d,\n"
+                     "      %d, %d, %d, %d\n"
                      "    }\n"
                      "  }\n"
                      "}\n",
                      posBuf,
-                     (void*) Next(c),
+                     Next(c),
                      Mass(c),
                      Type(c),
 
                      Rcrit2(c),
-                     (void*) More(c),
+                     More(c),
+                     NBodies(c),
 
                      Quad(c).xx, Quad(c).xy, Quad(c).xz,
                      Quad(c).yy, Quad(c).yz,
                      Quad(c).zz,
 
-                     (void*) Subp(c)[0], (void*) Subp(c)[1], (void*) Subp(c)[2], (void*) Subp(c)[3],
-                     (void*) Subp(c)[5], (void*) Subp(c)[5], (void*) Subp(c)[6], (void*) Subp(c)[7]
+                     Subp(c)[0], Subp(c)[1], Subp(c)[2], Subp(c)[3],
+                     Subp(c)[4], Subp(c)[5], Subp(c)[6], Subp(c)[7]
             ))
     {
         mw_fail("asprintf() failed\n");
@@ -534,12 +555,29 @@ char* showNBodyCtx(const NBodyCtx* ctx)
                      "  treeRSize       = %f\n"
                      "  sunGCDist       = %f\n"
                      "  criterion       = %s\n"
+                     "  integrator      = %s\n"
                      "  useQuad         = %s\n"
                      "  allowIncest     = %s\n"
+                     "  parallelTree    = %s\n"
+                     "  costBalance     = %s\n"
+                     "  walkGroupSize   = %u\n"
+                     "  multipoleOrder  = %u\n"
+                     "  treeRefitSteps  = %u\n"
+                     "  maxRung         = %u\n"
+                     "  rungEta         = %f\n"
+                     "  pmGridSize      = %u\n"
+                     "  pmBoxSize       = %f\n"
+                     "  pmSplit         = %f\n"
+                     "  forceTolerance  = %f\n"
+                     "  deterministic   = %s\n"
+                     "  potentialTableTolerance = %f\n"
+                     "  dispersionTableTolerance = %f\n"
                      "  LMC             = %s\n"
                      "  LMCmass         = %f\n"
                      "  LMCscale        = %f\n"
                      "  LMCDynaFric     = %s\n"
+                     "  restricted      = %s\n"
+                     "  restrictedMassLoss = %s\n"
                      "  checkpointT     = %d\n"
                      "  nStep           = %u\n"
                      "  potentialType   = %s\n"
@@ -552,12 +590,29 @@ char* showNBodyCtx(const NBodyCtx* ctx)
                      ctx->treeRSize,
                      ctx->sunGCDist,
                      showCriterionT(ctx->criterion),
+                     showIntegratorT(ctx->integrator),
                      showBool(ctx->useQuad),
                      showBool(ctx->allowIncest),
+                     showBool(ctx->parallelTree),
+                     showBool(ctx->costBalance),
+                     ctx->walkGroupSize,
+                     ctx->multipoleOrder,
+                     ctx->treeRefitSteps,
+                     ctx->maxRung,
+                     ctx->rungEta,
+                     ctx->pmGridSize,
+                     ctx->pmBoxSize,
+                     ctx->pmSplit,
+                     ctx->forceTolerance,
+                     showBool(ctx->deterministic),
+                     ctx->potentialTableTolerance,
+                     ctx->dispersionTableTolerance,
                      showBool(ctx->LMC),
                      ctx->LMCmass,
                      ctx->LMCscale,
                      showBool(ctx->LMCDynaFric),
+                     showBool(ctx->restricted),
+                     showBool(ctx->restrictedMassLoss),
                      (int) ctx->checkpointT,
                      ctx->nStep,
                      showExternalPotentialType(ctx->potentialType),
@@ -663,13 +718,19 @@ char* showNBodyTree(const NBodyTree* t)
                      "    root     = %p\n"
                      "    rsize    = %g\n"
                      "    cellUsed = %u\n"
+                     "    cellPeak = %u\n"
                      "    maxDepth = %u\n"
+                     "    builds   = %u\n"
+                     "    refits   = %u\n"
                      "  };\n",
                      t,
                      t->root,
                      t->rsize,
                      t->cellUsed,
-                     t->maxDepth))
+                     t->cellPeak,
+                     t->maxDepth,
+                     t->buildCount,
+                     t->refitCount))
     {
         mw_fail("asprintf() failed\n");
     }
@@ -694,7 +755,6 @@ char* showNBodyState(const NBodyState* st)
     if (0 > asprintf(&buf,
                      "NBodyState %p = {\n"
                      "  tree           = %s\n"
-                     "  freeCell       = %p\n"
                      "  lastCheckpoint = %d\n"
                      "  step           = %u\n"
                      "  nbody          = %u\n"
@@ -704,7 +764,6 @@ char* showNBodyState(const NBodyState* st)
                      "};\n",
                      st,
                      treeBuf,
-                     st->freeCell,
                      (int) st->lastCheckpoint,
                      st->step,
                      st->nbody,
@@ -21,6 +21,7 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "nbody_priv.h"
 #include "nbody_tree.h"
+#include "nbody_numa.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -31,9 +32,59 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 #pragma GCC diagnostic ignored "-Wfloat-equal"
 #endif
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif /* _OPENMP */
+
+
+/* Deepest level to which nbLoadTreeParallel() may build the top of the
+ * tree serially. Every cell at the level it splits at is then filled
+ * in, ordered, summarized and threaded independently by one thread.
+ */
+#define NBODY_PAR_TREE_MAX_DEPTH 5
+#define NBODY_PAR_TREE_BUCKETS (1 << (NDIM * NBODY_PAR_TREE_MAX_DEPTH))
+
+/* The split goes deeper until no cell at its level holds more than
+ * this fraction of a thread's share of the bodies, so a crowded cell
+ * does not leave one thread building most of the tree */
+#define NBODY_PAR_TREE_SHARES 4
+
+/* Level limit used to descend the whole tree */
+#define NBODY_TREE_NO_STOP UINT_MAX
+
+/* Number of arena cells a builder reserves at once */
+#define NBODY_CELL_BATCH 64
+
+/* A refit tree is rebuilt once more than this fraction of its cells
+ * hold bodies spread over more than NBODY_REFIT_MAX_GROWTH times the
+ * size the cell was built with */
+#define NBODY_REFIT_MAX_GROWTH 1.5
+#define NBODY_REFIT_STALE_FRACTION 0.01
+
+/* Arena cells reserved by one thread loading (part of) the tree */
+typedef struct
+{
+    nodelink_t nextCell;      /* next reserved cell to hand out */
+    nodelink_t endCell;       /* end of the reserved cells */
+    unsigned int maxDepth;    /* deepest level this builder stored a body */
+    int overflow;             /* ran out of arena cells */
+} NBodyCellPool;
+
+#define EMPTY_CELL_POOL { NULL_LINK, NULL_LINK, 0, FALSE }
+
+/* Occupied cell at the split level and the bodies which belong in it */
+typedef struct NBodyTreeBucket
+{
+    nodelink_t loaded;        /* cell in the load arena */
+    nodelink_t cell;          /* cell in the walk ordered arena */
+    unsigned int nCell;       /* count of cells in its subtree */
+    real size;
+    int first, last;          /* range of the bucket sorted bodies */
+} NBodyTreeBucket;
+
 
 /* subIndex: compute subcell index for body p in cell q. */
-static inline int nbSubIndex(Body* p, NBodyCell* q)
+static inline int nbSubIndex(const Body* p, const NBodyCell* q)
 {
     int ind = 0;
 
@@ -63,15 +114,23 @@ static inline void nbIncAddNBodyQuadMatrix(NBodyQuadMatrix* RESTRICT a, NBodyQua
     a->zz += b->zz;
 }
 
-/* hackQuad: descend tree, evaluating quadrupole moments.  Note that this
- * routine is coded so that the Subp() and Quad() components of a cell can
- * share the same memory locations.
+/* hackQuad: descend tree from cell pi, evaluating quadrupole moments.
+ * Note that this routine is coded so that the Subp() and Quad()
+ * components of a cell can share the same memory locations. Cells at
+ * level stopLev are assumed to have been processed already. Bodies with
+ * bodyQuads add their own moment like a cell.
  */
-static void hackQuad(NBodyCell* p)
+static void hackQuad(NBodyCell* cells,
+                     const Body* btab,
+                     const NBodyQuadMatrix* bodyQuads,
+                     nodelink_t pi,
+                     unsigned int lev,
+                     unsigned int stopLev)
 {
     unsigned int ndesc, i;
-    NBodyNode* desc[NSUB];
-    NBodyNode* q;
+    nodelink_t desc[NSUB];
+    NBodyCell* p = &cells[pi];
+    const NBodyNode* q;
     mwvector dr;
     real drsq;
     NBodyQuadMatrix quad = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
@@ -79,18 +138,19 @@ static void hackQuad(NBodyCell* p)
     ndesc = 0;                                  /* count occupied subnodes  */
     for (i = 0; i < NSUB; ++i)                  /* loop over all subnodes   */
     {
-        if (Subp(p)[i] != NULL)                 /* if this one's occupied   */
+        if (Subp(p)[i] != NULL_LINK)            /* if this one's occupied   */
         {
             desc[ndesc++] = Subp(p)[i];         /* copy it to safety        */
         }
     }
+    memset(&Quad(p), 0, sizeof(Quad(p)));       /* links are not a moment   */
 
     for (i = 0; i < ndesc; ++i)                 /* loop over real subnodes  */
     {
-        q = desc[i];                            /* access each one in turn  */
-        if (isCell(q))                          /* if it's also a cell      */
+        q = LinkNode(cells, btab, desc[i]);     /* access each one in turn  */
+        if (isCell(q) && lev + 1 < stopLev)     /* if it's also a cell      */
         {
-            hackQuad((NBodyCell*) q);           /* then process it first    */
+            hackQuad(cells, btab, bodyQuads, desc[i], lev + 1, stopLev); /* then process it first */
         }
 
         dr = mw_subv(Pos(q), Pos(p));           /* find displacement vect.  */
@@ -115,58 +175,176 @@ static void hackQuad(NBodyCell* p)
         {
             nbIncAddNBodyQuadMatrix(&quad, &Quad(q));     /* then include its moment  */
         }
+        else if (bodyQuads)
+        {
+            NBodyQuadMatrix own = bodyQuads[(const Body*) q - btab];
+            nbIncAddNBodyQuadMatrix(&quad, &own);
+        }
 
         nbIncAddNBodyQuadMatrix(&Quad(p), &quad); /* increment moment of cell */
     }
 }
 
 
+/* hackOctupole: find the octupole moments of all cells, working up
+ * from the leaves. Cells are stored in depth first order, so each
+ * comes after its parent. The raw third moments S_ijk = sum m x_i x_j
+ * x_k are formed first, since those of a child move to its parent
+ * using only its second moments, and are then made traceless. Needs
+ * the Next and More links and the quadrupole moments.
+ */
+static void hackOctupole(NBodyTree* t, const Body* btab)
+{
+    int c;
+    const NBodyCell* cells = t->cells;
+    NBodyOctMatrix* octs = t->octs;
+    real* m2 = (real*) mwMalloc(t->cellUsed * sizeof(real));   /* sum m |x|^2 of each cell */
+
+    for (c = (int) t->cellUsed - 1; c >= 0; --c)
+    {
+        const NBodyCell* p = &cells[c];
+        NBodyOctMatrix s = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+        real p2 = 0.0;
+        nodelink_t l = More(p);
+
+        while (l != Next(p))                    /* loop over children */
+        {
+            const NBodyNode* q = LinkNode(cells, btab, l);
+            mwvector dr = mw_subv(Pos(q), Pos(p));
+            real dx = X(dr), dy = Y(dr), dz = Z(dr);
+            real m = Mass(q);
+
+            p2 += m * mw_sqrv(dr);
+
+            s.xxx += m * dx * dx * dx;
+            s.xxy += m * dx * dx * dy;
+            s.xxz += m * dx * dx * dz;
+            s.xyy += m * dx * dy * dy;
+            s.xyz += m * dx * dy * dz;
+            s.xzz += m * dx * dz * dz;
+            s.yyy += m * dy * dy * dy;
+            s.yyz += m * dy * dy * dz;
+            s.yzz += m * dy * dz * dz;
+            s.zzz += m * dz * dz * dz;
+
+            if (isCell(q))
+            {
+                /* S_ijk += S'_ijk + dr_i R_jk + dr_j R_ik + dr_k R_ij with
+                 * the second moments R_ij = (Q_ij + delta_ij sum m |x|^2) / 3 */
+                const NBodyOctMatrix* o = &octs[l];
+                real rxx = (Quad(q).xx + m2[l]) / 3.0;
+                real rxy = Quad(q).xy / 3.0;
+                real rxz = Quad(q).xz / 3.0;
+                real ryy = (Quad(q).yy + m2[l]) / 3.0;
+                real ryz = Quad(q).yz / 3.0;
+                real rzz = (Quad(q).zz + m2[l]) / 3.0;
+
+                p2 += m2[l];
+
+                s.xxx += o->xxx + 3.0 * dx * rxx;
+                s.xxy += o->xxy + 2.0 * dx * rxy + dy * rxx;
+                s.xxz += o->xxz + 2.0 * dx * rxz + dz * rxx;
+                s.xyy += o->xyy + dx * ryy + 2.0 * dy * rxy;
+                s.xyz += o->xyz + dx * ryz + dy * rxz + dz * rxy;
+                s.xzz += o->xzz + dx * rzz + 2.0 * dz * rxz;
+                s.yyy += o->yyy + 3.0 * dy * ryy;
+                s.yyz += o->yyz + 2.0 * dy * ryz + dz * ryy;
+                s.yzz += o->yzz + dy * rzz + 2.0 * dz * ryz;
+                s.zzz += o->zzz + 3.0 * dz * rzz;
+            }
+
+            l = Next(q);
+        }
+
+        octs[c] = s;
+        m2[c] = p2;
+    }
+
+    free(m2);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(c) shared(octs) schedule(static)
+  #endif
+    for (c = 0; c < (int) t->cellUsed; ++c)
+    {
+        /* O_ijk = 15 S_ijk - 3 (delta_ij T_k + delta_ik T_j + delta_jk T_i), T_k = S_iik */
+        NBodyOctMatrix* o = &octs[c];
+        real tx = o->xxx + o->xyy + o->xzz;
+        real ty = o->xxy + o->yyy + o->yzz;
+        real tz = o->xxz + o->yyz + o->zzz;
+
+        o->xxx = 15.0 * o->xxx - 9.0 * tx;
+        o->xxy = 15.0 * o->xxy - 3.0 * ty;
+        o->xxz = 15.0 * o->xxz - 3.0 * tz;
+        o->xyy = 15.0 * o->xyy - 3.0 * tx;
+        o->xyz = 15.0 * o->xyz;
+        o->xzz = 15.0 * o->xzz - 3.0 * tx;
+        o->yyy = 15.0 * o->yyy - 9.0 * ty;
+        o->yyz = 15.0 * o->yyz - 3.0 * tz;
+        o->yzz = 15.0 * o->yzz - 3.0 * ty;
+        o->zzz = 15.0 * o->zzz - 9.0 * tz;
+    }
+}
+
 /* threadTree: do a recursive treewalk starting from node p,
- * with next stop n, installing Next and More links.
+ * with next stop n, installing Next and More links. The children of
+ * cells at level stopLev are left for a later call.
  */
-static void threadTree(NBodyNode* p, NBodyNode* n)
+static void threadTree(NBodyCell* cells, Body* btab, nodelink_t p, nodelink_t n, unsigned int lev, unsigned int stopLev)
 {
     unsigned int ndesc, i;
-    NBodyNode* desc[NSUB+1];
+    nodelink_t desc[NSUB+1];
+    NBodyNode* pn = LinkNode(cells, btab, p);
 
-    Next(p) = n;                                /* link to next node */
-    if (isCell(p))                              /* any children to thread? */
+    Next(pn) = n;                               /* link to next node */
+    if (isCell(pn) && lev < stopLev)            /* any children to thread? */
     {
         ndesc = 0;                              /* count extant children */
         for (i = 0; i < NSUB; ++i)              /* loop over subnodes */
         {
-            if (Subp(p)[i] != NULL)             /* found a live one? */
+            if (Subp(pn)[i] != NULL_LINK)       /* found a live one? */
             {
-                desc[ndesc++] = Subp(p)[i];     /* store in table */
+                desc[ndesc++] = Subp(pn)[i];    /* store in table */
             }
         }
-        More(p) = desc[0];                      /* link to first child */
+        More(pn) = desc[0];                     /* link to first child */
         desc[ndesc] = n;                        /* end table with next */
         for (i = 0; i < ndesc; i++)             /* loop over children */
         {
-            threadTree(desc[i], desc[i + 1]);     /* thread each w/ next */
+            threadTree(cells, btab, desc[i], desc[i + 1], lev + 1, stopLev); /* thread each w/ next */
         }
     }
 }
 
 /* expandBox: find range of coordinate values (with respect to root)
  * and expand root cell to fit. The size is doubled at each step to
- * take advantage of exact representation of powers of two.
+ * take advantage of exact representation of powers of two. The range
+ * is taken from t->bodyExtent instead if the integrator found it while
+ * moving the bodies, which saves a pass over them. The integrator
+ * measures from the origin, where nbNewTree() puts the root.
  */
 static void expandBox(NBodyTree* t, const Body* btab, int nbody)
 {
     real xyzmax;
     const Body* p;
-    const NBodyCell* root = t->root;
+    const NBodyCell* root = &t->loadCells[0];
 
     assert(t->rsize > 0.0);
 
     xyzmax = 0.0;
-    for (p = btab; p < btab + nbody; ++p)
+    if (t->extentKnown)
     {
-        xyzmax = mw_fmax(xyzmax, mw_abs(X(Pos(p)) - X(Pos(root))));
-        xyzmax = mw_fmax(xyzmax, mw_abs(Y(Pos(p)) - Y(Pos(root))));
-        xyzmax = mw_fmax(xyzmax, mw_abs(Z(Pos(p)) - Z(Pos(root))));
+        xyzmax = t->bodyExtent;
+        t->extentKnown = FALSE;
+    }
+    else
+    {
+        for (p = btab; p < btab + nbody; ++p)
+        {
+            xyzmax = mw_fmax(xyzmax, mw_abs(X(Pos(p)) - X(Pos(root))));
+            xyzmax = mw_fmax(xyzmax, mw_abs(Y(Pos(p)) - Y(Pos(root))));
+            xyzmax = mw_fmax(xyzmax, mw_abs(Z(Pos(p)) - Z(Pos(root))));
+        }
     }
 
     while (t->rsize < 2.0 * xyzmax)
@@ -175,51 +353,88 @@ static void expandBox(NBodyTree* t, const Body* btab, int nbody)
     }
 }
 
-/* makecell: return pointer to free cell. */
-static NBodyCell* nbMakeCell(NBodyState* st, NBodyTree* t)
+/* Make sure both cell arenas have room for at least n cells. Their
+ * contents are not kept. New arenas are zeroed by all the threads so
+ * their pages are spread over the threads' memory nodes. */
+static void nbReserveCellArenas(NBodyTree* t, unsigned int n, mwbool hugePages)
 {
-    NBodyCell* c;
-
-    if (st->freeCell == NULL)                   /* no free cells left? */
+    if (n <= t->cellCapacity)
     {
-        c = (NBodyCell*) mwMallocA(sizeof(*c)); /* allocate a new one */
+        return;
     }
-    else                                        /* use existing free cell */
+
+    mwFreeA(t->cells);
+    mwFreeA(t->loadCells);
+    mwFreeA(t->octs);
+    free(t->cellSize);
+    t->octs = NULL;                             /* made again when needed */
+    t->cellSize = NULL;
+    t->cells = (NBodyCell*) nbAllocBig(n * sizeof(NBodyCell), hugePages);
+    t->loadCells = (NBodyCell*) nbAllocBig(n * sizeof(NBodyCell), hugePages);
+    nbFirstTouch(t->cells, (int) n, sizeof(NBodyCell));
+    nbFirstTouch(t->loadCells, (int) n, sizeof(NBodyCell));
+    t->cellCapacity = n;
+    t->root = NULL;
+}
+
+/* Reserve the next batch of load arena cells for pool */
+static void nbRefillCellPool(NBodyTree* t, NBodyCellPool* pool)
+{
+    unsigned int first, last;
+
+  #ifdef _OPENMP
+    #pragma omp critical(nbReserveCells)
+  #endif
     {
-        c = (NBodyCell*) st->freeCell;          /* take one on front */
-        st->freeCell = Next(c);                 /* go on to next one */
+        first = t->cellReserved;
+        last = MIN(first + NBODY_CELL_BATCH, t->cellCapacity);
+        t->cellReserved = last;
     }
-    Type(c) = CELL(0);                          /* initialize cell type */
-    More(c) = NULL;
-    memset(&c->stuff, 0, sizeof(c->stuff));     /* empty sub cells */
-    t->cellUsed++;                              /* count one more cell */
-    return c;
+
+    pool->nextCell = (nodelink_t) first;
+    pool->endCell = (nodelink_t) last;
 }
 
-/* reclaim cells in tree, prepare to build new one. */
-static void nbNewTree(NBodyState* st, NBodyTree* t)
+/* makecell: return link to a free cell of the load arena, or NULL_LINK
+ * (and mark the pool as overflowed) if the arena is full. The root is
+ * always the first cell made, so no other cell gets index 0. */
+static nodelink_t nbMakeCell(NBodyTree* t, NBodyCellPool* pool)
 {
-    NBodyNode* p = (NBodyNode*) t->root;              /* start with the root */
+    nodelink_t c;
+    NBodyCell* cell;
 
-    while (p != NULL)                       /* loop scanning tree */
+    if (pool->nextCell == pool->endCell)        /* nothing reserved left? */
     {
-        if (isCell(p))                      /* found cell to free? */
-        {
-            Next(p) = st->freeCell;         /* link to front of */
-            st->freeCell = p;               /* ...existing list */
-            p = More(p);                    /* scan down tree */
-        }
-        else                                /* skip over bodies */
-        {
-            p = Next(p);                    /* go on to next */
-        }
+        nbRefillCellPool(t, pool);
     }
 
+    if (pool->nextCell == pool->endCell)        /* no free cells left? */
+    {
+        pool->overflow = TRUE;
+        return NULL_LINK;
+    }
+
+    c = pool->nextCell++;                       /* take the next one */
+    cell = &t->loadCells[c];
+    Type(cell) = CELL(0);                       /* initialize cell type */
+    More(cell) = NULL_LINK;
+    memset(&cell->stuff, 0, sizeof(cell->stuff)); /* empty sub cells */
+    return c;
+}
+
+/* prepare to load a new tree into the load arena */
+static void nbNewTree(NBodyTree* t, NBodyCellPool* pool)
+{
+    nodelink_t root;
+
+    t->root = NULL;
+    t->cellReserved = 0;
     t->cellUsed = 0;   /* init count of cells, levels */
     t->maxDepth = 0;
 
-    t->root = nbMakeCell(st, t);      /* allocate the root cell */
-    mw_zerov(Pos(t->root));           /* initialize the midpoint */
+    root = nbMakeCell(t, pool);       /* allocate the root cell */
+    assert(root == 0);
+    mw_zerov(Pos(&t->loadCells[root])); /* initialize the midpoint */
 }
 
 
@@ -238,20 +453,18 @@ static inline void nbInitMidpoint(NBodyCell* c, const Body* p, const NBodyCell*
     Z(Pos(c)) = calcOffset(Z(Pos(p)), Z(Pos(q)), qsize);
 }
 
-/* loadBody: descend tree and insert body p in appropriate place. */
-static void nbLoadBody(NBodyState* st, NBodyTree* t, Body* p)
+/* loadBody: descend tree from loaded cell qi of size qsize at level lev
+ * and insert body p in appropriate place. Gives up if the load arena
+ * runs out of cells. */
+static void nbLoadBody(NBodyTree* t, NBodyCellPool* pool, const Body* btab, nodelink_t qi, real qsize, unsigned int lev, const Body* p)
 {
-    NBodyCell* q;
-    NBodyCell* c;
+    NBodyCell* cells = t->loadCells;
+    NBodyCell* q = &cells[qi];
+    nodelink_t c;
     size_t qind;
-    unsigned int lev;
-    real qsize;
 
-    q = t->root;                                /* start with tree t.root */
     qind = nbSubIndex(p, q);                    /* get index of subcell */
-    qsize = t->rsize;                           /* keep track of cell size */
-    lev = 0;                                    /* count levels descended */
-    while (Subp(q)[qind] != NULL)               /* loop descending tree */
+    while (Subp(q)[qind] != NULL_LINK)          /* loop descending tree */
     {
         if (qsize <= REAL_EPSILON)
         {
@@ -263,22 +476,89 @@ static void nbLoadBody(NBodyState* st, NBodyTree* t, Body* p)
             return;
         }
 
-        if (isBody(Subp(q)[qind]))              /* reached a "leaf"? */
+        if (isBodyLink(Subp(q)[qind]))          /* reached a "leaf"? */
         {
-            c = nbMakeCell(st, t);             /* allocate new cell */
-            nbInitMidpoint(c, p, q, qsize);    /* initialize midpoint */
+            c = nbMakeCell(t, pool);            /* allocate new cell */
+            if (c == NULL_LINK)                 /* arena is full */
+            {
+                return;
+            }
+            nbInitMidpoint(&cells[c], p, q, qsize); /* initialize midpoint */
 
-            Subp(c)[nbSubIndex((Body*) Subp(q)[qind], c)] = Subp(q)[qind];
+            Subp(&cells[c])[nbSubIndex(&btab[linkBody(Subp(q)[qind])], &cells[c])] = Subp(q)[qind];
             /* put body in cell */
-            Subp(q)[qind] = (NBodyNode*) c;    /* link cell in tree */
+            Subp(q)[qind] = c;                  /* link cell in tree */
         }
-        q = (NBodyCell*) Subp(q)[qind];   /* advance to next level */
+        q = &cells[Subp(q)[qind]];        /* advance to next level */
         qind = nbSubIndex(p, q);          /* get index to examine */
         qsize *= 0.5;                     /* shrink current cell */
         ++lev;                            /* count another level */
     }
-    Subp(q)[qind] = (NBodyNode*) p;            /* found place, store p */
-    t->maxDepth = MAX(t->maxDepth, lev);  /* remember maximum level */
+    Subp(q)[qind] = bodyLink((nodelink_t) (p - btab)); /* found place, store p */
+    pool->maxDepth = MAX(pool->maxDepth, lev);  /* remember maximum level */
+}
+
+/* Count the cells in the loaded subtree below (and including) cell p */
+static unsigned int nbCountCells(const NBodyCell* cells, nodelink_t p)
+{
+    unsigned int i, n = 1;
+
+    for (i = 0; i < NSUB; ++i)
+    {
+        if (isCellLink(Subp(&cells[p])[i]))
+        {
+            n += nbCountCells(cells, Subp(&cells[p])[i]);
+        }
+    }
+
+    return n;
+}
+
+/* Copy loaded cell p and the cells below it into the walk arena in
+ * depth first order, starting at index n, and relink them. The
+ * subtrees of cells at level stopLev are given the space counted in the
+ * next of buckets, and copied by a later call. Returns the index after
+ * the last cell placed.
+ */
+static nodelink_t nbOrderCells(NBodyTree* t,
+                               nodelink_t p,
+                               nodelink_t n,
+                               unsigned int lev,
+                               unsigned int stopLev,
+                               NBodyTreeBucket* buckets,
+                               int* nextBucket)
+{
+    unsigned int i;
+    NBodyCell* c = &t->cells[n];
+
+    *c = t->loadCells[p];
+    ++n;
+
+    for (i = 0; i < NSUB; ++i)
+    {
+        nodelink_t q = Subp(c)[i];
+
+        if (!isCellLink(q))                     /* bodies keep their link */
+        {
+            continue;
+        }
+
+        if (lev + 1 < stopLev)
+        {
+            Subp(c)[i] = n;
+            n = nbOrderCells(t, q, n, lev + 1, stopLev, buckets, nextBucket);
+        }
+        else
+        {
+            NBodyTreeBucket* b = &buckets[(*nextBucket)++];
+
+            assert(b->loaded == q);
+            Subp(c)[i] = b->cell = n;
+            n += (nodelink_t) b->nCell;
+        }
+    }
+
+    return n;
 }
 
 ALWAYS_INLINE
@@ -320,6 +600,8 @@ static inline real findRCrit(const NBodyCtx* ctx, const NBodyCell* p, real treeR
     switch (ctx->criterion)
     {
         case TreeCode:
+        case FMM: /* Only walked for test particles */
+        case PM:  /* Only walked for the short range force */
             /* use size plus offset */
             rc = psize / ctx->theta + mw_distv(cmpos, Pos(p));
             return sqr(rc);
@@ -380,28 +662,33 @@ static inline void nbCheckTreeStructure(NBodyTree* tree, const mwvector pPos, co
 }
 
 
-/* hackCofM: descend tree finding center-of-mass coordinates and
- * setting critical cell radii.
+/* hackCofM: descend tree from walk ordered cell pi finding
+ * center-of-mass coordinates and setting critical cell radii. Cells at
+ * level stopLev are assumed to have been summarized already.
  */
-static void hackCofM(const NBodyCtx* ctx, NBodyTree* tree, NBodyCell* p, real psize)
+static void hackCofM(const NBodyCtx* ctx, NBodyTree* tree, const Body* btab, nodelink_t pi, real psize, unsigned int lev, unsigned int stopLev)
 {
     int i;
-    NBodyNode* q;
+    NBodyCell* p = &tree->cells[pi];
+    const NBodyNode* q;
     mwvector cmpos = ZERO_VECTOR;                /* init center of mass */
 
     assert(psize >= REAL_EPSILON);
 
     Mass(p) = 0.0;                              /* init total mass... */
+    NBodies(p) = 0;                             /* and count of bodies */
     for (i = 0; i < NSUB; ++i)                  /* loop over subnodes */
     {
-        if ((q = Subp(p)[i]) != NULL)           /* does subnode exist? */
+        if (Subp(p)[i] != NULL_LINK)            /* does subnode exist? */
         {
-            if (isCell(q))                     /* and is it a cell? */
+            q = LinkNode(tree->cells, btab, Subp(p)[i]);
+            if (isCell(q) && lev + 1 < stopLev) /* and is it a cell? */
             {
-                hackCofM(ctx, tree, (NBodyCell*) q, 0.5 * psize); /* find subcell cm */
+                hackCofM(ctx, tree, btab, Subp(p)[i], 0.5 * psize, lev + 1, stopLev); /* find subcell cm */
             }
 
             Mass(p) += Mass(q);                       /* sum total mass */
+            NBodies(p) += isCell(q) ? NBodies(q) : 1;
                                                       /* weight pos by mass */
             mw_incaddv_s(cmpos, Pos(q), Mass(q));     /* sum c-of-m position */
         }
@@ -421,40 +708,648 @@ static void hackCofM(const NBodyCtx* ctx, NBodyTree* tree, NBodyCell* p, real ps
 
     Rcrit2(p) = findRCrit(ctx, p, tree->rsize, cmpos, psize);            /* set critical radius */
     Pos(p) = cmpos;             /* and center-of-mass pos */
+
+    if (tree->cellSize)                         /* remember size for refits */
+        tree->cellSize[pi] = psize;
 }
 
-/* nbMakeTree: initialize tree structure for hierarchical force calculation
- * from body array btab, which contains ctx.nbody bodies.
+/* Find the cell at depth NBODY_PAR_TREE_MAX_DEPTH below the root at
+ * rootPos which body p falls in, descending the same way nbLoadBody()
+ * does. The path is returned as an index into the cells at that depth,
+ * and shifting it right by NDIM bits goes up a level.
  */
-NBodyStatus nbMakeTree(const NBodyCtx* ctx, NBodyState* st)
+static inline int nbBucketIndex(const Body* p, mwvector rootPos, real rsize)
+{
+    int key = 0;
+    unsigned int lev;
+    mwvector mid = rootPos;
+    real qsize = rsize;
+
+    for (lev = 0; lev < NBODY_PAR_TREE_MAX_DEPTH; ++lev)
+    {
+        int ind = 0;
+
+        if (X(mid) <= X(Pos(p)))
+            ind += NSUB >> (0 + 1);
+        if (Y(mid) <= Y(Pos(p)))
+            ind += NSUB >> (1 + 1);
+        if (Z(mid) <= Z(Pos(p)))
+            ind += NSUB >> (2 + 1);
+
+        key = NSUB * key + ind;
+
+        X(mid) = calcOffset(X(Pos(p)), X(mid), qsize);
+        Y(mid) = calcOffset(Y(Pos(p)), Y(mid), qsize);
+        Z(mid) = calcOffset(Z(Pos(p)), Z(mid), qsize);
+        qsize *= 0.5;
+    }
+
+    return key;
+}
+
+/* Pick the shallowest level at which no cell holds more than its share
+ * of the massive bodies, from the count of them in each cell at
+ * NBODY_PAR_TREE_MAX_DEPTH */
+static unsigned int nbChooseSplitDepth(const int* occupancy, int total, int nThreads)
+{
+    unsigned int depth;
+
+    for (depth = 1; depth < NBODY_PAR_TREE_MAX_DEPTH; ++depth)
+    {
+        int b, k, largest = 0;
+        int span = 1 << (NDIM * (NBODY_PAR_TREE_MAX_DEPTH - depth));
+
+        for (b = 0; b < NBODY_PAR_TREE_BUCKETS; b += span)
+        {
+            int n = 0;
+
+            for (k = b; k < b + span; ++k)
+            {
+                n += occupancy[k];
+            }
+            largest = MAX(largest, n);
+        }
+
+        if ((long long) largest * NBODY_PAR_TREE_SHARES * nThreads <= total)
+        {
+            break;
+        }
+    }
+
+    return depth;
+}
+
+/* Counting sort of the massive bodies by the cell they belong in at
+ * the level the tree is split at, which is chosen here and kept in
+ * t->splitDepth. The indices of the bodies of bucket b end up in
+ * t->bucketBodies[bucketStart[b]] to t->bucketBodies[bucketStart[b + 1] - 1],
+ * in their original order. bucketStart is left in t->bucketCounts.
+ */
+static const int* nbSortBodiesIntoBuckets(NBodyState* st)
 {
-    Body* p;
-    const Body* endp = st->bodytab + st->nbody;
     NBodyTree* t = &st->tree;
+    const mwvector rootPos = Pos(&t->loadCells[0]);
+    int maxThreads = nbGetMaxThreads();
+    int* keys = t->bodyBucket;
+    int* sorted = t->bucketBodies;
+    int* counts;
+    int* bucketStart;
+
+    if (t->bucketThreads < maxThreads)
+    {
+        free(t->bucketCounts);
+        t->bucketCounts = (int*) mwMalloc(((maxThreads + 1) * NBODY_PAR_TREE_BUCKETS + 1) * sizeof(int));
+        t->bucketThreads = maxThreads;
+    }
+    counts = t->bucketCounts;
+    bucketStart = &counts[maxThreads * NBODY_PAR_TREE_BUCKETS];
 
-    nbNewTree(st, t);                                /* flush existing tree, etc */
+  #ifdef _OPENMP
+    #pragma omp parallel shared(keys, sorted, counts, bucketStart)
+  #endif
+    {
+        int i, b, k, total, shift;
+      #ifdef _OPENMP
+        int tid = omp_get_thread_num();
+        int nThreads = omp_get_num_threads();
+      #else
+        int tid = 0;
+        int nThreads = 1;
+      #endif
+        int lo = (int) (((long long) st->nbody * tid) / nThreads);
+        int hi = (int) (((long long) st->nbody * (tid + 1)) / nThreads);
+        int* count = &counts[tid * NBODY_PAR_TREE_BUCKETS];
+
+        memset(count, 0, NBODY_PAR_TREE_BUCKETS * sizeof(int));
+
+        for (i = lo; i < hi; ++i)
+        {
+            const Body* p = &st->bodytab[i];
+
+            if (Mass(p) != 0.0)                  /* exclude test particles */
+            {
+                keys[i] = nbBucketIndex(p, rootPos, t->rsize);
+                ++count[keys[i]];
+            }
+            else
+            {
+                keys[i] = -1;
+            }
+        }
+
+      #ifdef _OPENMP
+        #pragma omp barrier
+        #pragma omp single
+      #endif
+        {
+            int nBuckets, span;
 
+            total = 0;
+            for (b = 0; b < NBODY_PAR_TREE_BUCKETS; ++b)
+            {
+                bucketStart[b] = 0;
+                for (k = 0; k < nThreads; ++k)
+                {
+                    bucketStart[b] += counts[k * NBODY_PAR_TREE_BUCKETS + b];
+                }
+                total += bucketStart[b];
+            }
+
+            t->splitDepth = nbChooseSplitDepth(bucketStart, total, nThreads);
+            nBuckets = 1 << (NDIM * t->splitDepth);
+            span = NBODY_PAR_TREE_BUCKETS / nBuckets;
+
+            /* Each thread's count of the bodies in each cell at the split */
+            for (k = 0; k < nThreads; ++k)
+            {
+                int* c = &counts[k * NBODY_PAR_TREE_BUCKETS];
+
+                for (b = 0; b < nBuckets; ++b)
+                {
+                    int j, n = 0;
+
+                    for (j = b * span; j < (b + 1) * span; ++j)
+                    {
+                        n += c[j];
+                    }
+                    c[b] = n;
+                }
+            }
+
+            /* Each thread's share of a bucket follows the previous thread's */
+            total = 0;
+            for (b = 0; b < nBuckets; ++b)
+            {
+                bucketStart[b] = total;
+                for (k = 0; k < nThreads; ++k)
+                {
+                    int n = counts[k * NBODY_PAR_TREE_BUCKETS + b];
+                    counts[k * NBODY_PAR_TREE_BUCKETS + b] = total;
+                    total += n;
+                }
+            }
+            bucketStart[nBuckets] = total;
+        }
+
+        shift = NDIM * (NBODY_PAR_TREE_MAX_DEPTH - t->splitDepth);
+        for (i = lo; i < hi; ++i)
+        {
+            if (keys[i] >= 0)
+            {
+                sorted[count[keys[i] >> shift]++] = i;
+            }
+        }
+    }
+
+    return bucketStart;
+}
+
+/* Serially create the cells above t->splitDepth. A cell exists in the
+ * tree exactly when at least 2 bodies fall inside it, so the cells
+ * built here are the same as nbLoadBody() would produce. Occupied cells
+ * at t->splitDepth are collected into buckets, in depth first order, to
+ * be filled later.
+ */
+static void nbLoadTopCells(NBodyTree* t,
+                           NBodyCellPool* pool,
+                           nodelink_t qi,
+                           real qsize,
+                           unsigned int lev,
+                           int key,
+                           const int* bucketStart,
+                           NBodyTreeBucket* buckets,
+                           int* nBuckets)
+{
+    unsigned int i;
+    int span = 1 << (NDIM * (t->splitDepth - lev - 1));  /* buckets under each subcell */
+
+    for (i = 0; i < NSUB; ++i)
+    {
+        nodelink_t c;
+        NBodyCell* q;
+        NBodyCell* cell;
+        int sub = NSUB * key + i;
+        int first = bucketStart[sub * span];
+        int last = bucketStart[(sub + 1) * span];
+
+        if (last - first == 0)                  /* empty subcell */
+        {
+            continue;
+        }
+
+        q = &t->loadCells[qi];
+        if (last - first == 1)                  /* lone body is a leaf */
+        {
+            Subp(q)[i] = bodyLink(t->bucketBodies[first]);
+            pool->maxDepth = MAX(pool->maxDepth, lev);
+            continue;
+        }
+
+        c = nbMakeCell(t, pool);
+        if (c == NULL_LINK)                     /* arena is full */
+        {
+            return;
+        }
+
+        cell = &t->loadCells[c];
+        X(Pos(cell)) = X(Pos(q)) + 0.25 * ((i & (NSUB >> 1)) ? qsize : -qsize);
+        Y(Pos(cell)) = Y(Pos(q)) + 0.25 * ((i & (NSUB >> 2)) ? qsize : -qsize);
+        Z(Pos(cell)) = Z(Pos(q)) + 0.25 * ((i & (NSUB >> 3)) ? qsize : -qsize);
+        Subp(q)[i] = c;
+
+        if (lev + 1 < t->splitDepth)
+        {
+            nbLoadTopCells(t, pool, c, 0.5 * qsize, lev + 1, sub, bucketStart, buckets, nBuckets);
+            if (pool->overflow)
+            {
+                return;
+            }
+        }
+        else
+        {
+            buckets[*nBuckets].loaded = c;
+            buckets[*nBuckets].size = 0.5 * qsize;
+            buckets[*nBuckets].first = first;
+            buckets[*nBuckets].last = last;
+            ++*nBuckets;
+        }
+    }
+}
+
+/* Load the tree by inserting bodies one at a time from the root, then
+ * copy it into walk order.
+ */
+static NBodyStatus nbLoadTreeSerial(NBodyState* st)
+{
+    int i;
+    NBodyTree* t = &st->tree;
+    NBodyCellPool pool = EMPTY_CELL_POOL;
+
+    nbNewTree(t, &pool);                             /* flush existing tree, etc */
     expandBox(t, st->bodytab, st->nbody);            /* and expand cell to fit */
-    for (p = st->bodytab; p < endp; p++)             /* loop over bodies... */
+    for (i = 0; i < st->nbody && !pool.overflow; ++i) /* loop over bodies... */
     {
+        const Body* p = &st->bodytab[i];
+
         if (Mass(p) != 0.0)                  /* exclude test particles */
-            nbLoadBody(st, t, p);              /* and insert into tree */
+            nbLoadBody(t, &pool, st->bodytab, 0, t->rsize, 0, p); /* and insert into tree */
+    }
+    t->maxDepth = pool.maxDepth;
+
+    if (pool.overflow)
+        return NBODY_CELL_OVERFLOW_ERROR;
+
+    /* Check if tree structure error occured */
+    if (t->structureError)
+        return NBODY_TREE_STRUCTURE_ERROR;
+
+    t->cellUsed = (unsigned int) nbOrderCells(t, 0, 0, 0, NBODY_TREE_NO_STOP, NULL, NULL);
+
+    return NBODY_SUCCESS;
+}
+
+/* Load the same tree as nbLoadTreeSerial(), filling in and ordering
+ * the subtrees below t->splitDepth in parallel. Their cells in the walk
+ * arena are returned in t->buckets.
+ */
+static NBodyStatus nbLoadTreeParallel(NBodyState* st, int* nBuckets)
+{
+    int i, nextBucket = 0;
+    int overflow;
+    NBodyTree* t = &st->tree;
+    NBodyCellPool pool = EMPTY_CELL_POOL;
+    NBodyTreeBucket* buckets;
+    const int* bucketStart;
+
+    if (t->bucketBodyCapacity < st->nbody)
+    {
+        free(t->bodyBucket);
+        free(t->bucketBodies);
+        free(t->buckets);
+        t->bodyBucket = (int*) mwMalloc(st->nbody * sizeof(int));
+        t->bucketBodies = (int*) mwMalloc(st->nbody * sizeof(int));
+        t->buckets = (NBodyTreeBucket*) mwMalloc((st->nbody / 2 + 1) * sizeof(NBodyTreeBucket));
+        t->bucketBodyCapacity = st->nbody;
     }
+    buckets = t->buckets;           /* each holds at least 2 bodies */
+
+    nbNewTree(t, &pool);                             /* flush existing tree, etc */
+    expandBox(t, st->bodytab, st->nbody);            /* and expand cell to fit */
+
+    bucketStart = nbSortBodiesIntoBuckets(st);
+    nbLoadTopCells(t, &pool, 0, t->rsize, 0, 0, bucketStart, buckets, nBuckets);
+    t->maxDepth = pool.maxDepth;
+    overflow = pool.overflow;
+
+    if (!overflow)
+    {
+      #ifdef _OPENMP
+        #pragma omp parallel private(i) shared(buckets)
+      #endif
+        {
+            NBodyCellPool threadPool = EMPTY_CELL_POOL;
+
+          #ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 1)
+          #endif
+            for (i = 0; i < *nBuckets; ++i)
+            {
+                int j;
+                const NBodyTreeBucket* b = &buckets[i];
+
+                for (j = b->first; j < b->last && !threadPool.overflow; ++j)
+                {
+                    nbLoadBody(t, &threadPool, st->bodytab, b->loaded, b->size, t->splitDepth,
+                               &st->bodytab[t->bucketBodies[j]]);
+                }
+            }
+
+          #ifdef _OPENMP
+            #pragma omp critical(nbMergeCellPools)
+          #endif
+            {
+                t->maxDepth = MAX(t->maxDepth, threadPool.maxDepth);
+                overflow |= threadPool.overflow;
+            }
+        }
+    }
+
+    if (overflow)
+        return NBODY_CELL_OVERFLOW_ERROR;
 
     /* Check if tree structure error occured */
-    if (st->tree.structureError)
+    if (t->structureError)
         return NBODY_TREE_STRUCTURE_ERROR;
 
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(buckets) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < *nBuckets; ++i)
+    {
+        buckets[i].nCell = nbCountCells(t->loadCells, buckets[i].loaded);
+    }
+
+    /* Place the top cells and give each bucket its range of the arena */
+    t->cellUsed = (unsigned int) nbOrderCells(t, 0, 0, 0, t->splitDepth, buckets, &nextBucket);
+    assert(nextBucket == *nBuckets);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(buckets) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < *nBuckets; ++i)
+    {
+        nbOrderCells(t, buckets[i].loaded, buckets[i].cell, t->splitDepth, NBODY_TREE_NO_STOP, NULL, NULL);
+    }
+
+    return NBODY_SUCCESS;
+}
+
+/* Find the bounding box of the bodies below each cell, working up from
+ * the leaves. Returns the count of cells which have grown too much
+ * since the tree was built. */
+static unsigned int nbRefitBounds(const NBodyTree* t, const Body* btab, mwvector* lo, mwvector* hi)
+{
+    int c;
+    unsigned int grown = 0;
+    const NBodyCell* cells = t->cells;
+
+    for (c = (int) t->cellUsed - 1; c >= 0; --c)
+    {
+        const NBodyCell* p = &cells[c];
+        nodelink_t l = More(p);
+        mwvector plo = isBodyLink(l) ? Pos(&btab[linkBody(l)]) : lo[l];
+        mwvector phi = plo;
+        real size;
+
+        while (l != Next(p))                    /* loop over children */
+        {
+            const NBodyNode* q = LinkNode(cells, btab, l);
+            const mwvector qlo = isBodyLink(l) ? Pos(q) : lo[l];
+            const mwvector qhi = isBodyLink(l) ? Pos(q) : hi[l];
+
+            X(plo) = mw_fmin(X(plo), X(qlo));
+            Y(plo) = mw_fmin(Y(plo), Y(qlo));
+            Z(plo) = mw_fmin(Z(plo), Z(qlo));
+            X(phi) = mw_fmax(X(phi), X(qhi));
+            Y(phi) = mw_fmax(Y(phi), Y(qhi));
+            Z(phi) = mw_fmax(Z(phi), Z(qhi));
+
+            l = Next(q);
+        }
+
+        lo[c] = plo;
+        hi[c] = phi;
+
+        size = mw_fmax(X(phi) - X(plo), mw_fmax(Y(phi) - Y(plo), Z(phi) - Z(plo)));
+        if (size > NBODY_REFIT_MAX_GROWTH * t->cellSize[c])
+            ++grown;
+    }
+
+    return grown;
+}
+
+/* Find the mass, center of mass, quadrupole moment and critical radius
+ * of each cell from its children, working up from the leaves. A cell
+ * is treated as the cube around the center of its bounding box which
+ * is no smaller than the cell was built. */
+static void nbRefitMoments(const NBodyCtx* ctx, NBodyTree* t, const Body* btab, const mwvector* lo, const mwvector* hi)
+{
+    int c;
+    NBodyCell* cells = t->cells;
+    mwbool useQuad = ctx->useQuad || ctx->multipoleOrder >= 3;
+
+    for (c = (int) t->cellUsed - 1; c >= 0; --c)
+    {
+        NBodyCell* p = &cells[c];
+        NBodyCell box;                          /* geometric cell, for findRCrit() */
+        mwvector cmpos = ZERO_VECTOR;
+        real mass = 0.0;
+        real psize;
+        nodelink_t l;
+
+        for (l = More(p); l != Next(p); l = Next(LinkNode(cells, btab, l)))
+        {
+            const NBodyNode* q = LinkNode(cells, btab, l);
+            mass += Mass(q);
+            mw_incaddv_s(cmpos, Pos(q), Mass(q));
+        }
+
+        Pos(&box) = mw_mulvs(mw_addv(lo[c], hi[c]), 0.5);
+        psize = mw_fmax(X(hi[c]) - X(lo[c]), mw_fmax(Y(hi[c]) - Y(lo[c]), Z(hi[c]) - Z(lo[c])));
+        psize = mw_fmax(psize, t->cellSize[c]);
+
+        if (mass > 0.0)
+        {
+            mw_incdivs(cmpos, mass);
+        }
+        else
+        {
+            cmpos = Pos(&box);
+        }
+
+        if (useQuad)
+        {
+            NBodyQuadMatrix quad = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+            for (l = More(p); l != Next(p); l = Next(LinkNode(cells, btab, l)))
+            {
+                const NBodyNode* q = LinkNode(cells, btab, l);
+                mwvector dr = mw_subv(Pos(q), cmpos);
+                real drsq = mw_sqrv(dr);
+                real m = Mass(q);
+
+                quad.xx += m * (3.0 * (X(dr) * X(dr)) - drsq);
+                quad.xy += m * (3.0 * (X(dr) * Y(dr)));
+                quad.xz += m * (3.0 * (X(dr) * Z(dr)));
+                quad.yy += m * (3.0 * (Y(dr) * Y(dr)) - drsq);
+                quad.yz += m * (3.0 * (Y(dr) * Z(dr)));
+                quad.zz += m * (3.0 * (Z(dr) * Z(dr)) - drsq);
+
+                if (isCell(q))
+                    nbIncAddNBodyQuadMatrix(&quad, &Quad(q));
+            }
+
+            Quad(p) = quad;
+        }
+
+        Mass(p) = mass;
+        Rcrit2(p) = findRCrit(ctx, &box, t->rsize, cmpos, psize);
+        Pos(p) = cmpos;
+    }
+}
+
+/* nbRefitTree: reuse the structure of the last tree built for the
+ * current body positions, refreshing only the cell moments and
+ * critical radii. Returns FALSE, leaving the tree alone, if it has gone
+ * stale and should be built again.
+ */
+static mwbool nbRefitTree(const NBodyCtx* ctx, NBodyState* st)
+{
+    NBodyTree* t = &st->tree;
+    mwvector* lo = (mwvector*) mwMallocA(t->cellUsed * sizeof(mwvector));
+    mwvector* hi = (mwvector*) mwMallocA(t->cellUsed * sizeof(mwvector));
+    unsigned int grown;
+    mwbool fresh;
+
+    grown = nbRefitBounds(t, st->bodytab, lo, hi);
+    fresh = ((real) grown <= NBODY_REFIT_STALE_FRACTION * (real) t->cellUsed);
+
+    if (fresh)
+    {
+        nbRefitMoments(ctx, t, st->bodytab, lo, hi);
+        if (ctx->multipoleOrder >= 3)
+            hackOctupole(t, st->bodytab);
+    }
+
+    mwFreeA(lo);
+    mwFreeA(hi);
 
-    hackCofM(ctx, &st->tree, t->root, t->rsize);   /* find c-of-m coordinates */
+    return fresh;
+}
+
+/* nbMakeTree: initialize tree structure for hierarchical force calculation
+ * from body array btab, which contains ctx.nbody bodies.
+ *
+ * Bodies are first loaded into one cell arena, and the finished tree is
+ * copied into a second one in depth first order, so the force walk
+ * visits cells in the order they are stored. Both arenas are kept
+ * between steps and grown whenever a tree does not fit.
+ *
+ * With ctx->treeRefitSteps, the last tree is refit instead for up to
+ * that many steps, unless it has gone stale.
+ */
+NBodyStatus nbMakeTree(const NBodyCtx* ctx, NBodyState* st)
+{
+    int i, nBuckets;
+    NBodyTree* t = &st->tree;
+    NBodyStatus rc;
+    NBodyTreeBucket* buckets;
+    unsigned int topLev;
+
+    if (ctx->treeRefitSteps > 0 && t->root && t->cellSize && t->refitSteps < ctx->treeRefitSteps)
+    {
+        if (nbRefitTree(ctx, st))
+        {
+            t->extentKnown = FALSE;
+            ++t->refitSteps;
+            ++t->refitCount;
+            return NBODY_SUCCESS;
+        }
+    }
+
+    nbReserveCellArenas(t, st->nbody / 2 + NBODY_CELL_BATCH * (nbGetMaxThreads() + 1), st->hugePages);
+
+    do
+    {
+        nBuckets = 0;
+        if (ctx->parallelTree)
+            rc = nbLoadTreeParallel(st, &nBuckets);
+        else
+            rc = nbLoadTreeSerial(st);
+
+        if (rc == NBODY_CELL_OVERFLOW_ERROR)     /* grow arenas and retry */
+            nbReserveCellArenas(t, 2 * t->cellCapacity, st->hugePages);
+    }
+    while (rc == NBODY_CELL_OVERFLOW_ERROR);
+
+    if (nbStatusIsFatal(rc))
+        return rc;
+
+    t->root = &t->cells[0];
+    buckets = t->buckets;
+    topLev = ctx->parallelTree ? t->splitDepth : NBODY_TREE_NO_STOP;
+    t->cellPeak = MAX(t->cellPeak, t->cellUsed);
+
+    if (ctx->treeRefitSteps > 0 && !t->cellSize)
+        t->cellSize = (real*) mwMalloc(t->cellCapacity * sizeof(real));
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(buckets) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nBuckets; ++i)
+    {
+        hackCofM(ctx, t, st->bodytab, buckets[i].cell, buckets[i].size, t->splitDepth, NBODY_TREE_NO_STOP);
+    }
+    hackCofM(ctx, t, st->bodytab, 0, t->rsize, 0, topLev); /* find c-of-m coordinates */
 
     /* Check if tree structure error occured */
-    if (st->tree.structureError)
+    if (t->structureError)
         return NBODY_TREE_STRUCTURE_ERROR;
 
-    threadTree((NBodyNode*) t->root, NULL);        /* add Next and More links */
-    if (ctx->useQuad)                           /* including quad moments? */
-        hackQuad(t->root);                      /* assign Quad moments */
+    /* add Next and More links. The top sets the Next link of each
+     * bucket cell to continue from */
+    threadTree(t->cells, st->bodytab, 0, NULL_LINK, 0, topLev);
+
+  #ifdef _OPENMP
+    #pragma omp parallel for private(i) shared(buckets) schedule(dynamic, 1)
+  #endif
+    for (i = 0; i < nBuckets; ++i)
+    {
+        nodelink_t c = buckets[i].cell;
+        threadTree(t->cells, st->bodytab, c, Next(&t->cells[c]), t->splitDepth, NBODY_TREE_NO_STOP);
+    }
+
+    if (ctx->useQuad || ctx->multipoleOrder >= 3)    /* including quad moments? */
+    {
+      #ifdef _OPENMP
+        #pragma omp parallel for private(i) shared(buckets) schedule(dynamic, 1)
+      #endif
+        for (i = 0; i < nBuckets; ++i)
+        {
+            hackQuad(t->cells, st->bodytab, t->bodyQuads, buckets[i].cell, t->splitDepth, NBODY_TREE_NO_STOP);
+        }
+        hackQuad(t->cells, st->bodytab, t->bodyQuads, 0, 0, topLev);   /* assign Quad moments */
+    }
+
+    if (ctx->multipoleOrder >= 3)                    /* and octupole moments? */
+    {
+        if (!t->octs)
+            t->octs = (NBodyOctMatrix*) mwMallocA(t->cellCapacity * sizeof(NBodyOctMatrix));
+        hackOctupole(t, st->bodytab);
+    }
+
+    ++t->buildCount;
+    t->refitSteps = 0;
 
     return NBODY_SUCCESS;
 }
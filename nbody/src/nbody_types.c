@@ -25,54 +25,52 @@ along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
 #include "nbody_types.h"
 #include "nbody_show.h"
 #include "nbody_defaults.h"
+#include "nbody_pm.h"
+#include "nbody_counters.h"
+#include "nbody_energy.h"
+#include "nbody_potential_table.h"
+#include "nbody_friction.h"
 
 #if NBODY_OPENCL
   #include "nbody_cl.h"
 #endif /* NBODY_OPENCL */
 
+#if NBODY_MPI
+  #include "nbody_mpi.h"
+#endif /* NBODY_MPI */
+
 #if USE_POSIX_SHMEM
   #include <sys/mman.h>
 #endif
 
-static void freeNBodyTree(NBodyTree* t)
+void freeNBodyTree(NBodyTree* t)
 {
-    NBodyNode* p;
-    NBodyNode* tmp;
-
-    p = (NBodyNode*) t->root;
-    while (p != NULL)
-    {
-        if (isCell(p))
-        {
-            tmp = More(p);
-            mwFreeA(p);
-            p = tmp;
-        }
-        else                        /* skip over bodies */
-        {
-            p = Next(p);
-        }
-    }
+    mwFreeA(t->cells);
+    mwFreeA(t->loadCells);
+    mwFreeA(t->octs);
+    free(t->cellSize);
+    free(t->bodyBucket);
+    free(t->bucketBodies);
+    free(t->bucketCounts);
+    free(t->buckets);
 
     t->root = NULL;
+    t->cells = NULL;
+    t->loadCells = NULL;
+    t->octs = NULL;
+    t->bodyQuads = NULL;
+    t->cellSize = NULL;
+    t->bodyBucket = NULL;
+    t->bucketBodies = NULL;
+    t->bucketCounts = NULL;
+    t->buckets = NULL;
+    t->bucketThreads = 0;
+    t->bucketBodyCapacity = 0;
+    t->cellCapacity = 0;
     t->cellUsed = 0;
     t->maxDepth = 0;
 }
 
-static void freeFreeCells(NBodyNode* freeCell)
-{
-    NBodyNode* p;
-    NBodyNode* tmp;
-
-    p = freeCell;
-    while (p)
-    {
-        tmp = Next(p);
-        mwFreeA(p);
-        p = tmp;
-    }
-}
-
 int nbDetachSharedScene(NBodyState* st)
 {
   #if USE_POSIX_SHMEM
@@ -109,8 +107,6 @@ int destroyNBodyState(NBodyState* st)
 
     freeNBodyTree(&st->tree);
     //mw_printf("After Free Tree\n");
-    freeFreeCells(st->freeCell);
-    //mw_printf("After Free Cells\n");
     mwFreeA(st->bodytab);
     //mw_printf("After Free bodytab\n");
     mwFreeA(st->bestLikelihoodBodyTab);
@@ -124,6 +120,25 @@ int destroyNBodyState(NBodyState* st)
         mwFreeA(st->shiftByLMC);
     }
     //mw_printf("After Free LMCShift\n");
+
+    free(st->rungs);
+    free(st->bodyCost);
+    free(st->costOrder);
+    free(st->costSum);
+    nbDestroyPM(st->pm);
+    st->pm = NULL;
+    nbDestroyCounters(st->counters);
+    st->counters = NULL;
+    nbDestroyEnergy(st->energy);
+    st->energy = NULL;
+    nbDestroyPotentialTable(st->potTable);
+    st->potTable = NULL;
+    nbDestroyDispersionTable(st->dispersion);
+    st->dispersion = NULL;
+  #if NBODY_MPI
+    nbDestroyMPI(st->mpi);
+    st->mpi = NULL;
+  #endif
     
     free(st->checkpointResolved);
     //mw_printf("After Free checkpointResolved\n");
@@ -187,7 +202,6 @@ void setInitialNBodyState(NBodyState* st, const NBodyCtx* ctx, Body* bodies, int
     static const NBodyTree emptyTree = EMPTY_TREE;
 
     st->tree = emptyTree;
-    st->freeCell = NULL;
     st->usesQuad = ctx->useQuad;
     st->usesExact = (ctx->criterion == Exact);
 
@@ -217,6 +231,15 @@ void setInitialNBodyState(NBodyState* st, const NBodyCtx* ctx, Body* bodies, int
     /* The tests may step the system from an arbitrary place, so make sure this is 0'ed */
     st->acctab = (mwvector*) mwCallocA(nbody, sizeof(mwvector));
 
+    /* The restricted dwarf starts at the centre of mass of the bodies with all its mass */
+    if (ctx->restricted)
+    {
+        st->dwarfPos = nbCenterOfMass(st);
+        st->dwarfVel = nbCenterOfMom(st);
+        SET_VECTOR(st->dwarfAcc, 0.0, 0.0, 0.0);
+        st->dwarfMassFraction = 1.0;
+    }
+
 }
 
 void setRandomLMCNBodyState(NBodyState* st, int nShift, dsfmt_t* dsfmtState)
@@ -300,6 +323,54 @@ NBodyStatus nbInitNBodyStateCL(NBodyState* st, const NBodyCtx* ctx)
         return NBODY_UNSUPPORTED;
     }
 
+    if (ctx->criterion == FMM)
+    {
+        mw_printf("Cannot use FMM criterion with OpenCL\n");
+        return NBODY_UNSUPPORTED;
+    }
+
+    if (ctx->criterion == PM)
+    {
+        mw_printf("Cannot use PM criterion with OpenCL\n");
+        return NBODY_UNSUPPORTED;
+    }
+
+    if (ctx->multipoleOrder >= 3)
+    {
+        mw_printf("Cannot use octupole moments with OpenCL\n");
+        return NBODY_UNSUPPORTED;
+    }
+
+    if (ctx->maxRung > 0)
+    {
+        mw_printf("Cannot use block timesteps with OpenCL\n");
+        return NBODY_UNSUPPORTED;
+    }
+
+    if (ctx->integrator != Leapfrog)
+    {
+        mw_printf("Cannot use %s integrator with OpenCL\n", showIntegratorT(ctx->integrator));
+        return NBODY_UNSUPPORTED;
+    }
+
+    if (ctx->restricted)
+    {
+        mw_printf("Cannot use restricted mode with OpenCL\n");
+        return NBODY_UNSUPPORTED;
+    }
+
+    if (ctx->forceTolerance > 0.0)
+    {
+        mw_printf("Cannot tune the force calculation with OpenCL\n");
+        return NBODY_UNSUPPORTED;
+    }
+
+    if (ctx->potentialTableTolerance > 0.0)
+    {
+        mw_printf("Cannot tabulate the external potential with OpenCL\n");
+        return NBODY_UNSUPPORTED;
+    }
+
     devInfo = &st->ci->di;
 
     if (!nbCheckDevCapabilities(devInfo, ctx, st->nbody))
@@ -499,6 +570,20 @@ int equalNBodyState(const NBodyState* st1, const NBodyState* st2)
         }
     }
 
+    if (st1->rungs || st2->rungs)
+    {
+        if (!st1->rungs || !st2->rungs)
+        {
+            mw_printf("Comparing non-NULL rungs to NULL pointer!\n");
+            return FALSE;
+        }
+        if (memcmp(st1->rungs, st2->rungs, st1->nbody * sizeof(int)) != 0)
+        {
+            mw_printf("Different timestep rungs detected!\n");
+            return FALSE;
+        }
+    }
+
     if (!equalBodyArray(st1->bodytab, st2->bodytab, st1->nbody))
     {
         return FALSE;
@@ -526,8 +611,6 @@ void cloneNBodyState(NBodyState* st, const NBodyState* oldSt)
     st->tree = emptyTree;
     st->tree.rsize = oldSt->tree.rsize;
 
-    st->freeCell = NULL;
-
     st->lastCheckpoint       = oldSt->lastCheckpoint;
     st->step                 = oldSt->step;
     st->nbody                = oldSt->nbody;
@@ -577,6 +660,19 @@ void cloneNBodyState(NBodyState* st, const NBodyState* oldSt)
     st->LMCpos = oldSt->LMCpos;
     st->LMCvel = oldSt->LMCvel;
 
+    st->dwarfPos = oldSt->dwarfPos;
+    st->dwarfVel = oldSt->dwarfVel;
+    st->dwarfAcc = oldSt->dwarfAcc;
+    st->dwarfMassFraction = oldSt->dwarfMassFraction;
+
+    if (oldSt->rungs)
+    {
+        st->rungs = (int*) mwMalloc(nbody * sizeof(int));
+        memcpy(st->rungs, oldSt->rungs, nbody * sizeof(int));
+    }
+    st->activeRung = oldSt->activeRung;
+    st->substepTime = oldSt->substepTime;
+
     if (st->ci)
     {
         mw_panic("OpenCL NBodyState cloning not implemented\n");
@@ -604,7 +700,6 @@ void clonePartialNBodyState(NBodyState* st, const NBodyState* oldSt)
     unsigned int nbody = oldSt->nbody;
     st->tree = emptyTree;
     st->tree.rsize = oldSt->tree.rsize;
-    st->freeCell = NULL;
     st->lastCheckpoint       = oldSt->lastCheckpoint;
     st->step                 = oldSt->step;
     st->nbody                = oldSt->nbody;
@@ -621,6 +716,11 @@ void clonePartialNBodyState(NBodyState* st, const NBodyState* oldSt)
     st->treeIncest = oldSt->treeIncest;
     st->tree.structureError = oldSt->tree.structureError;
 
+    st->dwarfPos = oldSt->dwarfPos;
+    st->dwarfVel = oldSt->dwarfVel;
+    st->dwarfAcc = oldSt->dwarfAcc;
+    st->dwarfMassFraction = oldSt->dwarfMassFraction;
+
     assert(nbody > 0);
     assert(st->bodytab == NULL && st->acctab == NULL);
 }
@@ -736,6 +836,19 @@ int equalSpherical(const Spherical* s1, const Spherical* s2)
         && feqWithNan(s1->scale, s2->scale);
 }
 
+int equalDwarf(const Dwarf* d1, const Dwarf* d2)
+{
+    return (d1->type == d2->type)
+        && feqWithNan(d1->mass, d2->mass)
+        && feqWithNan(d1->scaleLength, d2->scaleLength)
+        && feqWithNan(d1->n, d2->n)
+        && feqWithNan(d1->p0, d2->p0)
+        && feqWithNan(d1->r200, d2->r200)
+        && feqWithNan(d1->ps, d2->ps)
+        && feqWithNan(d1->r1, d2->r1)
+        && feqWithNan(d1->rc, d2->rc);
+}
+
 int equalPotential(const Potential* p1, const Potential* p2)
 {
     return equalSpherical(&p1->sphere[0], &p2->sphere[0])
@@ -773,6 +886,7 @@ int equalNBodyCtx(const NBodyCtx* ctx1, const NBodyCtx* ctx2)
         && feqWithNan(ctx1->NGPra, ctx2->NGPra)
         && feqWithNan(ctx1->lNCP, ctx2->lNCP)
         && feqWithNan(ctx1->criterion, ctx2->criterion)
+        && ctx1->integrator == ctx2->integrator
         && (ctx1->potentialType == ctx2->potentialType)
         && feqWithNan(ctx1->SimpleOutput, ctx2->SimpleOutput)
         && feqWithNan(ctx1->useQuad, ctx2->useQuad)
@@ -800,6 +914,20 @@ int equalNBodyCtx(const NBodyCtx* ctx1, const NBodyCtx* ctx2)
         && feqWithNan(ctx1->DistCorrect, ctx2->DistCorrect)
         && feqWithNan(ctx1->PMCorrect, ctx2->PMCorrect)
         && feqWithNan(ctx1->quietErrors, ctx2->quietErrors)
+        && feqWithNan(ctx1->parallelTree, ctx2->parallelTree)
+        && ctx1->costBalance == ctx2->costBalance
+        && ctx1->walkGroupSize == ctx2->walkGroupSize
+        && ctx1->multipoleOrder == ctx2->multipoleOrder
+        && ctx1->treeRefitSteps == ctx2->treeRefitSteps
+        && ctx1->maxRung == ctx2->maxRung
+        && feqWithNan(ctx1->rungEta, ctx2->rungEta)
+        && ctx1->pmGridSize == ctx2->pmGridSize
+        && feqWithNan(ctx1->pmBoxSize, ctx2->pmBoxSize)
+        && feqWithNan(ctx1->pmSplit, ctx2->pmSplit)
+        && feqWithNan(ctx1->forceTolerance, ctx2->forceTolerance)
+        && ctx1->deterministic == ctx2->deterministic
+        && feqWithNan(ctx1->potentialTableTolerance, ctx2->potentialTableTolerance)
+        && feqWithNan(ctx1->dispersionTableTolerance, ctx2->dispersionTableTolerance)
         && ctx1->checkpointT == ctx2->checkpointT
         && feqWithNan(ctx1->nStep, ctx2->nStep)
         && equalPotential(&ctx1->pot, &ctx2->pot)
@@ -808,6 +936,10 @@ int equalNBodyCtx(const NBodyCtx* ctx1, const NBodyCtx* ctx2)
         && feqWithNan(ctx1->LMCscale, ctx2->LMCscale)
         && feqWithNan(ctx1->LMCDynaFric, ctx2->LMCDynaFric)
         && feqWithNan(ctx1->coulomb_log, ctx2->coulomb_log)
+        && ctx1->restricted == ctx2->restricted
+        && ctx1->restrictedMassLoss == ctx2->restrictedMassLoss
+        && equalDwarf(&ctx1->restrictedLight, &ctx2->restrictedLight)
+        && equalDwarf(&ctx1->restrictedDark, &ctx2->restrictedDark)
         && feqWithNan(ctx1->calibrationRuns, ctx2->calibrationRuns);
 }
 
@@ -64,6 +64,8 @@ function randomNBodyCtx(prng)
       treeRSize     = prng:randomListItem({ 4, 8, 2, 16 }),
       criterion     = prng:randomListItem({"TreeCode", "SW93", "BH86", "Exact"}),
       useQuad       = prng:randomBool(),
+      maxRung       = prng:randomListItem({ 0, 0, 2, 4 }),
+      rungEta       = prng:random(0.01, 0.1),
       BestLikeStart = prng:random(0.85,0.99),
       BetaSigma     = sigma,
       VelSigma      = sigma,
@@ -0,0 +1,33 @@
+-- The Miyamoto-Nagai disk, logarithmic halo and Hernquist bulge as a
+-- Lua potential, for lua_potential_test to compare with the built-in
+-- ones. The constants match the test's. An optional argument flattens
+-- the halo along y, which makes it a triaxial halo with c1 = 1,
+-- c2 = 1 / qy^2 and c3 = 0.
+
+local args = { ... }
+local diskMass, diskA, diskB = 4.45865888e5, 6.5, 0.26
+local vhalo, haloD, haloQ = 73.0, 12.0, 1.0
+local haloQY = tonumber(args[1]) or 1.0
+local bulgeMass, bulgeA = 1.5e5, 0.7
+
+function makePotential()
+   return function(x, y, z)
+      local zp = sqrt(z * z + diskB * diskB)
+      local azp = diskA + zp
+      local rp = x * x + y * y + azp * azp
+      local rth = rp * sqrt(rp)
+
+      local ax = -diskMass * x / rth
+      local ay = -diskMass * y / rth
+      local az = -diskMass * z * azp / (zp * rth)
+
+      local k = -2.0 * vhalo * vhalo / (haloD * haloD + x * x + (y / haloQY) * (y / haloQY) + (z / haloQ) * (z / haloQ))
+      ax = ax + k * x
+      ay = ay + k * y / (haloQY * haloQY)
+      az = az + k * z / (haloQ * haloQ)
+
+      local r = sqrt(x * x + y * y + z * z)
+      local h = -bulgeMass / (r * (bulgeA + r) * (bulgeA + r))
+      return ax + h * x, ay + h * y, az + h * z
+   end
+end
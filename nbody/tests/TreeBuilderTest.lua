@@ -0,0 +1,72 @@
+-- The parallel tree builder must build exactly the same tree as
+-- inserting the bodies one at a time, so stepping with either one
+-- should give identical states. The seed and potential are fixed, so a
+-- failure can be run again.
+
+require "NBodyTesting"
+SM = require "SampleModels"
+
+function randomTreeCtx(prng)
+   return NBodyCtx.create{
+      timestep    = prng:random(1.0e-5, 1.0e-4),
+      timeEvolve  = prng:random(0, 10),
+      theta       = prng:random(0.3, 1),
+      eps2        = prng:random(1.0e-9, 1.0e-3),
+      treeRSize   = prng:randomListItem({ 4, 8, 2, 16 }),
+      criterion   = prng:randomListItem({ "TreeCode", "SW93", "BH86" }),
+      useQuad     = prng:randomBool(),
+      BetaSigma   = 2.5,
+      VelSigma    = 2.5,
+      DistSigma   = 2.5,
+      PMSigma     = 2.5,
+      BetaCorrect = 1.111,
+      VelCorrect  = 1.111,
+      DistCorrect = 1.111,
+      PMCorrect   = 1.111,
+      allowIncest = true,
+      quietErrors = true
+   }
+end
+
+local nTests = 10
+local prng = DSFMT.create(5489)
+
+local potential = Potential.create{
+   spherical = Spherical.hernquist{ mass = 1.5e5, scale = 0.8 },
+   disk      = Disk.miyamotoNagai{ mass = 4.5e5, scaleLength = 6.0, scaleHeight = 0.3 },
+   disk2     = Disk.none{ mass = 3.0e5 },
+   halo      = Halo.logarithmic{ vhalo = 73, scaleLength = 12.0, flattenZ = 1.0 }
+}
+
+for i = 1, nTests do
+   local nbody = prng:randomListItem({ 20, 500, 4000 })
+   local m = SM.randomPlummer(prng, nbody)
+   local ctx = randomTreeCtx(prng)
+   local testSteps = floor(prng:random(1, 11))
+   local stSerial, stParallel
+
+   ctx:addPotential(potential)
+
+   ctx.parallelTree = false
+   stSerial = NBodyState.create(ctx, m)
+   for j = 1, testSteps do
+      stSerial:step(ctx)
+   end
+
+   ctx.parallelTree = true
+   stParallel = NBodyState.create(ctx, m)
+   for j = 1, testSteps do
+      stParallel:step(ctx)
+   end
+
+   assert(stSerial:isFinite() and stParallel:isFinite(),
+          string.format("Bodies are not finite after %d steps:\n%s", testSteps, tostring(ctx)))
+
+   assert(stSerial == stParallel,
+          string.format("Parallel tree build differs after %d steps:\nstate 1 = %s\nstate 2 = %s\n%s",
+                        testSteps,
+                        tostring(stSerial),
+                        tostring(stParallel),
+                        tostring(ctx))
+       )
+end
@@ -0,0 +1,173 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tabulates the velocity dispersion of a few static potentials and
+ * compares it with the one integrated directly at random points out to
+ * past the upper limit of the integral. Also reports how much faster the
+ * table is, and checks potentials depending on time or azimuth are not
+ * tabulated.
+ */
+
+#include "milkyway_util.h"
+#include "nbody_types.h"
+#include "nbody_potential.h"
+#include "nbody_friction.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_POINTS 2000
+
+/* The table is checked to this in the middle of its cells */
+static const real tableTolerance = 1.0e-4;
+static const real tolerance = 1.0e-3;
+
+/* Either is larger, so two NaNs count as the same */
+static inline int differ(real a, real b)
+{
+    return a < b || a > b;
+}
+
+static inline real randomUnit(void)
+{
+    return ((real) rand() + 0.5) / ((real) RAND_MAX + 1.0);
+}
+
+/* Spread evenly in log radius from 1 kpc to past the upper limit, a
+ * twentieth of them in the plane */
+static mwvector randomPoint(int i, real upper)
+{
+    mwvector p;
+    real r = mw_pow(2.0 * upper, randomUnit());
+    real cosTheta = (i % 20 == 0) ? 0.0 : 2.0 * randomUnit() - 1.0;
+    real sinTheta = mw_sqrt(1.0 - sqr(cosTheta));
+    real phi = 2.0 * M_PI * randomUnit();
+
+    SET_VECTOR(p, r * sinTheta * mw_cos(phi), r * sinTheta * mw_sin(phi), r * cosTheta);
+    return p;
+}
+
+static int checkTable(const char* name, const Potential* pot)
+{
+    int i, failed = 0;
+    real worst = 0.0;
+    double t0, tDirect, tTable;
+    NBodyDispersionTable* t;
+    mwvector* points = (mwvector*) mwMallocA(N_POINTS * sizeof(mwvector));
+    real* direct = (real*) mwMallocA(N_POINTS * sizeof(real));
+
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        points[i] = randomPoint(i, 50.0 * pot->halo.scaleLength);
+    }
+
+    t0 = mwGetTime();
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        direct[i] = nbVelDispersion(NULL, pot, points[i], 0.0);
+    }
+    tDirect = mwGetTime() - t0;
+
+    t = nbMakeDispersionTable(pot, tableTolerance);
+    if (!t)
+    {
+        mw_printf("%s was not tabulated\n", name);
+        failed = 1;
+    }
+
+    t0 = mwGetTime();
+    for (i = 0; i < N_POINTS && !failed; ++i)
+    {
+        real sigma2 = nbVelDispersion(t, pot, points[i], 0.0);
+
+        if (direct[i] <= 0.0)
+        {
+            /* Past the upper limit */
+            if (differ(sigma2, direct[i]))
+            {
+                mw_printf("%s: %g from the table, %g directly at (%g, %g, %g)\n",
+                          name, sigma2, direct[i], X(points[i]), Y(points[i]), Z(points[i]));
+                failed = 1;
+            }
+        }
+        else
+        {
+            worst = mw_fmax(worst, mw_fabs(sigma2 - direct[i]) / direct[i]);
+        }
+    }
+    tTable = mwGetTime() - t0;
+
+    mw_printf("%s: largest relative error %.3e, %.3gs directly, %.3gs from the table\n",
+              name, worst, tDirect, tTable);
+
+    if (!failed && !(worst <= tolerance))
+    {
+        mw_printf("%s table is outside the tolerance %g\n", name, tolerance);
+        failed = 1;
+    }
+
+    nbDestroyDispersionTable(t);
+    mwFreeA(points);
+    mwFreeA(direct);
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+    NBodyDispersionTable* t;
+    Potential pot = EMPTY_POTENTIAL;
+
+    srand(1234);
+
+    pot.sphere[0].type = HernquistSpherical;
+    pot.sphere[0].mass = 1.5e5;
+    pot.sphere[0].scale = 0.7;
+    pot.disk.type = MiyamotoNagaiDisk;
+    pot.disk.mass = 4.45865888e5;
+    pot.disk.scaleLength = 6.5;
+    pot.disk.scaleHeight = 0.26;
+    pot.disk2.type = NoDisk;
+    pot.halo.type = LogarithmicHalo;
+    pot.halo.vhalo = 73.0;
+    pot.halo.scaleLength = 12.0;
+    pot.halo.flattenZ = 1.0;
+    failed |= checkTable("Miyamoto-Nagai, logarithmic, Hernquist", &pot);
+
+    pot.halo.type = NFWHalo;
+    pot.halo.vhalo = 155.0;
+    pot.halo.scaleLength = 22.25;
+    failed |= checkTable("Miyamoto-Nagai, NFW, Hernquist", &pot);
+
+    pot.halo.type = TriaxialHalo;
+    pot.halo.vhalo = 116.0;
+    pot.halo.scaleLength = 16.3;
+    pot.halo.flattenZ = 1.43;
+    pot.halo.c1 = 1.08;
+    pot.halo.c2 = 0.73;
+    pot.halo.c3 = -0.21;
+    t = nbMakeDispersionTable(&pot, tableTolerance);
+    if (t)
+    {
+        mw_printf("Triaxial halo was tabulated\n");
+        nbDestroyDispersionTable(t);
+        failed = 1;
+    }
+
+    return failed;
+}
@@ -0,0 +1,154 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Evaluates potentials made of the components with loops of their own
+ * and of ones without for a block of random positions, including the
+ * centre, and checks nbExtAccelerationBlock() gives exactly what
+ * nbExtAcceleration() does at each. Also reports how much faster the
+ * block is.
+ */
+
+#include "milkyway_util.h"
+#include "nbody_types.h"
+#include "nbody_potential.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_POINTS 4096
+#define N_REPEAT 50
+
+static inline real randomCoord(void)
+{
+    return 100.0 * (2.0 * ((real) rand() + 0.5) / ((real) RAND_MAX + 1.0) - 1.0);
+}
+
+/* Either is larger, so two NaNs count as the same */
+static inline int differ(real a, real b)
+{
+    return a < b || a > b;
+}
+
+static int checkBlock(const char* name, const Potential* pot, const real* x, const real* y, const real* z)
+{
+    int i, k, nDiff = 0;
+    double t0, tDirect, tBlock;
+    real* ax = (real*) mwMallocA(3 * N_POINTS * sizeof(real));
+    real* ay = ax + N_POINTS;
+    real* az = ay + N_POINTS;
+    mwvector* direct = (mwvector*) mwMallocA(N_POINTS * sizeof(mwvector));
+
+    t0 = mwGetTime();
+    for (k = 0; k < N_REPEAT; ++k)
+    {
+        for (i = 0; i < N_POINTS; ++i)
+        {
+            mwvector pos = mw_vec(x[i], y[i], z[i]);
+            direct[i] = nbExtAcceleration(pot, pos, 0.5);
+        }
+    }
+    tDirect = mwGetTime() - t0;
+
+    t0 = mwGetTime();
+    for (k = 0; k < N_REPEAT; ++k)
+    {
+        nbExtAccelerationBlock(pot, x, y, z, ax, ay, az, N_POINTS, 0.5);
+    }
+    tBlock = mwGetTime() - t0;
+
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        if (differ(ax[i], X(direct[i])) || differ(ay[i], Y(direct[i])) || differ(az[i], Z(direct[i])))
+        {
+            if (nDiff++ == 0)
+            {
+                mw_printf("%s: (%g, %g, %g) from the block, (%g, %g, %g) directly at (%g, %g, %g)\n",
+                          name, ax[i], ay[i], az[i], X(direct[i]), Y(direct[i]), Z(direct[i]), x[i], y[i], z[i]);
+            }
+        }
+    }
+
+    mw_printf("%s: %d of %d positions differ, %.3gs directly, %.3gs as a block\n",
+              name, nDiff, N_POINTS, tDirect, tBlock);
+
+    mwFreeA(ax);
+    mwFreeA(direct);
+
+    return nDiff != 0;
+}
+
+int main(void)
+{
+    int i, failed = 0;
+    Potential pot = EMPTY_POTENTIAL;
+    real* x = (real*) mwMallocA(3 * N_POINTS * sizeof(real));
+    real* y = x + N_POINTS;
+    real* z = y + N_POINTS;
+
+    srand(1234);
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        x[i] = randomCoord();
+        y[i] = randomCoord();
+        z[i] = randomCoord();
+    }
+    x[0] = y[0] = z[0] = 0.0;
+
+    pot.sphere[0].type = HernquistSpherical;
+    pot.sphere[0].mass = 1.5e5;
+    pot.sphere[0].scale = 0.7;
+    pot.disk.type = MiyamotoNagaiDisk;
+    pot.disk.mass = 4.45865888e5;
+    pot.disk.scaleLength = 6.5;
+    pot.disk.scaleHeight = 0.26;
+    pot.disk2.type = NoDisk;
+    pot.halo.type = LogarithmicHalo;
+    pot.halo.vhalo = 73.0;
+    pot.halo.scaleLength = 12.0;
+    pot.halo.flattenZ = 1.0;
+    failed |= checkBlock("Miyamoto-Nagai, logarithmic, Hernquist", &pot, x, y, z);
+
+    pot.halo.type = NFWHalo;
+    pot.halo.vhalo = 155.0;
+    pot.halo.scaleLength = 22.25;
+    failed |= checkBlock("Miyamoto-Nagai, NFW, Hernquist", &pot, x, y, z);
+
+    pot.halo.type = TriaxialHalo;
+    pot.halo.vhalo = 116.0;
+    pot.halo.scaleLength = 16.3;
+    pot.halo.flattenZ = 1.43;
+    pot.halo.c1 = 1.08;
+    pot.halo.c2 = 0.73;
+    pot.halo.c3 = -0.21;
+    failed |= checkBlock("Miyamoto-Nagai, triaxial, Hernquist", &pot, x, y, z);
+
+    /* Components without loops of their own between ones with them */
+    pot.disk2.type = OrbitingBar;
+    pot.disk2.mass = 1.0e4;
+    pot.disk2.scaleLength = 3.5;
+    pot.disk2.patternSpeed = 41.0;
+    pot.disk2.startAngle = 0.5;
+    pot.halo.type = HernquistHalo;
+    pot.halo.mass = 1.0e6;
+    pot.sphere[0].type = PlummerSpherical;
+    failed |= checkBlock("Miyamoto-Nagai, bar, Hernquist halo, Plummer", &pot, x, y, z);
+
+    mwFreeA(x);
+
+    return failed;
+}
+
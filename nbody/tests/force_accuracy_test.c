@@ -0,0 +1,684 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the self gravity found by the different force methods with
+ * direct summation over a Plummer sphere, and reports how long the
+ * tree code, fast multipole method and direct summation take. Also
+ * checks the Exact criterion against a naive direct sum, that a tree
+ * refit after the bodies move is as accurate as a new tree, that
+ * balancing the walks by cost does not change the forces, that the
+ * restricted mode gives the analytic acceleration of its dwarf, how
+ * the particle-mesh solver compares with the tree, that the tuned
+ * settings for a force tolerance keep to it, and that counting the walks
+ * leaves the forces alone.
+ */
+
+#include "milkyway_util.h"
+#include "nbody_types.h"
+#include "nbody_defaults.h"
+#include "nbody_grav.h"
+#include "nbody_show.h"
+#include "nbody_util.h"
+#include "nbody_autotune.h"
+#include "nbody_counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int nbody = 4000;
+static const real theta = 0.5;
+
+/* Largest RMS relative acceleration error accepted from a tree walk */
+static const real maxTreeError = 0.02;
+
+static inline real randomUnit(void)
+{
+    return ((real) rand() + 0.5) / ((real) RAND_MAX + 1.0);
+}
+
+/* Plummer sphere of unit mass and scale radius, positions only */
+static Body* makePlummerBodies(int n)
+{
+    int i;
+    Body* bodies = (Body*) mwCallocA(n, sizeof(Body));
+
+    for (i = 0; i < n; ++i)
+    {
+        real r = 1.0 / mw_sqrt(mw_pow(randomUnit(), -2.0 / 3.0) - 1.0);
+        real cosTheta = 2.0 * randomUnit() - 1.0;
+        real sinTheta = mw_sqrt(1.0 - sqr(cosTheta));
+        real phi = 2.0 * M_PI * randomUnit();
+
+        r = mw_fmin(r, 50.0);
+        SET_VECTOR(Pos(&bodies[i]), r * sinTheta * mw_cos(phi), r * sinTheta * mw_sin(phi), r * cosTheta);
+        Mass(&bodies[i]) = 1.0 / n;
+        Type(&bodies[i]) = BODY(FALSE);
+        bodies[i].bodynode.id = (unsigned int) i;
+    }
+
+    return bodies;
+}
+
+static NBodyCtx makeForceCtx(criterion_t criterion, mwbool useQuad, unsigned int walkGroupSize)
+{
+    NBodyCtx ctx = defaultNBodyCtx;
+
+    ctx.criterion = criterion;
+    ctx.theta = (criterion == Exact) ? 0.0 : theta;
+    ctx.useQuad = (criterion == Exact) ? FALSE : useQuad;
+    ctx.walkGroupSize = walkGroupSize;
+    ctx.eps2 = 1.0e-6;
+    ctx.treeRSize = 4.0;
+    ctx.timestep = 1.0e-3;
+    ctx.potentialType = EXTERNAL_POTENTIAL_NONE;
+    ctx.allowIncest = TRUE;
+    ctx.quietErrors = TRUE;
+
+    return ctx;
+}
+
+/* Find the accelerations of the bodies with ctx, into acc */
+static int computeAccelerations(const NBodyCtx* ctx, const Body* bodies, int n, mwvector* acc, double* time)
+{
+    double t0;
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc;
+    Body* copy = (Body*) mwMallocA(n * sizeof(Body));
+
+    memcpy(copy, bodies, n * sizeof(Body));
+    setInitialNBodyState(&st, ctx, copy, n);
+
+    t0 = mwGetTime();
+    rc = nbGravMap(ctx, &st);
+    if (time)
+        *time = mwGetTime() - t0;
+    if (nbStatusIsFatal(rc))
+    {
+        mw_printf("Force calculation failed: %d\n", rc);
+        destroyNBodyState(&st);
+        return 1;
+    }
+
+    memcpy(acc, st.acctab, n * sizeof(mwvector));
+    destroyNBodyState(&st);
+
+    return 0;
+}
+
+static real rmsRelativeError(const mwvector* acc, const mwvector* exact, int n)
+{
+    int i;
+    real sum = 0.0;
+
+    for (i = 0; i < n; ++i)
+    {
+        sum += mw_sqrv(mw_subv(acc[i], exact[i])) / mw_sqrv(exact[i]);
+    }
+
+    return mw_sqrt(sum / n);
+}
+
+/* Plain per body direct summation, as the Exact criterion used to
+ * find it, to check the tiled pair kernel against */
+static void naiveDirectSum(const Body* bodies, int n, real eps2, mwvector* acc)
+{
+    int i, j;
+
+    for (i = 0; i < n; ++i)
+    {
+        mwvector a = ZERO_VECTOR;
+
+        for (j = 0; j < n; ++j)
+        {
+            mwvector dr = mw_subv(Pos(&bodies[j]), Pos(&bodies[i]));
+            real drSq = mw_sqrv(dr) + eps2;
+            real drab = mw_sqrt(drSq);
+            real mor3 = Mass(&bodies[j]) / drab / drSq;
+
+            mw_incaddv(a, mw_mulvs(dr, mor3));
+        }
+
+        acc[i] = a;
+    }
+}
+
+/* Compare the Exact criterion with the naive direct sum it replaced */
+static int checkExact(const Body* bodies, int n, const mwvector* exact, double tExact)
+{
+    NBodyCtx ctx = makeForceCtx(Exact, FALSE, 0);
+    mwvector* naive = (mwvector*) mwMallocA(n * sizeof(mwvector));
+    double t0 = mwGetTime();
+    double tNaive;
+    real err;
+
+    naiveDirectSum(bodies, n, ctx.eps2, naive);
+    tNaive = mwGetTime() - t0;
+    err = rmsRelativeError(exact, naive, n);
+    mwFreeA(naive);
+
+    mw_printf("Exact    error = %.3e against naive direct sum, time = %.3fs (naive %.3fs, %.1fx)\n",
+              err, tExact, tNaive, tNaive / tExact);
+
+    if (err > 1.0e-12)
+    {
+        mw_printf("  Exact forces differ from the direct sum\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Find the forces on bodies with a refit of their tree after moving
+ * them by up to dx, and compare them with those from a new tree */
+static int checkRefit(const Body* bodies, int n, real dx)
+{
+    int i, failed = 0;
+    NBodyCtx ctx = makeForceCtx(TreeCode, TRUE, 0);
+    NBodyCtx exactCtx = makeForceCtx(Exact, FALSE, 0);
+    NBodyState st = EMPTY_NBODYSTATE;
+    Body* moved = (Body*) mwMallocA(n * sizeof(Body));
+    mwvector* exact = (mwvector*) mwMallocA(n * sizeof(mwvector));
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+    real errRefit, errBuild;
+
+    memcpy(moved, bodies, n * sizeof(Body));
+    for (i = 0; i < n; ++i)
+    {
+        X(Pos(&moved[i])) += dx * (2.0 * randomUnit() - 1.0);
+        Y(Pos(&moved[i])) += dx * (2.0 * randomUnit() - 1.0);
+        Z(Pos(&moved[i])) += dx * (2.0 * randomUnit() - 1.0);
+    }
+
+    ctx.treeRefitSteps = 1;
+    setInitialNBodyState(&st, &ctx, (Body*) mwMallocA(n * sizeof(Body)), n);
+    memcpy(st.bodytab, bodies, n * sizeof(Body));
+
+    failed |= nbStatusIsFatal(nbGravMap(&ctx, &st));
+    for (i = 0; i < n; ++i)         /* keep the tree links of the bodies */
+    {
+        Pos(&st.bodytab[i]) = Pos(&moved[i]);
+    }
+    failed |= nbStatusIsFatal(nbGravMap(&ctx, &st));
+    memcpy(acc, st.acctab, n * sizeof(mwvector));
+
+    if (st.tree.buildCount != 1 || st.tree.refitCount != 1)
+    {
+        mw_printf("refit: expected 1 build and 1 refit, got %u and %u\n",
+                  st.tree.buildCount, st.tree.refitCount);
+        failed = 1;
+    }
+    destroyNBodyState(&st);
+
+    failed |= computeAccelerations(&exactCtx, moved, n, exact, NULL);
+    errRefit = rmsRelativeError(acc, exact, n);
+
+    ctx.treeRefitSteps = 0;
+    failed |= computeAccelerations(&ctx, moved, n, acc, NULL);
+    errBuild = rmsRelativeError(acc, exact, n);
+
+    mw_printf("TreeCode refit: error = %.3e (new tree %.3e)\n", errRefit, errBuild);
+
+    if (errRefit > maxTreeError || errRefit > 1.5 * errBuild)
+    {
+        mw_printf("  refit tree is too inaccurate\n");
+        failed = 1;
+    }
+
+    mwFreeA(moved);
+    mwFreeA(exact);
+    mwFreeA(acc);
+
+    return failed;
+}
+
+/* Take two force calculations on the same tree, the second split
+ * between threads by the costs measured in the first, and check they
+ * match the dynamically scheduled walk exactly */
+static int checkCostBalance(const Body* bodies, int n)
+{
+    int failed = 0;
+    NBodyCtx ctx = makeForceCtx(TreeCode, TRUE, 0);
+    NBodyState st = EMPTY_NBODYSTATE;
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+
+    ctx.costBalance = FALSE;
+    failed |= computeAccelerations(&ctx, bodies, n, acc, NULL);
+
+    ctx.costBalance = TRUE;
+    setInitialNBodyState(&st, &ctx, (Body*) mwMallocA(n * sizeof(Body)), n);
+    memcpy(st.bodytab, bodies, n * sizeof(Body));
+
+    failed |= nbStatusIsFatal(nbGravMap(&ctx, &st));
+    failed |= nbStatusIsFatal(nbGravMap(&ctx, &st));
+
+    if (!st.bodyCost)
+    {
+        mw_printf("cost balance: no body costs were measured\n");
+        failed = 1;
+    }
+    else if (memcmp(acc, st.acctab, n * sizeof(mwvector)) != 0)
+    {
+        mw_printf("cost balance: forces differ from the dynamically scheduled walk\n");
+        failed = 1;
+    }
+
+    if (st.forceImbalanceCount > 0)
+    {
+        mw_printf("TreeCode cost balance: mean thread imbalance = %.3f, max = %.3f\n",
+                  st.forceImbalanceSum / st.forceImbalanceCount, st.forceImbalanceMax);
+    }
+
+    destroyNBodyState(&st);
+    mwFreeA(acc);
+
+    return failed;
+}
+
+/* Find the accelerations with the PM criterion into acc, timing a
+ * second force calculation once the Green's function is known */
+static int computePMAccelerations(const NBodyCtx* ctx, const Body* bodies, int n, mwvector* acc, double* time)
+{
+    double t0;
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc;
+
+    setInitialNBodyState(&st, ctx, (Body*) mwMallocA(n * sizeof(Body)), n);
+    memcpy(st.bodytab, bodies, n * sizeof(Body));
+
+    rc = nbGravMap(ctx, &st);
+    t0 = mwGetTime();
+    rc |= nbGravMap(ctx, &st);
+    *time = mwGetTime() - t0;
+
+    memcpy(acc, st.acctab, n * sizeof(mwvector));
+    destroyNBodyState(&st);
+
+    if (nbStatusIsFatal(rc))
+    {
+        mw_printf("PM force calculation failed: %d\n", rc);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Compare the particle-mesh forces with direct summation. Split with
+ * the tree, the mesh must be as accurate as a tree walk. The mesh alone
+ * cannot resolve anything below a cell, so it is compared with direct
+ * summation softened to a cell. */
+static int checkPM(const Body* bodies, int n, const mwvector* exact, double tTree)
+{
+    int failed = 0;
+    NBodyCtx ctx = makeForceCtx(PM, TRUE, 0);
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+    mwvector* softExact = (mwvector*) mwMallocA(n * sizeof(mwvector));
+    double tPM, tExact;
+    real err;
+
+    ctx.pmGridSize = 64;
+    ctx.pmSplit = 1.25;
+    ctx.pmBoxSize = 0.0;
+    failed |= computePMAccelerations(&ctx, bodies, n, acc, &tPM);
+    err = rmsRelativeError(acc, exact, n);
+    mw_printf("PM       split = %g, fitted box: error = %.3e, time = %.3fs (TreeCode %.3fs)\n",
+              ctx.pmSplit, err, tPM, tTree);
+    if (err > maxTreeError)
+    {
+        mw_printf("  error exceeds %g\n", maxTreeError);
+        failed = 1;
+    }
+
+    ctx.pmBoxSize = 8.0;
+    failed |= computePMAccelerations(&ctx, bodies, n, acc, &tPM);
+    mw_printf("PM       split = %g, box = %g: error = %.3e, time = %.3fs\n",
+              ctx.pmSplit, ctx.pmBoxSize, rmsRelativeError(acc, exact, n), tPM);
+
+    ctx.pmSplit = 0.0;
+    ctx.eps2 = sqr(ctx.pmBoxSize / ctx.pmGridSize);
+    failed |= computePMAccelerations(&ctx, bodies, n, acc, &tPM);
+    {
+        NBodyCtx exactCtx = makeForceCtx(Exact, FALSE, 0);
+        exactCtx.eps2 = ctx.eps2;
+        failed |= computeAccelerations(&exactCtx, bodies, n, softExact, &tExact);
+    }
+    err = rmsRelativeError(acc, softExact, n);
+    mw_printf("PM       mesh alone, box = %g: error = %.3e, time = %.3fs (Exact %.3fs, both softened to a cell)\n",
+              ctx.pmBoxSize, err, tPM, tExact);
+    if (err > 0.05)
+    {
+        mw_printf("  error exceeds %g\n", 0.05);
+        failed = 1;
+    }
+
+    mwFreeA(acc);
+    mwFreeA(softExact);
+
+    return failed;
+}
+
+/* Replace the self gravity with a two component Plummer dwarf of the
+ * same total mass and scale, and check each body gets the analytic
+ * acceleration towards the centre of mass */
+static int checkRestricted(const Body* bodies, int n, const mwvector* exact, double tTree)
+{
+    int i, failed = 0;
+    NBodyCtx ctx = makeForceCtx(TreeCode, FALSE, 0);
+    NBodyState st = EMPTY_NBODYSTATE;
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+    mwvector* analytic = (mwvector*) mwMallocA(n * sizeof(mwvector));
+    mwvector centre;
+    double tRestricted;
+
+    ctx.restricted = TRUE;
+    ctx.restrictedLight.type = Plummer;
+    ctx.restrictedLight.mass = 0.25;
+    ctx.restrictedLight.scaleLength = 1.0;
+    ctx.restrictedDark.type = Plummer;
+    ctx.restrictedDark.mass = 0.75;
+    ctx.restrictedDark.scaleLength = 1.0;
+
+    failed |= computeAccelerations(&ctx, bodies, n, acc, &tRestricted);
+
+    setInitialNBodyState(&st, &ctx, (Body*) mwMallocA(n * sizeof(Body)), n);
+    memcpy(st.bodytab, bodies, n * sizeof(Body));
+    centre = nbCenterOfMass(&st);
+    destroyNBodyState(&st);
+
+    for (i = 0; i < n; ++i)
+    {
+        mwvector dr = mw_subv(Pos(&bodies[i]), centre);
+        analytic[i] = mw_mulvs(dr, -1.0 * minusthreehalves(mw_sqrv(dr) + 1.0));
+    }
+
+    mw_printf("Restricted: error = %.3e, self gravity difference = %.3e, time = %.3fs (TreeCode %.3fs)\n",
+              rmsRelativeError(acc, analytic, n), rmsRelativeError(acc, exact, n), tRestricted, tTree);
+
+    if (rmsRelativeError(acc, analytic, n) > 1.0e-12)
+    {
+        mw_printf("  restricted accelerations differ from the analytic dwarf\n");
+        failed = 1;
+    }
+
+    mwFreeA(acc);
+    mwFreeA(analytic);
+
+    return failed;
+}
+
+/* Tune the criterion, theta and useQuad for a few tolerances, and check
+ * the error of the tuned settings on all of the bodies. The tuning only
+ * samples some of them, so it is allowed a little over. */
+static int checkAutotune(const Body* bodies, int n, const mwvector* exact)
+{
+    static const real tolerances[] = { 1.0e-2, 2.0e-3 };
+    unsigned int i;
+    int failed = 0;
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+
+    for (i = 0; i < sizeof(tolerances) / sizeof(tolerances[0]); ++i)
+    {
+        NBodyCtx ctx = makeForceCtx(TreeCode, TRUE, 0);
+        NBodyState st = EMPTY_NBODYSTATE;
+        double tTuned;
+        real err;
+
+        ctx.forceTolerance = tolerances[i];
+        setInitialNBodyState(&st, &ctx, (Body*) mwMallocA(n * sizeof(Body)), n);
+        memcpy(st.bodytab, bodies, n * sizeof(Body));
+        nbAutotune(&ctx, &st);
+        destroyNBodyState(&st);
+
+        failed |= computeAccelerations(&ctx, bodies, n, acc, &tTuned);
+        err = rmsRelativeError(acc, exact, n);
+        mw_printf("Tuned    tolerance = %g: %s theta = %.3f quad = %d, error = %.3e, time = %.3fs\n",
+                  ctx.forceTolerance, showCriterionT(ctx.criterion), ctx.theta, ctx.useQuad, err, tTuned);
+
+        if (err > 1.5 * ctx.forceTolerance)
+        {
+            mw_printf("  error exceeds %g\n", 1.5 * ctx.forceTolerance);
+            failed = 1;
+        }
+    }
+
+    mwFreeA(acc);
+
+    return failed;
+}
+
+/* Find the forces per body and in groups with the walks counted, and
+ * check the forces are the same as without and the counts add up */
+static int checkCounters(const Body* bodies, int n)
+{
+    static const unsigned int groupSizes[] = { 0, 32 };
+    unsigned int i;
+    int j;
+    int failed = 0;
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+
+    for (i = 0; i < sizeof(groupSizes) / sizeof(groupSizes[0]); ++i)
+    {
+        NBodyCtx ctx = makeForceCtx(TreeCode, TRUE, groupSizes[i]);
+        NBodyState st = EMPTY_NBODYSTATE;
+        NBodyThreadCounts sum;
+
+        failed |= computeAccelerations(&ctx, bodies, n, acc, NULL);
+
+        setInitialNBodyState(&st, &ctx, (Body*) mwMallocA(n * sizeof(Body)), n);
+        memcpy(st.bodytab, bodies, n * sizeof(Body));
+        nbStartCounters(&st);
+        failed |= nbStatusIsFatal(nbGravMap(&ctx, &st));
+
+        memset(&sum, 0, sizeof(sum));
+        for (j = 0; j < st.counters->nThread; ++j)
+        {
+            sum.walks += st.counters->threads[j].walks;
+            sum.bodies += st.counters->threads[j].bodies;
+            sum.cellInteractions += st.counters->threads[j].cellInteractions;
+            sum.bodyInteractions += st.counters->threads[j].bodyInteractions;
+        }
+
+        mw_printf("Counted  group size = %u: %llu walks, %.1f body-cell and %.1f body-body per body\n",
+                  groupSizes[i], (unsigned long long) sum.walks,
+                  (double) sum.cellInteractions / n, (double) sum.bodyInteractions / n);
+
+        if (memcmp(acc, st.acctab, n * sizeof(mwvector)) != 0)
+        {
+            mw_printf("  counted forces differ\n");
+            failed = 1;
+        }
+
+        if (   sum.bodies != (uint64_t) n
+            || (groupSizes[i] == 0 ? sum.walks != (uint64_t) n : sum.walks > (uint64_t) n)
+            || st.counters->forces != 1
+            || st.counters->trees != 1
+            || sum.cellInteractions == 0
+            || sum.bodyInteractions == 0)
+        {
+            mw_printf("  counts do not add up\n");
+            failed = 1;
+        }
+
+        destroyNBodyState(&st);
+    }
+
+    mwFreeA(acc);
+
+    return failed;
+}
+
+/* Per body and grouped walks of each tree criterion, with and without
+ * quadrupole moments */
+static int checkTreeWalks(const Body* bodies, int n, const mwvector* exact)
+{
+    static const criterion_t criteria[] = { BH86, SW93, TreeCode };
+    unsigned int i, quad;
+    int failed = 0;
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+
+    for (i = 0; i < sizeof(criteria) / sizeof(criteria[0]); ++i)
+    {
+        for (quad = 0; quad <= 1; ++quad)
+        {
+            NBodyCtx ctx = makeForceCtx(criteria[i], (mwbool) quad, 0);
+            real errBody, errGroup;
+
+            failed |= computeAccelerations(&ctx, bodies, n, acc, NULL);
+            errBody = rmsRelativeError(acc, exact, n);
+
+            ctx.walkGroupSize = 32;
+            failed |= computeAccelerations(&ctx, bodies, n, acc, NULL);
+            errGroup = rmsRelativeError(acc, exact, n);
+
+            mw_printf("%-8s quad = %u: per body walk error = %.3e, grouped walk error = %.3e\n",
+                      showCriterionT(criteria[i]), quad, errBody, errGroup);
+
+            if (errBody > maxTreeError || errGroup > maxTreeError)
+            {
+                mw_printf("  error exceeds %g\n", maxTreeError);
+                failed = 1;
+            }
+
+            /* Groups only ever open more cells than their bodies would */
+            if (errGroup > 1.01 * errBody)
+            {
+                mw_printf("  grouped walk is less accurate than the per body walk\n");
+                failed = 1;
+            }
+        }
+    }
+
+    mwFreeA(acc);
+
+    return failed;
+}
+
+/* Octupole moments against quadrupoles for each tree criterion */
+static int checkOctupole(const Body* bodies, int n, const mwvector* exact)
+{
+    static const criterion_t criteria[] = { BH86, SW93, TreeCode };
+    unsigned int i;
+    int failed = 0;
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+
+    for (i = 0; i < sizeof(criteria) / sizeof(criteria[0]); ++i)
+    {
+        NBodyCtx ctx = makeForceCtx(criteria[i], TRUE, 0);
+        real errQuad, errOct;
+
+        failed |= computeAccelerations(&ctx, bodies, n, acc, NULL);
+        errQuad = rmsRelativeError(acc, exact, n);
+
+        ctx.multipoleOrder = 3;
+        failed |= computeAccelerations(&ctx, bodies, n, acc, NULL);
+        errOct = rmsRelativeError(acc, exact, n);
+
+        mw_printf("%-8s octupole: error = %.3e (quadrupole %.3e)\n",
+                  showCriterionT(criteria[i]), errOct, errQuad);
+
+        if (errOct >= errQuad)
+        {
+            mw_printf("  octupole moments do not improve on the quadrupole\n");
+            failed = 1;
+        }
+    }
+
+    mwFreeA(acc);
+
+    return failed;
+}
+
+/* The fast multipole method, timed against the tree code, whose time
+ * is kept in tTree for the later checks to compare with */
+static int checkFMM(const Body* bodies, int n, const mwvector* exact, double tExact, double* tTree)
+{
+    unsigned int quad;
+    int failed = 0;
+    double tFMM;
+    mwvector* acc = (mwvector*) mwMallocA(n * sizeof(mwvector));
+
+    for (quad = 0; quad <= 1; ++quad)
+    {
+        NBodyCtx treeCtx = makeForceCtx(TreeCode, (mwbool) quad, 0);
+        NBodyCtx fmmCtx = makeForceCtx(FMM, (mwbool) quad, 0);
+        real errFMM;
+
+        failed |= computeAccelerations(&treeCtx, bodies, n, acc, tTree);
+        failed |= computeAccelerations(&fmmCtx, bodies, n, acc, &tFMM);
+        errFMM = rmsRelativeError(acc, exact, n);
+
+        mw_printf("FMM      quad = %u: error = %.3e, time = %.3fs (TreeCode %.3fs, Exact %.3fs)\n",
+                  quad, errFMM, tFMM, *tTree, tExact);
+
+        if (errFMM > maxTreeError)
+        {
+            mw_printf("  error exceeds %g\n", maxTreeError);
+            failed = 1;
+        }
+    }
+
+    mwFreeA(acc);
+
+    return failed;
+}
+
+/* Note a failed check by name, so one failure does not hide the rest */
+static int report(const char* name, int failed)
+{
+    if (failed)
+    {
+        mw_printf("FAILED: %s\n", name);
+    }
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+    double tExact = 0.0, tTree = 0.0;
+    Body* bodies;
+    mwvector* exact;
+
+    srand(1234);
+
+    bodies = makePlummerBodies(nbody);
+    exact = (mwvector*) mwMallocA(nbody * sizeof(mwvector));
+
+    {
+        NBodyCtx ctx = makeForceCtx(Exact, FALSE, 0);
+        int exactFailed = computeAccelerations(&ctx, bodies, nbody, exact, &tExact);
+
+        exactFailed |= checkExact(bodies, nbody, exact, tExact);
+        failed |= report("Exact", exactFailed);
+    }
+
+    failed |= report("tree walks", checkTreeWalks(bodies, nbody, exact));
+    failed |= report("octupole", checkOctupole(bodies, nbody, exact));
+    failed |= report("FMM", checkFMM(bodies, nbody, exact, tExact, &tTree));
+    failed |= report("PM", checkPM(bodies, nbody, exact, tTree));
+    failed |= report("refit", checkRefit(bodies, nbody, 1.0e-3));
+    failed |= report("cost balance", checkCostBalance(bodies, nbody));
+    failed |= report("restricted", checkRestricted(bodies, nbody, exact, tTree));
+    failed |= report("autotune", checkAutotune(bodies, nbody, exact));
+    failed |= report("counters", checkCounters(bodies, nbody));
+
+    mwFreeA(exact);
+    mwFreeA(bodies);
+
+    return failed;
+}
@@ -0,0 +1,579 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Evolves an isolated Plummer sphere with the leapfrog and fourth order
+ * Yoshida integrators, and compares the largest relative energy error
+ * along the way and the time taken. The Yoshida integrator must
+ * conserve energy better than leapfrog at the same timestep, also with
+ * the kicks done in the tree walk. In deterministic mode, and always
+ * with Exact, the orbits must not depend on the number of threads. The
+ * potential energy kept from the force calculations must match the
+ * direct sum over the pairs of bodies, also bitwise the same on any
+ * number of threads in deterministic mode, and the energy with the work
+ * of an external potential must be conserved. Block timesteps must improve
+ * on the timestep they subdivide at less cost than its finest rung.
+ */
+
+#include "milkyway_util.h"
+#include "nbody.h"
+#include "nbody_types.h"
+#include "nbody_defaults.h"
+#include "nbody_energy.h"
+#include "nbody_grav.h"
+#include "nbody_plain.h"
+#include "nbody_show.h"
+#include "nbody_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int nbody = 256;
+static const real eps2 = 0.01;
+static const real timeEvolve = 4.0;
+static const real baseTimestep = 1.0 / 64.0;
+
+static inline real randomUnit(void)
+{
+    return ((real) rand() + 0.5) / ((real) RAND_MAX + 1.0);
+}
+
+static mwvector randomDirection(real r)
+{
+    mwvector v;
+    real cosTheta = 2.0 * randomUnit() - 1.0;
+    real sinTheta = mw_sqrt(1.0 - sqr(cosTheta));
+    real phi = 2.0 * M_PI * randomUnit();
+
+    SET_VECTOR(v, r * sinTheta * mw_cos(phi), r * sinTheta * mw_sin(phi), r * cosTheta);
+    return v;
+}
+
+/* Plummer sphere of unit mass and scale radius in equilibrium, with
+ * speeds drawn from the isotropic distribution function by rejection */
+static Body* makePlummerBodies(int n)
+{
+    int i;
+    Body* bodies = (Body*) mwCallocA(n, sizeof(Body));
+
+    for (i = 0; i < n; ++i)
+    {
+        real r = 1.0 / mw_sqrt(mw_pow(randomUnit(), -2.0 / 3.0) - 1.0);
+        real q;
+
+        r = mw_fmin(r, 20.0);
+        do
+        {
+            q = randomUnit();
+        }
+        while (0.1 * randomUnit() > sqr(q) * mw_pow(1.0 - sqr(q), 3.5));
+
+        Pos(&bodies[i]) = randomDirection(r);
+        Vel(&bodies[i]) = randomDirection(q * mw_sqrt(2.0) * mw_pow(1.0 + sqr(r), -0.25));
+        Mass(&bodies[i]) = 1.0 / n;
+        Type(&bodies[i]) = BODY(FALSE);
+        bodies[i].bodynode.id = (unsigned int) i;
+    }
+
+    return bodies;
+}
+
+/* Whether two sets of bodies have exactly the same positions and velocities */
+static int sameOrbits(const Body* a, const Body* b, int n)
+{
+    int i;
+
+    /* Bitwise, which also avoids comparing floats with == */
+    for (i = 0; i < n; ++i)
+    {
+        if (   memcmp(&X(Pos(&a[i])), &X(Pos(&b[i])), 3 * sizeof(real)) != 0
+            || memcmp(&X(Vel(&a[i])), &X(Vel(&b[i])), 3 * sizeof(real)) != 0)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Softened potential energy summed over the pairs */
+static real pairPotential(const NBodyState* st)
+{
+    int i, j;
+    real potential = 0.0;
+    const Body* b = st->bodytab;
+
+    for (i = 0; i < st->nbody; ++i)
+    {
+        for (j = i + 1; j < st->nbody; ++j)
+        {
+            real drSq = mw_sqrv(mw_subv(Pos(&b[i]), Pos(&b[j]))) + eps2;
+            potential -= Mass(&b[i]) * Mass(&b[j]) / mw_sqrt(drSq);
+        }
+    }
+
+    return potential;
+}
+
+/* Total kinetic and softened potential energy */
+static real totalEnergy(const NBodyState* st)
+{
+    int i;
+    real kinetic = 0.0;
+    const Body* b = st->bodytab;
+
+    for (i = 0; i < st->nbody; ++i)
+    {
+        kinetic += 0.5 * Mass(&b[i]) * mw_sqrv(Vel(&b[i]));
+    }
+
+    return kinetic + pairPotential(st);
+}
+
+/* Evolve the bodies with the integrator, returning the largest relative
+ * energy error seen and the time taken. The final bodies are left in
+ * final if it is not NULL. */
+static int evolve(integrator_t integrator, criterion_t criterion, real timestep, unsigned int maxRung,
+                  mwbool deterministic, const Body* bodies, Body* final, real* maxError, double* time)
+{
+    NBodyCtx ctx = defaultNBodyCtx;
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc;
+    Body* copy = (Body*) mwMallocA(nbody * sizeof(Body));
+    mwvector zero = ZERO_VECTOR;
+    unsigned int i, nStep = (unsigned int) mw_ceil(timeEvolve / timestep);
+    real e0, err;
+    double t0, elapsed = 0.0;
+
+    ctx.criterion = criterion;
+    ctx.theta = (criterion == Exact) ? 0.0 : 0.5;
+    ctx.useQuad = FALSE;
+    ctx.integrator = integrator;
+    ctx.maxRung = maxRung;
+    ctx.deterministic = deterministic;
+    ctx.pmGridSize = 16;
+    ctx.pmSplit = 1.0;
+    ctx.eps2 = eps2;
+    ctx.timestep = timestep;
+    ctx.timeEvolve = timeEvolve;
+    ctx.nStep = nStep;
+    ctx.potentialType = EXTERNAL_POTENTIAL_NONE;
+    ctx.allowIncest = TRUE;
+    ctx.quietErrors = TRUE;
+
+    memcpy(copy, bodies, nbody * sizeof(Body));
+    setInitialNBodyState(&st, &ctx, copy, nbody);
+
+    e0 = totalEnergy(&st);
+    *maxError = 0.0;
+
+    rc = nbGravMap(&ctx, &st);
+    for (i = 0; i < nStep && !nbStatusIsFatal(rc); ++i)
+    {
+        t0 = mwGetTime();
+        rc = nbStepSystemPlain(&ctx, &st, zero, zero);
+        elapsed += mwGetTime() - t0;
+
+        err = mw_fabs((totalEnergy(&st) - e0) / e0);
+        *maxError = mw_fmax(*maxError, err);
+    }
+
+    if (final)
+        memcpy(final, st.bodytab, nbody * sizeof(Body));
+    destroyNBodyState(&st);
+    *time = elapsed;
+
+    if (nbStatusIsFatal(rc))
+    {
+        mw_printf("Integration with %s failed: %s\n", showIntegratorT(integrator), showNBodyStatus(rc));
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Step the bodies a few times keeping their energy in st */
+static NBodyStatus keepEnergy(criterion_t criterion, mwbool deterministic, const Body* bodies, NBodyState* st)
+{
+    NBodyCtx ctx = defaultNBodyCtx;
+    NBodyStatus rc;
+    Body* copy = (Body*) mwMallocA(nbody * sizeof(Body));
+    mwvector zero = ZERO_VECTOR;
+    unsigned int i;
+
+    ctx.criterion = criterion;
+    ctx.deterministic = deterministic;
+    ctx.theta = (criterion == Exact) ? 0.0 : 0.5;
+    ctx.useQuad = TRUE;
+    ctx.eps2 = eps2;
+    ctx.timestep = baseTimestep;
+    ctx.potentialType = EXTERNAL_POTENTIAL_NONE;
+    ctx.allowIncest = TRUE;
+    ctx.quietErrors = TRUE;
+
+    memcpy(copy, bodies, nbody * sizeof(Body));
+    setInitialNBodyState(st, &ctx, copy, nbody);
+    nbStartEnergy(st);
+
+    rc = nbGravMap(&ctx, st);
+    nbSampleEnergy(st, 0.0, zero);
+    for (i = 0; i < 8 && !nbStatusIsFatal(rc); ++i)
+    {
+        rc = nbStepSystemPlain(&ctx, st, zero, zero);
+        nbSampleEnergy(st, st->step * ctx.timestep, zero);
+    }
+
+    return rc;
+}
+
+/* Compare the potential found in the force calculation with the pair sum */
+static int checkEnergy(criterion_t criterion, const Body* bodies, real tolerance)
+{
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc = keepEnergy(criterion, FALSE, bodies, &st);
+    real potential, err;
+    int failed = 0;
+
+    potential = pairPotential(&st);
+    err = mw_fabs((st.energy->last.potential - potential) / potential);
+    mw_printf("%s potential energy %.10f, pair sum %.10f, relative error %.3e\n",
+              showCriterionT(criterion), st.energy->last.potential, potential, err);
+
+    if (nbStatusIsFatal(rc))
+    {
+        mw_printf("Integration with %s failed: %s\n", showCriterionT(criterion), showNBodyStatus(rc));
+        failed = 1;
+    }
+    else if (!st.energy->potentialKnown || st.energy->samples != 9 || !(err <= tolerance))
+    {
+        mw_printf("%s potential energy does not match the pair sum\n", showCriterionT(criterion));
+        failed = 1;
+    }
+
+    destroyNBodyState(&st);
+    return failed;
+}
+
+/* FMM does not find the potential, which must be reported as unknown
+ * rather than give a drift */
+static int checkEnergyUnknown(const Body* bodies)
+{
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc = keepEnergy(FMM, FALSE, bodies, &st);
+    int failed = 0;
+
+    if (   nbStatusIsFatal(rc)
+        || st.energy->potentialKnown
+        || !st.energy->phiUnknownBy
+        || strcmp(st.energy->phiUnknownBy, "FMM") != 0)
+    {
+        mw_printf("FMM potential energy was not reported unknown\n");
+        failed = 1;
+    }
+
+    destroyNBodyState(&st);
+    return failed;
+}
+
+/* Yoshida against leapfrog with the Exact criterion */
+/* Put the bodies on an orbit through a Hernquist sphere and check the
+ * energy with the work of the external force stays conserved, while the
+ * internal and bulk kinetic energy alone change a great deal */
+static int checkExternalEnergy(const Body* bodies)
+{
+    NBodyCtx ctx = defaultNBodyCtx;
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc;
+    Body* copy = (Body*) mwMallocA(nbody * sizeof(Body));
+    mwvector offset, kick;
+    mwvector zero = ZERO_VECTOR;
+    real change;
+    int i;
+    int failed = 0;
+
+    ctx.criterion = Exact;
+    ctx.eps2 = eps2;
+    ctx.timestep = baseTimestep;
+    ctx.potentialType = EXTERNAL_POTENTIAL_DEFAULT;
+    ctx.pot = (Potential) EMPTY_POTENTIAL;
+    ctx.pot.sphere[0].type = HernquistSpherical;
+    ctx.pot.sphere[0].mass = 20.0;
+    ctx.pot.sphere[0].scale = 2.0;
+    ctx.pot.disk.type = NoDisk;
+    ctx.pot.disk2.type = NoDisk;
+    ctx.pot.halo.type = NoHalo;
+    ctx.quietErrors = TRUE;
+
+    SET_VECTOR(offset, 8.0, 0.0, 0.0);
+    SET_VECTOR(kick, 0.0, 1.0, 0.0);
+    memcpy(copy, bodies, nbody * sizeof(Body));
+    for (i = 0; i < nbody; ++i)
+    {
+        mw_incaddv(Pos(&copy[i]), offset);
+        mw_incaddv(Vel(&copy[i]), kick);
+    }
+
+    setInitialNBodyState(&st, &ctx, copy, nbody);
+    nbStartEnergy(&st);
+
+    rc = nbGravMap(&ctx, &st);
+    nbSampleEnergy(&st, 0.0, zero);
+    for (i = 0; i < 256 && !nbStatusIsFatal(rc); ++i)
+    {
+        rc = nbStepSystemPlain(&ctx, &st, zero, zero);
+        nbSampleEnergy(&st, st.step * ctx.timestep, zero);
+    }
+
+    change = mw_fabs(st.energy->last.external / (st.energy->first.kinetic + st.energy->first.potential));
+    mw_printf("External work %.6f, %.3e of the internal energy, drift with it %.3e\n",
+              -st.energy->last.external, change, st.energy->driftMax);
+
+    if (nbStatusIsFatal(rc))
+    {
+        mw_printf("Integration in the external potential failed: %s\n", showNBodyStatus(rc));
+        failed = 1;
+    }
+    else if (!st.energy->potentialKnown || !(change > 0.1) || !(st.energy->driftMax < 1.0e-3))
+    {
+        mw_printf("Energy with the external work is not conserved\n");
+        failed = 1;
+    }
+
+    destroyNBodyState(&st);
+    return failed;
+}
+
+static int checkIntegrators(const Body* bodies)
+{
+    real errLeapfrog, errYoshida, errYoshidaLong;
+    double tLeapfrog, tYoshida, tYoshidaLong;
+    int failed = 0;
+
+    failed |= evolve(Leapfrog, Exact, baseTimestep, 0, FALSE, bodies, NULL, &errLeapfrog, &tLeapfrog);
+    failed |= evolve(Yoshida4, Exact, baseTimestep, 0, FALSE, bodies, NULL, &errYoshida, &tYoshida);
+
+    /* Same number of force calculations as leapfrog */
+    failed |= evolve(Yoshida4, Exact, 3.0 * baseTimestep, 0, FALSE, bodies, NULL, &errYoshidaLong, &tYoshidaLong);
+
+    mw_printf("Leapfrog dt = %g: max energy error = %.3e, time = %.3fs\n", baseTimestep, errLeapfrog, tLeapfrog);
+    mw_printf("Yoshida4 dt = %g: max energy error = %.3e, time = %.3fs\n", baseTimestep, errYoshida, tYoshida);
+    mw_printf("Yoshida4 dt = %g: max energy error = %.3e, time = %.3fs\n", 3.0 * baseTimestep, errYoshidaLong, tYoshidaLong);
+
+    if (!(errYoshida < errLeapfrog))
+    {
+        mw_printf("Yoshida4 energy error is not below leapfrog at the same timestep\n");
+        failed = 1;
+    }
+
+    return failed;
+}
+
+/* The tree is sized from the extent found in the drift, and the closing
+ * kick is done in the walk */
+static int checkTreeKicks(const Body* bodies)
+{
+    real errTree;
+    double tTree;
+    int i, failed = 0;
+
+    for (i = 0; i < 2; ++i)
+    {
+        integrator_t integrator = (i == 0) ? Leapfrog : Yoshida4;
+
+        failed |= evolve(integrator, TreeCode, baseTimestep, 0, FALSE, bodies, NULL, &errTree, &tTree);
+        mw_printf("%s dt = %g, TreeCode: max energy error = %.3e, time = %.3fs\n",
+                  showIntegratorT(integrator), baseTimestep, errTree, tTree);
+
+        /* Exact gives a few 1e-5, the tree with theta = 0.5 a few 1e-4 */
+        if (!(errTree < 1.0e-2))
+        {
+            mw_printf("Kicks in the tree walk do not conserve %s energy\n", showIntegratorT(integrator));
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
+
+/* RMS distance between the positions of two sets of bodies */
+static real rmsPositionDifference(const Body* a, const Body* b, int n)
+{
+    int i;
+    real sum = 0.0;
+
+    for (i = 0; i < n; ++i)
+    {
+        sum += mw_sqrv(mw_subv(Pos(&a[i]), Pos(&b[i])));
+    }
+
+    return mw_sqrt(sum / n);
+}
+
+/* Block timesteps down to rung 3 of a coarse timestep must conserve
+ * energy better than the coarse timestep alone, stay close to the
+ * orbits of the finest timestep taken by every body, and take less
+ * time than it */
+static int checkBlockSteps(const Body* bodies)
+{
+    const real coarse = 8.0 * baseTimestep;
+    const unsigned int maxRung = 3;
+    Body* finalCoarse = (Body*) mwMallocA(nbody * sizeof(Body));
+    Body* finalBlock = (Body*) mwMallocA(nbody * sizeof(Body));
+    Body* finalFine = (Body*) mwMallocA(nbody * sizeof(Body));
+    real errCoarse, errBlock, errFine, diffCoarse, diffBlock;
+    double tCoarse, tBlock, tFine;
+    int failed = 0;
+
+    failed |= evolve(Leapfrog, Exact, coarse, 0, FALSE, bodies, finalCoarse, &errCoarse, &tCoarse);
+    failed |= evolve(Leapfrog, Exact, coarse, maxRung, FALSE, bodies, finalBlock, &errBlock, &tBlock);
+    failed |= evolve(Leapfrog, Exact, coarse / 8.0, 0, FALSE, bodies, finalFine, &errFine, &tFine);
+
+    diffCoarse = rmsPositionDifference(finalCoarse, finalFine, nbody);
+    diffBlock = rmsPositionDifference(finalBlock, finalFine, nbody);
+
+    mw_printf("Leapfrog dt = %g: max energy error = %.3e, position difference = %.3e, time = %.3fs\n",
+              coarse, errCoarse, diffCoarse, tCoarse);
+    mw_printf("Leapfrog dt = %g, maxRung = %u: max energy error = %.3e, position difference = %.3e, time = %.3fs\n",
+              coarse, maxRung, errBlock, diffBlock, tBlock);
+    mw_printf("Leapfrog dt = %g: max energy error = %.3e, time = %.3fs\n", coarse / 8.0, errFine, tFine);
+
+    if (!(errBlock < errCoarse) || !(diffBlock < diffCoarse))
+    {
+        mw_printf("Block timesteps are no more accurate than the coarse timestep\n");
+        failed = 1;
+    }
+
+    if (!(tBlock < tFine))
+    {
+        mw_printf("Block timesteps take longer than the finest timestep for every body\n");
+        failed = 1;
+    }
+
+    mwFreeA(finalCoarse);
+    mwFreeA(finalBlock);
+    mwFreeA(finalFine);
+
+    return failed;
+}
+
+#ifdef _OPENMP
+
+/* Evolve on one thread and on three, which divide the bodies
+ * differently, both ways with the Exact and PM criteria */
+static int checkThreads(const Body* bodies)
+{
+    Body* finalOne = (Body*) mwMallocA(nbody * sizeof(Body));
+    Body* finalThree = (Body*) mwMallocA(nbody * sizeof(Body));
+    real err;
+    int i, failed = 0;
+
+    for (i = 0; i < 4; ++i)
+    {
+        const criterion_t criterion = (i < 2) ? Exact : PM;
+        const mwbool deterministic = (i % 2 == 1);
+        const int maxThreads = nbGetMaxThreads();
+        double tOne, tThree;
+
+        omp_set_num_threads(1);
+        failed |= evolve(Leapfrog, criterion, baseTimestep, 0, deterministic, bodies, finalOne, &err, &tOne);
+        omp_set_num_threads(3);
+        failed |= evolve(Leapfrog, criterion, baseTimestep, 0, deterministic, bodies, finalThree, &err, &tThree);
+        omp_set_num_threads(maxThreads);
+
+        mw_printf("Leapfrog dt = %g, %s%s: time = %.3fs on one thread, %.3fs on three, %s orbits\n",
+                  baseTimestep, showCriterionT(criterion), deterministic ? " deterministic" : "",
+                  tOne, tThree, sameOrbits(finalOne, finalThree, nbody) ? "same" : "different");
+
+        if ((deterministic || criterion == Exact) && !sameOrbits(finalOne, finalThree, nbody))
+        {
+            mw_printf("%s orbits depend on the number of threads\n", showCriterionT(criterion));
+            failed = 1;
+        }
+    }
+
+    mwFreeA(finalOne);
+    mwFreeA(finalThree);
+
+    return failed;
+}
+
+/* In deterministic mode the energy sums must not depend on the number
+ * of threads either */
+static int checkEnergyThreads(const Body* bodies)
+{
+    NBodyState stOne = EMPTY_NBODYSTATE;
+    NBodyState stThree = EMPTY_NBODYSTATE;
+    const int maxThreads = nbGetMaxThreads();
+    NBodyStatus rcOne, rcThree;
+    int failed = 0;
+
+    omp_set_num_threads(1);
+    rcOne = keepEnergy(TreeCode, TRUE, bodies, &stOne);
+    omp_set_num_threads(3);
+    rcThree = keepEnergy(TreeCode, TRUE, bodies, &stThree);
+    omp_set_num_threads(maxThreads);
+
+    if (   nbStatusIsFatal(rcOne)
+        || nbStatusIsFatal(rcThree)
+        || memcmp(&stOne.energy->last, &stThree.energy->last, sizeof(NBodyEnergySample)) != 0)
+    {
+        mw_printf("Deterministic energy depends on the number of threads\n");
+        failed = 1;
+    }
+
+    destroyNBodyState(&stOne);
+    destroyNBodyState(&stThree);
+    return failed;
+}
+
+#endif /* _OPENMP */
+
+/* Note a failed check by name, so one failure does not hide the rest */
+static int report(const char* name, int failed)
+{
+    if (failed)
+    {
+        mw_printf("FAILED: %s\n", name);
+    }
+
+    return failed;
+}
+
+int main(void)
+{
+    Body* bodies;
+    int failed = 0;
+
+    srand(1234);
+    bodies = makePlummerBodies(nbody);
+
+    failed |= report("integrators", checkIntegrators(bodies));
+    failed |= report("kicks in the tree walk", checkTreeKicks(bodies));
+    failed |= report("block timesteps", checkBlockSteps(bodies));
+    failed |= report("Exact potential energy", checkEnergy(Exact, bodies, 1.0e-12));
+    failed |= report("TreeCode potential energy", checkEnergy(TreeCode, bodies, 1.0e-3));
+    failed |= report("FMM potential energy unknown", checkEnergyUnknown(bodies));
+    failed |= report("external work", checkExternalEnergy(bodies));
+  #ifdef _OPENMP
+    failed |= report("thread count", checkThreads(bodies));
+    failed |= report("deterministic energy", checkEnergyThreads(bodies));
+  #endif
+
+    mwFreeA(bodies);
+
+    return failed;
+}
@@ -0,0 +1,164 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tabulates the Lua potential in the given script, which copies a
+ * built-in one, and compares the acceleration from the table with the
+ * one from calling the closure and the built-in one at random points out
+ * to the edge of the table. Also reports how long each takes. With a
+ * flattening of the halo along y the potential is not axisymmetric, so
+ * it takes the Cartesian table rather than the one in R and z.
+ */
+
+#include "milkyway_util.h"
+#include "nbody.h"
+#include "nbody_types.h"
+#include "nbody_defaults.h"
+#include "nbody_lua.h"
+#include "nbody_potential.h"
+#include "nbody_potential_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_POINTS 20000
+
+static const real tolerance = 1.0e-3;
+
+static inline real randomCoord(void)
+{
+    return 100.0 * (2.0 * ((real) rand() + 0.5) / ((real) RAND_MAX + 1.0) - 1.0);
+}
+
+int main(int argc, const char* argv[])
+{
+    int i, failed = 0;
+    real worst = 0.0, worstBuiltin = 0.0;
+    double t0, tCall, tTable, tBuiltin;
+    NBodyFlags nbf = EMPTY_NBODY_FLAGS;
+    NBodyCtx ctx = defaultNBodyCtx;
+    NBodyState st = EMPTY_NBODYSTATE;
+    Potential pot = EMPTY_POTENTIAL;
+    mwvector* points = (mwvector*) mwMallocA(N_POINTS * sizeof(mwvector));
+    mwvector* called = (mwvector*) mwMallocA(N_POINTS * sizeof(mwvector));
+    mwvector* tabled = (mwvector*) mwMallocA(N_POINTS * sizeof(mwvector));
+    mwvector* builtin = (mwvector*) mwMallocA(N_POINTS * sizeof(mwvector));
+
+    if (argc != 2 && argc != 3)
+    {
+        mw_printf("Usage: %s <Lua potential script> [halo flattening along y]\n", argv[0]);
+        return 1;
+    }
+
+    nbf.inputFile = (char*) argv[1];
+    nbf.forwardedArgs = &argv[2];
+    nbf.numForwardedArgs = argc - 2;
+    if (nbOpenPotentialEvalStatePerThread(&st, &nbf))
+    {
+        mw_printf("Failed to open Lua potential '%s'\n", argv[1]);
+        return 1;
+    }
+
+    /* As in the script */
+    pot.sphere[0].type = HernquistSpherical;
+    pot.sphere[0].mass = 1.5e5;
+    pot.sphere[0].scale = 0.7;
+    pot.disk.type = MiyamotoNagaiDisk;
+    pot.disk.mass = 4.45865888e5;
+    pot.disk.scaleLength = 6.5;
+    pot.disk.scaleHeight = 0.26;
+    pot.disk2.type = NoDisk;
+    pot.halo.type = LogarithmicHalo;
+    pot.halo.vhalo = 73.0;
+    pot.halo.scaleLength = 12.0;
+    pot.halo.flattenZ = 1.0;
+
+    if (argc == 3)
+    {
+        pot.halo.type = TriaxialHalo;
+        pot.halo.c1 = 1.0;
+        pot.halo.c2 = 1.0 / sqr(atof(argv[2]));
+        pot.halo.c3 = 0.0;
+    }
+
+    srand(1234);
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        SET_VECTOR(points[i], randomCoord(), randomCoord(), randomCoord());
+    }
+
+    t0 = mwGetTime();
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        nbEvalPotentialClosure(&st, points[i], &called[i]);
+    }
+    tCall = mwGetTime() - t0;
+
+    t0 = mwGetTime();
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        builtin[i] = nbExtAcceleration(&pot, points[i], 0.0);
+    }
+    tBuiltin = mwGetTime() - t0;
+
+    ctx.potentialType = EXTERNAL_POTENTIAL_CUSTOM_LUA;
+    ctx.potentialTableTolerance = tolerance;
+    nbMakePotentialTable(&ctx, &st);
+    if (!st.potTable)
+    {
+        mw_printf("Lua potential was not tabulated\n");
+        failed = 1;
+    }
+
+    t0 = mwGetTime();
+    for (i = 0; i < N_POINTS && !failed; ++i)
+    {
+        nbTableClosureAcceleration(&st, points[i], &tabled[i]);
+    }
+    tTable = mwGetTime() - t0;
+
+    for (i = 0; i < N_POINTS && !failed; ++i)
+    {
+        worst = mw_fmax(worst, mw_absv(mw_subv(tabled[i], called[i])) / mw_absv(called[i]));
+        worstBuiltin = mw_fmax(worstBuiltin, mw_absv(mw_subv(called[i], builtin[i])) / mw_absv(builtin[i]));
+    }
+
+    mw_printf("Largest relative error of the table %.3e, of the closure from the built-in potential %.3e\n",
+              worst, worstBuiltin);
+    mw_printf("%.3gs calling the closure, %.3gs from the table, %.3gs built in\n",
+              tCall, tTable, tBuiltin);
+
+    /* Cubic interpolation is worst between the nodes, where it was checked */
+    if (failed || st.potentialEvalError || !(worst <= tolerance) || !(worstBuiltin <= 1.0e-12))
+    {
+        failed = 1;
+    }
+
+    /* The table is only worth having if it beats calling the closure */
+    if (!failed && !(tTable < tCall))
+    {
+        mw_printf("Looking up the table was no faster than calling the closure\n");
+        failed = 1;
+    }
+
+    destroyNBodyState(&st);
+    mwFreeA(points);
+    mwFreeA(called);
+    mwFreeA(tabled);
+    mwFreeA(builtin);
+
+    return failed;
+}
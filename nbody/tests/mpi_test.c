@@ -0,0 +1,311 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Finds the forces on a Plummer sphere split over the processes it is
+ * run with, and compares them with direct summation and the tree on a
+ * single process. The split forces, with the quad moments of the cells
+ * sent between the processes, must be as accurate as the single tree,
+ * every body must come back, and the processes must share the work
+ * evenly. A short leapfrog evolution over the processes must
+ * conserve energy as well as one on a single process.
+ */
+
+#include "milkyway_util.h"
+#include "nbody.h"
+#include "nbody_types.h"
+#include "nbody_defaults.h"
+#include "nbody_grav.h"
+#include "nbody_plain.h"
+#include "nbody_show.h"
+#include "nbody_mpi.h"
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int nbody = 8192;
+static const real eps2 = 1.0e-4;
+static const real timestep = 1.0 / 128.0;
+static const unsigned int nStep = 64;
+
+static inline real randomUnit(void)
+{
+    return ((real) rand() + 0.5) / ((real) RAND_MAX + 1.0);
+}
+
+static mwvector randomDirection(real r)
+{
+    mwvector v;
+    real cosTheta = 2.0 * randomUnit() - 1.0;
+    real sinTheta = mw_sqrt(1.0 - sqr(cosTheta));
+    real phi = 2.0 * M_PI * randomUnit();
+
+    SET_VECTOR(v, r * sinTheta * mw_cos(phi), r * sinTheta * mw_sin(phi), r * cosTheta);
+    return v;
+}
+
+/* Plummer sphere of unit mass and scale radius in equilibrium. Every
+ * process makes the same one from the same seed. */
+static Body* makePlummerBodies(int n)
+{
+    int i;
+    Body* bodies = (Body*) mwCallocA(n, sizeof(Body));
+
+    for (i = 0; i < n; ++i)
+    {
+        real r = 1.0 / mw_sqrt(mw_pow(randomUnit(), -2.0 / 3.0) - 1.0);
+        real q;
+
+        r = mw_fmin(r, 20.0);
+        do
+        {
+            q = randomUnit();
+        }
+        while (0.1 * randomUnit() > sqr(q) * mw_pow(1.0 - sqr(q), 3.5));
+
+        Pos(&bodies[i]) = randomDirection(r);
+        Vel(&bodies[i]) = randomDirection(q * mw_sqrt(2.0) * mw_pow(1.0 + sqr(r), -0.25));
+        Mass(&bodies[i]) = 1.0 / n;
+        Type(&bodies[i]) = BODY(FALSE);
+        bodies[i].bodynode.id = (unsigned int) i;
+    }
+
+    return bodies;
+}
+
+static void setTestCtx(NBodyCtx* ctx, criterion_t criterion)
+{
+    *ctx = defaultNBodyCtx;
+    ctx->criterion = criterion;
+    ctx->theta = (criterion == Exact) ? 0.0 : 0.5;
+    ctx->useQuad = (criterion != Exact);
+    ctx->eps2 = eps2;
+    ctx->timestep = timestep;
+    ctx->timeEvolve = nStep * timestep;
+    ctx->nStep = nStep;
+    ctx->potentialType = EXTERNAL_POTENTIAL_NONE;
+    ctx->allowIncest = TRUE;
+    ctx->quietErrors = TRUE;
+    ctx->costBalance = TRUE;
+}
+
+/* RMS of the relative error of each acceleration */
+static real rmsError(const mwvector* acc, const mwvector* ref, int n)
+{
+    int i;
+    real sum = 0.0;
+
+    for (i = 0; i < n; ++i)
+    {
+        sum += mw_sqrv(mw_subv(acc[i], ref[i])) / mw_sqrv(ref[i]);
+    }
+
+    return mw_sqrt(sum / n);
+}
+
+/* Total kinetic and softened potential energy */
+static real totalEnergy(const Body* b, int n)
+{
+    int i, j;
+    real kinetic = 0.0;
+    real potential = 0.0;
+
+    for (i = 0; i < n; ++i)
+    {
+        kinetic += 0.5 * Mass(&b[i]) * mw_sqrv(Vel(&b[i]));
+        for (j = i + 1; j < n; ++j)
+        {
+            real drSq = mw_sqrv(mw_subv(Pos(&b[i]), Pos(&b[j]))) + eps2;
+            potential -= Mass(&b[i]) * Mass(&b[j]) / mw_sqrt(drSq);
+        }
+    }
+
+    return kinetic + potential;
+}
+
+/* Find the accelerations of the bodies, over all the processes if
+ * distributed, twice so the second is split by the measured cost. The
+ * largest cost of any process's walks over the mean is left in imbalance. */
+static NBodyStatus forces(criterion_t criterion, mwbool distributed, const Body* bodies,
+                          mwvector* acc, real* imbalance)
+{
+    NBodyCtx ctx;
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc;
+    Body* copy = (Body*) mwMallocA(nbody * sizeof(Body));
+
+    setTestCtx(&ctx, criterion);
+    memcpy(copy, bodies, nbody * sizeof(Body));
+    setInitialNBodyState(&st, &ctx, copy, nbody);
+
+    rc = distributed ? nbMPIDistribute(&ctx, &st) : NBODY_SUCCESS;
+    if (!nbStatusIsFatal(rc))
+        rc = nbGravMap(&ctx, &st);
+    if (!nbStatusIsFatal(rc))
+        rc = nbGravMap(&ctx, &st);
+
+    if (!nbStatusIsFatal(rc) && distributed && imbalance)
+    {
+        int i;
+        double cost = 0.0, maxCost, sumCost;
+
+        for (i = 0; i < st.nbody; ++i)
+        {
+            cost += st.bodyCost[i];
+        }
+
+        MPI_Allreduce(&cost, &maxCost, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        MPI_Allreduce(&cost, &sumCost, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        *imbalance = maxCost / (sumCost / nbMPISize());
+    }
+
+    if (distributed)
+        rc |= nbMPICollect(&st);
+
+    if (!nbStatusIsFatal(rc))
+        memcpy(acc, st.acctab, nbody * sizeof(mwvector));
+    destroyNBodyState(&st);
+
+    return rc;
+}
+
+/* Evolve the bodies with leapfrog, over all the processes if
+ * distributed, and return the relative energy error at the end. The
+ * final bodies must be the initial ones in their original order. */
+static NBodyStatus evolve(mwbool distributed, const Body* bodies, real* energyError)
+{
+    NBodyCtx ctx;
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc;
+    Body* copy = (Body*) mwMallocA(nbody * sizeof(Body));
+    mwvector zero = ZERO_VECTOR;
+    unsigned int i;
+    int j;
+
+    setTestCtx(&ctx, TreeCode);
+    memcpy(copy, bodies, nbody * sizeof(Body));
+    setInitialNBodyState(&st, &ctx, copy, nbody);
+
+    rc = distributed ? nbMPIDistribute(&ctx, &st) : NBODY_SUCCESS;
+    if (!nbStatusIsFatal(rc))
+        rc = nbGravMap(&ctx, &st);
+    for (i = 0; i < nStep && !nbStatusIsFatal(rc); ++i)
+    {
+        rc = nbStepSystemPlain(&ctx, &st, zero, zero);
+    }
+
+    if (distributed)
+        rc |= nbMPICollect(&st);
+
+    for (j = 0; j < st.nbody && !nbStatusIsFatal(rc); ++j)
+    {
+        if (idBody(&st.bodytab[j]) != (unsigned int) j)
+        {
+            mw_printf("Body %d came back in place of body %u\n", j, idBody(&st.bodytab[j]));
+            rc = NBODY_ERROR;
+        }
+    }
+
+    if (!nbStatusIsFatal(rc) && nbMPIRank() == 0)
+        *energyError = mw_fabs(totalEnergy(st.bodytab, nbody) / totalEnergy(bodies, nbody) - 1.0);
+    destroyNBodyState(&st);
+
+    return rc;
+}
+
+int main(void)
+{
+    Body* bodies;
+    mwvector* accExact;
+    mwvector* accTree;
+    mwvector* accSplit;
+    real errTree = 0.0, errSplit = 0.0, imbalance = 0.0;
+    real energyTree = 0.0, energySplit = 0.0;
+    NBodyStatus rc = NBODY_SUCCESS;
+    int rank, failed = 0;
+
+    if (nbMPIInit())
+    {
+        mw_printf("Failed to initialize MPI\n");
+        return 1;
+    }
+    rank = nbMPIRank();
+
+    srand(1234);
+    bodies = makePlummerBodies(nbody);
+    accExact = (mwvector*) mwMallocA(nbody * sizeof(mwvector));
+    accTree = (mwvector*) mwMallocA(nbody * sizeof(mwvector));
+    accSplit = (mwvector*) mwMallocA(nbody * sizeof(mwvector));
+
+    if (rank == 0)
+    {
+        rc |= forces(Exact, FALSE, bodies, accExact, NULL);
+        rc |= forces(TreeCode, FALSE, bodies, accTree, NULL);
+        rc |= evolve(FALSE, bodies, &energyTree);
+    }
+
+    rc |= forces(TreeCode, TRUE, bodies, accSplit, &imbalance);
+    rc |= evolve(TRUE, bodies, &energySplit);
+
+    if (rank == 0)
+    {
+        if (nbStatusIsFatal(rc))
+        {
+            mw_printf("Force calculation failed: %s\n", showNBodyStatus(rc));
+            failed = 1;
+        }
+        else
+        {
+            errTree = rmsError(accTree, accExact, nbody);
+            errSplit = rmsError(accSplit, accExact, nbody);
+
+            mw_printf("%d bodies over %d processes\n", nbody, nbMPISize());
+            mw_printf("Tree on one process:   rms relative force error = %.3e, energy error = %.3e\n",
+                      errTree, energyTree);
+            mw_printf("Tree over processes:   rms relative force error = %.3e, energy error = %.3e\n",
+                      errSplit, energySplit);
+            mw_printf("Largest share of the walk cost over the mean = %.3f\n", imbalance);
+
+            if (!(errSplit < 1.1 * errTree))
+            {
+                mw_printf("Forces over several processes are too inaccurate\n");
+                failed = 1;
+            }
+
+            if (!(energySplit < 2.0 * energyTree + 1.0e-6))
+            {
+                mw_printf("Evolution over several processes does not conserve energy\n");
+                failed = 1;
+            }
+
+            if (!(imbalance < 1.25))
+            {
+                mw_printf("Work is not shared evenly between the processes\n");
+                failed = 1;
+            }
+        }
+    }
+
+    mwFreeA(accExact);
+    mwFreeA(accTree);
+    mwFreeA(accSplit);
+    mwFreeA(bodies);
+    nbMPIFinalize();
+
+    return failed;
+}
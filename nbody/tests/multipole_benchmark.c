@@ -0,0 +1,204 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * For each multipole order and opening angle, reports the mean number
+ * of interactions per body in the tree walk against the RMS relative
+ * force error from direct summation, over a Plummer sphere.
+ *
+ * Usage: multipole_benchmark [nbody]
+ */
+
+#include "milkyway_util.h"
+#include "nbody_types.h"
+#include "nbody_defaults.h"
+#include "nbody_grav.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline real randomUnit(void)
+{
+    return ((real) rand() + 0.5) / ((real) RAND_MAX + 1.0);
+}
+
+static Body* makePlummerBodies(int n)
+{
+    int i;
+    Body* bodies = (Body*) mwCallocA(n, sizeof(Body));
+
+    for (i = 0; i < n; ++i)
+    {
+        real r = 1.0 / mw_sqrt(mw_pow(randomUnit(), -2.0 / 3.0) - 1.0);
+        real cosTheta = 2.0 * randomUnit() - 1.0;
+        real sinTheta = mw_sqrt(1.0 - sqr(cosTheta));
+        real phi = 2.0 * M_PI * randomUnit();
+
+        r = mw_fmin(r, 50.0);
+        SET_VECTOR(Pos(&bodies[i]), r * sinTheta * mw_cos(phi), r * sinTheta * mw_sin(phi), r * cosTheta);
+        Mass(&bodies[i]) = 1.0 / n;
+        Type(&bodies[i]) = BODY(FALSE);
+        bodies[i].bodynode.id = (unsigned int) i;
+    }
+
+    return bodies;
+}
+
+static NBodyCtx makeForceCtx(criterion_t criterion, real theta, unsigned int order)
+{
+    NBodyCtx ctx = defaultNBodyCtx;
+
+    ctx.criterion = criterion;
+    ctx.theta = theta;
+    ctx.useQuad = (order >= 2);
+    ctx.multipoleOrder = order;
+    ctx.eps2 = 1.0e-6;
+    ctx.treeRSize = 4.0;
+    ctx.timestep = 1.0e-3;
+    ctx.potentialType = EXTERNAL_POTENTIAL_NONE;
+    ctx.allowIncest = TRUE;
+    ctx.quietErrors = TRUE;
+
+    return ctx;
+}
+
+/* Count the cells and bodies each body interacts with in the walk of
+ * the tree in st, the same way nbGravity() accepts them */
+static real meanInteractions(const NBodyState* st)
+{
+    int i;
+    double total = 0.0;
+    const NBodyCell* cells = st->tree.cells;
+    const Body* btab = st->bodytab;
+
+    for (i = 0; i < st->nbody; ++i)
+    {
+        const mwvector pos0 = Pos(&btab[i]);
+        const NBodyNode* q = (const NBodyNode*) st->tree.root;
+        nodelink_t l;
+
+        while (q != NULL)
+        {
+            if (isBody(q) || mw_sqrv(mw_subv(Pos(q), pos0)) >= Rcrit2(q))
+            {
+                total += 1.0;
+                l = Next(q);
+            }
+            else
+            {
+                l = More(q);
+            }
+
+            q = (l == NULL_LINK) ? NULL : LinkNode(cells, btab, l);
+        }
+    }
+
+    return total / st->nbody;
+}
+
+/* Find the accelerations with ctx into acc, and the mean interactions per body */
+static int computeAccelerations(const NBodyCtx* ctx, const Body* bodies, int n, mwvector* acc, real* interactions)
+{
+    NBodyState st = EMPTY_NBODYSTATE;
+    NBodyStatus rc;
+    Body* copy = (Body*) mwMallocA(n * sizeof(Body));
+
+    memcpy(copy, bodies, n * sizeof(Body));
+    setInitialNBodyState(&st, ctx, copy, n);
+
+    rc = nbGravMap(ctx, &st);
+    if (nbStatusIsFatal(rc))
+    {
+        mw_printf("Force calculation failed: %d\n", rc);
+        destroyNBodyState(&st);
+        return 1;
+    }
+
+    memcpy(acc, st.acctab, n * sizeof(mwvector));
+    if (interactions)
+        *interactions = meanInteractions(&st);
+    destroyNBodyState(&st);
+
+    return 0;
+}
+
+static real rmsRelativeError(const mwvector* acc, const mwvector* exact, int n)
+{
+    int i;
+    real sum = 0.0;
+
+    for (i = 0; i < n; ++i)
+    {
+        sum += mw_sqrv(mw_subv(acc[i], exact[i])) / mw_sqrv(exact[i]);
+    }
+
+    return mw_sqrt(sum / n);
+}
+
+int main(int argc, const char* argv[])
+{
+    static const real thetas[] = { 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1.0 };
+    static const char* orderNames[] = { NULL, "monopole", "quadrupole", "octupole" };
+    int nbody = (argc > 1) ? atoi(argv[1]) : 20000;
+    unsigned int i, order;
+    Body* bodies;
+    mwvector* exact;
+    mwvector* acc;
+
+    if (nbody <= 0)
+    {
+        mw_printf("Usage: %s [nbody]\n", argv[0]);
+        return 1;
+    }
+
+    srand(1234);
+
+    bodies = makePlummerBodies(nbody);
+    exact = (mwvector*) mwMallocA(nbody * sizeof(mwvector));
+    acc = (mwvector*) mwMallocA(nbody * sizeof(mwvector));
+
+    {
+        NBodyCtx ctx = makeForceCtx(Exact, 0.0, 0);
+        if (computeAccelerations(&ctx, bodies, nbody, exact, NULL))
+            return 1;
+    }
+
+    mw_printf("# nbody = %d, criterion = TreeCode\n", nbody);
+    mw_printf("# %-10s %6s %14s %14s\n", "order", "theta", "interactions", "rms_error");
+
+    for (order = 1; order <= 3; ++order)
+    {
+        for (i = 0; i < sizeof(thetas) / sizeof(thetas[0]); ++i)
+        {
+            NBodyCtx ctx = makeForceCtx(TreeCode, thetas[i], order);
+            real interactions;
+
+            if (computeAccelerations(&ctx, bodies, nbody, acc, &interactions))
+                return 1;
+
+            mw_printf("  %-10s %6.2f %14.1f %14.4e\n",
+                      orderNames[order], thetas[i], interactions, rmsRelativeError(acc, exact, nbody));
+        }
+    }
+
+    mwFreeA(exact);
+    mwFreeA(acc);
+    mwFreeA(bodies);
+
+    return 0;
+}
+
@@ -0,0 +1,228 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Integrates a reverse orbit with the LMC and one without, first with no
+ * cache and then twice with one in the working directory, and checks the
+ * orbits and the LMC shift array come back bit for bit each time. Also
+ * checks a changed input is integrated again rather than read, and that
+ * a truncated file is ignored, and reports how much faster the cache is.
+ */
+
+#include "milkyway_util.h"
+#include "nbody_types.h"
+#include "nbody_orbit_integrator.h"
+#include "nbody_orbit_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    mwvector pos, vel, LMCpos, LMCvel;
+    mwvector* shift;
+    size_t nShift;
+} LMCOrbit;
+
+static const mwvector dwarfPos = mw_vec(8.0, 4.0, 20.0);
+static const mwvector dwarfVel = mw_vec(-100.0, 90.0, -30.0);
+static const mwvector LMCPos = mw_vec(-1.1, -41.1, -27.9);
+static const mwvector LMCVel = mw_vec(-57.0, -226.0, 221.0);
+static const real tstop = 2.0;
+static const real ftime = 2.5;
+static const real dt = 1.0e-3;
+static const real LMCscale = 15.0;
+static const real coulombLog = 3.0;
+
+static LMCOrbit reverseOrbitLMC(const Potential* pot, real LMCmass)
+{
+    LMCOrbit o;
+
+    nbReverseOrbit_LMC(&o.pos, &o.vel, &o.LMCpos, &o.LMCvel, pot, dwarfPos, dwarfVel, LMCPos, LMCVel,
+                       TRUE, ftime, tstop, dt, LMCmass, LMCscale, coulombLog, 0.0);
+    getLMCArray(&o.shift, &o.nShift);
+
+    return o;
+}
+
+/* Both bit for bit the same */
+static int sameOrbit(const LMCOrbit* a, const LMCOrbit* b)
+{
+    return memcmp(&a->pos, &b->pos, sizeof(mwvector)) == 0
+        && memcmp(&a->vel, &b->vel, sizeof(mwvector)) == 0
+        && memcmp(&a->LMCpos, &b->LMCpos, sizeof(mwvector)) == 0
+        && memcmp(&a->LMCvel, &b->LMCvel, sizeof(mwvector)) == 0
+        && a->nShift == b->nShift
+        && memcmp(a->shift, b->shift, a->nShift * sizeof(mwvector)) == 0;
+}
+
+/* The file nbReverseOrbit_LMC() keeps its orbit in */
+static char* cacheFileLMC(const Potential* pot, real LMCmass)
+{
+    char* key;
+    char* path;
+    const real inputs[] = { X(dwarfPos), Y(dwarfPos), Z(dwarfPos), X(dwarfVel), Y(dwarfVel), Z(dwarfVel),
+                            X(LMCPos), Y(LMCPos), Z(LMCPos), X(LMCVel), Y(LMCVel), Z(LMCVel),
+                            (real) TRUE, ftime, tstop, dt, LMCmass, LMCscale, coulombLog, 0.0 };
+
+    key = nbOrbitCacheKey("LMC reverse orbit", pot, inputs, sizeof(inputs) / sizeof(inputs[0]));
+    path = nbOrbitCacheFile(key);
+    free(key);
+
+    return path;
+}
+
+static int checkLMC(const Potential* pot)
+{
+    int failed = 0;
+    double t0, tIntegrate, tCache;
+    char* path;
+    char* otherPath;
+    FILE* f;
+    LMCOrbit direct, first, cached, other, truncated;
+    const real LMCmass = 449865.888;
+
+    nbSetOrbitCache(NULL);
+    t0 = mwGetTime();
+    direct = reverseOrbitLMC(pot, LMCmass);
+    tIntegrate = mwGetTime() - t0;
+
+    nbSetOrbitCache(".");
+    path = cacheFileLMC(pot, LMCmass);
+    otherPath = cacheFileLMC(pot, 2.0 * LMCmass);
+    mw_remove(path);
+    mw_remove(otherPath);
+
+    first = reverseOrbitLMC(pot, LMCmass);
+    t0 = mwGetTime();
+    cached = reverseOrbitLMC(pot, LMCmass);
+    tCache = mwGetTime() - t0;
+
+    if (!sameOrbit(&first, &direct) || !sameOrbit(&cached, &direct))
+    {
+        mw_printf("LMC orbit from the cache is not the one integrated\n");
+        failed = 1;
+    }
+
+    other = reverseOrbitLMC(pot, 2.0 * LMCmass);
+    if (memcmp(&other.LMCpos, &direct.LMCpos, sizeof(mwvector)) == 0)
+    {
+        mw_printf("LMC orbit with a different mass was read from the cache\n");
+        failed = 1;
+    }
+
+    /* Cut the last vector of the shift array off the file */
+    f = fopen(path, "rb");
+    if (f)
+    {
+        size_t size;
+        char* contents = (char*) mwMalloc(1 << 20);
+
+        size = fread(contents, 1, 1 << 20, f);
+        fclose(f);
+
+        f = fopen(path, "wb");
+        fwrite(contents, 1, size - sizeof(mwvector), f);
+        fclose(f);
+        free(contents);
+
+        truncated = reverseOrbitLMC(pot, LMCmass);
+        if (!sameOrbit(&truncated, &direct))
+        {
+            mw_printf("LMC orbit from a truncated cache is not the one integrated\n");
+            failed = 1;
+        }
+        mwFreeA(truncated.shift);
+    }
+    else
+    {
+        mw_printf("Orbit cache '%s' was not written\n", path);
+        failed = 1;
+    }
+
+    mw_printf("LMC reverse orbit: %.3gs integrating, %.3gs from the cache\n", tIntegrate, tCache);
+
+    mw_remove(path);
+    mw_remove(otherPath);
+    free(path);
+    free(otherPath);
+    mwFreeA(direct.shift);
+    mwFreeA(first.shift);
+    mwFreeA(cached.shift);
+    mwFreeA(other.shift);
+
+    return failed;
+}
+
+static int checkPlain(const Potential* pot)
+{
+    int failed = 0;
+    char* key;
+    char* path;
+    mwvector pos, vel, cachedPos, cachedVel;
+    const real inputs[] = { X(dwarfPos), Y(dwarfPos), Z(dwarfPos), X(dwarfVel), Y(dwarfVel), Z(dwarfVel), tstop, dt };
+
+    nbSetOrbitCache(NULL);
+    nbReverseOrbit(&pos, &vel, pot, dwarfPos, dwarfVel, tstop, dt);
+
+    nbSetOrbitCache(".");
+    key = nbOrbitCacheKey("reverse orbit", pot, inputs, sizeof(inputs) / sizeof(inputs[0]));
+    path = nbOrbitCacheFile(key);
+    mw_remove(path);
+
+    nbReverseOrbit(&cachedPos, &cachedVel, pot, dwarfPos, dwarfVel, tstop, dt);
+    nbReverseOrbit(&cachedPos, &cachedVel, pot, dwarfPos, dwarfVel, tstop, dt);
+
+    if (memcmp(&cachedPos, &pos, sizeof(mwvector)) != 0 || memcmp(&cachedVel, &vel, sizeof(mwvector)) != 0)
+    {
+        mw_printf("Reverse orbit from the cache is not the one integrated\n");
+        failed = 1;
+    }
+
+    mw_remove(path);
+    free(path);
+    free(key);
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+    Potential pot = EMPTY_POTENTIAL;
+
+    pot.sphere[0].type = HernquistSpherical;
+    pot.sphere[0].mass = 1.5e5;
+    pot.sphere[0].scale = 0.7;
+    pot.disk.type = MiyamotoNagaiDisk;
+    pot.disk.mass = 4.45865888e5;
+    pot.disk.scaleLength = 6.5;
+    pot.disk.scaleHeight = 0.26;
+    pot.disk2.type = NoDisk;
+    pot.halo.type = LogarithmicHalo;
+    pot.halo.vhalo = 73.0;
+    pot.halo.scaleLength = 12.0;
+    pot.halo.flattenZ = 1.0;
+
+    failed |= checkPlain(&pot);
+    failed |= checkLMC(&pot);
+
+    nbSetOrbitCache(NULL);
+
+    return failed;
+}
+
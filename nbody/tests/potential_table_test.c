@@ -0,0 +1,138 @@
+/*
+ * This file is part of Milkway@Home.
+ *
+ * Milkyway@Home is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Milkyway@Home is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Milkyway@Home.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tabulates a potential with the double exponential disk and one with
+ * the caustic halo, and compares the acceleration from the table with the
+ * one evaluated directly at random points out to the edge of the table
+ * and in the plane. Also reports how much faster the table is. The points
+ * stay well off the axis, where the disk's own quadrature is not accurate
+ * enough to compare with.
+ */
+
+#include "milkyway_util.h"
+#include "nbody_types.h"
+#include "nbody_defaults.h"
+#include "nbody_potential.h"
+#include "nbody_potential_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_POINTS 2000
+
+static const real tolerance = 1.0e-3;
+
+static inline real randomUnit(void)
+{
+    return ((real) rand() + 0.5) / ((real) RAND_MAX + 1.0);
+}
+
+/* Spread evenly in log radius from 0.01 to 100 kpc and within 72 degrees
+ * of the plane, a twentieth of them in it */
+static mwvector randomPoint(int i)
+{
+    mwvector p;
+    real r = 0.01 * mw_pow(1.0e4, randomUnit());
+    real cosTheta = (i % 20 == 0) ? 0.0 : 0.95 * (2.0 * randomUnit() - 1.0);
+    real sinTheta = mw_sqrt(1.0 - sqr(cosTheta));
+    real phi = 2.0 * M_PI * randomUnit();
+
+    SET_VECTOR(p, r * sinTheta * mw_cos(phi), r * sinTheta * mw_sin(phi), r * cosTheta);
+    return p;
+}
+
+static int checkTable(const char* name, disk_t diskType, halo_t haloType)
+{
+    NBodyCtx ctx = defaultNBodyCtx;
+    NBodyState st = EMPTY_NBODYSTATE;
+    int i, failed = 0;
+    real worst = 0.0;
+    double t0, tDirect, tTable;
+    mwvector* points = (mwvector*) mwMallocA(N_POINTS * sizeof(mwvector));
+    mwvector* direct = (mwvector*) mwMallocA(N_POINTS * sizeof(mwvector));
+
+    ctx.potentialType = EXTERNAL_POTENTIAL_DEFAULT;
+    ctx.potentialTableTolerance = tolerance;
+    ctx.pot.sphere[0].type = HernquistSpherical;
+    ctx.pot.sphere[0].mass = 1.5e5;
+    ctx.pot.sphere[0].scale = 0.8;
+    ctx.pot.disk.type = diskType;
+    ctx.pot.disk.mass = 4.0e5;
+    ctx.pot.disk.scaleLength = 4.5;
+    ctx.pot.disk.scaleHeight = 0.3;
+    ctx.pot.disk2.type = NoDisk;
+    ctx.pot.halo.type = haloType;
+    ctx.pot.halo.vhalo = 74.61;
+    ctx.pot.halo.scaleLength = 12.0;
+    ctx.pot.halo.flattenZ = 1.0;
+
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        points[i] = randomPoint(i);
+    }
+
+    t0 = mwGetTime();
+    for (i = 0; i < N_POINTS; ++i)
+    {
+        direct[i] = nbExtAcceleration(&ctx.pot, points[i], 0.0);
+    }
+    tDirect = mwGetTime() - t0;
+
+    nbMakePotentialTable(&ctx, &st);
+    if (!st.potTable)
+    {
+        mw_printf("%s was not tabulated\n", name);
+        failed = 1;
+    }
+
+    t0 = mwGetTime();
+    for (i = 0; i < N_POINTS && !failed; ++i)
+    {
+        mwvector a = nbTableExtAcceleration(st.potTable, &ctx.pot, points[i], 0.0);
+
+        worst = mw_fmax(worst, mw_absv(mw_subv(a, direct[i])) / mw_absv(direct[i]));
+    }
+    tTable = mwGetTime() - t0;
+
+    mw_printf("%s: largest relative error %.3e, %.3gs directly, %.3gs from the table\n",
+              name, worst, tDirect, tTable);
+
+    /* Cubic interpolation is worst between the nodes, where it was checked */
+    if (!failed && !(worst <= tolerance))
+    {
+        mw_printf("%s table is outside the tolerance %g\n", name, tolerance);
+        failed = 1;
+    }
+
+    destroyNBodyState(&st);
+    mwFreeA(points);
+    mwFreeA(direct);
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    srand(1234);
+    failed |= checkTable("Double exponential disk", DoubleExponentialDisk, LogarithmicHalo);
+    failed |= checkTable("Caustic halo", MiyamotoNagaiDisk, CausticHalo);
+
+    return failed;
+}
+